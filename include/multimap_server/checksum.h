@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_CHECKSUM_H
+#define MULTIMAP_SERVER_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace multimap_server
+{
+
+/** Incremental 64-bit checksum, based on MurmurHash64A. It is fast enough
+ *  to run over whole grids and is used both to detect corrupted data and to
+ *  identify map contents. It is not a cryptographic hash.
+ *
+ *  The result only depends on the bytes fed to it, not on how they are
+ *  split between calls to update().
+ */
+class Checksum64
+{
+public:
+  Checksum64();
+
+  void update(const void* data, size_t size);
+
+  /** Checksum of all the bytes fed so far */
+  uint64_t digest() const;
+
+private:
+  uint64_t h_;
+  uint64_t length_;
+  unsigned char tail_[8];
+  size_t tail_size_;
+
+  void mixWord(uint64_t k);
+};
+
+/** Checksum of a single memory block */
+uint64_t checksum64(const void* data, size_t size);
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_COMPRESSED_GRID_H
+#define MULTIMAP_SERVER_COMPRESSED_GRID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+
+/** TiledGrid compressed tile by tile, for maps that are not being used.
+ *
+ *  Every tile is run-length encoded as (run length - 1, value) byte pairs,
+ *  which shrinks the large uniform areas of occupancy grids to a few bytes
+ *  and decodes with plain memsets. Tiles are independent, so decompression
+ *  is split between threads.
+ */
+class CompressedGrid
+{
+public:
+  CompressedGrid();
+  explicit CompressedGrid(const TiledGrid& grid);
+
+  /** Decode the grid, using up to threads threads */
+  TiledGrid decompress(unsigned int threads) const;
+
+  /** Bytes held by the encoded tiles */
+  size_t size() const;
+
+private:
+  unsigned int width_;
+  unsigned int height_;
+  unsigned int tiles_x_;
+  std::vector<std::vector<uint8_t> > tiles_;
+
+  void decodeTiles(size_t first, size_t last, TiledGrid* grid) const;
+};
+}
+
+#endif
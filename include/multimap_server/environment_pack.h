@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_ENVIRONMENT_PACK_H
+#define MULTIMAP_SERVER_ENVIRONMENT_PACK_H
+
+/*
+ * An environment pack is a single file holding every map of an environment,
+ * already converted to occupancy values. Layout (host byte order):
+ *
+ *   header | manifest (one entry per map) | padding | grid 0 | padding | grid 1 ...
+ *
+ * Every grid starts on a PACK_ALIGNMENT boundary, so the file can be mapped
+ * and the grids used in place. The manifest and every grid carry a
+ * checksum64() checksum.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace multimap_server
+{
+
+/** Alignment of the grids inside a pack */
+const size_t PACK_ALIGNMENT = 4096;
+
+/** Maximum length of the names stored in a pack, including the terminator */
+const size_t PACK_NAME_SIZE = 64;
+
+/** A map stored in an environment pack. The cells follow the
+ *  nav_msgs::OccupancyGrid layout: row major, starting at the lower-left
+ *  corner.
+ */
+struct PackedMap
+{
+  std::string name;
+  uint32_t width;
+  uint32_t height;
+  double resolution;
+  /** Triple specifying 2-D pose of lower-left corner of the map */
+  double origin[3];
+  /** width * height cells */
+  const int8_t* data;
+  uint64_t checksum;
+};
+
+/** Read-only view of a pack file, which stays mapped in memory for the
+ *  lifetime of the object.
+ */
+class EnvironmentPack
+{
+public:
+  /** Map the pack and validate its header and manifest.
+   *
+   * @throws std::runtime_error If the file can't be mapped or is not a valid
+   *                            pack
+   */
+  explicit EnvironmentPack(const std::string& path);
+  ~EnvironmentPack();
+
+  const std::string& environment() const { return environment_; }
+  const std::string& globalFrame() const { return global_frame_; }
+  const std::vector<PackedMap>& maps() const { return maps_; }
+
+  /** Check the grid of a map against the checksum in the manifest */
+  bool verify(const PackedMap& map) const;
+
+private:
+  // Not copyable: the object owns the mapping
+  EnvironmentPack(const EnvironmentPack&);
+  EnvironmentPack& operator=(const EnvironmentPack&);
+
+  std::string path_;
+  void* mapping_;
+  size_t size_;
+  std::string environment_;
+  std::string global_frame_;
+  std::vector<PackedMap> maps_;
+};
+
+/** Write an environment pack. The checksum of the maps is computed, the
+ *  value of their checksum field is ignored.
+ *
+ * @throws std::runtime_error If a name is too long or the file can't be
+ *                            written
+ */
+void writeEnvironmentPack(const std::string& path, const std::string& environment, const std::string& global_frame,
+                          const std::vector<PackedMap>& maps);
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_GRID_ALLOCATOR_H
+#define MULTIMAP_SERVER_GRID_ALLOCATOR_H
+
+#include <stddef.h>
+#include <string>
+
+namespace multimap_server
+{
+
+/** Backing of the tiles of grids, see setHugePages() */
+enum HugePages
+{
+  /** Tiles are allocated from the heap, on 4 KB pages */
+  HUGE_PAGES_OFF,
+  /** Tiles are carved from 2 MB slabs that the kernel backs with
+   *  transparent huge pages (madvise) */
+  HUGE_PAGES_TRANSPARENT,
+  /** Tiles are carved from 2 MB slabs of reserved huge pages
+   *  (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages) */
+  HUGE_PAGES_HUGETLB
+};
+
+/** Parse "off", "transparent" or "hugetlb"
+ *
+ * @throws std::runtime_error For any other name
+ */
+HugePages parseHugePages(const std::string& name);
+
+const char* hugePagesName(HugePages pages);
+
+/** Select the backing of the tiles allocated from now on. Tiles already
+ *  allocated keep theirs.
+ *
+ *  A grid spread over 4 KB tiles needs one TLB entry per tile when it is
+ *  converted or serialized row by row; slabs of huge pages hold 512 tiles
+ *  per entry. Slabs are never pre-faulted, and every thread carves tiles
+ *  from its own slabs: the pages are first touched by the thread that
+ *  converts the map, which the default NUMA policy places on its node.
+ *  Each thread keeps the free blocks of its slabs, so allocations only
+ *  contend with frees of the same slabs, and the slabs of an exited
+ *  thread go to the next thread that allocates tiles.
+ *
+ * @return The backing in effect. HUGE_PAGES_HUGETLB falls back to
+ *         HUGE_PAGES_TRANSPARENT when no huge page is reserved, which
+ *         falls back to HUGE_PAGES_OFF when the kernel has transparent
+ *         huge pages disabled. A slab that can't get reserved huge pages
+ *         once they are exhausted uses transparent huge pages as well
+ */
+HugePages setHugePages(HugePages pages);
+
+/** Allocate bytes for a grid buffer. Buffers of a tile size come from the
+ *  slabs when huge pages are enabled
+ *
+ * @throws std::bad_alloc
+ */
+void* allocateGridBuffer(size_t bytes);
+
+/** Free a buffer of allocateGridBuffer(), from any thread */
+void freeGridBuffer(void* buffer, size_t bytes);
+
+/** Standard allocator of grid buffers, for containers of cells */
+template <class T>
+class GridAllocator
+{
+public:
+  typedef T value_type;
+
+  GridAllocator()
+  {
+  }
+
+  template <class U>
+  GridAllocator(const GridAllocator<U>&)
+  {
+  }
+
+  T* allocate(size_t n)
+  {
+    return static_cast<T*>(allocateGridBuffer(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n)
+  {
+    freeGridBuffer(p, n * sizeof(T));
+  }
+};
+
+template <class T, class U>
+bool operator==(const GridAllocator<T>&, const GridAllocator<U>&)
+{
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const GridAllocator<T>&, const GridAllocator<U>&)
+{
+  return false;
+}
+}
+
+#endif
@@ -33,6 +33,9 @@
  * Author: Brian Gerkey
  */
 
+#include <stdexcept>
+#include <string>
+
 #include "nav_msgs/GetMap.h"
 
 /** Map mode
@@ -54,6 +57,48 @@ enum MapMode {TRINARY, SCALE, RAW};
 namespace multimap_server
 {
 
+/** Receives progress updates while a map is loaded, and lets the caller
+ *  abort the load.
+ */
+class LoadMonitor
+{
+public:
+  virtual ~LoadMonitor() {}
+
+  /** Called with the current stage ("decode", "preview" or "convert") and
+   *  the completed fraction of that stage, in [0, 1].
+   */
+  virtual void progress(const std::string& stage, double fraction) {}
+
+  /** Polled while loading. Returning true aborts the load. */
+  virtual bool cancelled() { return false; }
+
+  /** Called before decoding, with the metadata of the map, when the size
+   *  of the image can be read from its header (see probeImageSize()).
+   *  map_load_time is not set.
+   */
+  virtual void extents(const nav_msgs::MapMetaData& info) {}
+
+  /** Downsampling factor of the grid passed to preview(). The default, 0,
+   *  disables the preview.
+   */
+  virtual unsigned int previewFactor() { return 0; }
+
+  /** Called once the image has been decoded, before the full resolution
+   *  conversion, with a coarse version of the map. Each coarse cell holds
+   *  the most conservative value of its block: occupied if any cell is,
+   *  otherwise unknown if any cell is. Not called for RAW maps.
+   */
+  virtual void preview(const nav_msgs::OccupancyGrid& coarse) {}
+};
+
+/** Thrown when a LoadMonitor cancels a load */
+class LoadCancelled : public std::runtime_error
+{
+public:
+  explicit LoadCancelled(const std::string& what) : std::runtime_error(what) {}
+};
+
 /** Read the image from file and fill out the resp object, for later
  * use when our services are requested.
  *
@@ -66,12 +111,14 @@ namespace multimap_server
  * @param free_th Threshold below which pixels are free
  * @param origin Triple specifying 2-D pose of lower-left corner of image
  * @param mode Map mode
+ * @param monitor Optional receiver of progress updates
  * @throws std::runtime_error If the image file can't be loaded
+ * @throws LoadCancelled If the monitor cancelled the load
  * */
 void loadMapFromFile(nav_msgs::GetMap::Response* resp,
                      const char* fname, double res, bool negate,
                      double occ_th, double free_th, double* origin,
-                     MapMode mode=TRINARY);
+                     MapMode mode=TRINARY, LoadMonitor* monitor=NULL);
 }
 
 #endif
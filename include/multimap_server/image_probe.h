@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_IMAGE_PROBE_H
+#define MULTIMAP_SERVER_IMAGE_PROBE_H
+
+#include <string>
+
+namespace multimap_server
+{
+
+/** Read the width and height of an image from its header, without decoding
+ *  it. PNG, PNM (PBM, PGM, PPM), BMP, GIF and JPEG are recognized.
+ *
+ * @return false if the file can't be read or its format is not recognized.
+ *         The image may still be loadable by SDL_image
+ */
+bool probeImageSize(const std::string& path, unsigned int* width, unsigned int* height);
+
+/** Locate the pixels of a binary 8-bit PGM (P5 with a maxval of 255),
+ *  whose bytes are the gray values, top row first.
+ *
+ * @param data_offset Offset of the first pixel in the file
+ * @return false if the file is not such a PGM
+ */
+bool probeRawPgm(const std::string& path, unsigned int* width, unsigned int* height, long* data_offset);
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_MAP_BANDS_H
+#define MULTIMAP_SERVER_MAP_BANDS_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "nav_msgs/OccupancyGrid.h"
+#include "multimap_server/checksum.h"
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+
+/** Number of rows of the bands a grid of the given width is split into
+ *  for chunked transfers: as many as fit in max_cells, but at least one.
+ */
+inline uint32_t bandRows(uint32_t width, uint32_t max_cells)
+{
+  if (width == 0 || max_cells <= width)
+    return 1;
+  return max_cells / width;
+}
+
+inline uint32_t bandCount(uint32_t height, uint32_t band_rows)
+{
+  return height == 0 ? 1 : (height + band_rows - 1) / band_rows;
+}
+
+/** checksum64() of the cells of every band of a grid */
+inline std::vector<uint64_t> bandChecksums(const nav_msgs::OccupancyGrid& map, uint32_t band_rows)
+{
+  size_t band_cells = (size_t)band_rows * map.info.width;
+  std::vector<uint64_t> checksums(bandCount(map.info.height, band_rows));
+  for (size_t i = 0; i < checksums.size(); i++)
+  {
+    size_t begin = std::min(i * band_cells, map.data.size());
+    size_t end = std::min(begin + band_cells, map.data.size());
+    checksums[i] = checksum64(map.data.empty() ? NULL : &map.data[begin], end - begin);
+  }
+  return checksums;
+}
+
+/** Same as above, for a grid held in tiles */
+inline std::vector<uint64_t> bandChecksums(const TiledGrid& grid, uint32_t band_rows)
+{
+  std::vector<int8_t> band((size_t)band_rows * grid.width());
+  std::vector<uint64_t> checksums(bandCount(grid.height(), band_rows));
+  for (size_t i = 0; i < checksums.size(); i++)
+  {
+    unsigned int first_row = std::min((uint32_t)(i * band_rows), grid.height());
+    unsigned int rows = std::min(band_rows, grid.height() - first_row);
+    grid.copyRows(first_row, rows, band.empty() ? NULL : &band[0]);
+    checksums[i] = checksum64(band.empty() ? NULL : &band[0], (size_t)rows * grid.width());
+  }
+  return checksums;
+}
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_MAP_DESCRIPTION_H
+#define MULTIMAP_SERVER_MAP_DESCRIPTION_H
+
+#include <string>
+#include <vector>
+
+#include "multimap_server/image_loader.h"
+
+namespace multimap_server
+{
+
+/** How a layer is combined with the layers below it */
+enum LayerBlend
+{
+  /** The higher of the two values. Free and unknown cells of the layer are
+   *  transparent */
+  BLEND_MAX,
+  /** The value of the layer. Unknown cells of the layer are transparent */
+  BLEND_OVERRIDE
+};
+
+/** Entry of the layers list of a map .yaml file. The image must have the
+ *  size of the map image; resolution and origin are those of the map */
+struct LayerDescription
+{
+  std::string name;
+  /** Absolute path or URL of the image file */
+  std::string image;
+  LayerBlend blend;
+  int negate;
+  double occ_th;
+  double free_th;
+  MapMode mode;
+};
+
+/** Contents of a map .yaml file */
+struct MapDescription
+{
+  /** Absolute path or URL of the image file */
+  std::string image;
+  double resolution;
+  /** Triple specifying 2-D pose of lower-left corner of image */
+  double origin[3];
+  int negate;
+  double occ_th;
+  double free_th;
+  MapMode mode;
+  /** Composed over the map image in this order */
+  std::vector<LayerDescription> layers;
+};
+
+/** Parse a map .yaml file. Relative image paths are resolved against the
+ * directory of the .yaml file, or against url if it was downloaded.
+ *
+ * @param fname The map .yaml file to read
+ * @param url The URL fname was fetched from, if any
+ * @throws std::runtime_error If the file can't be opened or a tag is missing
+ *                            or invalid
+ * */
+MapDescription loadMapDescription(const std::string& fname, const std::string& url = std::string());
+
+/** Load the image of a map description into resp.
+ *
+ * @throws std::runtime_error If the image file can't be loaded
+ * @throws LoadCancelled If the monitor cancelled the load
+ * */
+void loadMapFromDescription(nav_msgs::GetMap::Response* resp, const MapDescription& desc,
+                            LoadMonitor* monitor=NULL);
+
+/** Load the image of a layer of a map description into resp.
+ *
+ * @throws std::runtime_error If the image file can't be loaded
+ * */
+void loadLayerFromDescription(nav_msgs::GetMap::Response* resp, const MapDescription& desc,
+                              const LayerDescription& layer);
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_MAP_DIFF_H
+#define MULTIMAP_SERVER_MAP_DIFF_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+
+/** Classes of cells counted by diffGrids(): unknown (negative), free
+ *  (below the occupied threshold) and occupied */
+enum CellClass
+{
+  CELL_UNKNOWN,
+  CELL_FREE,
+  CELL_OCCUPIED,
+  CELL_CLASSES
+};
+
+/** Differences between two grids of the same size */
+struct GridDiff
+{
+  uint64_t changed_cells;
+  /** Changed cells by class in the first grid (row) and in the second
+   *  grid (column). Cells whose value changed within a class are on the
+   *  diagonal */
+  uint64_t transitions[CELL_CLASSES][CELL_CLASSES];
+  /** Bounds of the changed cells of each group of touching changed tiles */
+  std::vector<CellBox> regions;
+  /** 100 where the grids differ and 0 elsewhere, row-major. Empty unless
+   *  requested */
+  std::vector<int8_t> mask;
+};
+
+/** Compare two grids of the same size. Tiles they share are skipped
+ *  without reading them, so two versions of an edited map only compare
+ *  the edited tiles; the other tiles are split between threads.
+ *
+ * @param occupied_threshold Lowest value of occupied cells
+ * @param with_mask Whether to fill GridDiff::mask
+ * @param threads Number of threads to use, at least 1
+ */
+GridDiff diffGrids(const TiledGrid& a, const TiledGrid& b, int8_t occupied_threshold, bool with_mask,
+                   unsigned int threads);
+
+/** Copy of grid inside a larger grid of unknown cells, cell (0, 0) of
+ *  grid landing on (offset_x, offset_y). Lines up two maps of one frame
+ *  for diffGrids() */
+TiledGrid placeGrid(const TiledGrid& grid, unsigned int width, unsigned int height, unsigned int offset_x,
+                    unsigned int offset_y);
+}
+
+#endif
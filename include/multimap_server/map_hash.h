@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_MAP_HASH_H
+#define MULTIMAP_SERVER_MAP_HASH_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "nav_msgs/OccupancyGrid.h"
+#include "multimap_server/checksum.h"
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+
+/** Feed the parts of a map that are hashed besides its cells */
+inline void hashMapGeometry(Checksum64* checksum, const nav_msgs::MapMetaData& info, const std::string& frame_id)
+{
+  double geometry[7] = { info.origin.position.x,    info.origin.position.y,    info.origin.position.z,
+                         info.origin.orientation.x, info.origin.orientation.y, info.origin.orientation.z,
+                         info.origin.orientation.w };
+
+  checksum->update(&info.width, sizeof(info.width));
+  checksum->update(&info.height, sizeof(info.height));
+  checksum->update(&info.resolution, sizeof(info.resolution));
+  checksum->update(geometry, sizeof(geometry));
+  checksum->update(frame_id.c_str(), frame_id.size());
+}
+
+/** Content hash of a map: grid, geometry and frame, but not the
+ *  timestamps. Two loads of the same map have the same hash. 0 is never
+ *  returned, so it can stand for "no map".
+ */
+inline uint64_t mapContentHash(const nav_msgs::OccupancyGrid& map)
+{
+  Checksum64 checksum;
+  hashMapGeometry(&checksum, map.info, map.header.frame_id);
+  if (!map.data.empty())
+    checksum.update(&map.data[0], map.data.size());
+
+  uint64_t hash = checksum.digest();
+  return hash == 0 ? 1 : hash;
+}
+
+/** Same hash as above, for a grid held in tiles */
+inline uint64_t mapContentHash(const nav_msgs::MapMetaData& info, const std::string& frame_id, const TiledGrid& grid)
+{
+  Checksum64 checksum;
+  hashMapGeometry(&checksum, info, frame_id);
+
+  // The checksum only depends on the bytes, so the grid is fed one band of rows at a time
+  std::vector<int8_t> band((size_t)TiledGrid::TILE_SIZE * grid.width());
+  for (unsigned int row = 0; row < grid.height(); row += TiledGrid::TILE_SIZE)
+  {
+    unsigned int rows = std::min(TiledGrid::TILE_SIZE, grid.height() - row);
+    grid.copyRows(row, rows, band.empty() ? NULL : &band[0]);
+    checksum.update(band.empty() ? NULL : &band[0], (size_t)rows * grid.width());
+  }
+
+  uint64_t hash = checksum.digest();
+  return hash == 0 ? 1 : hash;
+}
+}
+
+#endif
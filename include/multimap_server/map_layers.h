@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_MAP_LAYERS_H
+#define MULTIMAP_SERVER_MAP_LAYERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "multimap_server/map_description.h"
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+
+/** Layer of a map, with the size of the map */
+struct MapLayer
+{
+  std::string name;
+  LayerBlend blend;
+  TiledGrid grid;
+};
+
+/** Blend n cells of a BLEND_MAX layer into dst */
+void blendMax(int8_t* dst, const int8_t* src, size_t n);
+
+/** Blend n cells of a BLEND_OVERRIDE layer into dst */
+void blendOverride(int8_t* dst, const int8_t* src, size_t n);
+
+/** Whether blending n cells of a layer leaves any destination unchanged */
+bool isTransparent(LayerBlend blend, const int8_t* src, size_t n);
+
+/** Recompose tile (tx, ty) of composed from base and layers, all of the
+ *  same size. The tile is shared with base unless a layer changes it */
+void composeTile(const TiledGrid& base, const std::vector<MapLayer>& layers, unsigned int tx, unsigned int ty,
+                 TiledGrid* composed);
+
+/** Recompose the tiles of composed that overlap box */
+void composeBox(const TiledGrid& base, const std::vector<MapLayer>& layers, const CellBox& box,
+                TiledGrid* composed);
+
+/** Compose a map from its base grid and its layers */
+TiledGrid composeLayers(const TiledGrid& base, const std::vector<MapLayer>& layers);
+
+/** Cells of the tiles whose content differs between two grids of the same
+ *  size. Tiles they share are not compared.
+ *
+ * @return An empty box (min_x > max_x) if the grids are equal
+ */
+CellBox changedTiles(const TiledGrid& before, const TiledGrid& after);
+}
+
+#endif
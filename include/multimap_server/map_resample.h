@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_MAP_RESAMPLE_H
+#define MULTIMAP_SERVER_MAP_RESAMPLE_H
+
+#include <string>
+#include <vector>
+
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+
+/** Size of a grid and pose of its cells in their frame */
+struct GridPlacement
+{
+  unsigned int width;
+  unsigned int height;
+  /** Meters per cell */
+  double resolution;
+  /** Corner of cell (0, 0), and rotation of the grid around it */
+  double origin_x;
+  double origin_y;
+  double yaw;
+};
+
+/** How a resampled cell is read from its source */
+enum ResampleMode
+{
+  /** Cell of the source under the center of the cell */
+  RESAMPLE_NEAREST,
+  /** Most occupied cell of the source that the cell overlaps, even
+   *  partly: occupied, then partially occupied, unknown and free, as for
+   *  the coarse previews */
+  RESAMPLE_CONSERVATIVE
+};
+
+/** How overlapping sources are combined by resampleGrids() */
+enum MergePolicy
+{
+  /** Value of the first source that knows the cell */
+  MERGE_FIRST,
+  /** Highest known value */
+  MERGE_MAX,
+  /** Most occupied value, unknown winning over free */
+  MERGE_CONSERVATIVE
+};
+
+/** Parse "first", "max" or "conservative"
+ *
+ * @throws std::runtime_error For any other name
+ */
+MergePolicy parseMergePolicy(const std::string& name);
+
+/** Grid to resample */
+struct ResampleSource
+{
+  const TiledGrid* grid;
+  GridPlacement placement;
+};
+
+/** Smallest placement with the resolution and yaw given that covers all
+ *  sources. width, height and the origin of placement are set
+ *
+ * @return false, leaving placement as it was, if the placement would have
+ *         more than max_cells cells
+ */
+bool coverSources(const std::vector<ResampleSource>& sources, uint64_t max_cells, GridPlacement* placement);
+
+/** Resample sources, all in one frame, onto the cells of target. Cells
+ *  covered by several sources are merged with policy, in the order of
+ *  sources, and cells outside of every source are unknown.
+ *
+ *  The target is computed tile by tile, each tile only reading the source
+ *  cells below it, and the tiles are split between threads. Sources whose
+ *  cells are target cells moved by whole cells are copied row by row.
+ *
+ * @param threads Number of threads to use, at least 1
+ */
+TiledGrid resampleGrids(const std::vector<ResampleSource>& sources, const GridPlacement& target, ResampleMode mode,
+                        MergePolicy policy, unsigned int threads);
+}
+
+#endif
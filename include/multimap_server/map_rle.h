@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_MAP_RLE_H
+#define MULTIMAP_SERVER_MAP_RLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+
+/** Longest run of encodeRows(). Longer runs are split */
+const uint32_t MAX_RUN_LENGTH = 65535;
+
+/** End of the run of cells equal to cells[begin], at most end. Compares
+ *  eight cells at a time */
+size_t findRunEnd(const int8_t* cells, size_t begin, size_t end);
+
+/** Run-length encode the rows of grid, in the layout of the
+ *  multimap_server/MapRle message: runs never span two rows, and the runs
+ *  of row y are [row_starts[y], row_starts[y + 1]). row_starts gets
+ *  height + 1 entries. The vectors are replaced.
+ */
+void encodeRows(const TiledGrid& grid, std::vector<uint32_t>* row_starts, std::vector<uint16_t>* run_lengths,
+                std::vector<int8_t>* run_values);
+
+/** Decode the rows encoded by encodeRows() into width * height row-major
+ *  cells at out
+ *
+ * @throws std::runtime_error If the runs do not describe a width x height
+ *                            grid
+ */
+void decodeRows(unsigned int width, unsigned int height, const std::vector<uint32_t>& row_starts,
+                const std::vector<uint16_t>& run_lengths, const std::vector<int8_t>& run_values, int8_t* out);
+}
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_MESSAGE_ARENA_H
+#define MULTIMAP_SERVER_MESSAGE_ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace multimap_server
+{
+
+/** Monotonic memory for the messages a thread builds and publishes.
+ *
+ *  Allocating moves a cursor through a block, and nothing is freed until
+ *  the arena is rewound to a mark, which releases everything allocated
+ *  since at once. Rewinding to the empty arena merges the blocks grown
+ *  meanwhile into one, so that once a thread has built its largest message,
+ *  building messages of that size does not touch the heap anymore. The
+ *  block follows the messages actually built: it shrinks once the last
+ *  SHRINK_ROUNDS messages all needed less than half of it, and trim()
+ *  frees it once the arena has been idle.
+ *
+ *  Allocations are meant for one thread, see threadMessageArena(); only
+ *  trim() may be called from another one.
+ */
+class MessageArena : boost::noncopyable
+{
+public:
+  /** Position of the cursor, see rewind() */
+  struct Mark
+  {
+    size_t block;
+    size_t used;
+  };
+
+  /** Messages after which a block larger than needed is shrunk */
+  static const size_t SHRINK_ROUNDS = 64;
+
+  /** @param retained_bytes Largest block kept by a rewind to the empty
+   *                        arena. Larger messages are allocated again
+   *                        every time
+   */
+  explicit MessageArena(size_t retained_bytes);
+  ~MessageArena();
+
+  /** bytes of memory aligned for any type, valid until the arena is
+   *  rewound before this call
+   *
+   * @throws std::bad_alloc
+   */
+  void* allocate(size_t bytes);
+
+  Mark mark() const;
+
+  /** Release everything allocated since mark */
+  void rewind(const Mark& mark);
+
+  /** Bytes held by the blocks */
+  size_t capacity() const;
+
+  /** Change the largest block kept, from the next rewind to the empty
+   *  arena on
+   */
+  void setRetainedBytes(size_t retained_bytes);
+
+  /** Free the blocks if nothing is allocated and the arena was last
+   *  rewound to empty at least idle_seconds ago
+   *
+   * @return The bytes freed
+   */
+  size_t trim(double idle_seconds);
+
+private:
+  struct Block
+  {
+    char* data;
+    size_t size;
+    size_t used;
+  };
+
+  /** Only contended by trim() */
+  mutable boost::mutex mutex_;
+  size_t retained_bytes_;
+  /** Blocks after current_ are unused */
+  std::vector<Block> blocks_;
+  size_t current_;
+  /** Largest message since the block was last sized, and the messages since */
+  size_t peak_bytes_;
+  size_t rounds_;
+  /** Monotonic time of the last rewind to the empty arena */
+  double last_use_;
+
+  void addBlock(size_t size);
+};
+
+/** Arena of the calling thread, which keeps the block of its largest
+ *  recent message, up to setThreadArenaRetention() bytes, between messages */
+MessageArena& threadMessageArena();
+
+/** Largest block kept by the arena of every thread, current and future.
+ *  256 MB by default, enough to keep the message of a 16000 x 16000 cell
+ *  map; a server with smaller maps can lower it to bound the memory its
+ *  publishing threads hold while idle
+ */
+void setThreadArenaRetention(size_t retained_bytes);
+
+/** trim() the arenas of all threads
+ *
+ * @return The bytes freed
+ */
+size_t trimMessageArenas(double idle_seconds);
+
+/** Rewinds an arena when leaving the scope. Messages allocated from the
+ *  arena in the scope must be destroyed before
+ */
+class ArenaScope : boost::noncopyable
+{
+public:
+  explicit ArenaScope(MessageArena& arena) : arena_(arena), mark_(arena.mark())
+  {
+  }
+
+  ~ArenaScope()
+  {
+    arena_.rewind(mark_);
+  }
+
+private:
+  MessageArena& arena_;
+  MessageArena::Mark mark_;
+};
+
+/** Standard allocator drawing from a MessageArena, for the ContainerAllocator
+ *  parameter of ROS messages, e.g.
+ *  nav_msgs::OccupancyGrid_<ArenaAllocator<void> >. The message must be
+ *  constructed with ArenaAllocator<void>(&arena) so that its fields use the
+ *  arena; default constructed allocators use the heap.
+ */
+template <class T>
+class ArenaAllocator
+{
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind
+  {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator() : arena_(NULL)
+  {
+  }
+
+  explicit ArenaAllocator(MessageArena* arena) : arena_(arena)
+  {
+  }
+
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena())
+  {
+  }
+
+  MessageArena* arena() const
+  {
+    return arena_;
+  }
+
+  T* allocate(size_t n, const void* = NULL)
+  {
+    if (arena_)
+      return static_cast<T*>(arena_->allocate(n * sizeof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  /** Arena memory is only released by rewinding the arena */
+  void deallocate(T* p, size_t)
+  {
+    if (!arena_)
+      ::operator delete(p);
+  }
+
+  size_t max_size() const
+  {
+    return size_t(-1) / sizeof(T);
+  }
+
+  void construct(T* p, const T& value)
+  {
+    new (p) T(value);
+  }
+
+  void destroy(T* p)
+  {
+    p->~T();
+  }
+
+private:
+  MessageArena* arena_;
+};
+
+/** Only rebound, like std::allocator<void> */
+template <>
+class ArenaAllocator<void>
+{
+public:
+  typedef void value_type;
+  typedef void* pointer;
+  typedef const void* const_pointer;
+
+  template <class U>
+  struct rebind
+  {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator() : arena_(NULL)
+  {
+  }
+
+  explicit ArenaAllocator(MessageArena* arena) : arena_(arena)
+  {
+  }
+
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena())
+  {
+  }
+
+  MessageArena* arena() const
+  {
+    return arena_;
+  }
+
+private:
+  MessageArena* arena_;
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+  return a.arena() == b.arena();
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+  return a.arena() != b.arena();
+}
+}
+
+#endif
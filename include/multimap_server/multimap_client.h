@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_MULTIMAP_CLIENT_H
+#define MULTIMAP_SERVER_MULTIMAP_CLIENT_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "nav_msgs/OccupancyGrid.h"
+#include "multimap_server/MapRle.h"
+
+namespace multimap_server
+{
+
+/** Client of multimap_server that keeps the maps it receives in memory and
+ *  on disk, keyed by content hash. A map is only transferred again when the
+ *  server reports that its contents changed (fetch_map service), so a robot
+ *  restarting on the same floor reads its maps from the disk cache.
+ *
+ *  Cached maps keep their grid, geometry and frame, but their timestamps
+ *  are not preserved on disk.
+ */
+class MultimapClient
+{
+public:
+  /** @param server_name Name of the multimap_server node, e.g. "/multimap_server"
+   *  @param cache_dir Directory of the disk cache, created if needed. An empty
+   *                   string disables the disk cache
+   *  @param keep_in_memory Keep the returned maps in memory. Callers that hold
+   *                        on to the maps themselves can save that copy
+   */
+  explicit MultimapClient(const std::string& server_name = "/multimap_server",
+                          const std::string& cache_dir = defaultCacheDir(), bool keep_in_memory = true);
+
+  /** Get map ns/map_name. If the server can't be reached, the last cached
+   *  copy of the map is returned.
+   *
+   * @throws std::runtime_error If the map is neither available from the
+   *                            server nor cached
+   */
+  nav_msgs::OccupancyGridConstPtr getMap(const std::string& ns, const std::string& map_name);
+
+  /** Receives the bands of rows of a map as getMapInBands() assembles them.
+   *  data points to rows * info.width cells, starting at row first_row
+   */
+  typedef boost::function<void(const nav_msgs::MapMetaData& info, uint32_t first_row, uint32_t rows,
+                               const int8_t* data)> BandCallback;
+
+  /** Same as getMap(), but the map is transferred as a sequence of bands of
+   *  at most max_chunk_cells cells (0 for the server default), each checked
+   *  against the checksums of the transfer manifest. No message holds the
+   *  whole grid. Bands are requested by increasing distance from focus_row,
+   *  so that on_band sees the region around the robot first. A cached map
+   *  is passed to on_band as a single band.
+   *
+   * @throws std::runtime_error If the map is neither available from the
+   *                            server nor cached, or if it changed during
+   *                            the transfer
+   */
+  nav_msgs::OccupancyGridConstPtr getMapInBands(const std::string& ns, const std::string& map_name,
+                                                uint32_t focus_row = 0, const BandCallback& on_band = BandCallback(),
+                                                uint32_t max_chunk_cells = 0);
+
+  /** Same as getMap(), but the map is transferred with its rows run-length
+   *  encoded (static_map_rle service of the map), typically 10-50 times
+   *  smaller than the grid and decoded with plain memsets.
+   *
+   * @throws std::runtime_error If the map is neither available from the
+   *                            server nor cached, or if the encoding is
+   *                            invalid
+   */
+  nav_msgs::OccupancyGridConstPtr getMapRle(const std::string& ns, const std::string& map_name);
+
+  /** Decode a map received from static_map_rle or from the map_rle topic
+   *
+   * @throws std::runtime_error If the runs do not describe rle.info
+   */
+  static void decodeMapRle(const MapRle& rle, nav_msgs::OccupancyGrid* map);
+
+  /** Content hash of the last copy of ns/map_name returned by getMap(), 0 if none */
+  uint64_t getMapHash(const std::string& ns, const std::string& map_name);
+
+  /** $ROS_HOME/multimap_cache, or ~/.ros/multimap_cache */
+  static std::string defaultCacheDir();
+
+private:
+  std::string server_name_;
+  std::string cache_dir_;
+  bool keep_in_memory_;
+
+  /** Guards the caches. It is not held during service calls */
+  boost::mutex mutex_;
+  /** Maps in memory, by content hash */
+  std::map<uint64_t, nav_msgs::OccupancyGridConstPtr> memory_cache_;
+  /** Content hash of the last known version of each map, by ns/map_name */
+  std::map<std::string, uint64_t> known_hashes_;
+  /** Number of maps, in memory or in the disk index, whose last known
+   *  version has each content hash. Several maps can have the same
+   *  contents, which are only dropped once none of them uses them */
+  std::map<uint64_t, unsigned int> hash_refs_;
+
+  uint64_t lookupKnownHash(const std::string& key);
+  nav_msgs::OccupancyGridConstPtr lookupCached(uint64_t hash);
+  void store(const std::string& key, uint64_t hash, const nav_msgs::OccupancyGridConstPtr& map);
+  void countIndexedHashes();
+  void releaseHash(uint64_t hash);
+
+  std::string indexPath(const std::string& key) const;
+  std::string gridPath(uint64_t hash) const;
+};
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_SHARD_RING_H
+#define MULTIMAP_SERVER_SHARD_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+
+namespace multimap_server
+{
+
+/** Consistent hash ring assigning environments to the shards of a sharded
+ *  multimap_server deployment. Every shard owns a number of virtual nodes
+ *  on the ring, and an environment belongs to the shard of the first
+ *  virtual node at or after the hash of its name. Adding a shard only moves
+ *  the environments that the new shard takes over.
+ */
+class ShardRing
+{
+public:
+  /** @param shard_count Number of shards, at least 1
+   *  @param virtual_nodes Virtual nodes per shard */
+  explicit ShardRing(size_t shard_count, size_t virtual_nodes = 128);
+
+  /** Index of the shard owning an environment, in [0, shard_count) */
+  size_t shardFor(const std::string& environment) const;
+
+  size_t shardCount() const { return shard_count_; }
+
+private:
+  size_t shard_count_;
+  std::map<uint64_t, size_t> ring_;
+};
+}
+
+#endif
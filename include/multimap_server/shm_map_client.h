@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_SHM_MAP_CLIENT_H
+#define MULTIMAP_SERVER_SHM_MAP_CLIENT_H
+
+/*
+ * Read-only access to the maps that multimap_server places in POSIX shared
+ * memory (~shm_store). This header has no dependencies besides libc, so
+ * that any process on the same host can include it.
+ *
+ * Each map lives in its own segment: a ShmMapHeader followed, at
+ * header_size, by the width * height cells in nav_msgs::OccupancyGrid
+ * layout. The sequence number of the header works as a seqlock: it is odd
+ * while the server rewrites the grid and is incremented again once the
+ * grid is consistent.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace multimap_server
+{
+
+#define SHM_MAP_MAGIC "MMAPSHM"
+#define SHM_MAP_VERSION 1
+#define SHM_MAP_FRAME_SIZE 64
+
+/** Metadata at the start of every map segment */
+struct ShmMapHeader
+{
+  char magic[8];
+  uint32_t version;
+  /** Offset of the grid from the start of the segment */
+  uint32_t header_size;
+  /** Seqlock counter, only accessed through the __atomic builtins */
+  uint64_t sequence;
+  /** Set once the map has been dumped. The segment will not change anymore */
+  uint32_t removed;
+  uint32_t width;
+  uint32_t height;
+  float resolution;
+  double origin_position[3];
+  double origin_orientation[4];
+  uint32_t load_time_sec;
+  uint32_t load_time_nsec;
+  char frame_id[SHM_MAP_FRAME_SIZE];
+};
+
+/** Part of a segment name, with '%', '.' and '/' escaped as %25, %2E and
+ *  %2F, so that '.' only separates the parts */
+inline std::string shmEscapeName(const std::string& part)
+{
+  std::string escaped;
+  for (size_t i = 0; i < part.size(); i++)
+  {
+    if (part[i] == '%')
+      escaped += "%25";
+    else if (part[i] == '.')
+      escaped += "%2E";
+    else if (part[i] == '/')
+      escaped += "%2F";
+    else
+      escaped += part[i];
+  }
+  return escaped;
+}
+
+/** Name of the segment holding map ns/map_name: /prefix.ns.map_name, each
+ *  part escaped by shmEscapeName(), so that different maps never share a
+ *  segment.
+ */
+inline std::string shmMapSegmentName(const std::string& ns, const std::string& map_name,
+                                     const std::string& prefix = "multimap")
+{
+  return "/" + shmEscapeName(prefix) + "." + shmEscapeName(ns) + "." + shmEscapeName(map_name);
+}
+
+/** Maps the segment of a map read-only. The mapping stays valid after the
+ *  server dumps the map; removed() tells when it has happened, and a new
+ *  reader has to be created to follow a reloaded map.
+ */
+class ShmMapReader
+{
+public:
+  /** @throws std::runtime_error If the segment does not exist or is not a
+   *          map segment */
+  ShmMapReader(const std::string& ns, const std::string& map_name, const std::string& prefix = "multimap")
+    : mapping_(NULL), size_(0)
+  {
+    std::string name = shmMapSegmentName(ns, map_name, prefix);
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+      throw std::runtime_error("failed to open shared memory map \"" + name + "\": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmMapHeader))
+    {
+      close(fd);
+      throw std::runtime_error("\"" + name + "\" is not a shared memory map");
+    }
+    size_ = st.st_size;
+    mapping_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping_ == MAP_FAILED)
+    {
+      mapping_ = NULL;
+      throw std::runtime_error("failed to map shared memory map \"" + name + "\": " + strerror(errno));
+    }
+
+    const ShmMapHeader& h = header();
+    if (memcmp(h.magic, SHM_MAP_MAGIC, sizeof(h.magic)) != 0 || h.version != SHM_MAP_VERSION ||
+        h.header_size > size_ || (uint64_t)h.width * h.height > size_ - h.header_size)
+    {
+      munmap(mapping_, size_);
+      throw std::runtime_error("\"" + name + "\" is not a compatible shared memory map");
+    }
+  }
+
+  ~ShmMapReader()
+  {
+    munmap(mapping_, size_);
+  }
+
+  const ShmMapHeader& header() const
+  {
+    return *(const ShmMapHeader*)mapping_;
+  }
+
+  /** The cells of the map, in place. They may change while being read if
+   *  the server updates the map; use copy() for a consistent view.
+   */
+  const int8_t* data() const
+  {
+    return (const int8_t*)mapping_ + header().header_size;
+  }
+
+  /** Current value of the seqlock counter. It changes every time the grid
+   *  is updated */
+  uint64_t sequence() const
+  {
+    return __atomic_load_n(&header().sequence, __ATOMIC_ACQUIRE);
+  }
+
+  bool removed() const
+  {
+    return __atomic_load_n(&header().removed, __ATOMIC_ACQUIRE) != 0;
+  }
+
+  /** Copy a consistent snapshot of the grid, retrying while the server is
+   *  writing it.
+   *
+   * @param max_attempts Attempts before giving up
+   * @return The sequence number of the copied grid, or 0 if no consistent
+   *         copy could be made
+   */
+  uint64_t copy(std::vector<int8_t>* out, int max_attempts = 100) const
+  {
+    size_t cells = (size_t)header().width * header().height;
+    for (int attempt = 0; attempt < max_attempts; attempt++)
+    {
+      uint64_t before = sequence();
+      if (before % 2 == 1)
+      {
+        usleep(1000);
+        continue;
+      }
+      out->assign(data(), data() + cells);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (sequence() == before)
+        return before;
+    }
+    return 0;
+  }
+
+private:
+  // Not copyable: the object owns the mapping
+  ShmMapReader(const ShmMapReader&);
+  ShmMapReader& operator=(const ShmMapReader&);
+
+  void* mapping_;
+  size_t size_;
+};
+}
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MULTIMAP_SERVER_SHM_MAP_STORE_H
+#define MULTIMAP_SERVER_SHM_MAP_STORE_H
+
+#include <string>
+
+#include "multimap_server/shm_map_client.h"
+
+namespace multimap_server
+{
+
+/** Server side of a shared memory map segment (see shm_map_client.h) */
+class ShmMapSegment
+{
+public:
+  /** Create the segment of map ns/map_name and copy the grid into it. A
+   *  stale segment with the same name is replaced.
+   *
+   * @param metadata Map metadata. Only the fields from width onwards are
+   *                 used, the rest is filled by the segment
+   * @param data width * height cells. If NULL, the segment is created in
+   *             the middle of an update: the caller fills data() and
+   *             calls endUpdate()
+   * @throws std::runtime_error If the segment can't be created
+   */
+  ShmMapSegment(const std::string& ns, const std::string& map_name, const std::string& prefix,
+                const ShmMapHeader& metadata, const int8_t* data);
+
+  /** Unmap the segment. It stays available to readers until remove() */
+  ~ShmMapSegment();
+
+  /** Start rewriting the grid: readers see an odd sequence number until
+   *  endUpdate() */
+  void beginUpdate();
+
+  /** The writable grid, in nav_msgs::OccupancyGrid layout */
+  int8_t* data();
+
+  void endUpdate();
+
+  /** Mark the map as removed for current readers and unlink the segment */
+  void remove();
+
+  const std::string& name() const { return name_; }
+
+private:
+  // Not copyable: the object owns the mapping
+  ShmMapSegment(const ShmMapSegment&);
+  ShmMapSegment& operator=(const ShmMapSegment&);
+
+  std::string name_;
+  void* mapping_;
+  size_t size_;
+  bool removed_;
+
+  ShmMapHeader* header() { return (ShmMapHeader*)mapping_; }
+};
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_TILED_GRID_H
+#define MULTIMAP_SERVER_TILED_GRID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "multimap_server/grid_allocator.h"
+
+namespace multimap_server
+{
+
+/** Cell rectangle, inclusive bounds */
+struct CellBox
+{
+  unsigned int min_x;
+  unsigned int min_y;
+  unsigned int max_x;
+  unsigned int max_y;
+};
+
+/** Occupancy grid stored as square tiles of TILE_SIZE x TILE_SIZE cells.
+ *
+ *  Copies share their tiles: copying a grid only copies the tile pointers,
+ *  and a tile is duplicated the first time a copy writes to it. A grid
+ *  that is shared between threads must not be written to; writers edit
+ *  their own copy and publish it, so only the tiles they touched are new.
+ *
+ *  Cells are addressed like in nav_msgs/OccupancyGrid: x is the column, y
+ *  the row, and row-major exports match the layout of its data field.
+ */
+class TiledGrid
+{
+public:
+  static const unsigned int TILE_SIZE = 64;
+
+  TiledGrid();
+
+  /** Grid holding a copy of width * height row-major cells, or unknown
+   *  (-1) cells if data is NULL */
+  TiledGrid(unsigned int width, unsigned int height, const int8_t* data);
+
+  /** Grid of width * height cells without any tile yet. Every tile must
+   *  be given by allocateTile() before the grid is used otherwise */
+  static TiledGrid withoutTiles(unsigned int width, unsigned int height);
+
+  unsigned int width() const { return width_; }
+  unsigned int height() const { return height_; }
+
+  int8_t get(unsigned int x, unsigned int y) const;
+  void set(unsigned int x, unsigned int y, int8_t value);
+
+  /** Copy rows [first_row, first_row + rows) to out, row-major */
+  void copyRows(unsigned int first_row, unsigned int rows, int8_t* out) const;
+
+  /** Copy the cells of box to out, row-major, (box.max_x - box.min_x + 1)
+   *  cells per row */
+  void copyBox(const CellBox& box, int8_t* out) const;
+
+  /** Set the cells of box to value */
+  void fillBox(const CellBox& box, int8_t value);
+
+  /** Set the cells whose center lies inside a polygon to value. Vertices
+   *  are given in cell units, (0, 0) being the corner of cell (0, 0).
+   *
+   * @param touched Grown to include the changed cells
+   * @return false if no cell of the grid lies inside the polygon, or if a
+   *         vertex is not finite
+   */
+  bool fillPolygon(const std::vector<std::pair<double, double> >& vertices, int8_t value, CellBox* touched);
+
+  /** Number of tiles not shared with any other grid */
+  size_t ownedTiles() const;
+
+  unsigned int tilesX() const { return tiles_x_; }
+  unsigned int tilesY() const { return tiles_y_; }
+
+  /** Cells covered by tile (tx, ty), clipped to the grid */
+  CellBox tileBox(unsigned int tx, unsigned int ty) const;
+
+  /** TILE_SIZE x TILE_SIZE row-major cells of tile (tx, ty). The cells of
+   *  edge tiles that lie outside of the grid are -1 */
+  const int8_t* tileData(unsigned int tx, unsigned int ty) const
+  {
+    return &(*tiles_[(size_t)ty * tiles_x_ + tx])[0];
+  }
+
+  /** Same as tileData(), duplicating the tile first if it is shared. The
+   *  cells outside of the grid must be left at -1 */
+  int8_t* writableTileData(unsigned int tx, unsigned int ty);
+
+  /** Give tile (tx, ty) a new tile, whose cells the caller must all write,
+   *  padding included. Threads may allocate distinct tiles of a grid no
+   *  other thread reads yet; the tile memory is first touched by the
+   *  allocating thread */
+  int8_t* allocateTile(unsigned int tx, unsigned int ty);
+
+  /** Make tile (tx, ty) the tile of other, a grid of the same size */
+  void shareTile(const TiledGrid& other, unsigned int tx, unsigned int ty);
+
+  /** Whether tile (tx, ty) is the same tile as that of other */
+  bool sharesTile(const TiledGrid& other, unsigned int tx, unsigned int ty) const
+  {
+    return tiles_[(size_t)ty * tiles_x_ + tx] == other.tiles_[(size_t)ty * other.tiles_x_ + tx];
+  }
+
+private:
+  /** Allocated from huge page slabs when enabled, see setHugePages() */
+  typedef std::vector<int8_t, GridAllocator<int8_t> > Tile;
+
+  unsigned int width_;
+  unsigned int height_;
+  unsigned int tiles_x_;
+  unsigned int tiles_y_;
+  std::vector<boost::shared_ptr<Tile> > tiles_;
+
+  const Tile& tile(unsigned int x, unsigned int y) const
+  {
+    return *tiles_[(y / TILE_SIZE) * tiles_x_ + x / TILE_SIZE];
+  }
+
+  Tile& writableTile(unsigned int x, unsigned int y);
+};
+
+/** Grow box to include another box. A box with min_x > max_x is empty */
+void growBox(CellBox* box, const CellBox& other);
+}
+
+#endif
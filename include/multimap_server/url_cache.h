@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef MULTIMAP_SERVER_URL_CACHE_H
+#define MULTIMAP_SERVER_URL_CACHE_H
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+#include "multimap_server/map_description.h"
+
+namespace multimap_server
+{
+
+/** Local copies of the map files named by URLs.
+ *
+ *  Plain paths, file:// and package:// URLs name local files, which are
+ *  used in place. Other URLs are downloaded into a content-addressed
+ *  cache: every file is stored once under its checksum. A copy whose size
+ *  or modification time changed since it was stored is checked against
+ *  its checksum again before it is reused. http:// and https:// URLs are
+ *  revalidated with conditional requests (ETag, Last-Modified), so an
+ *  unchanged map is not transferred again, and the cached copy is used as
+ *  is when the server can't be reached. Other schemes supported by
+ *  resource_retriever are downloaded on every fetch. Once the copies
+ *  exceed the size limit of the cache, the least recently fetched ones are
+ *  deleted.
+ *
+ *  Safe to use from several threads.
+ */
+class UrlCache
+{
+public:
+  /** Copies fetched less than this many seconds ago are never deleted to
+   *  make room, so that the paths fetch() returned stay valid for loading */
+  static const int MIN_EVICTION_AGE = 60;
+
+  /** @param cache_dir Directory of the cache, created if needed
+   *  @param timeout Seconds allowed for a transfer, 0 for no limit
+   *  @param max_bytes Size of the copies above which the least recently
+   *                   fetched ones are deleted, 0 for no limit
+   */
+  UrlCache(const std::string& cache_dir, double timeout, uint64_t max_bytes);
+
+  /** Local path of the file named by url
+   *
+   * @throws std::runtime_error If the file can't be fetched and is not
+   *                            cached
+   */
+  std::string fetch(const std::string& url);
+
+  /** Parse the map .yaml file named by url and fetch its image and layer
+   *  images. Relative image names are resolved against url, and the
+   *  images of the description are local paths.
+   *
+   * @throws std::runtime_error See loadMapDescription() and fetch()
+   */
+  MapDescription loadMapDescription(const std::string& url);
+
+  /** Whether name is a URL, as opposed to a path */
+  static bool isUrl(const std::string& name);
+
+  /** $ROS_HOME/multimap_url_cache, or ~/.ros/multimap_url_cache */
+  static std::string defaultCacheDir();
+
+private:
+  /** What the cache knows about a downloaded URL */
+  struct Entry
+  {
+    uint64_t checksum;
+    uint64_t size;
+    /** Modification time of the copy when it was stored, in nanoseconds */
+    int64_t mtime;
+    std::string etag;
+    std::string last_modified;
+  };
+
+  std::string cache_dir_;
+  double timeout_;
+  uint64_t max_bytes_;
+  /** Serializes evictions */
+  boost::mutex evict_mutex_;
+
+  /** Download url into a temporary file of the cache
+   *
+   * @return False if the response was 304 Not Modified for cached
+   */
+  bool httpGet(const std::string& url, const Entry* cached, Entry* entry, std::string* temp_path);
+  void retrieve(const std::string& url, Entry* entry, std::string* temp_path);
+
+  bool readEntry(const std::string& url, Entry* entry) const;
+  void writeEntry(const std::string& url, const Entry& entry) const;
+  /** Whether the copy of entry is intact. Copies are only hashed again
+   *  when their size or modification time changed, and the entry is then
+   *  updated */
+  bool objectValid(const std::string& url, Entry* entry) const;
+  std::string objectPath(const std::string& url, uint64_t checksum) const;
+  std::string entryPath(const std::string& url) const;
+
+  /** Delete the least recently fetched copies until the cache fits in
+   *  max_bytes_, except keep */
+  void evict(const std::string& keep);
+};
+}
+
+#endif
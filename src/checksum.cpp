@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 64-bit checksum used for map packs and map contents.
+ */
+
+#include <string.h>
+
+#include "multimap_server/checksum.h"
+
+#define CHECKSUM_SEED 0x6d756c74696d6170ULL
+#define CHECKSUM_M 0xc6a4a7935bd1e995ULL
+#define CHECKSUM_R 47
+
+namespace multimap_server
+{
+Checksum64::Checksum64() : h_(CHECKSUM_SEED), length_(0), tail_size_(0)
+{
+}
+
+void Checksum64::mixWord(uint64_t k)
+{
+  k *= CHECKSUM_M;
+  k ^= k >> CHECKSUM_R;
+  k *= CHECKSUM_M;
+
+  h_ ^= k;
+  h_ *= CHECKSUM_M;
+}
+
+void Checksum64::update(const void* data, size_t size)
+{
+  // Empty updates may come with a NULL pointer, which memcpy must not be given
+  if (size == 0)
+    return;
+
+  const unsigned char* p = (const unsigned char*)data;
+  length_ += size;
+
+  // Complete the word left over by the previous call
+  if (tail_size_ > 0)
+  {
+    while (tail_size_ < 8 && size > 0)
+    {
+      tail_[tail_size_++] = *p++;
+      size--;
+    }
+    if (tail_size_ < 8)
+      return;
+    uint64_t k;
+    memcpy(&k, tail_, 8);
+    mixWord(k);
+    tail_size_ = 0;
+  }
+
+  while (size >= 8)
+  {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    mixWord(k);
+    p += 8;
+    size -= 8;
+  }
+
+  memcpy(tail_, p, size);
+  tail_size_ = size;
+}
+
+uint64_t Checksum64::digest() const
+{
+  uint64_t h = h_;
+  if (tail_size_ > 0)
+  {
+    uint64_t k = 0;
+    memcpy(&k, tail_, tail_size_);
+    h ^= k;
+    h *= CHECKSUM_M;
+  }
+
+  h ^= length_ * CHECKSUM_M;
+  h ^= h >> CHECKSUM_R;
+  h *= CHECKSUM_M;
+  h ^= h >> CHECKSUM_R;
+  return h;
+}
+
+uint64_t checksum64(const void* data, size_t size)
+{
+  Checksum64 checksum;
+  checksum.update(data, size);
+  return checksum.digest();
+}
+}
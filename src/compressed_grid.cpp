@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Run-length compression of tiled grids.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "multimap_server/compressed_grid.h"
+#include "multimap_server/map_rle.h"
+
+namespace multimap_server
+{
+namespace
+{
+const size_t TILE_CELLS = TiledGrid::TILE_SIZE * TiledGrid::TILE_SIZE;
+// Tiles decoded by a thread, below which starting it costs more than it saves
+const size_t MIN_TILES_PER_THREAD = 64;
+}
+
+CompressedGrid::CompressedGrid() : width_(0), height_(0), tiles_x_(0)
+{
+}
+
+CompressedGrid::CompressedGrid(const TiledGrid& grid)
+  : width_(grid.width()), height_(grid.height()), tiles_x_(grid.tilesX())
+{
+  tiles_.resize((size_t)grid.tilesX() * grid.tilesY());
+  for (unsigned int ty = 0; ty < grid.tilesY(); ty++)
+  {
+    for (unsigned int tx = 0; tx < grid.tilesX(); tx++)
+    {
+      const int8_t* cells = grid.tileData(tx, ty);
+      std::vector<uint8_t>& encoded = tiles_[(size_t)ty * tiles_x_ + tx];
+      for (size_t i = 0; i < TILE_CELLS;)
+      {
+        size_t end = findRunEnd(cells, i, std::min(TILE_CELLS, i + 256));
+        encoded.push_back(end - i - 1);
+        encoded.push_back(cells[i]);
+        i = end;
+      }
+      // The vectors were grown by doubling
+      std::vector<uint8_t>(encoded).swap(encoded);
+    }
+  }
+}
+
+TiledGrid CompressedGrid::decompress(unsigned int threads) const
+{
+  // Each thread allocates the tiles it decodes, so allocation is split as well and the pages are touched once
+  TiledGrid grid = TiledGrid::withoutTiles(width_, height_);
+  size_t chunks = std::max<size_t>(1, std::min<size_t>(threads, tiles_.size() / MIN_TILES_PER_THREAD));
+  if (chunks == 1)
+  {
+    decodeTiles(0, tiles_.size(), &grid);
+    return grid;
+  }
+
+  // Threads allocate distinct tiles of a grid no one else holds yet
+  boost::thread_group workers;
+  size_t per_chunk = (tiles_.size() + chunks - 1) / chunks;
+  for (size_t first = 0; first < tiles_.size(); first += per_chunk)
+  {
+    workers.create_thread(boost::bind(&CompressedGrid::decodeTiles, this, first,
+                                      std::min(tiles_.size(), first + per_chunk), &grid));
+  }
+  workers.join_all();
+  return grid;
+}
+
+void CompressedGrid::decodeTiles(size_t first, size_t last, TiledGrid* grid) const
+{
+  for (size_t tile = first; tile < last; tile++)
+  {
+    int8_t* cells = grid->allocateTile(tile % tiles_x_, tile / tiles_x_);
+    const std::vector<uint8_t>& encoded = tiles_[tile];
+    for (size_t i = 0; i + 1 < encoded.size(); i += 2)
+    {
+      size_t run = encoded[i] + 1;
+      memset(cells, (int8_t)encoded[i + 1], run);
+      cells += run;
+    }
+  }
+}
+
+size_t CompressedGrid::size() const
+{
+  size_t bytes = 0;
+  for (size_t i = 0; i < tiles_.size(); i++)
+  {
+    bytes += tiles_[i].size();
+  }
+  return bytes;
+}
+}
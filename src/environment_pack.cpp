@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reading and writing of environment packs.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+
+#include "multimap_server/checksum.h"
+#include "multimap_server/environment_pack.h"
+
+#define PACK_MAGIC "MMAPPACK"
+#define PACK_VERSION 1
+
+namespace multimap_server
+{
+namespace
+{
+struct PackHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t map_count;
+  uint64_t manifest_checksum;
+  char environment[PACK_NAME_SIZE];
+  char global_frame[PACK_NAME_SIZE];
+};
+
+struct PackEntry
+{
+  char name[PACK_NAME_SIZE];
+  uint32_t width;
+  uint32_t height;
+  double resolution;
+  double origin[3];
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint64_t checksum;
+};
+
+size_t alignUp(size_t offset)
+{
+  return (offset + PACK_ALIGNMENT - 1) / PACK_ALIGNMENT * PACK_ALIGNMENT;
+}
+
+void copyName(char* dst, const std::string& src, const std::string& what)
+{
+  if (src.size() >= PACK_NAME_SIZE)
+  {
+    throw std::runtime_error(what + " \"" + src + "\" is too long to be stored in an environment pack");
+  }
+  memset(dst, 0, PACK_NAME_SIZE);
+  memcpy(dst, src.c_str(), src.size());
+}
+
+std::string readName(const char* src)
+{
+  return std::string(src, strnlen(src, PACK_NAME_SIZE));
+}
+
+void writeAll(FILE* out, const void* data, size_t size, const std::string& path)
+{
+  if (size > 0 && fwrite(data, 1, size, out) != size)
+  {
+    fclose(out);
+    throw std::runtime_error("failed to write environment pack \"" + path + "\": " + strerror(errno));
+  }
+}
+}
+
+EnvironmentPack::EnvironmentPack(const std::string& path) : path_(path), mapping_(NULL), size_(0)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    throw std::runtime_error("failed to open environment pack \"" + path + "\": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PackHeader))
+  {
+    close(fd);
+    throw std::runtime_error("\"" + path + "\" is not an environment pack");
+  }
+  size_ = st.st_size;
+  mapping_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping_ == MAP_FAILED)
+  {
+    mapping_ = NULL;
+    throw std::runtime_error("failed to map environment pack \"" + path + "\": " + strerror(errno));
+  }
+
+  try
+  {
+    const char* base = (const char*)mapping_;
+    const PackHeader* header = (const PackHeader*)base;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0)
+    {
+      throw std::runtime_error("\"" + path + "\" is not an environment pack");
+    }
+    if (header->version != PACK_VERSION)
+    {
+      throw std::runtime_error("environment pack \"" + path + "\" has an unsupported version");
+    }
+    size_t manifest_size = (size_t)header->map_count * sizeof(PackEntry);
+    if (header->map_count > (size_ - sizeof(PackHeader)) / sizeof(PackEntry))
+    {
+      throw std::runtime_error("environment pack \"" + path + "\" is truncated");
+    }
+    const PackEntry* entries = (const PackEntry*)(base + sizeof(PackHeader));
+    if (checksum64(entries, manifest_size) != header->manifest_checksum)
+    {
+      throw std::runtime_error("the manifest of environment pack \"" + path + "\" is corrupted");
+    }
+
+    environment_ = readName(header->environment);
+    global_frame_ = readName(header->global_frame);
+
+    for (uint32_t i = 0; i < header->map_count; i++)
+    {
+      const PackEntry& entry = entries[i];
+      if (entry.data_size != (uint64_t)entry.width * entry.height || entry.data_offset % PACK_ALIGNMENT != 0 ||
+          entry.data_offset > size_ || entry.data_size > size_ - entry.data_offset)
+      {
+        throw std::runtime_error("environment pack \"" + path + "\" has an invalid entry for map " +
+                                 readName(entry.name));
+      }
+
+      PackedMap map;
+      map.name = readName(entry.name);
+      map.width = entry.width;
+      map.height = entry.height;
+      map.resolution = entry.resolution;
+      map.origin[0] = entry.origin[0];
+      map.origin[1] = entry.origin[1];
+      map.origin[2] = entry.origin[2];
+      map.data = (const int8_t*)(base + entry.data_offset);
+      map.checksum = entry.checksum;
+      maps_.push_back(map);
+    }
+  }
+  catch (...)
+  {
+    munmap(mapping_, size_);
+    throw;
+  }
+
+  // The grids are typically read once, front to back
+  madvise(mapping_, size_, MADV_SEQUENTIAL);
+}
+
+EnvironmentPack::~EnvironmentPack()
+{
+  if (mapping_)
+  {
+    munmap(mapping_, size_);
+  }
+}
+
+bool EnvironmentPack::verify(const PackedMap& map) const
+{
+  return checksum64(map.data, (size_t)map.width * map.height) == map.checksum;
+}
+
+void writeEnvironmentPack(const std::string& path, const std::string& environment, const std::string& global_frame,
+                          const std::vector<PackedMap>& maps)
+{
+  PackHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+  header.version = PACK_VERSION;
+  header.map_count = maps.size();
+  copyName(header.environment, environment, "environment name");
+  copyName(header.global_frame, global_frame, "global frame");
+
+  std::vector<PackEntry> entries(maps.size());
+  size_t offset = alignUp(sizeof(PackHeader) + maps.size() * sizeof(PackEntry));
+  for (size_t i = 0; i < maps.size(); i++)
+  {
+    PackEntry& entry = entries[i];
+    memset(&entry, 0, sizeof(entry));
+    copyName(entry.name, maps[i].name, "map name");
+    entry.width = maps[i].width;
+    entry.height = maps[i].height;
+    entry.resolution = maps[i].resolution;
+    entry.origin[0] = maps[i].origin[0];
+    entry.origin[1] = maps[i].origin[1];
+    entry.origin[2] = maps[i].origin[2];
+    entry.data_offset = offset;
+    entry.data_size = (uint64_t)maps[i].width * maps[i].height;
+    entry.checksum = checksum64(maps[i].data, entry.data_size);
+    offset = alignUp(offset + entry.data_size);
+  }
+  header.manifest_checksum = checksum64(entries.data(), entries.size() * sizeof(PackEntry));
+
+  // Write to a temporary file first, so that a pack being replaced is never seen half written
+  std::string tmp_path = path + ".tmp";
+  FILE* out = fopen(tmp_path.c_str(), "wb");
+  if (!out)
+  {
+    throw std::runtime_error("failed to create environment pack \"" + tmp_path + "\": " + strerror(errno));
+  }
+
+  std::vector<char> padding(PACK_ALIGNMENT, 0);
+  size_t written = 0;
+  writeAll(out, &header, sizeof(header), tmp_path);
+  writeAll(out, entries.data(), entries.size() * sizeof(PackEntry), tmp_path);
+  written = sizeof(header) + entries.size() * sizeof(PackEntry);
+  for (size_t i = 0; i < maps.size(); i++)
+  {
+    writeAll(out, padding.data(), entries[i].data_offset - written, tmp_path);
+    writeAll(out, maps[i].data, entries[i].data_size, tmp_path);
+    written = entries[i].data_offset + entries[i].data_size;
+  }
+  writeAll(out, padding.data(), alignUp(written) - written, tmp_path);
+
+  if (fclose(out) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    throw std::runtime_error("failed to write environment pack \"" + path + "\": " + strerror(errno));
+  }
+}
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Converts the environments of an environments .yaml file into environment
+ * packs, one file per environment.
+ */
+
+#define USAGE                                                                                                          \
+  "\nUSAGE: environment_packer <environments.yaml> <output_directory>\n"                                              \
+  "  environments.yaml: environments to pack, in the format read by multimap_server\n"                                 \
+  "  output_directory: directory where <environment>.mmpack files are written"
+
+#include <fstream>
+#include <vector>
+
+#include "ros/console.h"
+#include "yaml-cpp/yaml.h"
+#include <ros/package.h>
+
+#include "multimap_server/environment_pack.h"
+#include "multimap_server/map_description.h"
+#include "multimap_server/map_layers.h"
+#include "multimap_server/url_cache.h"
+
+/** Bake the layers of a map description into its grid, as multimap_server composes them on load */
+void bakeLayers(nav_msgs::OccupancyGrid* map, const multimap_server::MapDescription& desc)
+{
+  std::vector<multimap_server::MapLayer> layers;
+  std::vector<multimap_server::LayerDescription>::const_iterator layer_desc;
+  for (layer_desc = desc.layers.begin(); layer_desc != desc.layers.end(); ++layer_desc)
+  {
+    nav_msgs::GetMap::Response loaded;
+    multimap_server::loadLayerFromDescription(&loaded, desc, *layer_desc);
+    if (loaded.map.info.width != map->info.width || loaded.map.info.height != map->info.height)
+    {
+      throw std::runtime_error("Layer " + layer_desc->name + " does not have the size of the map image");
+    }
+
+    multimap_server::MapLayer layer;
+    layer.name = layer_desc->name;
+    layer.blend = layer_desc->blend;
+    layer.grid = multimap_server::TiledGrid(map->info.width, map->info.height, &loaded.map.data[0]);
+    layers.push_back(layer);
+  }
+
+  multimap_server::TiledGrid base(map->info.width, map->info.height, &map->data[0]);
+  multimap_server::composeLayers(base, layers).copyRows(0, map->info.height, &map->data[0]);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "%s\n", USAGE);
+    return -1;
+  }
+  std::string fname(argv[1]);
+  std::string output_dir(argv[2]);
+
+  std::ifstream fin(fname.c_str());
+  if (fin.fail())
+  {
+    fprintf(stderr, "The file %s could not be opened\n", fname.c_str());
+    return -1;
+  }
+  YAML::Node doc = YAML::Load(fin);
+  multimap_server::UrlCache url_cache(multimap_server::UrlCache::defaultCacheDir(), 60.0);
+
+  try
+  {
+    for (YAML::const_iterator namespace_iterator = doc.begin(); namespace_iterator != doc.end(); ++namespace_iterator)
+    {
+      std::string environment = namespace_iterator->first.as<std::string>();
+      std::string global_frame = namespace_iterator->second["global_frame"].as<std::string>();
+      YAML::Node maps = namespace_iterator->second["maps"];
+
+      // The grids must outlive the PackedMap entries pointing at them
+      std::vector<nav_msgs::GetMap::Response> grids(maps.size());
+      std::vector<multimap_server::PackedMap> packed_maps;
+
+      size_t i = 0;
+      for (YAML::const_iterator maps_iterator = maps.begin(); maps_iterator != maps.end(); ++maps_iterator, ++i)
+      {
+        std::string map_path = maps_iterator->second.as<std::string>();
+        if (!multimap_server::UrlCache::isUrl(map_path))
+        {
+          map_path = ros::package::getPath(namespace_iterator->second["maps_package"].as<std::string>()) + "/" +
+                     map_path;
+        }
+        multimap_server::MapDescription desc = url_cache.loadMapDescription(map_path);
+        printf("Converting %s/%s from \"%s\"\n", environment.c_str(), maps_iterator->first.as<std::string>().c_str(),
+               desc.image.c_str());
+        multimap_server::loadMapFromDescription(&grids[i], desc);
+        if (!desc.layers.empty())
+        {
+          bakeLayers(&grids[i].map, desc);
+        }
+
+        multimap_server::PackedMap packed;
+        packed.name = maps_iterator->first.as<std::string>();
+        packed.width = grids[i].map.info.width;
+        packed.height = grids[i].map.info.height;
+        packed.resolution = desc.resolution;
+        packed.origin[0] = desc.origin[0];
+        packed.origin[1] = desc.origin[1];
+        packed.origin[2] = desc.origin[2];
+        packed.data = &grids[i].map.data[0];
+        packed_maps.push_back(packed);
+      }
+
+      std::string pack_path = output_dir + "/" + environment + ".mmpack";
+      multimap_server::writeEnvironmentPack(pack_path, environment, global_frame, packed_maps);
+      printf("Wrote %lu maps to \"%s\"\n", (unsigned long)packed_maps.size(), pack_path.c_str());
+    }
+  }
+  catch (std::exception& e)
+  {
+    fprintf(stderr, "environment_packer failed: %s\n", e.what());
+    return -1;
+  }
+
+  return 0;
+}
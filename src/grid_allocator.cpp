@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Huge page slabs for the tiles of grids.
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "multimap_server/grid_allocator.h"
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+namespace
+{
+const size_t SLAB_SIZE = 2 * 1024 * 1024;
+const size_t BLOCK_SIZE = TiledGrid::TILE_SIZE * TiledGrid::TILE_SIZE;
+
+struct Heap;
+
+/** Protected by the mutex of its heap */
+struct Slab
+{
+  char* base;
+  /** Bytes handed out from the start of the slab. Blocks freed since are in free_blocks */
+  size_t carved;
+  size_t live_blocks;
+  /** Linked through the first bytes of the blocks */
+  void* free_blocks;
+  /** Never changes: a heap outlives its slabs */
+  Heap* heap;
+};
+
+/** Slabs that one thread carves blocks from. The mutex is only contended by frees from other threads. Heaps are
+ *  never destroyed: the heap of an exited thread goes to the next new thread, with its slabs and free blocks */
+struct Heap
+{
+  boost::mutex mutex;
+  /** Slab blocks are carved from, which stays mapped while it is current */
+  Slab* current;
+  /** The other slabs that have free blocks */
+  std::vector<Slab*> partial;
+};
+
+void retireHeap(Heap* heap);
+
+HugePages huge_pages = HUGE_PAGES_OFF;
+/** Protects slabs, which frees only read. Taken after the mutex of a heap, never before */
+boost::shared_mutex slabs_mutex;
+/** By base address */
+std::map<uintptr_t, Slab*> slabs;
+/** Read without slabs_mutex, so that frees skip the slab lookup when no slab was ever mapped */
+size_t slab_count = 0;
+/** Protects retired_heaps */
+boost::mutex retired_mutex;
+/** Heaps of the threads that exited */
+std::vector<Heap*> retired_heaps;
+boost::thread_specific_ptr<Heap> thread_heap(retireHeap);
+
+/** Map a 2 MB aligned slab. Its pages are not touched */
+char* mapSlab(bool hugetlb)
+{
+#ifdef MAP_HUGETLB
+  if (hugetlb)
+  {
+    void* slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED)
+      return static_cast<char*>(slab);
+    // Reserved huge pages exhausted: transparent huge pages still cut the TLB misses
+  }
+#endif
+
+  // Transparent huge pages need an aligned range: twice the size is mapped and trimmed
+  void* mapping = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    throw std::bad_alloc();
+  char* start = static_cast<char*>(mapping);
+  char* slab = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(start) + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1));
+  if (slab > start)
+    munmap(start, slab - start);
+  if (start + 2 * SLAB_SIZE > slab + SLAB_SIZE)
+    munmap(slab + SLAB_SIZE, start + 2 * SLAB_SIZE - (slab + SLAB_SIZE));
+#ifdef MADV_HUGEPAGE
+  madvise(slab, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+  return slab;
+}
+
+/** With the mutex of the heap of the slab held. The slab must not be current */
+void unmapSlab(Slab* slab)
+{
+  std::vector<Slab*>& partial = slab->heap->partial;
+  partial.erase(std::remove(partial.begin(), partial.end(), slab), partial.end());
+  {
+    boost::unique_lock<boost::shared_mutex> lock(slabs_mutex);
+    slabs.erase(reinterpret_cast<uintptr_t>(slab->base));
+    __atomic_store_n(&slab_count, slabs.size(), __ATOMIC_RELAXED);
+  }
+  munmap(slab->base, SLAB_SIZE);
+  delete slab;
+}
+
+/** Called by boost::thread_specific_ptr when the thread exits */
+void retireHeap(Heap* heap)
+{
+  {
+    boost::mutex::scoped_lock lock(heap->mutex);
+    Slab* current = heap->current;
+    heap->current = NULL;
+    if (current && current->live_blocks == 0)
+      unmapSlab(current);
+    else if (current && (current->free_blocks || current->carved < SLAB_SIZE))
+      heap->partial.push_back(current);
+  }
+  boost::mutex::scoped_lock lock(retired_mutex);
+  retired_heaps.push_back(heap);
+}
+
+/** Heap of the calling thread, which is the heap of an exited thread when there is one */
+Heap* threadHeap()
+{
+  Heap* heap = thread_heap.get();
+  if (heap)
+    return heap;
+
+  {
+    boost::mutex::scoped_lock lock(retired_mutex);
+    if (!retired_heaps.empty())
+    {
+      heap = retired_heaps.back();
+      retired_heaps.pop_back();
+    }
+  }
+  if (!heap)
+  {
+    heap = new Heap;
+    heap->current = NULL;
+  }
+  thread_heap.reset(heap);
+  return heap;
+}
+
+void* allocateBlock(bool hugetlb)
+{
+  Heap* heap = threadHeap();
+  boost::mutex::scoped_lock lock(heap->mutex);
+  Slab* slab = heap->current;
+  if (!slab || (!slab->free_blocks && slab->carved == SLAB_SIZE))
+  {
+    // Blocks freed in the other slabs of the heap are reused before a new slab is mapped
+    if (!heap->partial.empty())
+    {
+      slab = heap->partial.back();
+      heap->partial.pop_back();
+    }
+    else
+    {
+      slab = new Slab;
+      try
+      {
+        slab->base = mapSlab(hugetlb);
+      }
+      catch (std::bad_alloc&)
+      {
+        delete slab;
+        throw;
+      }
+      slab->carved = 0;
+      slab->live_blocks = 0;
+      slab->free_blocks = NULL;
+      slab->heap = heap;
+      boost::unique_lock<boost::shared_mutex> slabs_lock(slabs_mutex);
+      slabs[reinterpret_cast<uintptr_t>(slab->base)] = slab;
+      __atomic_store_n(&slab_count, slabs.size(), __ATOMIC_RELAXED);
+    }
+    // The previous slab is full, so it is neither unmapped nor listed as partial here
+    heap->current = slab;
+  }
+
+  void* block;
+  if (slab->free_blocks)
+  {
+    block = slab->free_blocks;
+    slab->free_blocks = *static_cast<void**>(block);
+  }
+  else
+  {
+    block = slab->base + slab->carved;
+    slab->carved += BLOCK_SIZE;
+  }
+  slab->live_blocks++;
+  return block;
+}
+
+/** Slab holding buffer, NULL if it was not carved from a slab */
+Slab* findSlab(void* buffer)
+{
+  boost::shared_lock<boost::shared_mutex> lock(slabs_mutex);
+  std::map<uintptr_t, Slab*>::const_iterator it = slabs.find(reinterpret_cast<uintptr_t>(buffer) & ~(SLAB_SIZE - 1));
+  return it != slabs.end() ? it->second : NULL;
+}
+
+bool hugeTlbAvailable()
+{
+#ifdef MAP_HUGETLB
+  void* probe = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (probe != MAP_FAILED)
+  {
+    munmap(probe, SLAB_SIZE);
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool transparentHugePagesAvailable()
+{
+#ifdef MADV_HUGEPAGE
+  // "always [madvise] never", the selected mode in brackets
+  std::ifstream enabled("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string modes;
+  if (std::getline(enabled, modes))
+    return modes.find("[never]") == std::string::npos;
+#endif
+  return false;
+}
+}
+
+HugePages parseHugePages(const std::string& name)
+{
+  if (name == "off")
+    return HUGE_PAGES_OFF;
+  if (name == "transparent")
+    return HUGE_PAGES_TRANSPARENT;
+  if (name == "hugetlb")
+    return HUGE_PAGES_HUGETLB;
+  throw std::runtime_error("unknown huge page mode \"" + name + "\", expected off, transparent or hugetlb");
+}
+
+const char* hugePagesName(HugePages pages)
+{
+  switch (pages)
+  {
+    case HUGE_PAGES_TRANSPARENT:
+      return "transparent";
+    case HUGE_PAGES_HUGETLB:
+      return "hugetlb";
+    default:
+      return "off";
+  }
+}
+
+HugePages setHugePages(HugePages pages)
+{
+  if (pages == HUGE_PAGES_HUGETLB && !hugeTlbAvailable())
+    pages = HUGE_PAGES_TRANSPARENT;
+  if (pages == HUGE_PAGES_TRANSPARENT && !transparentHugePagesAvailable())
+    pages = HUGE_PAGES_OFF;
+  __atomic_store_n(&huge_pages, pages, __ATOMIC_RELAXED);
+  return pages;
+}
+
+void* allocateGridBuffer(size_t bytes)
+{
+  HugePages pages = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED);
+  if (bytes == BLOCK_SIZE && pages != HUGE_PAGES_OFF)
+    return allocateBlock(pages == HUGE_PAGES_HUGETLB);
+  return ::operator new(bytes);
+}
+
+void freeGridBuffer(void* buffer, size_t bytes)
+{
+  // The slab can't be unmapped meanwhile: buffer is one of its live blocks
+  Slab* slab = bytes == BLOCK_SIZE && __atomic_load_n(&slab_count, __ATOMIC_RELAXED) > 0 ? findSlab(buffer) : NULL;
+  if (!slab)
+  {
+    ::operator delete(buffer);
+    return;
+  }
+
+  Heap* heap = slab->heap;
+  boost::mutex::scoped_lock lock(heap->mutex);
+  bool was_full = !slab->free_blocks && slab->carved == SLAB_SIZE;
+  *static_cast<void**>(buffer) = slab->free_blocks;
+  slab->free_blocks = buffer;
+  slab->live_blocks--;
+  if (slab == heap->current)
+    return;
+  // Slabs go back to the system as soon as their last tile is freed
+  if (slab->live_blocks == 0)
+    unmapSlab(slab);
+  else if (was_full)
+    heap->partial.push_back(slab);
+}
+}
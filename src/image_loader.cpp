@@ -33,11 +33,17 @@
  * Author: Brian Gerkey
  */
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // We use SDL_image to load the image from disk
 #include <SDL/SDL_image.h>
@@ -46,14 +52,220 @@
 #include <LinearMath/btQuaternion.h>
 
 #include "multimap_server/image_loader.h"
+#include "multimap_server/image_probe.h"
 
 // compute linear index for given map coords
 #define MAP_IDX(sx, i, j) ((sx) * (j) + (i))
 
+// number of rows converted between progress updates / cancellation checks
+#define PROGRESS_ROWS 256
+
 namespace multimap_server
 {
+namespace
+{
+void setMetaData(nav_msgs::MapMetaData* info, unsigned int width, unsigned int height, double res, double* origin)
+{
+  info->width = width;
+  info->height = height;
+  info->resolution = res;
+  info->origin.position.x = *(origin);
+  info->origin.position.y = *(origin + 1);
+  info->origin.position.z = 0.0;
+  btQuaternion q;
+  // setEulerZYX(yaw, pitch, roll)
+  q.setEulerZYX(*(origin + 2), 0, 0);
+  info->origin.orientation.x = q.x();
+  info->origin.orientation.y = q.y();
+  info->origin.orientation.z = q.z();
+  info->origin.orientation.w = q.w();
+}
+
+/** Occupancy value of the pixel at p, as stored in the map */
+unsigned char cellValue(const unsigned char* p, int n_channels, int avg_channels, bool negate, double occ_th,
+                        double free_th, MapMode mode)
+{
+  int k;
+  int alpha;
+  int color_sum;
+  double color_avg;
+  double occ;
+
+  // Compute mean of RGB for this pixel
+  color_sum = 0;
+  for (k = 0; k < avg_channels; k++)
+    color_sum += *(p + (k));
+  color_avg = color_sum / (double)avg_channels;
+
+  if (n_channels == 1)
+    alpha = 1;
+  else
+    alpha = *(p + n_channels - 1);
+
+  if (negate)
+    color_avg = 255 - color_avg;
+
+  if (mode == RAW)
+    return color_avg;
+
+  // If negate is true, we consider blacker pixels free, and whiter
+  // pixels free.  Otherwise, it's vice versa.
+  occ = (255 - color_avg) / 255.0;
+
+  // Apply thresholds to RGB means to determine occupancy values for
+  // map.
+  if (occ > occ_th)
+    return +100;
+  else if (occ < free_th)
+    return 0;
+  else if (mode == TRINARY || alpha < 1.0)
+    return -1;
+  else
+  {
+    double ratio = (occ - free_th) / (occ_th - free_th);
+    return 99 * ratio;
+  }
+}
+
+/** Copy the rows of an 8-bit image into data, bottom row first. This is what cellValue() computes for one channel
+ *  in RAW mode without negate */
+void copyFlippedRows(const unsigned char* pixels, int rowstride, nav_msgs::MapMetaData* info, std::vector<int8_t>* data,
+                     LoadMonitor* monitor, const char* fname)
+{
+  for (unsigned int j = 0; j < info->height; j++)
+  {
+    if (monitor && j % PROGRESS_ROWS == 0)
+    {
+      monitor->progress("convert", j / (double)info->height);
+      if (monitor->cancelled())
+        throw LoadCancelled(std::string("loading of \"") + fname + "\" was cancelled");
+    }
+    memcpy(&(*data)[MAP_IDX(info->width, 0, info->height - j - 1)], pixels + (size_t)j * rowstride, info->width);
+  }
+}
+
+/** Load a binary 8-bit PGM in RAW mode without negate, by copying the rows of the mapped file.
+ *
+ * @return false if fname is not such a PGM, which is then loaded by SDL_image
+ */
+bool loadRawPgm(nav_msgs::GetMap::Response* resp, const char* fname, double res, double* origin,
+                LoadMonitor* monitor)
+{
+  unsigned int width, height;
+  long data_offset;
+  if (!probeRawPgm(fname, &width, &height, &data_offset))
+    return false;
+
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  size_t map_size = data_offset + (size_t)width * height;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < map_size)
+  {
+    close(fd);
+    return false;
+  }
+  void* mapped = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+  madvise(mapped, map_size, MADV_SEQUENTIAL);
+
+  if (monitor)
+    monitor->progress("decode", 1.0);
+  setMetaData(&resp->map.info, width, height, res, origin);
+  resp->map.data.resize((size_t)width * height);
+  try
+  {
+    copyFlippedRows((const unsigned char*)mapped + data_offset, width, &resp->map.info, &resp->map.data, monitor,
+                    fname);
+  }
+  catch (...)
+  {
+    munmap(mapped, map_size);
+    throw;
+  }
+  munmap(mapped, map_size);
+
+  if (monitor)
+    monitor->progress("convert", 1.0);
+  return true;
+}
+
+/** Order of occupancy values when downsampling conservatively: free,
+ *  unknown, partially occupied, occupied */
+int conservativeRank(int8_t value)
+{
+  return value < 0 ? 1 : (value == 0 ? 0 : value + 1);
+}
+
+/** Build the preview of a decoded image, previewFactor() times coarser
+ *  than the map, where every cell holds the highest ranked value of its
+ *  block, and hand it to the monitor. The rows of a block are reduced
+ *  column by column first, then each block of columns, so that no
+ *  occupied pixel is ever skipped */
+void buildPreview(SDL_Surface* img, const nav_msgs::MapMetaData& info, int n_channels, int avg_channels, bool negate,
+                  double occ_th, double free_th, MapMode mode, LoadMonitor* monitor, const char* fname)
+{
+  unsigned int factor = monitor->previewFactor();
+  nav_msgs::OccupancyGrid coarse;
+  coarse.info = info;
+  coarse.info.resolution = info.resolution * factor;
+  coarse.info.width = (info.width + factor - 1) / factor;
+  coarse.info.height = (info.height + factor - 1) / factor;
+  coarse.data.resize(coarse.info.width * coarse.info.height);
+
+  unsigned char* pixels = (unsigned char*)(img->pixels);
+  std::vector<int8_t> columns(info.width);
+  for (unsigned int r = 0; r < coarse.info.height; r++)
+  {
+    if (r % PROGRESS_ROWS == 0)
+    {
+      monitor->progress("preview", r / (double)coarse.info.height);
+      if (monitor->cancelled())
+      {
+        SDL_FreeSurface(img);
+        throw LoadCancelled(std::string("loading of \"") + fname + "\" was cancelled");
+      }
+    }
+
+    // Highest ranked value of each column over the rows of the block, with the same row inversion as the full
+    // resolution conversion. Free is the lowest ranked value
+    std::fill(columns.begin(), columns.end(), 0);
+    unsigned int last_y = std::min((r + 1) * factor, info.height);
+    for (unsigned int y = r * factor; y < last_y; y++)
+    {
+      const unsigned char* line = pixels + (info.height - y - 1) * img->pitch;
+      for (unsigned int x = 0; x < info.width; x++)
+      {
+        int8_t value = cellValue(line + x * n_channels, n_channels, avg_channels, negate, occ_th, free_th, mode);
+        if (conservativeRank(value) > conservativeRank(columns[x]))
+          columns[x] = value;
+      }
+    }
+
+    int8_t* row = &coarse.data[r * coarse.info.width];
+    for (unsigned int c = 0; c < coarse.info.width; c++)
+    {
+      unsigned int last_x = std::min((c + 1) * factor, info.width);
+      int8_t value = columns[c * factor];
+      for (unsigned int x = c * factor + 1; x < last_x; x++)
+      {
+        if (conservativeRank(columns[x]) > conservativeRank(value))
+          value = columns[x];
+      }
+      row[c] = value;
+    }
+  }
+
+  monitor->progress("preview", 1.0);
+  monitor->preview(coarse);
+}
+}
+
 void loadMapFromFile(nav_msgs::GetMap::Response* resp, const char* fname, double res, bool negate, double occ_th,
-                     double free_th, double* origin, MapMode mode)
+                     double free_th, double* origin, MapMode mode, LoadMonitor* monitor)
 {
   SDL_Surface* img;
 
@@ -62,11 +274,23 @@ void loadMapFromFile(nav_msgs::GetMap::Response* resp, const char* fname, double
   unsigned char value;
   int rowstride, n_channels, avg_channels;
   unsigned int i, j;
-  int k;
-  double occ;
-  int alpha;
-  int color_sum;
-  double color_avg;
+
+  if (monitor)
+  {
+    // The extents are known from the image header long before the decode completes
+    unsigned int probed_width, probed_height;
+    if (probeImageSize(fname, &probed_width, &probed_height))
+    {
+      nav_msgs::MapMetaData info;
+      setMetaData(&info, probed_width, probed_height, res, origin);
+      monitor->extents(info);
+    }
+    monitor->progress("decode", 0.0);
+  }
+
+  // Raw 8-bit PGMs, such as cost-map layers, are copied as is without decoding them
+  if (mode == RAW && !negate && loadRawPgm(resp, fname, res, origin, monitor))
+    return;
 
   // Load the image using SDL.  If we get NULL back, the image load failed.
   if (!(img = IMG_Load(fname)))
@@ -76,20 +300,20 @@ void loadMapFromFile(nav_msgs::GetMap::Response* resp, const char* fname, double
     throw std::runtime_error(errmsg);
   }
 
+  // SDL decodes the whole image in one call, so there are no intermediate
+  // decode updates
+  if (monitor)
+  {
+    monitor->progress("decode", 1.0);
+    if (monitor->cancelled())
+    {
+      SDL_FreeSurface(img);
+      throw LoadCancelled(std::string("loading of \"") + fname + "\" was cancelled");
+    }
+  }
+
   // Copy the image data into the map structure
-  resp->map.info.width = img->w;
-  resp->map.info.height = img->h;
-  resp->map.info.resolution = res;
-  resp->map.info.origin.position.x = *(origin);
-  resp->map.info.origin.position.y = *(origin + 1);
-  resp->map.info.origin.position.z = 0.0;
-  btQuaternion q;
-  // setEulerZYX(yaw, pitch, roll)
-  q.setEulerZYX(*(origin + 2), 0, 0);
-  resp->map.info.origin.orientation.x = q.x();
-  resp->map.info.origin.orientation.y = q.y();
-  resp->map.info.origin.orientation.z = q.z();
-  resp->map.info.origin.orientation.w = q.w();
+  setMetaData(&resp->map.info, img->w, img->h, res, origin);
 
   // Allocate space to hold the data
   resp->map.data.resize(resp->map.info.width * resp->map.info.height);
@@ -105,57 +329,54 @@ void loadMapFromFile(nav_msgs::GetMap::Response* resp, const char* fname, double
   else
     avg_channels = n_channels - 1;
 
+  // Raw values have no occupancy order, so they get no preview
+  if (monitor && mode != RAW && monitor->previewFactor() > 1)
+    buildPreview(img, resp->map.info, n_channels, avg_channels, negate, occ_th, free_th, mode, monitor, fname);
+
   // Copy pixel data into the map structure
   pixels = (unsigned char*)(img->pixels);
+  if (mode == RAW && !negate && n_channels == 1)
+  {
+    try
+    {
+      copyFlippedRows(pixels, rowstride, &resp->map.info, &resp->map.data, monitor, fname);
+    }
+    catch (...)
+    {
+      SDL_FreeSurface(img);
+      throw;
+    }
+    SDL_FreeSurface(img);
+    if (monitor)
+      monitor->progress("convert", 1.0);
+    return;
+  }
   for (j = 0; j < resp->map.info.height; j++)
   {
-    for (i = 0; i < resp->map.info.width; i++)
+    if (monitor && j % PROGRESS_ROWS == 0)
     {
-      // Compute mean of RGB for this pixel
-      p = pixels + j * rowstride + i * n_channels;
-      color_sum = 0;
-      for (k = 0; k < avg_channels; k++)
-        color_sum += *(p + (k));
-      color_avg = color_sum / (double)avg_channels;
-
-      if (n_channels == 1)
-        alpha = 1;
-      else
-        alpha = *(p + n_channels - 1);
-
-      if (negate)
-        color_avg = 255 - color_avg;
-
-      if (mode == RAW)
+      monitor->progress("convert", j / (double)resp->map.info.height);
+      if (monitor->cancelled())
       {
-        value = color_avg;
-        resp->map.data[MAP_IDX(resp->map.info.width, i, resp->map.info.height - j - 1)] = value;
-        continue;
+        SDL_FreeSurface(img);
+        throw LoadCancelled(std::string("loading of \"") + fname + "\" was cancelled");
       }
+    }
 
-      // If negate is true, we consider blacker pixels free, and whiter
-      // pixels free.  Otherwise, it's vice versa.
-      occ = (255 - color_avg) / 255.0;
+    for (i = 0; i < resp->map.info.width; i++)
+    {
+      p = pixels + j * rowstride + i * n_channels;
+      value = cellValue(p, n_channels, avg_channels, negate, occ_th, free_th, mode);
 
-      // Apply thresholds to RGB means to determine occupancy values for
-      // map.  Note that we invert the graphics-ordering of the pixels to
+      // Note that we invert the graphics-ordering of the pixels to
       // produce a map with cell (0,0) in the lower-left corner.
-      if (occ > occ_th)
-        value = +100;
-      else if (occ < free_th)
-        value = 0;
-      else if (mode == TRINARY || alpha < 1.0)
-        value = -1;
-      else
-      {
-        double ratio = (occ - free_th) / (occ_th - free_th);
-        value = 99 * ratio;
-      }
-
       resp->map.data[MAP_IDX(resp->map.info.width, i, resp->map.info.height - j - 1)] = value;
     }
   }
 
   SDL_FreeSurface(img);
+
+  if (monitor)
+    monitor->progress("convert", 1.0);
 }
 }
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Image size from file headers, read ahead of the full decode.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "multimap_server/image_probe.h"
+
+namespace multimap_server
+{
+namespace
+{
+uint32_t bigEndian16(const unsigned char* p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+uint32_t bigEndian32(const unsigned char* p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint32_t littleEndian16(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t littleEndian32(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/** Next decimal number of a PNM header, skipping whitespace and comments */
+bool readPnmNumber(FILE* file, unsigned int* value)
+{
+  int c = fgetc(file);
+  while (c != EOF && (isspace(c) || c == '#'))
+  {
+    if (c == '#')
+    {
+      while (c != EOF && c != '\n')
+        c = fgetc(file);
+    }
+    c = fgetc(file);
+  }
+  if (c == EOF || !isdigit(c))
+    return false;
+
+  *value = 0;
+  while (c != EOF && isdigit(c))
+  {
+    *value = *value * 10 + (c - '0');
+    c = fgetc(file);
+  }
+  return true;
+}
+
+/** Walk the JPEG segments up to the first start of frame */
+bool probeJpeg(FILE* file, unsigned int* width, unsigned int* height)
+{
+  if (fseek(file, 2, SEEK_SET) != 0)
+    return false;
+
+  while (true)
+  {
+    int c = fgetc(file);
+    if (c != 0xFF)
+      return false;
+    // Markers may be preceded by any number of fill bytes
+    int marker;
+    do
+    {
+      marker = fgetc(file);
+    } while (marker == 0xFF);
+    if (marker == EOF)
+      return false;
+
+    // Markers without a segment
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+      continue;
+    if (marker == 0xD9)
+      return false;
+
+    unsigned char length_bytes[2];
+    if (fread(length_bytes, 1, 2, file) != 2)
+      return false;
+    uint32_t length = bigEndian16(length_bytes);
+    if (length < 2)
+      return false;
+
+    // SOF0..SOF15, except DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+    {
+      unsigned char frame[5];
+      if (fread(frame, 1, 5, file) != 5)
+        return false;
+      *height = bigEndian16(frame + 1);
+      *width = bigEndian16(frame + 3);
+      return true;
+    }
+    if (fseek(file, length - 2, SEEK_CUR) != 0)
+      return false;
+  }
+}
+
+bool probe(FILE* file, unsigned int* width, unsigned int* height)
+{
+  unsigned char header[26];
+  size_t size = fread(header, 1, sizeof(header), file);
+
+  static const unsigned char png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  if (size >= 24 && memcmp(header, png_signature, 8) == 0 && memcmp(header + 12, "IHDR", 4) == 0)
+  {
+    *width = bigEndian32(header + 16);
+    *height = bigEndian32(header + 20);
+    return true;
+  }
+
+  if (size >= 10 && (memcmp(header, "GIF87a", 6) == 0 || memcmp(header, "GIF89a", 6) == 0))
+  {
+    *width = littleEndian16(header + 6);
+    *height = littleEndian16(header + 8);
+    return true;
+  }
+
+  if (size >= 26 && header[0] == 'B' && header[1] == 'M')
+  {
+    if (littleEndian32(header + 14) == 12)
+    {
+      // OS/2 bitmap core header
+      *width = littleEndian16(header + 18);
+      *height = littleEndian16(header + 20);
+    }
+    else
+    {
+      // Negative heights are top-down bitmaps
+      int32_t signed_height = (int32_t)littleEndian32(header + 22);
+      *width = littleEndian32(header + 18);
+      *height = signed_height < 0 ? -signed_height : signed_height;
+    }
+    return true;
+  }
+
+  if (size >= 2 && header[0] == 'P' && header[1] >= '1' && header[1] <= '6')
+  {
+    return fseek(file, 2, SEEK_SET) == 0 && readPnmNumber(file, width) && readPnmNumber(file, height);
+  }
+
+  if (size >= 3 && header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF)
+  {
+    return probeJpeg(file, width, height);
+  }
+
+  return false;
+}
+}
+
+bool probeImageSize(const std::string& path, unsigned int* width, unsigned int* height)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  bool found = probe(file, width, height);
+  fclose(file);
+  return found && *width > 0 && *height > 0;
+}
+
+bool probeRawPgm(const std::string& path, unsigned int* width, unsigned int* height, long* data_offset)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  // A single whitespace character separates maxval from the pixels, and readPnmNumber() consumes it
+  char magic[2];
+  unsigned int maxval;
+  bool found = fread(magic, 1, 2, file) == 2 && magic[0] == 'P' && magic[1] == '5' && readPnmNumber(file, width) &&
+               readPnmNumber(file, height) && readPnmNumber(file, &maxval) && maxval == 255;
+  *data_offset = ftell(file);
+  fclose(file);
+  return found && *width > 0 && *height > 0 && *data_offset > 0;
+}
+}
@@ -31,18 +31,53 @@
 
 #define USAGE                                                                                                          \
   "\nUSAGE: multimap_server <multimap_server_config.yaml>\n"                                                           \
-  "  multimap_server_config.yaml: Indicates which environments are going to be loaded and info on how to do it"
+  "  multimap_server_config.yaml: Indicates which environments are going to be loaded and info on how to do it\n"      \
+  "  It is not needed when the ~leader parameter is set: the maps are then replicated from the leader"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <libgen.h>
+#include <malloc.h>
+#include <math.h>
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <deque>
 #include <fstream>
+#include <map>
+#include <set>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "ros/ros.h"
 #include "ros/console.h"
+#include "ros/callback_queue.h"
 #include "multimap_server/image_loader.h"
+#include "multimap_server/map_description.h"
+#include "multimap_server/environment_pack.h"
+#include "multimap_server/shm_map_store.h"
+#include "multimap_server/map_hash.h"
+#include "multimap_server/map_bands.h"
+#include "multimap_server/shard_ring.h"
+#include "multimap_server/tiled_grid.h"
+#include "multimap_server/grid_allocator.h"
+#include "multimap_server/message_arena.h"
+#include "multimap_server/map_layers.h"
+#include "multimap_server/compressed_grid.h"
+#include "multimap_server/map_rle.h"
+#include "multimap_server/map_diff.h"
+#include "multimap_server/map_resample.h"
+#include "multimap_server/multimap_client.h"
+#include "multimap_server/url_cache.h"
 #include "yaml-cpp/yaml.h"
-#include <resource_retriever/retriever.h>
 #include <ros/package.h>
 
 #include "nav_msgs/MapMetaData.h"
@@ -52,173 +87,405 @@
 #include <multimap_server_msgs/LoadMap.h>
 #include <multimap_server_msgs/DumpMap.h>
 #include <multimap_server_msgs/LoadEnvironments.h>
+#include <multimap_server/LoadProgress.h>
+#include <multimap_server/LoadMapAsync.h>
+#include <multimap_server/CancelLoad.h>
+#include <multimap_server/FetchMap.h>
+#include <multimap_server/EnvironmentsSnapshot.h>
+#include <multimap_server/MapChange.h>
+#include <multimap_server/MapStreamChunk.h>
+#include <multimap_server/GetMapById.h>
+#include <multimap_server/GetMapManifest.h>
+#include <multimap_server/GetMapChunk.h>
+#include <multimap_server/EditMap.h>
+#include <multimap_server/ReloadLayer.h>
+#include <multimap_server/ResidencyStats.h>
+#include <multimap_server/MapRle.h>
+#include <multimap_server/GetMapRle.h>
+#include <multimap_server/DiffMaps.h>
+#include <multimap_server/StitchMaps.h>
+#include <multimap_server/TransformMap.h>
+#include <map_msgs/OccupancyGridUpdate.h>
+#include <std_msgs/String.h>
 
-#ifdef HAVE_YAMLCPP_GT_0_5_0
-// The >> operator disappeared in yaml-cpp 0.5, so this function is
-// added to provide support for code written under the yaml-cpp 0.3 API.
-template <typename T>
-void operator>>(const YAML::Node& node, T& i)
-{
-  i = node.as<T>();
-}
-#endif
-
-class Map
+/** Publishes what is known about a map before its grid has been converted: the metadata read from the image header
+ * and, in progressive mode, a coarse preview. Everything is forwarded to the monitor of the load as well */
+class EarlyPublisher : public multimap_server::LoadMonitor
 {
 public:
-  std::string map_fullname;
+  EarlyPublisher(multimap_server::LoadMonitor* monitor, const std::string& frame_id)
+    : monitor_(monitor), frame_id_(frame_id), factor_(0)
+  {
+  }
 
-  Map(const std::string& fname, const std::string& ns, const std::string& desired_name,
-      const std::string& global_frame_id)
-    : pn("~")
+  void setMetadataPublisher(const ros::Publisher& pub)
   {
-    std::string mapfname = "";
-    double origin[3];
-    int negate;
-    double occ_th, free_th;
-    MapMode mode = TRINARY;
-    double resolution;
+    metadata_pub_ = pub;
+  }
 
-    map_fullname = ns + "/" + desired_name;
+  void setPreviewPublisher(const ros::Publisher& pub, unsigned int factor)
+  {
+    preview_pub_ = pub;
+    factor_ = factor;
+  }
 
-    std::ifstream fin(fname.c_str());
-    if (fin.fail())
-    {
-      ROS_ERROR("Multimap_server could not open %s.", fname.c_str());
-      // exit(-1);
-    }
-#ifdef HAVE_YAMLCPP_GT_0_5_0
-    // The document loading process changed in yaml-cpp 0.5.
-    YAML::Node doc = YAML::Load(fin);
-#else
-    YAML::Parser parser(fin);
-    YAML::Node doc;
-    parser.GetNextDocument(doc);
-#endif
+  void progress(const std::string& stage, double fraction)
+  {
+    if (monitor_)
+      monitor_->progress(stage, fraction);
+  }
 
-    try
-    {
-      doc["resolution"] >> resolution;
-    }
-    catch (YAML::InvalidScalar)
-    {
-      ROS_ERROR("The map does not contain a resolution tag or it is invalid.");
-      exit(-1);
-    }
-    try
-    {
-      doc["negate"] >> negate;
-    }
-    catch (YAML::InvalidScalar)
+  bool cancelled()
+  {
+    return monitor_ && monitor_->cancelled();
+  }
+
+  void extents(const nav_msgs::MapMetaData& info)
+  {
+    if (metadata_pub_)
     {
-      ROS_ERROR("The map does not contain a negate tag or it is invalid.");
-      exit(-1);
+      nav_msgs::MapMetaData msg = info;
+      msg.map_load_time = ros::Time::now();
+      metadata_pub_.publish(msg);
     }
-    try
+    if (monitor_)
+      monitor_->extents(info);
+  }
+
+  unsigned int previewFactor()
+  {
+    return factor_;
+  }
+
+  void preview(const nav_msgs::OccupancyGrid& coarse)
+  {
+    nav_msgs::OccupancyGrid msg = coarse;
+    msg.header.frame_id = frame_id_;
+    msg.header.stamp = ros::Time::now();
+    msg.info.map_load_time = msg.header.stamp;
+    preview_pub_.publish(msg);
+    ROS_INFO("Published a %d X %d preview @ %.3lf m/cell", msg.info.width, msg.info.height, msg.info.resolution);
+  }
+
+private:
+  multimap_server::LoadMonitor* monitor_;
+  ros::Publisher metadata_pub_;
+  ros::Publisher preview_pub_;
+  std::string frame_id_;
+  unsigned int factor_;
+};
+
+/** Messages the server builds to publish them, allocated from the arena of the publishing thread. roscpp allocates
+ * the responses of services itself, so they keep the default allocator */
+typedef nav_msgs::OccupancyGrid_<multimap_server::ArenaAllocator<void> > ArenaOccupancyGrid;
+typedef map_msgs::OccupancyGridUpdate_<multimap_server::ArenaAllocator<void> > ArenaOccupancyGridUpdate;
+typedef multimap_server::MapStreamChunk_<multimap_server::ArenaAllocator<void> > ArenaMapStreamChunk;
+
+/** Copy map metadata into a message of any allocator */
+template <class Allocator>
+void copyMetaData(const nav_msgs::MapMetaData& in, nav_msgs::MapMetaData_<Allocator>* out)
+{
+  out->map_load_time = in.map_load_time;
+  out->resolution = in.resolution;
+  out->width = in.width;
+  out->height = in.height;
+  out->origin.position.x = in.origin.position.x;
+  out->origin.position.y = in.origin.position.y;
+  out->origin.position.z = in.origin.position.z;
+  out->origin.orientation.x = in.origin.orientation.x;
+  out->origin.orientation.y = in.origin.orientation.y;
+  out->origin.orientation.z = in.origin.orientation.z;
+  out->origin.orientation.w = in.origin.orientation.w;
+}
+
+/** One version of the cells of a map. Never modified once published: an edit builds the next version, which shares
+ * the tiles it did not touch with this one */
+class MapContent
+{
+public:
+  multimap_server::TiledGrid grid;
+  /** See multimap_server::mapContentHash() */
+  uint64_t hash;
+
+  /** Checksums of the bands of band_rows rows, computed on first use. Band sizes come from the clients, so only
+   * the last few are kept */
+  std::vector<uint64_t> bandChecksums(uint32_t band_rows) const
+  {
+    boost::mutex::scoped_lock lock(band_checksums_mutex);
+    std::deque<std::pair<uint32_t, std::vector<uint64_t> > >::const_iterator it;
+    for (it = band_checksums.begin(); it != band_checksums.end(); ++it)
     {
-      doc["occupied_thresh"] >> occ_th;
+      if (it->first == band_rows)
+      {
+        return it->second;
+      }
     }
-    catch (YAML::InvalidScalar)
+    if (band_checksums.size() >= MAX_BAND_SIZES)
     {
-      ROS_ERROR("The map does not contain an occupied_thresh tag or it is invalid.");
-      exit(-1);
+      band_checksums.pop_front();
     }
-    try
+    band_checksums.push_back(std::make_pair(band_rows, multimap_server::bandChecksums(grid, band_rows)));
+    return band_checksums.back().second;
+  }
+
+  /** Run-length encoded copy of grid, encoded on first use and kept with the version. The header and info of the
+   * message are those given the first time */
+  boost::shared_ptr<const multimap_server::MapRle> rle(const std::string& frame_id, const ros::Time& stamp,
+                                                       const nav_msgs::MapMetaData& info) const
+  {
+    boost::mutex::scoped_lock lock(rle_mutex);
+    if (!encoded_rle)
     {
-      doc["free_thresh"] >> free_th;
+      boost::shared_ptr<multimap_server::MapRle> encoded = boost::make_shared<multimap_server::MapRle>();
+      encoded->header.frame_id = frame_id;
+      encoded->header.stamp = stamp;
+      encoded->info = info;
+      encoded->version = hash;
+      multimap_server::encodeRows(grid, &encoded->row_starts, &encoded->run_lengths, &encoded->run_values);
+      encoded_rle = encoded;
     }
-    catch (YAML::InvalidScalar)
+    return encoded_rle;
+  }
+
+private:
+  static const size_t MAX_BAND_SIZES = 4;
+  mutable boost::mutex band_checksums_mutex;
+  mutable std::deque<std::pair<uint32_t, std::vector<uint64_t> > > band_checksums;
+  mutable boost::mutex rle_mutex;
+  mutable boost::shared_ptr<const multimap_server::MapRle> encoded_rle;
+};
+typedef boost::shared_ptr<const MapContent> MapContentConstPtr;
+
+/** Cells of a map while it is compressed */
+struct CompressedCells
+{
+  /** The composed grid is not kept: composing it again on restore makes it share its tiles with the base grid */
+  multimap_server::CompressedGrid base;
+  std::vector<multimap_server::CompressedGrid> layers;
+  uint64_t hash;
+
+  size_t size() const
+  {
+    size_t bytes = base.size();
+    for (size_t i = 0; i < layers.size(); i++)
     {
-      ROS_ERROR("The map does not contain a free_thresh tag or it is invalid.");
-      exit(-1);
+      bytes += layers[i].size();
     }
-    try
+    return bytes;
+  }
+};
+
+/** Where the cells of a map are, from the fastest to the slowest to access */
+enum Residency
+{
+  RESIDENT,
+  COMPRESSED,
+  EVICTED
+};
+
+/** Accesses to the cells of a map. See multimap_server/ResidencyStats */
+struct ResidencyCounters
+{
+  uint64_t hits;
+  uint64_t decompressions;
+  uint64_t source_reads;
+  /** Seconds */
+  double decompression_time;
+  double decompression_max_time;
+  double source_read_time;
+  double source_read_max_time;
+};
+
+/** Wall clock in milliseconds, for idle times */
+int64_t wallMilliseconds()
+{
+  return (int64_t)(ros::WallTime::now().toSec() * 1000.0);
+}
+
+/** Rotation of a map origin around z */
+double quaternionYaw(const geometry_msgs::Quaternion& q)
+{
+  return atan2(2.0 * (q.w * q.z + q.x * q.y), 1.0 - 2.0 * (q.y * q.y + q.z * q.z));
+}
+
+/** Largest map computed from other maps, beyond which it could not be published */
+const uint64_t MAX_DERIVED_CELLS = 1ull << 30;
+
+/** Placement of the cells of a map in its frame */
+multimap_server::GridPlacement placementOf(const nav_msgs::MapMetaData& info)
+{
+  multimap_server::GridPlacement placement;
+  placement.width = info.width;
+  placement.height = info.height;
+  placement.resolution = info.resolution;
+  placement.origin_x = info.origin.position.x;
+  placement.origin_y = info.origin.position.y;
+  placement.yaw = quaternionYaw(info.origin.orientation);
+  return placement;
+}
+
+/** Metadata of a map whose cells have a placement */
+nav_msgs::MapMetaData metaDataOf(const multimap_server::GridPlacement& placement)
+{
+  nav_msgs::MapMetaData info;
+  info.width = placement.width;
+  info.height = placement.height;
+  info.resolution = placement.resolution;
+  info.origin.position.x = placement.origin_x;
+  info.origin.position.y = placement.origin_y;
+  info.origin.position.z = 0.0;
+  // Yaw only rotation, as built by loadMapFromFile
+  info.origin.orientation.x = 0.0;
+  info.origin.orientation.y = 0.0;
+  info.origin.orientation.z = sin(placement.yaw / 2.0);
+  info.origin.orientation.w = cos(placement.yaw / 2.0);
+  return info;
+}
+
+class Map
+{
+public:
+  std::string map_fullname;
+
+  /** Load the map described by a map .yaml file, whose images have been fetched. The map is not served until
+   * advertise() is called.
+   *
+   * @param monitor Optional progress receiver, which can also cancel the load
+   * @throws std::runtime_error If the image of the map can't be loaded
+   */
+  Map(const multimap_server::MapDescription& desc, const std::string& ns, const std::string& desired_name,
+      const std::string& global_frame_id, multimap_server::LoadMonitor* monitor = NULL)
+    : pn("~"), ns(ns), desired_name(desired_name)
+  {
+    map_fullname = ns + "/" + desired_name;
+
+    ROS_INFO("Loading map from image \"%s\"", desc.image.c_str());
+    EarlyPublisher early(monitor, global_frame_id);
+    if (!pn.param("multiplexed", false))
     {
-      std::string modeS = "";
-      doc["mode"] >> modeS;
+      // map_metadata goes out as soon as the image header has been read, for clients that only need the extents
+      std::string metadata_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map_metadata";
+      metadata_pub = pn.advertise<nav_msgs::MapMetaData>(metadata_topic_name, 1, true);
+      early.setMetadataPublisher(metadata_pub);
 
-      if (modeS == "trinary")
-        mode = TRINARY;
-      else if (modeS == "scale")
-        mode = SCALE;
-      else if (modeS == "raw")
-        mode = RAW;
-      else
+      if (pn.param("progressive", false))
       {
-        ROS_ERROR("Invalid mode tag \"%s\".", modeS.c_str());
-        exit(-1);
+        // A conservative coarse version of the map is served on map_coarse while the full resolution grid is being
+        // converted, so that planners and displays can start with it
+        std::string coarse_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map_coarse";
+        coarse_pub = pn.advertise<nav_msgs::OccupancyGrid>(coarse_topic_name, 1, true);
+        early.setPreviewPublisher(coarse_pub, std::max(2, pn.param("coarse_factor", 8)));
       }
     }
-    catch (YAML::Exception)
-    {
-      ROS_DEBUG("The map does not contain a mode tag or it is invalid... assuming Trinary");
-      mode = TRINARY;
-    }
-    try
-    {
-      doc["origin"][0] >> origin[0];
-      doc["origin"][1] >> origin[1];
-      doc["origin"][2] >> origin[2];
-    }
-    catch (YAML::InvalidScalar)
+
+    // The converted grid is only kept until it has been split in tiles
+    nav_msgs::GetMap::Response loaded;
+    multimap_server::loadMapFromDescription(&loaded, desc, &early);
+    source = SOURCE_IMAGE;
+    description = desc;
+    std::vector<multimap_server::LayerDescription>::const_iterator layer;
+    for (layer = desc.layers.begin(); layer != desc.layers.end(); ++layer)
     {
-      ROS_ERROR("The map does not contain an origin tag or it is invalid.");
-      exit(-1);
+      layers.push_back(loadLayer(*layer, loaded.map.info));
     }
-    try
+    finishLoad(loaded.map.info,
+               multimap_server::TiledGrid(loaded.map.info.width, loaded.map.info.height,
+                                          loaded.map.data.empty() ? NULL : &loaded.map.data[0]),
+               global_frame_id);
+  }
+
+  /** Create the map from a pre-converted grid of the environment pack pack_path, without any image decoding */
+  Map(const multimap_server::PackedMap& packed, const std::string& pack_path, const std::string& ns,
+      const std::string& desired_name, const std::string& global_frame_id)
+    : pn("~"), ns(ns), desired_name(desired_name), pack_path(pack_path)
+  {
+    map_fullname = ns + "/" + desired_name;
+    source = SOURCE_PACK;
+
+    nav_msgs::MapMetaData info;
+    info.width = packed.width;
+    info.height = packed.height;
+    info.resolution = packed.resolution;
+    info.origin.position.x = packed.origin[0];
+    info.origin.position.y = packed.origin[1];
+    info.origin.position.z = 0.0;
+    // Yaw only rotation, as built by loadMapFromFile
+    info.origin.orientation.x = 0.0;
+    info.origin.orientation.y = 0.0;
+    info.origin.orientation.z = sin(packed.origin[2] / 2.0);
+    info.origin.orientation.w = cos(packed.origin[2] / 2.0);
+
+    // Tiles are copied straight from the mapped pack
+    finishLoad(info, multimap_server::TiledGrid(info.width, info.height, packed.data), global_frame_id);
+  }
+
+  /** Create the map from a grid replicated from another multimap_server. The map keeps the content hash it has
+   * there, so that fetch_map answers the same on every replica */
+  Map(const nav_msgs::OccupancyGrid& grid, const std::string& ns, const std::string& desired_name,
+      uint64_t leader_content_hash)
+    : pn("~"), ns(ns), desired_name(desired_name)
+  {
+    map_fullname = ns + "/" + desired_name;
+    source = SOURCE_REPLICA;
+    finishLoad(grid.info,
+               multimap_server::TiledGrid(grid.info.width, grid.info.height, grid.data.empty() ? NULL : &grid.data[0]),
+               grid.header.frame_id, leader_content_hash);
+  }
+
+  /** Create a map computed from the cells of other maps, such as a stitched map. Like a replica, it has no source to
+   * be read again from */
+  Map(const nav_msgs::MapMetaData& info, const multimap_server::TiledGrid& grid, const std::string& ns,
+      const std::string& desired_name, const std::string& global_frame_id)
+    : pn("~"), ns(ns), desired_name(desired_name)
+  {
+    map_fullname = ns + "/" + desired_name;
+    source = SOURCE_DERIVED;
+    finishLoad(info, grid, global_frame_id);
+  }
+
+  /** Start serving the map: static_map and static_map_rle services, latched map and map_metadata topics and the
+   * map_rle topic. In multiplexed mode the server delivers all maps through maps_stream and get_map instead, so the
+   * map has no endpoints of its own */
+  void advertise()
+  {
+    if (!pn.param("multiplexed", false))
     {
-      doc["image"] >> mapfname;
-      // TODO: make this path-handling more robust
-      if (mapfname.size() == 0)
+      std::string service_name = "maps/" + ns + "/" + desired_name + "/" + "static_map";
+      service = pn.advertiseService(service_name, &Map::mapCallback, this);
+      if (rle_transport)
       {
-        ROS_ERROR("The image tag cannot be an empty string.");
-        exit(-1);
+        std::string rle_service_name = "maps/" + ns + "/" + desired_name + "/" + "static_map_rle";
+        rle_service = pn.advertiseService(rle_service_name, &Map::rleCallback, this);
       }
-      if (mapfname[0] != '/')
+
+      // Latched publisher for metadata. Maps loaded from images advertise it while loading
+      if (!metadata_pub)
       {
-        // dirname can modify what you pass it
-        char* fname_copy = strdup(fname.c_str());
-        mapfname = std::string(dirname(fname_copy)) + '/' + mapfname;
-        free(fname_copy);
+        std::string metadata_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map_metadata";
+        metadata_pub = pn.advertise<nav_msgs::MapMetaData>(metadata_topic_name, 1, true);
       }
-    }
-    catch (YAML::InvalidScalar)
-    {
-      ROS_ERROR("The map does not contain an image tag or it is invalid.");
-      exit(-1);
+      metadata_pub.publish(meta_data_message_);
+
+      advertiseMapTopics();
+
+      // Edits, in the format of costmap_2d static layers
+      std::string map_updates_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map_updates";
+      map_updates_pub = pn.advertise<map_msgs::OccupancyGridUpdate>(map_updates_topic_name, 10);
     }
 
-    ROS_INFO("Loading map from image \"%s\"", mapfname.c_str());
-    try
+    if (pn.param("shm_store", false))
     {
-      multimap_server::loadMapFromFile(&map_resp_, mapfname.c_str(), resolution, negate, occ_th, free_th, origin, mode);
+      exportToSharedMemory(pn.param("shm_prefix", std::string("multimap")));
     }
-    catch (std::runtime_error e)
+  }
+
+  ~Map()
+  {
+    // Shared memory segments outlive the process unless they are unlinked
+    if (shm_segment)
     {
-      ROS_ERROR("%s", e.what());
-      exit(-1);
+      shm_segment->remove();
     }
-    // To make sure get a consistent time in simulation
-    ros::Time::waitForValid();
-    map_resp_.map.info.map_load_time = ros::Time::now();
-    map_resp_.map.header.frame_id = global_frame_id;
-    map_resp_.map.header.stamp = ros::Time::now();
-    ROS_INFO("Read a %d X %d map @ %.3lf m/cell", map_resp_.map.info.width, map_resp_.map.info.height,
-             map_resp_.map.info.resolution);
-    meta_data_message_ = map_resp_.map.info;
-
-    std::string service_name = "maps/" + ns + "/" + desired_name + "/" + "static_map";
-    service = pn.advertiseService(service_name, &Map::mapCallback, this);
-
-    // Latched publisher for metadata
-    std::string metadata_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map_metadata";
-    metadata_pub = pn.advertise<nav_msgs::MapMetaData>(metadata_topic_name, 1, true);
-    metadata_pub.publish(meta_data_message_);
-
-    // Latched publisher for data
-    std::string map_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map";
-    map_pub = pn.advertise<nav_msgs::OccupancyGrid>(map_topic_name, 1, true);
-    map_pub.publish(map_resp_.map);
   }
 
   std::string getMapFullName()
@@ -226,92 +493,1958 @@ public:
     return map_fullname;
   }
 
-private:
-  ros::NodeHandle n;
-  ros::NodeHandle pn;
-  ros::Publisher map_pub;
-  ros::Publisher metadata_pub;
-  ros::ServiceServer service;
+  const std::string& getNamespace() const
+  {
+    return ns;
+  }
 
-  /** Callback invoked when someone requests our service */
-  bool mapCallback(nav_msgs::GetMap::Request& req, nav_msgs::GetMap::Response& res)
+  const std::string& getName() const
   {
-    // request is empty; we ignore it
+    return desired_name;
+  }
 
-    // = operator is overloaded to make deep copy (tricky!)
-    res = map_resp_;
-    ROS_INFO("Sending map");
+  const std::string& getFrameId() const
+  {
+    return frame_id;
+  }
 
-    return true;
+  /** Geometry of the map. Edits never change it */
+  const nav_msgs::MapMetaData& getInfo() const
+  {
+    return meta_data_message_;
   }
 
-  /** The map data is cached here, to be sent out to service callers
-   */
-  nav_msgs::MapMetaData meta_data_message_;
-  nav_msgs::GetMap::Response map_resp_;
-};
+  /** Current version of the cells. Readers keep using the version they got while an edit publishes the next one.
+   * An evicted map is read again from its source first, which blocks the caller
+   * @throws std::runtime_error If the source of an evicted map can't be read anymore */
+  MapContentConstPtr getContent()
+  {
+    MapContentConstPtr current = boost::atomic_load(&content);
+    if (!current)
+    {
+      return restore();
+    }
+    __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&last_access, wallMilliseconds(), __ATOMIC_RELAXED);
+    return current;
+  }
 
-class MultimapServer
-{
-public:
-  /** Trivial constructor */
-  MultimapServer(const std::string& fname) : pn("~")
+  /** Version of the cells whose content hash is hash, the current version for 0. Only the last ~version_history
+   * versions before the current one are kept
+   * @return NULL if the version is not known
+   * @throws std::runtime_error If the source of an evicted map can't be read anymore */
+  MapContentConstPtr getVersion(uint64_t hash)
   {
-    timerPublish = n.createTimer(ros::Duration(0.2), &MultimapServer::timerPublishCallback, this);
+    MapContentConstPtr current = getContent();
+    if (hash == 0 || current->hash == hash)
+    {
+      return current;
+    }
+    boost::mutex::scoped_lock lock(history_mutex);
+    std::deque<MapContentConstPtr>::const_reverse_iterator it;
+    for (it = history.rbegin(); it != history.rend(); ++it)
+    {
+      if ((*it)->hash == hash)
+        return *it;
+    }
+    return MapContentConstPtr();
+  }
 
-    std::string load_map_service_name = "load_map";
-    load_map_service = pn.advertiseService(load_map_service_name, &MultimapServer::loadMapCallback, this);
+  /** Content hash of the current version, known even while the map is evicted */
+  uint64_t getContentHash() const
+  {
+    return __atomic_load_n(&content_hash, __ATOMIC_ACQUIRE);
+  }
 
-    std::string load_environments_service_name = "load_environments";
-    load_environments_service =
-        pn.advertiseService(load_environments_service_name, &MultimapServer::loadEnvironmentsCallback, this);
+  /** Current version of the cells if they are in memory, NULL otherwise. Unlike getContent(), this never restores
+   * the map and doesn't count as an access */
+  MapContentConstPtr residentContent() const
+  {
+    return boost::atomic_load(&content);
+  }
 
-    std::string dump_map_service_name = "dump_map";
-    dump_map_service = pn.advertiseService(dump_map_service_name, &MultimapServer::dumpMapCallback, this);
+  /** Whether the cells are in memory */
+  bool isResident() const
+  {
+    return boost::atomic_load(&content) != NULL;
+  }
 
-    std::string dump_environments_service_name = "dump_environments";
-    dump_environments_service =
-        pn.advertiseService(dump_environments_service_name, &MultimapServer::dumpEnvironmentsCallback, this);
+  /** Where the cells are. bytes is set to the memory they take there, 0 for evicted maps */
+  Residency getResidency(size_t* bytes) const
+  {
+    // content and compressed_bytes change together under counters_mutex
+    boost::mutex::scoped_lock lock(counters_mutex);
+    MapContentConstPtr current = boost::atomic_load(&content);
+    if (current)
+    {
+      *bytes = (size_t)current->grid.tilesX() * current->grid.tilesY() * multimap_server::TiledGrid::TILE_SIZE *
+               multimap_server::TiledGrid::TILE_SIZE;
+      return RESIDENT;
+    }
+    *bytes = compressed_bytes;
+    return compressed_bytes > 0 ? COMPRESSED : EVICTED;
+  }
 
-    // Latched environments topic
-    std::string environments_topic_name = "environments";
-    environments_pub = pn.advertise<multimap_server_msgs::Environments>(environments_topic_name, 1, true);
+  ResidencyCounters getCounters() const
+  {
+    boost::mutex::scoped_lock lock(counters_mutex);
+    ResidencyCounters copy = counters;
+    copy.hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    return copy;
+  }
 
-    std::string msg;
+  /** Whether any node subscribes to the map or map_rle topic */
+  bool hasTopicSubscribers() const
+  {
+    return map_pub.getNumSubscribers() > 0 || rle_pub.getNumSubscribers() > 0;
+  }
+
+  /** Seconds since the cells were last accessed or restored */
+  double idleTime() const
+  {
+    return (wallMilliseconds() - __atomic_load_n(&last_access, __ATOMIC_RELAXED)) / 1000.0;
+  }
 
-    if (false == loadEnvironmentsFromYAML(fname, &msg))
+  /** Replace the cells by a compressed copy, decompressed on the next access. Unlike evict(), this works for every
+   * map. The map topics stay advertised, and a new subscriber restores the map
+   *
+   * @return false if the map is not resident
+   */
+  bool compress()
+  {
+    boost::mutex::scoped_lock lock(residency_mutex);
+    MapContentConstPtr current = boost::atomic_load(&content);
+    if (!current)
     {
-      ROS_ERROR("Multimap_server could not open %s: %s Shutting down", fname.c_str(), msg);
-      exit(-1);
+      return false;
     }
-  }
 
-private:
-  ros::NodeHandle n;
-  ros::NodeHandle pn;
+    boost::shared_ptr<CompressedCells> packed = boost::make_shared<CompressedCells>();
+    packed->base = multimap_server::CompressedGrid(base);
+    packed->hash = current->hash;
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+      packed->layers.push_back(multimap_server::CompressedGrid(layers[i].grid));
+      layers[i].grid = multimap_server::TiledGrid();
+    }
+    base = multimap_server::TiledGrid();
+    compressed = packed;
+    {
+      // Previous versions would keep their tiles in memory
+      boost::mutex::scoped_lock history_lock(history_mutex);
+      history.clear();
+    }
+    {
+      // Readers holding the current version keep it until they are done
+      boost::mutex::scoped_lock counters_lock(counters_mutex);
+      boost::atomic_store(&content, MapContentConstPtr());
+      compressed_bytes = std::max<size_t>(1, packed->size());
+    }
+    return true;
+  }
 
-  ros::Timer timerPublish;
-  ros::Publisher environments_pub;
-  ros::ServiceServer load_map_service;
-  ros::ServiceServer dump_map_service;
-  ros::ServiceServer load_environments_service;
-  ros::ServiceServer dump_environments_service;
+  /** Drop the cells, to be read again from the map image or environment pack on the next access, such as a new
+   * subscriber of the map topics. Replicated, derived and edited maps can't be evicted
+   *
+   * @return false if the map is already evicted or can't be evicted
+   */
+  bool evict()
+  {
+    boost::mutex::scoped_lock lock(residency_mutex);
+    if (source == SOURCE_REPLICA || source == SOURCE_DERIVED || edited || (!isResident() && !compressed))
+    {
+      return false;
+    }
+    {
+      // Readers holding the current version keep it until they are done
+      boost::mutex::scoped_lock counters_lock(counters_mutex);
+      boost::atomic_store(&content, MapContentConstPtr());
+      compressed_bytes = 0;
+    }
+    compressed.reset();
+    base = multimap_server::TiledGrid();
+    layers.clear();
+    return true;
+  }
 
-  std::vector<Map*> maps_vector;
-  multimap_server_msgs::Environments environments_vector;
+  /** Read the cells of an evicted map again from its source. Returns at once if the map is resident
+   * @throws std::runtime_error If the source can't be read anymore */
+  MapContentConstPtr restore()
+  {
+    boost::mutex::scoped_lock lock(residency_mutex);
+    return restoreLocked();
+  }
 
-  void timerPublishCallback(const ros::TimerEvent& event)
+  /** Build the full message of a version of the map */
+  template <class Allocator>
+  void toMessage(const MapContent& version, nav_msgs::OccupancyGrid_<Allocator>* out) const
   {
-    environments_pub.publish(environments_vector);
+    out->header.frame_id.assign(frame_id.data(), frame_id.size());
+    out->header.stamp = stamp;
+    copyMetaData(meta_data_message_, &out->info);
+    out->data.resize((size_t)version.grid.width() * version.grid.height());
+    version.grid.copyRows(0, version.grid.height(), out->data.empty() ? NULL : &out->data[0]);
   }
 
-  bool loadEnvironmentsFromYAML(std::string fname, std::string *msg)
+  /** Apply an edit_map request to the base grid or to a layer, and publish the new version of the cells, which
+   * shares the untouched tiles with the current one. Edits must not run concurrently: the server calls this with
+   * mutation_mutex held
+   *
+   * @return false, with msg set, if the request is invalid or covers no cell of the map
+   */
+  bool edit(const multimap_server::EditMap::Request& req, std::string* msg)
   {
-    std::ifstream fin(fname.c_str());
-    if (fin.fail())
+    if (req.value < -1 || req.value > 100)
     {
-      *msg = "The file " + fname + "could not be opened";
-      ROS_ERROR_STREAM(*msg);
+      *msg = "cell values must be between -1 and 100";
+      return false;
+    }
+    if (req.rectangles.size() % 4 != 0)
+    {
+      *msg = "rectangles must be given as min_x, min_y, max_x, max_y";
+      return false;
+    }
+
+    boost::mutex::scoped_lock lock(residency_mutex);
+    try
+    {
+      restoreLocked();
+    }
+    catch (std::runtime_error& e)
+    {
+      *msg = e.what();
+      return false;
+    }
+
+    // Work on copies, so that an invalid request leaves the map as it was
+    multimap_server::TiledGrid next_base = base;
+    std::vector<multimap_server::MapLayer> next_layers = layers;
+    multimap_server::TiledGrid* target = &next_base;
+    if (!req.layer.empty())
+    {
+      std::vector<multimap_server::MapLayer>::iterator layer = findLayer(&next_layers, req.layer);
+      if (layer == next_layers.end())
+      {
+        *msg = "the map has no layer " + req.layer;
+        return false;
+      }
+      target = &layer->grid;
+    }
+    multimap_server::CellBox touched = { 1, 1, 0, 0 };
+
+    std::vector<geometry_msgs::Polygon>::const_iterator polygon;
+    for (polygon = req.polygons.begin(); polygon != req.polygons.end(); ++polygon)
+    {
+      std::vector<std::pair<double, double> > vertices;
+      std::vector<geometry_msgs::Point32>::const_iterator point;
+      for (point = polygon->points.begin(); point != polygon->points.end(); ++point)
+      {
+        vertices.push_back(worldToCell(point->x, point->y));
+      }
+      target->fillPolygon(vertices, req.value, &touched);
+    }
+
+    for (size_t i = 0; i < req.rectangles.size(); i += 4)
+    {
+      // The map may be rotated, so rectangles are filled as polygons
+      std::vector<std::pair<double, double> > vertices;
+      vertices.push_back(worldToCell(req.rectangles[i], req.rectangles[i + 1]));
+      vertices.push_back(worldToCell(req.rectangles[i + 2], req.rectangles[i + 1]));
+      vertices.push_back(worldToCell(req.rectangles[i + 2], req.rectangles[i + 3]));
+      vertices.push_back(worldToCell(req.rectangles[i], req.rectangles[i + 3]));
+      target->fillPolygon(vertices, req.value, &touched);
+    }
+
+    std::vector<uint32_t>::const_iterator cell;
+    for (cell = req.cells.begin(); cell != req.cells.end(); ++cell)
+    {
+      if (*cell >= (size_t)target->width() * target->height())
+      {
+        *msg = "cell " + boost::lexical_cast<std::string>(*cell) + " is out of the map";
+        return false;
+      }
+      multimap_server::CellBox box = { *cell % target->width(), *cell / target->width(), *cell % target->width(),
+                                       *cell / target->width() };
+      target->set(box.min_x, box.min_y, req.value);
+      multimap_server::growBox(&touched, box);
+    }
+
+    if (touched.min_x > touched.max_x)
+    {
+      *msg = "the request covers no cell of the map";
+      return false;
+    }
+
+    base = next_base;
+    layers = next_layers;
+    // The map image does not hold the edit anymore
+    edited = true;
+    commit(touched);
+    ROS_INFO("Edited cells [%u, %u] x [%u, %u] of %s %s", touched.min_x, touched.max_x, touched.min_y,
+             touched.max_y, req.layer.empty() ? "map" : ("layer " + req.layer + " of map").c_str(),
+             map_fullname.c_str());
+    return true;
+  }
+
+  /** Load a layer again from its image, e.g. after the image was replaced, and recompose the tiles in which it
+   * changed. Must be called with mutation_mutex held, like edit()
+   *
+   * @param changed Set if the layer differs from the one in use
+   * @return false, with msg set, if the map has no such layer or its image can't be loaded
+   */
+  bool reloadLayer(const std::string& name, bool* changed, std::string* msg)
+  {
+    boost::mutex::scoped_lock lock(residency_mutex);
+    multimap_server::MapLayer reloaded;
+    try
+    {
+      restoreLocked();
+    }
+    catch (std::runtime_error& e)
+    {
+      *msg = e.what();
+      return false;
+    }
+
+    std::vector<multimap_server::MapLayer>::iterator layer = findLayer(&layers, name);
+    std::vector<multimap_server::LayerDescription>::const_iterator layer_desc;
+    for (layer_desc = description.layers.begin(); layer_desc != description.layers.end(); ++layer_desc)
+    {
+      if (layer_desc->name == name)
+        break;
+    }
+    if (layer == layers.end() || layer_desc == description.layers.end())
+    {
+      *msg = "the map has no layer " + name;
+      return false;
+    }
+
+    try
+    {
+      reloaded = loadLayer(*layer_desc, meta_data_message_);
+    }
+    catch (std::runtime_error& e)
+    {
+      *msg = e.what();
+      return false;
+    }
+
+    multimap_server::CellBox dirty = multimap_server::changedTiles(layer->grid, reloaded.grid);
+    *changed = dirty.min_x <= dirty.max_x;
+    if (*changed)
+    {
+      layer->grid = reloaded.grid;
+      commit(dirty);
+      ROS_INFO("Reloaded layer %s of map %s, cells [%u, %u] x [%u, %u] recomposed", name.c_str(),
+               map_fullname.c_str(), dirty.min_x, dirty.max_x, dirty.min_y, dirty.max_y);
+    }
+    return true;
+  }
+
+  /** Stop serving this map. Called when the map is dumped, so that its endpoints are gone even if a reader still
+   * holds a registry snapshot that references it. */
+  void shutdown()
+  {
+    boost::mutex::scoped_lock lock(residency_mutex);
+    dumped = true;
+    service.shutdown();
+    rle_service.shutdown();
+    metadata_pub.shutdown();
+    map_pub.shutdown();
+    rle_pub.shutdown();
+    map_updates_pub.shutdown();
+    coarse_pub.shutdown();
+    if (shm_segment)
+    {
+      shm_segment->remove();
+    }
+  }
+
+private:
+  ros::NodeHandle n;
+  ros::NodeHandle pn;
+  std::string ns;
+  std::string desired_name;
+  ros::Publisher map_pub;
+  ros::Publisher rle_pub;
+  ros::Publisher metadata_pub;
+  ros::Publisher map_updates_pub;
+  /** Only advertised in progressive mode, from construction on */
+  ros::Publisher coarse_pub;
+  ros::ServiceServer service;
+  ros::ServiceServer rle_service;
+  boost::shared_ptr<multimap_server::ShmMapSegment> shm_segment;
+
+  /** Where the cells of the map are read from, again after evict() */
+  enum Source
+  {
+    SOURCE_IMAGE,
+    SOURCE_PACK,
+    SOURCE_REPLICA,
+    /** Computed from other maps by stitch_maps */
+    SOURCE_DERIVED
+  };
+  Source source;
+  /** Description of a map loaded from a map .yaml file, to reload its image and layers */
+  multimap_server::MapDescription description;
+  /** Environment pack of a map loaded from a pack */
+  std::string pack_path;
+
+  /** Serializes eviction, restoration and changes of the cells. Protects base, layers and the flags below */
+  boost::mutex residency_mutex;
+  /** Grid of the map before composition with its layers. The composed grid is that of the content */
+  multimap_server::TiledGrid base;
+  std::vector<multimap_server::MapLayer> layers;
+  /** Set by shutdown() */
+  bool dumped;
+  /** Set once cells were edited, so that the source does not hold the current version anymore */
+  bool edited;
+  /** Set if the map serves static_map_rle and map_rle, which encode the versions they are asked for */
+  bool rle_transport;
+  /** Set while the map is compressed */
+  boost::shared_ptr<const CompressedCells> compressed;
+
+  /** Versions before the current one, oldest first, for diff_maps. They share their unedited tiles with the versions
+   * that followed, so they only take the memory of the tiles that were edited since */
+  mutable boost::mutex history_mutex;
+  std::deque<MapContentConstPtr> history;
+  size_t version_history;
+
+  /** Protects counters and compressed_bytes, which the statistics read without waiting for a restore. content is
+   * only emptied or filled again with it held, so that getResidency() never sees a map in between */
+  mutable boost::mutex counters_mutex;
+  ResidencyCounters counters;
+  /** 0 unless the map is compressed */
+  size_t compressed_bytes;
+  /** Updated atomically by getContent() */
+  uint64_t hits;
+  int64_t last_access;
+
+  /** Common end of all constructors: compose the grid with the layers */
+  void finishLoad(const nav_msgs::MapMetaData& info, const multimap_server::TiledGrid& grid,
+                  const std::string& global_frame_id, uint64_t known_hash = 0)
+  {
+    // To make sure get a consistent time in simulation
+    ros::Time::waitForValid();
+    meta_data_message_ = info;
+    meta_data_message_.map_load_time = ros::Time::now();
+    frame_id = global_frame_id;
+    stamp = ros::Time::now();
+    ROS_INFO("Read a %d X %d map @ %.3lf m/cell", info.width, info.height, info.resolution);
+
+    base = grid;
+    rle_transport = !pn.param("multiplexed", false) && pn.param("rle_transport", true);
+    version_history = std::max(0, pn.param("version_history", 4));
+    boost::shared_ptr<MapContent> initial = boost::make_shared<MapContent>();
+    initial->grid = multimap_server::composeLayers(base, layers);
+    initial->hash =
+        known_hash != 0 ? known_hash : multimap_server::mapContentHash(meta_data_message_, frame_id, initial->grid);
+    content = initial;
+    content_hash = initial->hash;
+    hits = 0;
+    last_access = wallMilliseconds();
+    memset(&counters, 0, sizeof(counters));
+    compressed_bytes = 0;
+    dumped = false;
+    edited = false;
+  }
+
+  /** Body of restore(), with residency_mutex held */
+  MapContentConstPtr restoreLocked()
+  {
+    MapContentConstPtr current = boost::atomic_load(&content);
+    if (current)
+    {
+      return current;
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    boost::shared_ptr<MapContent> restored = boost::make_shared<MapContent>();
+    bool decompressed = compressed != NULL;
+    if (decompressed)
+    {
+      int threads = pn.param("decompress_threads", 0);
+      if (threads <= 0)
+      {
+        threads = std::max(1u, boost::thread::hardware_concurrency());
+      }
+      base = compressed->base.decompress(threads);
+      for (size_t i = 0; i < layers.size(); i++)
+      {
+        layers[i].grid = compressed->layers[i].decompress(threads);
+      }
+      // The tiles that no layer changes are shared with the base again
+      restored->grid = multimap_server::composeLayers(base, layers);
+      restored->hash = compressed->hash;
+      compressed.reset();
+    }
+    else
+    {
+      readSource();
+      restored->grid = multimap_server::composeLayers(base, layers);
+      restored->hash = multimap_server::mapContentHash(meta_data_message_, frame_id, restored->grid);
+      if (restored->hash != getContentHash())
+      {
+        // Served as read, but clients caching by hash will see a new version
+        ROS_WARN("The source of map %s changed since it was loaded", map_fullname.c_str());
+        __atomic_store_n(&content_hash, restored->hash, __ATOMIC_RELEASE);
+      }
+    }
+    __atomic_store_n(&last_access, wallMilliseconds(), __ATOMIC_RELAXED);
+    double elapsed = (ros::WallTime::now() - start).toSec();
+    {
+      boost::mutex::scoped_lock counters_lock(counters_mutex);
+      boost::atomic_store(&content, MapContentConstPtr(restored));
+      compressed_bytes = 0;
+      if (decompressed)
+      {
+        counters.decompressions++;
+        counters.decompression_time += elapsed;
+        counters.decompression_max_time = std::max(counters.decompression_max_time, elapsed);
+      }
+      else
+      {
+        counters.source_reads++;
+        counters.source_read_time += elapsed;
+        counters.source_read_max_time = std::max(counters.source_read_max_time, elapsed);
+      }
+    }
+    ROS_INFO("Restored map %s from %s in %.3f s", map_fullname.c_str(), decompressed ? "memory" : "its source",
+             elapsed);
+    return restored;
+  }
+
+  /** Read base and layers again from the source of the map */
+  void readSource()
+  {
+    const nav_msgs::MapMetaData& info = meta_data_message_;
+    if (source == SOURCE_IMAGE)
+    {
+      nav_msgs::GetMap::Response loaded;
+      multimap_server::loadMapFromDescription(&loaded, description);
+      if (loaded.map.info.width != info.width || loaded.map.info.height != info.height)
+      {
+        throw std::runtime_error("The image of map " + map_fullname + " does not have its size anymore");
+      }
+      layers.clear();
+      std::vector<multimap_server::LayerDescription>::const_iterator layer;
+      for (layer = description.layers.begin(); layer != description.layers.end(); ++layer)
+      {
+        layers.push_back(loadLayer(*layer, info));
+      }
+      base = multimap_server::TiledGrid(info.width, info.height, loaded.map.data.empty() ? NULL : &loaded.map.data[0]);
+      return;
+    }
+
+    multimap_server::EnvironmentPack pack(pack_path);
+    std::vector<multimap_server::PackedMap>::const_iterator it;
+    for (it = pack.maps().begin(); it != pack.maps().end(); ++it)
+    {
+      if (it->name == desired_name && it->width == info.width && it->height == info.height)
+      {
+        base = multimap_server::TiledGrid(info.width, info.height, it->data);
+        return;
+      }
+    }
+    throw std::runtime_error("Environment pack " + pack_path + " does not hold map " + map_fullname + " anymore");
+  }
+
+  /** Publishers for data. They are not latched, which would keep a copy of the grid for the lifetime of the topic:
+   * every new subscriber gets the current version from a connect callback instead, which restores a compressed or
+   * evicted map */
+  void advertiseMapTopics()
+  {
+    std::string map_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map";
+    map_pub = pn.advertise<nav_msgs::OccupancyGrid>(map_topic_name, 1, boost::bind(&Map::mapConnectCallback, this, _1));
+    if (rle_transport)
+    {
+      std::string rle_topic_name = "maps/" + ns + "/" + desired_name + "/" + "map_rle";
+      rle_pub = pn.advertise<multimap_server::MapRle>(rle_topic_name, 1,
+                                                      boost::bind(&Map::rleConnectCallback, this, _1));
+    }
+  }
+
+  /** Current version for a new subscriber of the map topics, NULL if the map can't be restored */
+  MapContentConstPtr contentForSubscriber()
+  {
+    {
+      // Connections may still be accepted while the map is being dumped
+      boost::mutex::scoped_lock lock(residency_mutex);
+      if (dumped)
+        return MapContentConstPtr();
+    }
+    try
+    {
+      return getContent();
+    }
+    catch (std::runtime_error& e)
+    {
+      ROS_WARN("Could not send map %s to a new subscriber: %s", map_fullname.c_str(), e.what());
+      return MapContentConstPtr();
+    }
+  }
+
+  /** Send the current version to a new map subscriber */
+  void mapConnectCallback(const ros::SingleSubscriberPublisher& pub)
+  {
+    MapContentConstPtr current = contentForSubscriber();
+    if (current)
+    {
+      multimap_server::MessageArena& arena = multimap_server::threadMessageArena();
+      multimap_server::ArenaScope scope(arena);
+      ArenaOccupancyGrid msg((multimap_server::ArenaAllocator<void>(&arena)));
+      toMessage(*current, &msg);
+      pub.publish(msg);
+    }
+  }
+
+  /** Run-length encoded copy of a version. It is encoded by the first request for it, so versions that nobody asks
+   * for in that form are never encoded */
+  boost::shared_ptr<const multimap_server::MapRle> rleOf(const MapContent& version) const
+  {
+    return version.rle(frame_id, stamp, meta_data_message_);
+  }
+
+  /** Send the current version to a new map_rle subscriber. Like the map topic, map_rle is not latched, and the
+   * versions that have no subscriber are never encoded */
+  void rleConnectCallback(const ros::SingleSubscriberPublisher& pub)
+  {
+    MapContentConstPtr current = contentForSubscriber();
+    if (current)
+    {
+      pub.publish(*rleOf(*current));
+    }
+  }
+
+  /** Load a layer of the map description, which must have the size of the map
+   * @throws std::runtime_error If the image can't be loaded or has another size */
+  multimap_server::MapLayer loadLayer(const multimap_server::LayerDescription& layer_desc,
+                                      const nav_msgs::MapMetaData& info) const
+  {
+    ROS_INFO("Loading layer %s from image \"%s\"", layer_desc.name.c_str(), layer_desc.image.c_str());
+    nav_msgs::GetMap::Response loaded;
+    multimap_server::loadLayerFromDescription(&loaded, description, layer_desc);
+    if (loaded.map.info.width != info.width || loaded.map.info.height != info.height)
+    {
+      throw std::runtime_error("Layer " + layer_desc.name + " is " +
+                               boost::lexical_cast<std::string>(loaded.map.info.width) + " X " +
+                               boost::lexical_cast<std::string>(loaded.map.info.height) + ", the map is " +
+                               boost::lexical_cast<std::string>(info.width) + " X " +
+                               boost::lexical_cast<std::string>(info.height));
+    }
+
+    multimap_server::MapLayer layer;
+    layer.name = layer_desc.name;
+    layer.blend = layer_desc.blend;
+    layer.grid = multimap_server::TiledGrid(info.width, info.height,
+                                            loaded.map.data.empty() ? NULL : &loaded.map.data[0]);
+    return layer;
+  }
+
+  static std::vector<multimap_server::MapLayer>::iterator findLayer(std::vector<multimap_server::MapLayer>* layers,
+                                                                     const std::string& name)
+  {
+    std::vector<multimap_server::MapLayer>::iterator layer;
+    for (layer = layers->begin(); layer != layers->end(); ++layer)
+    {
+      if (layer->name == name)
+        break;
+    }
+    return layer;
+  }
+
+  /** Publish a new version of the cells, recomposing the tiles of the base grid and layers that overlap dirty */
+  void commit(const multimap_server::CellBox& dirty)
+  {
+    MapContentConstPtr previous = getContent();
+    boost::shared_ptr<MapContent> next = boost::make_shared<MapContent>();
+    next->grid = previous->grid;
+    multimap_server::composeBox(base, layers, dirty, &next->grid);
+    next->hash = multimap_server::mapContentHash(meta_data_message_, frame_id, next->grid);
+    boost::atomic_store(&content, MapContentConstPtr(next));
+    __atomic_store_n(&content_hash, next->hash, __ATOMIC_RELEASE);
+    rememberVersion(*previous);
+    publishEdit(*next, dirty);
+  }
+
+  /** Add a replaced version to the history, without its run-length encoded copy */
+  void rememberVersion(const MapContent& version)
+  {
+    boost::mutex::scoped_lock lock(history_mutex);
+    if (version_history == 0)
+    {
+      return;
+    }
+    boost::shared_ptr<MapContent> kept = boost::make_shared<MapContent>();
+    kept->grid = version.grid;
+    kept->hash = version.hash;
+    history.push_back(kept);
+    if (history.size() > version_history)
+    {
+      history.pop_front();
+    }
+  }
+
+  /** Map frame coordinates to cell units, (0, 0) being the corner of cell (0, 0) */
+  std::pair<double, double> worldToCell(double x, double y) const
+  {
+    const geometry_msgs::Pose& origin = meta_data_message_.origin;
+    double yaw = quaternionYaw(origin.orientation);
+    double dx = x - origin.position.x;
+    double dy = y - origin.position.y;
+    return std::make_pair((cos(yaw) * dx + sin(yaw) * dy) / meta_data_message_.resolution,
+                          (-sin(yaw) * dx + cos(yaw) * dy) / meta_data_message_.resolution);
+  }
+
+  void publishMap(const MapContent& version)
+  {
+    // The copy of the grid only lives until roscpp has serialized it
+    multimap_server::MessageArena& arena = multimap_server::threadMessageArena();
+    multimap_server::ArenaScope scope(arena);
+    ArenaOccupancyGrid msg((multimap_server::ArenaAllocator<void>(&arena)));
+    toMessage(version, &msg);
+    map_pub.publish(msg);
+    if (rle_pub && rle_pub.getNumSubscribers() > 0)
+    {
+      rle_pub.publish(*rleOf(version));
+    }
+  }
+
+  /** Send an edit to the subscribers of map_updates, the latched map topic and the shared memory segment */
+  void publishEdit(const MapContent& version, const multimap_server::CellBox& touched)
+  {
+    if (map_updates_pub)
+    {
+      multimap_server::MessageArena& arena = multimap_server::threadMessageArena();
+      multimap_server::ArenaScope scope(arena);
+      ArenaOccupancyGridUpdate update((multimap_server::ArenaAllocator<void>(&arena)));
+      update.header.frame_id.assign(frame_id.data(), frame_id.size());
+      update.header.stamp = ros::Time::now();
+      update.x = touched.min_x;
+      update.y = touched.min_y;
+      update.width = touched.max_x - touched.min_x + 1;
+      update.height = touched.max_y - touched.min_y + 1;
+      update.data.resize((size_t)update.width * update.height);
+      version.grid.copyBox(touched, &update.data[0]);
+      map_updates_pub.publish(update);
+
+      // Late subscribers of the latched topic must get the edited map
+      publishMap(version);
+    }
+
+    if (shm_segment)
+    {
+      shm_segment->beginUpdate();
+      version.grid.copyRows(touched.min_y, touched.max_y - touched.min_y + 1,
+                            shm_segment->data() + (size_t)touched.min_y * version.grid.width());
+      shm_segment->endUpdate();
+    }
+  }
+
+  /** Place a copy of the grid in a shared memory segment, where other processes on this host can map it read-only
+   * through multimap_server/shm_map_client.h */
+  void exportToSharedMemory(const std::string& prefix)
+  {
+    const nav_msgs::MapMetaData& info = meta_data_message_;
+    multimap_server::ShmMapHeader metadata;
+    memset(&metadata, 0, sizeof(metadata));
+    metadata.width = info.width;
+    metadata.height = info.height;
+    metadata.resolution = info.resolution;
+    metadata.origin_position[0] = info.origin.position.x;
+    metadata.origin_position[1] = info.origin.position.y;
+    metadata.origin_position[2] = info.origin.position.z;
+    metadata.origin_orientation[0] = info.origin.orientation.x;
+    metadata.origin_orientation[1] = info.origin.orientation.y;
+    metadata.origin_orientation[2] = info.origin.orientation.z;
+    metadata.origin_orientation[3] = info.origin.orientation.w;
+    metadata.load_time_sec = info.map_load_time.sec;
+    metadata.load_time_nsec = info.map_load_time.nsec;
+    strncpy(metadata.frame_id, frame_id.c_str(), sizeof(metadata.frame_id) - 1);
+
+    try
+    {
+      // The segment is filled straight from the tiles
+      shm_segment = boost::make_shared<multimap_server::ShmMapSegment>(ns, desired_name, prefix, metadata,
+                                                                        (const int8_t*)NULL);
+      const multimap_server::TiledGrid& grid = getContent()->grid;
+      grid.copyRows(0, grid.height(), shm_segment->data());
+      shm_segment->endUpdate();
+      ROS_INFO("Map %s placed in shared memory segment %s", map_fullname.c_str(), shm_segment->name().c_str());
+    }
+    catch (std::runtime_error& e)
+    {
+      // The map is still served through ROS
+      ROS_WARN("%s", e.what());
+    }
+  }
+
+  /** Callback invoked when someone requests our service. It works on the version of the cells current at the time of
+   * the call, so this can run concurrently from any spinner thread without locking */
+  bool mapCallback(nav_msgs::GetMap::Request& req, nav_msgs::GetMap::Response& res)
+  {
+    // request is empty; we ignore it
+
+    toMessage(*getContent(), &res.map);
+    ROS_INFO("Sending map");
+
+    return true;
+  }
+
+  /** Same as mapCallback(), with the rows run-length encoded. Like fetch_map, the map is not sent again to a caller
+   * that holds its current version */
+  bool rleCallback(multimap_server::GetMapRle::Request& req, multimap_server::GetMapRle::Response& res)
+  {
+    if (req.known_hash != 0 && req.known_hash == getContentHash())
+    {
+      res.not_modified = true;
+      return true;
+    }
+
+    res.map = *rleOf(*getContent());
+    ROS_INFO("Sending run-length encoded map, %zu runs", res.map.run_lengths.size());
+    return true;
+  }
+
+  nav_msgs::MapMetaData meta_data_message_;
+  std::string frame_id;
+  ros::Time stamp;
+  /** Only accessed through boost::atomic_load() and boost::atomic_store(). NULL while the map is evicted */
+  MapContentConstPtr content;
+  /** Hash of the current version, kept while the map is evicted */
+  uint64_t content_hash;
+};
+
+typedef boost::shared_ptr<Map> MapPtr;
+
+/** Lower the scheduling priority of the calling thread. On Linux the nice value is per thread */
+void lowerThreadPriority(int niceness)
+{
+  if (niceness != 0 && setpriority(PRIO_PROCESS, syscall(SYS_gettid), niceness) != 0)
+  {
+    ROS_WARN("Could not set niceness %d on worker thread", niceness);
+  }
+}
+
+/** Pool of threads servicing a single callback queue. A positive niceness lowers the scheduling priority of the
+ * worker threads, so that the work they do yields the CPU to map serving */
+class CallbackQueuePool
+{
+public:
+  CallbackQueuePool(ros::CallbackQueue* queue, int num_threads, int niceness)
+    : queue_(queue), num_threads_(num_threads), niceness_(niceness), running_(false)
+  {
+  }
+
+  ~CallbackQueuePool()
+  {
+    stop();
+  }
+
+  void start()
+  {
+    running_ = true;
+    for (int i = 0; i < num_threads_; i++)
+    {
+      threads_.create_thread(boost::bind(&CallbackQueuePool::run, this));
+    }
+  }
+
+  void stop()
+  {
+    running_ = false;
+    threads_.join_all();
+  }
+
+private:
+  ros::CallbackQueue* queue_;
+  int num_threads_;
+  int niceness_;
+  volatile bool running_;
+  boost::thread_group threads_;
+
+  void run()
+  {
+    lowerThreadPriority(niceness_);
+    while (running_ && ros::ok())
+    {
+      queue_->callAvailable(ros::WallDuration(0.1));
+    }
+  }
+};
+
+/** Resident set size of the process, in bytes */
+size_t residentSetSize()
+{
+  size_t pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm)
+  {
+    unsigned long size, resident;
+    if (fscanf(statm, "%lu %lu", &size, &resident) == 2)
+    {
+      pages = resident;
+    }
+    fclose(statm);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+/** Size for log and service messages, e.g. "12.3 MB" */
+std::string megabytes(size_t bytes)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "%.1f MB", bytes / 1048576.0);
+  return text;
+}
+
+/** Destroys dumped maps on a low priority thread, so that the dump services return as soon as the maps are out of
+ * the registry, and gives the freed memory back to the system. Also frees the message arenas of the threads that
+ * stopped publishing */
+class MapReclaimer
+{
+public:
+  explicit MapReclaimer(int niceness) : stopping_(false), reclaimed_bytes_(0), returned_bytes_(0)
+  {
+    thread_ = boost::thread(boost::bind(&MapReclaimer::run, this, niceness));
+  }
+
+  ~MapReclaimer()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+  }
+
+  /** Take over the references to maps that were removed from the registry, and empty maps. Maps still used by a
+   * request are destroyed when it completes, before the memory is returned
+   *
+   * @return Bytes of cells held by the maps
+   */
+  size_t reclaim(std::vector<MapPtr>* maps)
+  {
+    size_t total = 0;
+    std::vector<MapPtr>::const_iterator it;
+    for (it = maps->begin(); it != maps->end(); ++it)
+    {
+      size_t bytes;
+      (*it)->getResidency(&bytes);
+      total += bytes;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_.insert(pending_.end(), maps->begin(), maps->end());
+    pending_bytes_.push_back(total);
+    maps->clear();
+    cond_.notify_all();
+    return total;
+  }
+
+  /** Bytes of cells destroyed so far, and decrease of the resident set size that followed */
+  void getTotals(uint64_t* reclaimed_bytes, uint64_t* returned_bytes)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    *reclaimed_bytes = reclaimed_bytes_;
+    *returned_bytes = returned_bytes_;
+  }
+
+private:
+  /** Longest wait for the requests still using reclaimed maps */
+  static const int MAX_WAIT_MS = 10000;
+  /** Seconds after which the message arena of a thread that published nothing is freed */
+  static const int ARENA_IDLE_SECONDS = 30;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  bool stopping_;
+  std::vector<MapPtr> pending_;
+  std::vector<size_t> pending_bytes_;
+  uint64_t reclaimed_bytes_;
+  uint64_t returned_bytes_;
+  boost::thread thread_;
+
+  void run(int niceness)
+  {
+    lowerThreadPriority(niceness);
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!stopping_)
+    {
+      if (pending_.empty())
+      {
+        cond_.timed_wait(lock, boost::posix_time::seconds(ARENA_IDLE_SECONDS));
+        if (pending_.empty() && !stopping_)
+        {
+          lock.unlock();
+          if (multimap_server::trimMessageArenas(ARENA_IDLE_SECONDS) > 0)
+          {
+            returnFreeMemory();
+          }
+          lock.lock();
+        }
+        continue;
+      }
+
+      std::vector<MapPtr> maps;
+      maps.swap(pending_);
+      size_t bytes = 0;
+      for (size_t i = 0; i < pending_bytes_.size(); i++)
+      {
+        bytes += pending_bytes_[i];
+      }
+      pending_bytes_.clear();
+      lock.unlock();
+
+      ros::WallTime start = ros::WallTime::now();
+      size_t rss_before = residentSetSize();
+      std::vector<boost::weak_ptr<Map> > released(maps.begin(), maps.end());
+      size_t count = maps.size();
+      maps.clear();
+      for (int waited = 0; waited < MAX_WAIT_MS && !allExpired(released); waited += 100)
+      {
+        ros::WallDuration(0.1).sleep();
+      }
+      // Arenas that are not building a message are freed too, rather than pinning the heap around the freed tiles
+      multimap_server::trimMessageArenas(0.0);
+      returnFreeMemory();
+      size_t rss_after = residentSetSize();
+      size_t returned = rss_before > rss_after ? rss_before - rss_after : 0;
+      ROS_INFO("Reclaimed %lu maps holding %s in %.3f s, resident set shrank by %s", (unsigned long)count,
+               megabytes(bytes).c_str(), (ros::WallTime::now() - start).toSec(), megabytes(returned).c_str());
+
+      lock.lock();
+      reclaimed_bytes_ += bytes;
+      returned_bytes_ += returned;
+    }
+  }
+
+  static void returnFreeMemory()
+  {
+#ifdef __GLIBC__
+    // Freed tiles are scattered through the heap, which glibc only returns from its top without this
+    malloc_trim(0);
+#endif
+  }
+
+  static bool allExpired(const std::vector<boost::weak_ptr<Map> >& maps)
+  {
+    for (size_t i = 0; i < maps.size(); i++)
+    {
+      if (!maps[i].expired())
+        return false;
+    }
+    return true;
+  }
+};
+
+/** Loaded maps and environments. A registry is never modified once it has been published: readers grab the
+ * current snapshot without locking, writers copy it, apply their change and swap the new one in (RCU style).
+ */
+struct MapRegistry
+{
+  MapRegistry() : sequence(0)
+  {
+  }
+
+  std::vector<MapPtr> maps;
+  multimap_server_msgs::Environments environments;
+  /** Sequence number of the last change on map_changes that the registry includes */
+  uint64_t sequence;
+};
+typedef boost::shared_ptr<const MapRegistry> MapRegistryConstPtr;
+
+/** Send a version of a map on maps_stream as a sequence of bands of rows of at most chunk_size cells. Maps that would
+ * take more than max_chunks bands are sent in max_chunks larger ones, so that a whole map fits in the queue of a
+ * subscriber. Only one chunk is held in memory at a time. Pub is either the topic publisher or, for a new subscriber,
+ * a ros::SingleSubscriberPublisher */
+template <class Pub>
+void streamMap(const Pub& pub, Map& map, const MapContent& content, size_t chunk_size, size_t max_chunks)
+{
+  const nav_msgs::MapMetaData& info = map.getInfo();
+  uint32_t band_rows = multimap_server::bandRows(info.width, chunk_size);
+  if (multimap_server::bandCount(info.height, band_rows) > max_chunks)
+  {
+    band_rows = (info.height + max_chunks - 1) / max_chunks;
+  }
+  size_t chunk_count = multimap_server::bandCount(info.height, band_rows);
+
+  multimap_server::MessageArena& arena = multimap_server::threadMessageArena();
+  multimap_server::ArenaScope scope(arena);
+  ArenaMapStreamChunk chunk((multimap_server::ArenaAllocator<void>(&arena)));
+  chunk.ns.assign(map.getNamespace().data(), map.getNamespace().size());
+  chunk.map_name.assign(map.getName().data(), map.getName().size());
+  chunk.version = content.hash;
+  chunk.chunk_count = chunk_count;
+  chunk.frame_id.assign(map.getFrameId().data(), map.getFrameId().size());
+  copyMetaData(info, &chunk.info);
+  for (size_t i = 0; i < chunk_count; i++)
+  {
+    uint32_t first_row = i * band_rows;
+    uint32_t rows = std::min(band_rows, info.height - first_row);
+    chunk.chunk_index = i;
+    chunk.offset = (size_t)first_row * info.width;
+    chunk.data.resize((size_t)rows * info.width);
+    content.grid.copyRows(first_row, rows, chunk.data.empty() ? NULL : &chunk.data[0]);
+    chunk.checksum = multimap_server::checksum64(chunk.data.empty() ? NULL : &chunk.data[0], chunk.data.size());
+    pub.publish(chunk);
+  }
+}
+
+/** Map load requested through load_map_async */
+struct LoadJob
+{
+  uint32_t id;
+  multimap_server_msgs::LoadMap::Request request;
+  volatile bool cancel_requested;
+  /** Set, under the jobs lock, once the job can no longer be cancelled */
+  bool finished;
+};
+typedef boost::shared_ptr<LoadJob> LoadJobPtr;
+
+void publishLoadProgress(const ros::Publisher& pub, const LoadJob& job, uint8_t state, const std::string& stage,
+                         double percent, const std::string& msg)
+{
+  multimap_server::LoadProgress progress;
+  progress.job_id = job.id;
+  progress.ns = job.request.ns;
+  progress.map_name = job.request.map_name;
+  progress.state = state;
+  progress.stage = stage;
+  progress.percent = percent;
+  progress.msg = msg;
+  pub.publish(progress);
+}
+
+/** Reports the progress of a load job on the load_progress topic and forwards cancellation requests to the image
+ * loader */
+class LoadJobMonitor : public multimap_server::LoadMonitor
+{
+public:
+  LoadJobMonitor(const LoadJobPtr& job, const ros::Publisher& pub, const boost::function<void()>& on_extents)
+    : job_(job), pub_(pub), on_extents_(on_extents), last_percent_(-1)
+  {
+  }
+
+  void extents(const nav_msgs::MapMetaData& info)
+  {
+    on_extents_();
+  }
+
+  void progress(const std::string& stage, double fraction)
+  {
+    // Only whole percent changes are published
+    int percent = (int)(100 * fraction);
+    if (stage == last_stage_ && percent == last_percent_)
+    {
+      return;
+    }
+    last_stage_ = stage;
+    last_percent_ = percent;
+    publishLoadProgress(pub_, *job_, multimap_server::LoadProgress::RUNNING, stage, percent, "");
+  }
+
+  bool cancelled()
+  {
+    return job_->cancel_requested;
+  }
+
+private:
+  LoadJobPtr job_;
+  ros::Publisher pub_;
+  boost::function<void()> on_extents_;
+  std::string last_stage_;
+  int last_percent_;
+};
+
+class MultimapServer
+{
+public:
+  /** Trivial constructor */
+  MultimapServer(const std::string& fname)
+    : pn("~")
+    , admin_pn("~")
+    , admin_pool(&admin_queue, pn.param("admin_threads", 1), pn.param("admin_niceness", 10))
+    , reclaimer(pn.param("admin_niceness", 10))
+    , url_cache(pn.param("url_cache_dir", multimap_server::UrlCache::defaultCacheDir()), pn.param("url_timeout", 60.0),
+                (uint64_t)std::max(0, pn.param("url_cache_size_mb", 4096)) << 20)
+    , session(ros::WallTime::now().toNSec())
+    , change_sequence(0)
+    , stream_max_chunks(1)
+    , stopping_stream(false)
+    , registry(boost::make_shared<MapRegistry>())
+    , leader_session(0)
+    , leader_sequence(0)
+    , leader_resync_needed(true)
+    , next_job_id(1)
+    , stopping_load_workers(false)
+    , prefetch_evict_delay(0.0)
+    , prefetch_compress(false)
+    , compress_idle_time(0.0)
+    , stopping_residency(false)
+  {
+    // In a sharded deployment every server only holds the environments that the shard ring assigns to it
+    int shard_count = pn.param("shard_count", 1);
+    shard_index = pn.param("shard_index", 0);
+    if (shard_count > 1)
+    {
+      if (shard_index < 0 || shard_index >= shard_count)
+      {
+        ROS_ERROR("~shard_index must be between 0 and %d", shard_count - 1);
+        exit(-1);
+      }
+      shard_ring = boost::make_shared<multimap_server::ShardRing>(shard_count);
+      ROS_INFO("Serving shard %d of %d", shard_index, shard_count);
+    }
+
+    multimap_server::setThreadArenaRetention((size_t)std::max(1, pn.param("message_arena_retain_mb", 256)) << 20);
+
+    // Tiles of the maps loaded from now on
+    try
+    {
+      std::string huge_pages_name = pn.param("huge_pages", std::string("off"));
+      multimap_server::HugePages huge_pages = multimap_server::parseHugePages(huge_pages_name);
+      multimap_server::HugePages available = multimap_server::setHugePages(huge_pages);
+      if (available != huge_pages)
+      {
+        ROS_WARN("~huge_pages %s is not available, using %s", huge_pages_name.c_str(),
+                 multimap_server::hugePagesName(available));
+      }
+    }
+    catch (std::runtime_error& e)
+    {
+      ROS_ERROR("~huge_pages: %s", e.what());
+      exit(-1);
+    }
+
+    timerPublish = n.createTimer(ros::Duration(0.2), &MultimapServer::timerPublishCallback, this);
+
+    // Administrative services are handled on their own low priority queue, so that map requests, which are served
+    // from the global queue, keep a flat latency while maps are being loaded or dumped
+    admin_pn.setCallbackQueue(&admin_queue);
+
+    std::string load_map_service_name = "load_map";
+    load_map_service = admin_pn.advertiseService(load_map_service_name, &MultimapServer::loadMapCallback, this);
+
+    std::string load_environments_service_name = "load_environments";
+    load_environments_service =
+        admin_pn.advertiseService(load_environments_service_name, &MultimapServer::loadEnvironmentsCallback, this);
+
+    std::string dump_map_service_name = "dump_map";
+    dump_map_service = admin_pn.advertiseService(dump_map_service_name, &MultimapServer::dumpMapCallback, this);
+
+    std::string dump_environments_service_name = "dump_environments";
+    dump_environments_service =
+        admin_pn.advertiseService(dump_environments_service_name, &MultimapServer::dumpEnvironmentsCallback, this);
+
+    std::string edit_map_service_name = "edit_map";
+    edit_map_service = admin_pn.advertiseService(edit_map_service_name, &MultimapServer::editMapCallback, this);
+
+    std::string reload_layer_service_name = "reload_layer";
+    reload_layer_service =
+        admin_pn.advertiseService(reload_layer_service_name, &MultimapServer::reloadLayerCallback, this);
+
+    // Comparisons read every tile of two maps, so they don't hold up map requests either
+    std::string diff_maps_service_name = "diff_maps";
+    diff_maps_service = admin_pn.advertiseService(diff_maps_service_name, &MultimapServer::diffMapsCallback, this);
+
+    std::string stitch_maps_service_name = "stitch_maps";
+    stitch_maps_service =
+        admin_pn.advertiseService(stitch_maps_service_name, &MultimapServer::stitchMapsCallback, this);
+
+    std::string transform_map_service_name = "transform_map";
+    transform_map_service =
+        admin_pn.advertiseService(transform_map_service_name, &MultimapServer::transformMapCallback, this);
+
+    // Background loads are only queued by these services, so they are cheap enough for the global queue
+    std::string load_map_async_service_name = "load_map_async";
+    load_map_async_service =
+        pn.advertiseService(load_map_async_service_name, &MultimapServer::loadMapAsyncCallback, this);
+
+    std::string cancel_load_service_name = "cancel_load";
+    cancel_load_service = pn.advertiseService(cancel_load_service_name, &MultimapServer::cancelLoadCallback, this);
+
+    std::string fetch_map_service_name = "fetch_map";
+    fetch_map_service = pn.advertiseService(fetch_map_service_name, &MultimapServer::fetchMapCallback, this);
+
+    std::string load_progress_topic_name = "load_progress";
+    load_progress_pub = pn.advertise<multimap_server::LoadProgress>(load_progress_topic_name, 100);
+
+    // Latched environments topic
+    std::string environments_topic_name = "environments";
+    environments_pub = pn.advertise<multimap_server_msgs::Environments>(environments_topic_name, 1, true);
+
+    // Environments with their position in the change stream, followed by replicas when they resynchronize
+    std::string environments_snapshot_topic_name = "environments_snapshot";
+    environments_snapshot_pub =
+        pn.advertise<multimap_server::EnvironmentsSnapshot>(environments_snapshot_topic_name, 1, true);
+
+    // Change stream followed by replicas of this server
+    std::string map_changes_topic_name = "map_changes";
+    map_changes_pub = pn.advertise<multimap_server::MapChange>(map_changes_topic_name, 1000);
+
+    // Chunked transfers, so that huge maps are not sent as a single message
+    stream_chunk_size = std::max(1, pn.param("stream_chunk_size", 1 << 20));
+
+    std::string get_map_manifest_service_name = "get_map_manifest";
+    get_map_manifest_service =
+        pn.advertiseService(get_map_manifest_service_name, &MultimapServer::getMapManifestCallback, this);
+
+    std::string get_map_chunk_service_name = "get_map_chunk";
+    get_map_chunk_service = pn.advertiseService(get_map_chunk_service_name, &MultimapServer::getMapChunkCallback, this);
+
+    pn.param("multiplexed", multiplexed, false);
+    if (multiplexed)
+    {
+      // A map is published as a burst of chunks, of at most half the queue so that the next map does not push it
+      // out. A subscriber lagging more than the queue loses the oldest chunks and has to fetch the map with get_map.
+      // New subscribers get every loaded map, which makes the topic behave as if each map were latched. They are
+      // served by stream_thread, through stream_callbacks, rather than from the global queue
+      size_t stream_queue_size = std::max(1, pn.param("stream_queue_size", 100));
+      stream_max_chunks = std::max<size_t>(1, stream_queue_size / 2);
+      std::string maps_stream_topic_name = "maps_stream";
+      ros::AdvertiseOptions maps_stream_options = ros::AdvertiseOptions::create<multimap_server::MapStreamChunk>(
+          maps_stream_topic_name, stream_queue_size, boost::bind(&MultimapServer::mapsStreamConnectCallback, this, _1),
+          ros::SubscriberStatusCallback(), ros::VoidConstPtr(), &stream_callbacks);
+      maps_stream_pub = pn.advertise(maps_stream_options);
+      stream_thread = boost::thread(boost::bind(&MultimapServer::streamWorker, this));
+
+      std::string get_map_service_name = "get_map";
+      get_map_service = pn.advertiseService(get_map_service_name, &MultimapServer::getMapCallback, this);
+    }
+
+    std::string msg;
+
+    pn.param("leader", leader_name, std::string(""));
+    if (!leader_name.empty())
+    {
+      if (!fname.empty())
+      {
+        ROS_WARN("Following %s, %s is ignored", leader_name.c_str(), fname.c_str());
+      }
+      startFollowing();
+    }
+    else if (false == loadEnvironmentsFromYAML(fname, &msg))
+    {
+      ROS_ERROR("Multimap_server could not open %s: %s Shutting down", fname.c_str(), msg.c_str());
+      exit(-1);
+    }
+
+    admin_pool.start();
+
+    int load_threads = pn.param("async_load_threads", 1);
+    int load_niceness = pn.param("admin_niceness", 10);
+    for (int i = 0; i < load_threads; i++)
+    {
+      load_workers.create_thread(boost::bind(&MultimapServer::loadWorker, this, load_niceness));
+    }
+
+    // Robots report the environment they are in on these topics. The maps of those environments and of the adjacent
+    // ones are kept in memory, so that moving to the next floor never waits for a cold load
+    std::vector<std::string> prefetch_topics;
+    pn.param("prefetch_topics", prefetch_topics, std::vector<std::string>());
+    pn.param("prefetch_evict_delay", prefetch_evict_delay, 30.0);
+    prefetch_compress = (pn.param("prefetch_demotion", std::string("evict")) == "compress");
+    std::vector<std::string>::const_iterator topic;
+    for (topic = prefetch_topics.begin(); topic != prefetch_topics.end(); ++topic)
+    {
+      location_subs.push_back(n.subscribe<std_msgs::String>(
+          *topic, 1, boost::bind(&MultimapServer::locationCallback, this, *topic, _1)));
+    }
+
+    // Maps nobody asked for during this time are compressed in memory
+    pn.param("compress_idle_time", compress_idle_time, 0.0);
+
+    if (!prefetch_topics.empty() || compress_idle_time > 0.0)
+    {
+      residency_thread = boost::thread(boost::bind(&MultimapServer::residencyWorker, this, load_niceness));
+    }
+
+    std::string residency_stats_topic_name = "residency_stats";
+    residency_stats_pub = pn.advertise<multimap_server::ResidencyStats>(residency_stats_topic_name, 1);
+    timerResidencyStats = n.createTimer(ros::Duration(5.0), &MultimapServer::timerResidencyStatsCallback, this);
+  }
+
+  ~MultimapServer()
+  {
+    admin_pool.stop();
+
+    {
+      boost::mutex::scoped_lock lock(jobs_mutex);
+      stopping_load_workers = true;
+      std::map<uint32_t, LoadJobPtr>::iterator it;
+      for (it = active_jobs.begin(); it != active_jobs.end(); ++it)
+      {
+        it->second->cancel_requested = true;
+      }
+    }
+    jobs_cond.notify_all();
+    load_workers.join_all();
+
+    {
+      boost::mutex::scoped_lock lock(prefetch_mutex);
+      stopping_residency = true;
+    }
+    prefetch_cond.notify_all();
+    residency_thread.join();
+
+    {
+      boost::mutex::scoped_lock lock(stream_mutex);
+      stopping_stream = true;
+    }
+    stream_cond.notify_all();
+    stream_thread.join();
+  }
+
+private:
+  ros::NodeHandle n;
+  ros::NodeHandle pn;
+  ros::NodeHandle admin_pn;
+  ros::CallbackQueue admin_queue;
+  CallbackQueuePool admin_pool;
+  MapReclaimer reclaimer;
+  multimap_server::UrlCache url_cache;
+
+  ros::Timer timerPublish;
+  ros::Publisher environments_pub;
+  ros::ServiceServer load_map_service;
+  ros::ServiceServer dump_map_service;
+  ros::ServiceServer load_environments_service;
+  ros::ServiceServer dump_environments_service;
+  ros::ServiceServer edit_map_service;
+  ros::ServiceServer reload_layer_service;
+  ros::ServiceServer diff_maps_service;
+  ros::ServiceServer stitch_maps_service;
+  ros::ServiceServer transform_map_service;
+  ros::ServiceServer load_map_async_service;
+  ros::ServiceServer cancel_load_service;
+  ros::ServiceServer fetch_map_service;
+  ros::ServiceServer get_map_manifest_service;
+  ros::ServiceServer get_map_chunk_service;
+  ros::Publisher load_progress_pub;
+  ros::Publisher map_changes_pub;
+  /** Start time of this server, in nanoseconds, announced with its changes */
+  uint64_t session;
+  /** Sequence number of the last change published on map_changes */
+  uint64_t change_sequence;
+  ros::Publisher environments_snapshot_pub;
+
+  /** Multiplexed mode: all maps are delivered through maps_stream and get_map */
+  bool multiplexed;
+  size_t stream_chunk_size;
+  /** Most chunks a map is split in on maps_stream, half of ~stream_queue_size */
+  size_t stream_max_chunks;
+  ros::Publisher maps_stream_pub;
+  /** Connect callbacks of maps_stream, called by stream_thread between the changes it sends */
+  ros::CallbackQueue stream_callbacks;
+  ros::ServiceServer get_map_service;
+  /** Maps to send on maps_stream, in the order of their changes, with the version to send (none for a dump). They
+   * are queued under mutation_mutex and sent by stream_thread, so that a slow subscriber never holds up changes */
+  std::deque<std::pair<MapPtr, MapContentConstPtr> > pending_streams;
+  boost::mutex stream_mutex;
+  boost::condition_variable stream_cond;
+  bool stopping_stream;
+  boost::thread stream_thread;
+  /** How often stream_thread looks for new subscribers when no map changes */
+  static const int STREAM_POLL_MS = 100;
+
+  /** Serializes load/dump operations. Readers never take it */
+  boost::mutex mutation_mutex;
+  /** Current registry snapshot. Only accessed through getRegistry() and publishRegistry() */
+  MapRegistryConstPtr registry;
+
+  /** Only set in sharded mode */
+  boost::shared_ptr<multimap_server::ShardRing> shard_ring;
+  int shard_index;
+
+  /** Only set in follower mode: the leader node, and the client fetching its maps through the disk cache */
+  std::string leader_name;
+  boost::shared_ptr<multimap_server::MultimapClient> leader_client;
+  ros::Subscriber leader_changes_sub;
+  ros::Subscriber leader_environments_sub;
+  /** Session of the leader and sequence number of the last change received from it or included in the last
+   * snapshot applied, 0 before the first one. Protected by mutation_mutex, like leader_resync_needed */
+  uint64_t leader_session;
+  uint64_t leader_sequence;
+  /** Set until the maps have been checked against the leader's environments, and again when changes are missed */
+  bool leader_resync_needed;
+
+  /** Protects the load_map_async job queue */
+  boost::mutex jobs_mutex;
+  boost::condition_variable jobs_cond;
+  /** Jobs waiting for a worker */
+  std::deque<LoadJobPtr> pending_jobs;
+  /** Jobs that are either waiting or running, by id */
+  std::map<uint32_t, LoadJobPtr> active_jobs;
+  uint32_t next_job_id;
+  bool stopping_load_workers;
+  boost::thread_group load_workers;
+
+  /** Prefetch policy, enabled by ~prefetch_topics */
+  std::vector<ros::Subscriber> location_subs;
+  /** Protects the prefetch state below */
+  boost::mutex prefetch_mutex;
+  boost::condition_variable prefetch_cond;
+  /** Last environment reported on each location topic */
+  std::map<std::string, std::string> robot_environments;
+  /** Adjacent tags of the environments file, in both directions */
+  std::map<std::string, std::set<std::string> > environment_adjacency;
+  /** Seconds a map stays resident after its environment stopped being current or adjacent */
+  double prefetch_evict_delay;
+  /** Maps leaving the current and adjacent environments are compressed instead of evicted */
+  bool prefetch_compress;
+  /** Seconds without access after which a map is compressed, 0 to never compress idle maps */
+  double compress_idle_time;
+  bool stopping_residency;
+  /** Applies the prefetch policy and compresses idle maps */
+  boost::thread residency_thread;
+  ros::Publisher residency_stats_pub;
+  ros::Timer timerResidencyStats;
+
+  MapRegistryConstPtr getRegistry() const
+  {
+    return boost::atomic_load(&registry);
+  }
+
+  /** Make a new registry visible to readers and announce what changed on map_changes. The maps that are not in the
+   * new registry anymore are handed over to the reclaimer, which destroys them once the callers' references are
+   * gone. Must be called with mutation_mutex held
+   *
+   * @return Bytes of cells of the removed maps, released in the background
+   */
+  size_t publishRegistry(const boost::shared_ptr<MapRegistry>& new_registry)
+  {
+    MapRegistryConstPtr old_registry = getRegistry();
+    std::vector<MapChangeEntry> changes = registryChanges(*old_registry, *new_registry);
+    new_registry->sequence = change_sequence + changes.size();
+    boost::atomic_store(&registry, MapRegistryConstPtr(new_registry));
+    // Only announced once the maps can be fetched
+    std::vector<MapChangeEntry>::const_iterator change;
+    for (change = changes.begin(); change != changes.end(); ++change)
+    {
+      publishChange(change->first, change->second);
+    }
+
+    std::set<MapPtr> kept(new_registry->maps.begin(), new_registry->maps.end());
+    std::vector<MapPtr> removed;
+    std::vector<MapPtr>::const_iterator it;
+    for (it = old_registry->maps.begin(); it != old_registry->maps.end(); ++it)
+    {
+      if (!kept.count(*it))
+      {
+        removed.push_back(*it);
+      }
+    }
+    old_registry.reset();
+    return removed.empty() ? 0 : reclaimer.reclaim(&removed);
+  }
+
+  /** Operation of map_changes and the map it applies to */
+  typedef std::pair<uint8_t, MapPtr> MapChangeEntry;
+
+  /** Differences between two registries. Maps are compared by identity, so a map that was dumped and loaded again
+   * between two registries is announced as a RELOAD */
+  std::vector<MapChangeEntry> registryChanges(const MapRegistry& before, const MapRegistry& after)
+  {
+    std::vector<MapChangeEntry> changes;
+    std::map<std::string, MapPtr> previous;
+    std::vector<MapPtr>::const_iterator it;
+    for (it = before.maps.begin(); it != before.maps.end(); ++it)
+    {
+      previous[(*it)->getMapFullName()] = *it;
+    }
+
+    for (it = after.maps.begin(); it != after.maps.end(); ++it)
+    {
+      std::map<std::string, MapPtr>::iterator found = previous.find((*it)->getMapFullName());
+      if (found == previous.end())
+      {
+        changes.push_back(MapChangeEntry(multimap_server::MapChange::LOAD, *it));
+      }
+      else
+      {
+        if (found->second != *it)
+        {
+          changes.push_back(MapChangeEntry(multimap_server::MapChange::RELOAD, *it));
+        }
+        previous.erase(found);
+      }
+    }
+
+    std::map<std::string, MapPtr>::const_iterator removed;
+    for (removed = previous.begin(); removed != previous.end(); ++removed)
+    {
+      changes.push_back(MapChangeEntry(multimap_server::MapChange::DUMP, removed->second));
+    }
+    return changes;
+  }
+
+  /** Announce a new version of a map that stays in the registry. The registry is published again, so that the
+   * environments snapshots include the change. Must be called with mutation_mutex held */
+  void publishContentChange(const MapPtr& map)
+  {
+    publishChange(multimap_server::MapChange::RELOAD, map);
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+    publishRegistry(working);
+  }
+
+  void publishChange(uint8_t operation, const MapPtr& map_ptr)
+  {
+    Map& map = *map_ptr;
+    multimap_server::MapChange change;
+    change.session = session;
+    change.sequence = ++change_sequence;
+    change.operation = operation;
+    change.ns = map.getNamespace();
+    change.map_name = map.getName();
+    change.global_frame = map.getFrameId();
+    change.hash = (operation == multimap_server::MapChange::DUMP) ? 0 : map.getContentHash();
+    map_changes_pub.publish(change);
+
+    if (multiplexed)
+    {
+      // The map was just loaded or changed, so its content is normally resident
+      MapContentConstPtr content;
+      if (operation != multimap_server::MapChange::DUMP)
+      {
+        try
+        {
+          content = map.getContent();
+        }
+        catch (std::runtime_error& e)
+        {
+          ROS_WARN("Could not send %s on maps_stream: %s", map.getMapFullName().c_str(), e.what());
+          return;
+        }
+      }
+      boost::mutex::scoped_lock lock(stream_mutex);
+      pending_streams.push_back(std::make_pair(map_ptr, content));
+      stream_cond.notify_one();
+    }
+  }
+
+  /** Send the resident maps to a new maps_stream subscriber, from stream_thread. Evicted and compressed maps are left
+   * where they are, rather than restoring every map for each subscriber; the subscriber fetches them with get_map */
+  void mapsStreamConnectCallback(const ros::SingleSubscriberPublisher& pub)
+  {
+    MapRegistryConstPtr current = getRegistry();
+    size_t skipped = 0;
+    std::vector<MapPtr>::const_iterator it;
+    for (it = current->maps.begin(); it != current->maps.end(); ++it)
+    {
+      MapContentConstPtr content = (*it)->residentContent();
+      if (content)
+      {
+        streamMap(pub, **it, *content, stream_chunk_size, stream_max_chunks);
+      }
+      else
+      {
+        skipped++;
+      }
+    }
+    if (skipped > 0)
+    {
+      ROS_DEBUG("%zu maps that are not resident were not sent to the new maps_stream subscriber %s", skipped,
+                pub.getSubscriberName().c_str());
+    }
+  }
+
+  /** Send the changes of the maps on maps_stream, outside of mutation_mutex, and the resident maps to its new
+   * subscribers */
+  void streamWorker()
+  {
+    while (true)
+    {
+      stream_callbacks.callAvailable();
+      std::pair<MapPtr, MapContentConstPtr> pending;
+      {
+        boost::mutex::scoped_lock lock(stream_mutex);
+        if (!stopping_stream && pending_streams.empty())
+        {
+          // New subscribers do not signal stream_cond, they are picked up on the next poll
+          stream_cond.timed_wait(lock, boost::posix_time::milliseconds(STREAM_POLL_MS));
+        }
+        if (stopping_stream)
+        {
+          return;
+        }
+        if (pending_streams.empty())
+        {
+          continue;
+        }
+        pending = pending_streams.front();
+        pending_streams.pop_front();
+      }
+
+      if (!pending.second)
+      {
+        multimap_server::MapStreamChunk dumped;
+        dumped.ns = pending.first->getNamespace();
+        dumped.map_name = pending.first->getName();
+        dumped.chunk_count = 0;
+        maps_stream_pub.publish(dumped);
+      }
+      else
+      {
+        streamMap(maps_stream_pub, *pending.first, *pending.second, stream_chunk_size, stream_max_chunks);
+      }
+    }
+  }
+
+  /** Single retrieval service of multiplexed mode. Served from the registry snapshot, without locking */
+  bool getMapCallback(multimap_server::GetMapById::Request& req, multimap_server::GetMapById::Response& res)
+  {
+    // Namespaces may contain '/', map names may not
+    size_t separator = req.map_id.rfind('/');
+    MapPtr map;
+    if (separator != std::string::npos)
+    {
+      map = findMap(*getRegistry(), req.map_id.substr(0, separator), req.map_id.substr(separator + 1));
+    }
+    if (!map)
+    {
+      res.success = false;
+      res.msg = "get_map service failed: There is no map loaded under the name " + req.map_id;
+      return true;
+    }
+
+    // Version and cells must match even if the map is edited meanwhile
+    MapContentConstPtr content = map->getContent();
+    res.success = true;
+    res.version = content->hash;
+    map->toMessage(*content, &res.map);
+    return true;
+  }
+
+  void timerPublishCallback(const ros::TimerEvent& event)
+  {
+    MapRegistryConstPtr current = getRegistry();
+    environments_pub.publish(current->environments);
+
+    multimap_server::EnvironmentsSnapshot snapshot;
+    snapshot.session = session;
+    snapshot.sequence = current->sequence;
+    snapshot.environments = current->environments;
+    environments_snapshot_pub.publish(snapshot);
+  }
+
+  void addAdjacency(const std::string& environment, const std::vector<std::string>& adjacent)
+  {
+    boost::mutex::scoped_lock lock(prefetch_mutex);
+    std::vector<std::string>::const_iterator it;
+    for (it = adjacent.begin(); it != adjacent.end(); ++it)
+    {
+      environment_adjacency[environment].insert(*it);
+      environment_adjacency[*it].insert(environment);
+    }
+  }
+
+  /** Forget the adjacency of an environment, in both directions */
+  void removeAdjacency(const std::string& environment)
+  {
+    boost::mutex::scoped_lock lock(prefetch_mutex);
+    std::map<std::string, std::set<std::string> >::iterator it = environment_adjacency.find(environment);
+    if (it == environment_adjacency.end())
+    {
+      return;
+    }
+    std::set<std::string>::const_iterator adjacent;
+    for (adjacent = it->second.begin(); adjacent != it->second.end(); ++adjacent)
+    {
+      std::map<std::string, std::set<std::string> >::iterator other = environment_adjacency.find(*adjacent);
+      if (other != environment_adjacency.end())
+      {
+        other->second.erase(environment);
+        if (other->second.empty())
+        {
+          environment_adjacency.erase(other);
+        }
+      }
+    }
+    environment_adjacency.erase(environment);
+  }
+
+  void locationCallback(const std::string& topic, const std_msgs::String::ConstPtr& environment)
+  {
+    boost::mutex::scoped_lock lock(prefetch_mutex);
+    std::string& current = robot_environments[topic];
+    if (current != environment->data)
+    {
+      ROS_INFO("%s moved from environment \"%s\" to \"%s\"", topic.c_str(), current.c_str(),
+               environment->data.c_str());
+      current = environment->data;
+      prefetch_cond.notify_all();
+    }
+  }
+
+  /** Apply the prefetch policy whenever a robot changes environment, and every second to demote the maps whose delay
+   * expired and compress idle maps. The prefetch policy demotes nothing before the first location has been
+   * received */
+  void residencyWorker(int niceness)
+  {
+    lowerThreadPriority(niceness);
+    std::map<std::string, ros::WallTime> cold_since;
+
+    boost::mutex::scoped_lock lock(prefetch_mutex);
+    while (!stopping_residency)
+    {
+      std::set<std::string> hot;
+      if (!robot_environments.empty())
+      {
+        std::map<std::string, std::string>::const_iterator robot;
+        for (robot = robot_environments.begin(); robot != robot_environments.end(); ++robot)
+        {
+          hot.insert(robot->second);
+          std::map<std::string, std::set<std::string> >::const_iterator adjacent =
+              environment_adjacency.find(robot->second);
+          if (adjacent != environment_adjacency.end())
+          {
+            hot.insert(adjacent->second.begin(), adjacent->second.end());
+          }
+        }
+
+        lock.unlock();
+        applyPrefetch(hot, &cold_since);
+        lock.lock();
+      }
+      if (compress_idle_time > 0.0)
+      {
+        lock.unlock();
+        compressIdleMaps(hot);
+        lock.lock();
+      }
+      if (!stopping_residency)
+      {
+        prefetch_cond.timed_wait(lock, boost::posix_time::seconds(1));
+      }
+    }
+  }
+
+  /** Restore the evicted and compressed maps of the hot environments, then demote the maps that have been out of
+   * them for ~prefetch_evict_delay seconds */
+  void applyPrefetch(const std::set<std::string>& hot, std::map<std::string, ros::WallTime>* cold_since)
+  {
+    MapRegistryConstPtr current = getRegistry();
+    std::vector<MapPtr>::const_iterator it;
+    for (it = current->maps.begin(); it != current->maps.end(); ++it)
+    {
+      if (hot.count((*it)->getNamespace()) && !(*it)->isResident())
+      {
+        try
+        {
+          (*it)->restore();
+        }
+        catch (std::exception& e)
+        {
+          ROS_WARN("Could not prefetch map %s: %s", (*it)->getMapFullName().c_str(), e.what());
+        }
+      }
+    }
+
+    ros::WallTime now = ros::WallTime::now();
+    std::map<std::string, ros::WallTime> still_cold;
+    for (it = current->maps.begin(); it != current->maps.end(); ++it)
+    {
+      size_t bytes;
+      Residency residency = (*it)->getResidency(&bytes);
+      if (hot.count((*it)->getNamespace()) || residency == EVICTED || (prefetch_compress && residency == COMPRESSED))
+      {
+        continue;
+      }
+
+      std::map<std::string, ros::WallTime>::const_iterator since = cold_since->find((*it)->getMapFullName());
+      ros::WallTime cold = since != cold_since->end() ? since->second : now;
+      if ((now - cold).toSec() >= prefetch_evict_delay && (prefetch_compress ? (*it)->compress() : (*it)->evict()))
+      {
+        ROS_INFO("%s map %s", prefetch_compress ? "Compressed" : "Evicted", (*it)->getMapFullName().c_str());
+      }
+      else
+      {
+        still_cold[(*it)->getMapFullName()] = cold;
+      }
+    }
+    cold_since->swap(still_cold);
+  }
+
+  /** Compress the resident maps that were not accessed for ~compress_idle_time seconds, except those of the hot
+   * environments of the prefetch policy */
+  void compressIdleMaps(const std::set<std::string>& hot)
+  {
+    MapRegistryConstPtr current = getRegistry();
+    std::vector<MapPtr>::const_iterator it;
+    for (it = current->maps.begin(); it != current->maps.end(); ++it)
+    {
+      // Subscribers of the map topics use the map without ever calling getContent()
+      if (!hot.count((*it)->getNamespace()) && (*it)->isResident() && (*it)->idleTime() >= compress_idle_time &&
+          !(*it)->hasTopicSubscribers())
+      {
+        ros::WallTime start = ros::WallTime::now();
+        if ((*it)->compress())
+        {
+          size_t bytes;
+          (*it)->getResidency(&bytes);
+          ROS_INFO("Compressed idle map %s to %lu bytes in %.3f s", (*it)->getMapFullName().c_str(),
+                   (unsigned long)bytes, (ros::WallTime::now() - start).toSec());
+        }
+      }
+    }
+  }
+
+  void timerResidencyStatsCallback(const ros::TimerEvent& event)
+  {
+    multimap_server::ResidencyStats stats;
+    MapRegistryConstPtr current = getRegistry();
+    std::vector<MapPtr>::const_iterator it;
+    for (it = current->maps.begin(); it != current->maps.end(); ++it)
+    {
+      size_t bytes;
+      switch ((*it)->getResidency(&bytes))
+      {
+        case RESIDENT:
+          stats.resident_maps++;
+          stats.resident_bytes += bytes;
+          break;
+        case COMPRESSED:
+          stats.compressed_maps++;
+          stats.compressed_bytes += bytes;
+          break;
+        case EVICTED:
+          stats.evicted_maps++;
+          break;
+      }
+
+      ResidencyCounters counters = (*it)->getCounters();
+      stats.hits += counters.hits;
+      stats.decompressions += counters.decompressions;
+      stats.source_reads += counters.source_reads;
+      stats.decompression_mean_time += counters.decompression_time;
+      stats.decompression_max_time = std::max(stats.decompression_max_time, counters.decompression_max_time);
+      stats.source_read_mean_time += counters.source_read_time;
+      stats.source_read_max_time = std::max(stats.source_read_max_time, counters.source_read_max_time);
+    }
+    // The mean times hold the total times so far
+    if (stats.decompressions > 0)
+    {
+      stats.decompression_mean_time /= stats.decompressions;
+    }
+    if (stats.source_reads > 0)
+    {
+      stats.source_read_mean_time /= stats.source_reads;
+    }
+    reclaimer.getTotals(&stats.reclaimed_bytes, &stats.returned_bytes);
+    residency_stats_pub.publish(stats);
+  }
+
+  bool loadEnvironmentsFromYAML(std::string fname, std::string *msg)
+  {
+    boost::mutex::scoped_lock lock(mutation_mutex);
+
+    std::ifstream fin(fname.c_str());
+    if (fin.fail())
+    {
+      *msg = "The file " + fname + "could not be opened";
+      ROS_ERROR_STREAM(*msg);
       return false;
     }
 
@@ -324,141 +2457,996 @@ private:
     parser.GetNextDocument(doc);
 #endif
 
-    for (YAML::const_iterator namespace_iterator = doc.begin(); namespace_iterator != doc.end(); ++namespace_iterator)
+    // Maps are loaded into a private copy of the registry, which is published after every environment
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+
+    for (YAML::const_iterator namespace_iterator = doc.begin(); namespace_iterator != doc.end(); ++namespace_iterator)
+    {
+      multimap_server_msgs::Environment new_environment;
+      new_environment.name = namespace_iterator->first.as<std::string>();
+
+      if (!ownsEnvironment(new_environment.name))
+      {
+        ROS_DEBUG("Skipping environment %s, which belongs to another shard", new_environment.name.c_str());
+        continue;
+      }
+
+      if (namespace_iterator->second["adjacent"])
+      {
+        addAdjacency(new_environment.name, namespace_iterator->second["adjacent"].as<std::vector<std::string> >());
+      }
+
+      bool maps_loaded = true;
+      if (namespace_iterator->second["pack"])
+      {
+        maps_loaded = loadEnvironmentPack(namespace_iterator->second, &new_environment, *working, msg);
+      }
+      else
+      {
+        std::string global_frame = namespace_iterator->second["global_frame"].as<std::string>();
+        YAML::Node maps = namespace_iterator->second["maps"];
+
+        new_environment.global_frame = global_frame;
+
+        for (YAML::const_iterator maps_iterator = maps.begin(); maps_iterator != maps.end(); ++maps_iterator)
+        {
+          std::string map_path = maps_iterator->second.as<std::string>();
+          if (!multimap_server::UrlCache::isUrl(map_path))
+          {
+            map_path = ros::package::getPath(namespace_iterator->second["maps_package"].as<std::string>()) + "/" +
+                       map_path;
+          }
+          std::string map_namespace = namespace_iterator->first.as<std::string>();
+          std::string map_name = maps_iterator->first.as<std::string>();
+          std::string map_frame = namespace_iterator->second["global_frame"].as<std::string>();
+
+          if (isMapAlreadyLoaded(*working, map_namespace, map_name) == true)
+          {
+            *msg = "A map with the name " + map_namespace + "/" + map_name + " is already loaded";
+            ROS_WARN_STREAM(*msg);
+            maps_loaded = false;
+          }
+          else
+          {
+            try
+            {
+              MapPtr new_map = boost::make_shared<Map>(url_cache.loadMapDescription(map_path), map_namespace,
+                                                       map_name, map_frame);
+              new_map->advertise();
+              working->maps.push_back(new_map);
+              new_environment.map_name.push_back(map_name);
+            }
+            catch (std::exception& e)
+            {
+              *msg = std::string("load_map service failed with exception: ") + e.what();
+              ROS_WARN_STREAM(*msg);
+              maps_loaded = false;
+            }
+          }
+        }
+      }
+
+      if ( maps_loaded == true)
+      {
+        working->environments.environments.push_back(new_environment);
+        publishRegistry(boost::make_shared<MapRegistry>(*working));
+      }
+      else
+      {
+        ROS_ERROR("Error loading maps for environment %s", new_environment.name.c_str());
+        publishRegistry(working);
+        return false;
+      }
+
+    }
+    publishRegistry(working);
+    *msg = "Environments loaded successfully";
+    return true;
+  }
+
+  /** Load all the maps of an environment from the environment pack given by its "pack" tag. The grids are used as
+   * stored, without any decoding. Must be called with mutation_mutex held */
+  bool loadEnvironmentPack(const YAML::Node& environment_node, multimap_server_msgs::Environment* environment,
+                           MapRegistry& working, std::string* msg)
+  {
+    std::string pack_path = environment_node["pack"].as<std::string>();
+    if (pack_path.size() == 0 || pack_path[0] != '/')
+    {
+      pack_path = ros::package::getPath(environment_node["maps_package"].as<std::string>()) + "/" + pack_path;
+    }
+
+    try
+    {
+      multimap_server::EnvironmentPack pack(pack_path);
+      // The global_frame of the environments file takes precedence over the one stored in the pack
+      if (environment_node["global_frame"])
+      {
+        environment->global_frame = environment_node["global_frame"].as<std::string>();
+      }
+      else
+      {
+        environment->global_frame = pack.globalFrame();
+      }
+
+      bool verify = pn.param("verify_pack_checksums", true);
+      std::vector<multimap_server::PackedMap>::const_iterator it;
+      for (it = pack.maps().begin(); it != pack.maps().end(); ++it)
+      {
+        if (isMapAlreadyLoaded(working, environment->name, it->name) == true)
+        {
+          *msg = "A map with the name " + environment->name + "/" + it->name + " is already loaded";
+          ROS_WARN_STREAM(*msg);
+          return false;
+        }
+        if (verify && !pack.verify(*it))
+        {
+          *msg = "The grid of map " + it->name + " in environment pack " + pack_path + " is corrupted";
+          ROS_WARN_STREAM(*msg);
+          return false;
+        }
+
+        MapPtr new_map =
+            boost::make_shared<Map>(*it, pack_path, environment->name, it->name, environment->global_frame);
+        new_map->advertise();
+        working.maps.push_back(new_map);
+        environment->map_name.push_back(it->name);
+      }
+    }
+    catch (std::exception& e)
+    {
+      *msg = std::string("Loading environment pack failed with exception: ") + e.what();
+      ROS_WARN_STREAM(*msg);
+      return false;
+    }
+    return true;
+  }
+
+  /** Start serving a freshly loaded map and add it to the working registry, creating its environment if needed.
+   * Must be called with mutation_mutex held */
+  void addMapToRegistry(MapRegistry& working, const MapPtr& new_map, const multimap_server_msgs::LoadMap::Request& req,
+                        std::string* warning_msg)
+  {
+    new_map->advertise();
+    working.maps.push_back(new_map);
+    addToEnvironment(working, req, warning_msg);
+  }
+
+  /** List a map in its environment, creating the environment if needed. A map that was announced while loading is
+   * already listed */
+  void addToEnvironment(MapRegistry& working, const multimap_server_msgs::LoadMap::Request& req,
+                        std::string* warning_msg)
+  {
+    bool env_exists = false;
+    std::vector<multimap_server_msgs::Environment>::iterator it;
+    for (it = working.environments.environments.begin(); it != working.environments.environments.end(); ++it)
+    {
+      if (it->name == req.ns)
+      {
+        if (std::find(it->map_name.begin(), it->map_name.end(), req.map_name) == it->map_name.end())
+        {
+          it->map_name.push_back(req.map_name);
+        }
+        env_exists = true;
+        if (req.global_frame != "" && req.global_frame != it->global_frame)
+        {
+          *warning_msg = "WARNING: You specified a global_frame, but the environment already exists with a different "
+                         "global_frame. Ignoring the input value.";
+          ROS_WARN("%s", warning_msg->c_str());
+        }
+      }
+    }
+    if (false == env_exists)
+    {
+      multimap_server_msgs::Environment new_environment;
+      new_environment.name = req.ns;
+      new_environment.global_frame = req.global_frame;
+      new_environment.map_name.push_back(req.map_name);
+      working.environments.environments.push_back(new_environment);
+    }
+  }
+
+  bool loadMapCallback(multimap_server_msgs::LoadMap::Request& req, multimap_server_msgs::LoadMap::Response& res)
+  {
+    std::string warning_msg = "";
+
+    if (isFollower())
+    {
+      res.success = false;
+      res.msg = "load_map service failed: this server follows " + leader_name + ", load the map there";
+      return true;
+    }
+
+    if (!ownsEnvironment(req.ns))
+    {
+      res.success = false;
+      res.msg = "load_map service failed: environment " + req.ns + " belongs to another shard";
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+
+    if (isMapAlreadyLoaded(*working, req.ns, req.map_name) == true)
+    {
+      res.success = false;
+      res.msg = "load_map service failed: a map with the same name is already loaded";
+      return true;
+    }
+
+    std::ifstream fin(req.map_url.c_str());
+    if (!multimap_server::UrlCache::isUrl(req.map_url) && fin.fail())
+    {
+      res.success = false;
+      res.msg = "load_map service failed: could not open %s: " + req.map_url;
+      return true;
+    }
+
+    try
+    {
+      MapPtr new_map = boost::make_shared<Map>(url_cache.loadMapDescription(req.map_url), req.ns, req.map_name,
+                                               req.global_frame);
+      addMapToRegistry(*working, new_map, req, &warning_msg);
+      publishRegistry(working);
+    }
+    catch (std::exception& e)
+    {
+      res.success = false;
+      res.msg = "load_map service failed with exception: " + std::string(e.what());
+      return true;
+    }
+
+    res.success = true;
+    res.msg = "load_map service worked succesfully for: " + std::string(req.map_url) + ". " + warning_msg;
+    return true;
+  }
+
+  bool loadMapAsyncCallback(multimap_server::LoadMapAsync::Request& req, multimap_server::LoadMapAsync::Response& res)
+  {
+    std::string map_fullname = req.ns + "/" + req.map_name;
+
+    if (isFollower())
+    {
+      res.success = false;
+      res.msg = "load_map_async service failed: this server follows " + leader_name + ", load the map there";
+      return true;
+    }
+
+    if (!ownsEnvironment(req.ns))
+    {
+      res.success = false;
+      res.msg = "load_map_async service failed: environment " + req.ns + " belongs to another shard";
+      return true;
+    }
+
+    if (isMapAlreadyLoaded(*getRegistry(), req.ns, req.map_name) == true)
+    {
+      res.success = false;
+      res.msg = "load_map_async service failed: a map with the same name is already loaded";
+      return true;
+    }
+
+    // URLs are only fetched by the load job
+    std::ifstream fin(req.map_url.c_str());
+    if (!multimap_server::UrlCache::isUrl(req.map_url) && fin.fail())
+    {
+      res.success = false;
+      res.msg = "load_map_async service failed: could not open " + req.map_url;
+      return true;
+    }
+
+    LoadJobPtr job = boost::make_shared<LoadJob>();
+    job->request.map_url = req.map_url;
+    job->request.ns = req.ns;
+    job->request.map_name = req.map_name;
+    job->request.global_frame = req.global_frame;
+    job->cancel_requested = false;
+    job->finished = false;
+
+    {
+      boost::mutex::scoped_lock lock(jobs_mutex);
+      std::map<uint32_t, LoadJobPtr>::iterator it;
+      for (it = active_jobs.begin(); it != active_jobs.end(); ++it)
+      {
+        if (it->second->request.ns + "/" + it->second->request.map_name == map_fullname)
+        {
+          res.success = false;
+          res.msg = "load_map_async service failed: a map with the same name is already being loaded by job " +
+                    boost::lexical_cast<std::string>(it->first);
+          return true;
+        }
+      }
+      job->id = next_job_id++;
+      active_jobs[job->id] = job;
+      pending_jobs.push_back(job);
+    }
+    jobs_cond.notify_one();
+
+    publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::QUEUED, "", 0.0, "");
+    res.success = true;
+    res.job_id = job->id;
+    res.msg = "load_map_async service queued " + req.map_url + " as job " + boost::lexical_cast<std::string>(job->id);
+    return true;
+  }
+
+  bool cancelLoadCallback(multimap_server::CancelLoad::Request& req, multimap_server::CancelLoad::Response& res)
+  {
+    LoadJobPtr dequeued;
+    {
+      boost::mutex::scoped_lock lock(jobs_mutex);
+      std::map<uint32_t, LoadJobPtr>::iterator it = active_jobs.find(req.job_id);
+      if (it == active_jobs.end())
+      {
+        res.success = false;
+        res.msg = "cancel_load service failed: there is no queued or running job " +
+                  boost::lexical_cast<std::string>(req.job_id);
+        return true;
+      }
+      if (it->second->finished)
+      {
+        res.success = false;
+        res.msg = "cancel_load service failed: job " + boost::lexical_cast<std::string>(req.job_id) +
+                  " has already finished";
+        return true;
+      }
+      // A running job notices the flag at its next progress check
+      it->second->cancel_requested = true;
+
+      std::deque<LoadJobPtr>::iterator queued = std::find(pending_jobs.begin(), pending_jobs.end(), it->second);
+      if (queued != pending_jobs.end())
+      {
+        dequeued = *queued;
+        pending_jobs.erase(queued);
+        active_jobs.erase(it);
+      }
+    }
+
+    if (dequeued)
+    {
+      publishLoadProgress(load_progress_pub, *dequeued, multimap_server::LoadProgress::CANCELLED, "", 0.0,
+                          "Cancelled before it started");
+    }
+    res.success = true;
+    res.msg = "Job " + boost::lexical_cast<std::string>(req.job_id) + " cancelled";
+    return true;
+  }
+
+  void loadWorker(int niceness)
+  {
+    lowerThreadPriority(niceness);
+
+    while (true)
+    {
+      LoadJobPtr job;
+      {
+        boost::mutex::scoped_lock lock(jobs_mutex);
+        while (!stopping_load_workers && pending_jobs.empty())
+        {
+          jobs_cond.wait(lock);
+        }
+        if (stopping_load_workers)
+        {
+          return;
+        }
+        job = pending_jobs.front();
+        pending_jobs.pop_front();
+      }
+
+      runLoadJob(job);
+
+      boost::mutex::scoped_lock lock(jobs_mutex);
+      active_jobs.erase(job->id);
+    }
+  }
+
+  /** Load the map of a job outside of any lock, then register it in a single registry update */
+  void runLoadJob(const LoadJobPtr& job)
+  {
+    const multimap_server_msgs::LoadMap::Request& req = job->request;
+    publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::RUNNING, "", 0.0, "");
+
+    MapPtr new_map;
+    try
+    {
+      LoadJobMonitor monitor(job, load_progress_pub, boost::bind(&MultimapServer::announceMap, this, req));
+      new_map = boost::make_shared<Map>(url_cache.loadMapDescription(req.map_url), req.ns, req.map_name,
+                                        req.global_frame, &monitor);
+    }
+    catch (multimap_server::LoadCancelled& e)
+    {
+      withdrawMap(req);
+      publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::CANCELLED, "", 0.0, e.what());
+      return;
+    }
+    catch (std::exception& e)
+    {
+      bool cancelled = !finishJob(job);
+      withdrawMap(req);
+      if (cancelled)
+      {
+        publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::CANCELLED, "", 0.0, e.what());
+        return;
+      }
+      publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::FAILED, "", 0.0,
+                          "load_map_async failed with exception: " + std::string(e.what()));
+      return;
+    }
+
+    std::string warning_msg = "";
+    {
+      boost::mutex::scoped_lock lock(mutation_mutex);
+      // Past this point a cancel_load call reports the job as finished
+      if (!finishJob(job))
+      {
+        boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+        removeAnnouncement(*working, req);
+        publishRegistry(working);
+        publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::CANCELLED, "", 0.0,
+                            "Cancelled before registration");
+        return;
+      }
+
+      boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+      if (isMapAlreadyLoaded(*working, req.ns, req.map_name) == true)
+      {
+        publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::FAILED, "", 0.0,
+                            "load_map_async failed: a map with the same name was loaded in the meantime");
+        return;
+      }
+      addMapToRegistry(*working, new_map, req, &warning_msg);
+      publishRegistry(working);
+    }
+
+    publishLoadProgress(load_progress_pub, *job, multimap_server::LoadProgress::SUCCEEDED, "", 100.0,
+                        "load_map_async worked succesfully for: " + req.map_url + ". " + warning_msg);
+  }
+
+  /** Mark a job as finished, so that it can no longer be cancelled
+   * @return false if it was cancelled first */
+  bool finishJob(const LoadJobPtr& job)
+  {
+    boost::mutex::scoped_lock lock(jobs_mutex);
+    if (job->cancel_requested)
+    {
+      return false;
+    }
+    job->finished = true;
+    return true;
+  }
+
+  /** List a map being loaded by load_map_async in its environment as soon as its extents are known, ahead of the
+   * decode. Its map_metadata topic is already up at that point */
+  void announceMap(const multimap_server_msgs::LoadMap::Request& req)
+  {
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+    if (isMapAlreadyLoaded(*working, req.ns, req.map_name) == true)
+    {
+      // The load will fail anyway
+      return;
+    }
+    std::string warning_msg;
+    addToEnvironment(*working, req, &warning_msg);
+    publishRegistry(working);
+    environments_pub.publish(working->environments);
+  }
+
+  /** Undo announceMap() for a load that did not succeed */
+  void withdrawMap(const multimap_server_msgs::LoadMap::Request& req)
+  {
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+    removeAnnouncement(*working, req);
+    publishRegistry(working);
+  }
+
+  /** Must be called with mutation_mutex held */
+  void removeAnnouncement(MapRegistry& working, const multimap_server_msgs::LoadMap::Request& req)
+  {
+    if (isMapAlreadyLoaded(working, req.ns, req.map_name) == true)
+    {
+      // Listed for another map of the same name
+      return;
+    }
+    std::vector<multimap_server_msgs::Environment>::iterator env;
+    for (env = working.environments.environments.begin(); env != working.environments.environments.end(); ++env)
+    {
+      if (env->name == req.ns)
+      {
+        env->map_name.erase(std::remove(env->map_name.begin(), env->map_name.end(), req.map_name), env->map_name.end());
+      }
+    }
+  }
+
+  bool loadEnvironmentsCallback(multimap_server_msgs::LoadEnvironments::Request& req,
+                                multimap_server_msgs::LoadEnvironments::Response& res)
+  {
+    if (isFollower())
+    {
+      res.success = false;
+      res.msg = "load_environments service failed: this server follows " + leader_name + ", load them there";
+      return true;
+    }
+
+    std::string msg;
+    if (true == loadEnvironmentsFromYAML(req.environments_url, &msg))
+    {
+      res.success = true;
+      res.msg = "Environments loaded using file " + req.environments_url;
+    }
+    else
+    {
+      res.success = false;
+      res.msg = "Multimap_server could not open " + req.environments_url + ": " + msg;
+    }
+    return true;
+  }
+
+  /** Set cells of a loaded map. The map stays in the registry: only its content is replaced, and announced as a
+   * RELOAD on map_changes so that followers and multiplexed subscribers get the new version */
+  bool editMapCallback(multimap_server::EditMap::Request& req, multimap_server::EditMap::Response& res)
+  {
+    if (isFollower())
+    {
+      res.success = false;
+      res.msg = "edit_map service failed: this server follows " + leader_name + ", edit the map there";
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    MapPtr map = findMap(*getRegistry(), req.ns, req.map_name);
+    if (!map)
+    {
+      res.success = false;
+      res.msg = "edit_map service failed: There is no map loaded under the name " + req.ns + "/" + req.map_name;
+      return true;
+    }
+
+    std::string msg;
+    if (!map->edit(req, &msg))
+    {
+      res.success = false;
+      res.msg = "edit_map service failed: " + msg;
+      return true;
+    }
+
+    publishContentChange(map);
+    res.success = true;
+    res.hash = map->getContentHash();
+    res.msg = "Map " + map->getMapFullName() + " edited";
+    return true;
+  }
+
+  bool reloadLayerCallback(multimap_server::ReloadLayer::Request& req, multimap_server::ReloadLayer::Response& res)
+  {
+    if (isFollower())
+    {
+      res.success = false;
+      res.msg = "reload_layer service failed: this server follows " + leader_name + ", reload the layer there";
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    MapPtr map = findMap(*getRegistry(), req.ns, req.map_name);
+    if (!map)
+    {
+      res.success = false;
+      res.msg = "reload_layer service failed: There is no map loaded under the name " + req.ns + "/" + req.map_name;
+      return true;
+    }
+
+    bool changed = false;
+    std::string msg;
+    if (!map->reloadLayer(req.layer, &changed, &msg))
+    {
+      res.success = false;
+      res.msg = "reload_layer service failed: " + msg;
+      return true;
+    }
+
+    if (changed)
+    {
+      publishContentChange(map);
+    }
+    res.success = true;
+    res.hash = map->getContentHash();
+    res.msg = "Layer " + req.layer + " of map " + map->getMapFullName() + (changed ? " reloaded" : " is unchanged");
+    return true;
+  }
+
+  bool diffMapsCallback(multimap_server::DiffMaps::Request& req, multimap_server::DiffMaps::Response& res)
+  {
+    res.success = false;
+    MapRegistryConstPtr current = getRegistry();
+    MapPtr map_a = findMap(*current, req.ns_a, req.map_name_a);
+    MapPtr map_b = findMap(*current, req.ns_b, req.map_name_b);
+    if (!map_a || !map_b)
+    {
+      std::string missing = !map_a ? req.ns_a + "/" + req.map_name_a : req.ns_b + "/" + req.map_name_b;
+      res.msg = "diff_maps service failed: There is no map loaded under the name " + missing;
+      return true;
+    }
+    if (map_a->getFrameId() != map_b->getFrameId())
+    {
+      res.msg = "diff_maps service failed: the maps are in different frames, " + map_a->getFrameId() + " and " +
+                map_b->getFrameId();
+      return true;
+    }
+
+    // Both maps must lie on the same lattice of cells, which is then the one of map a
+    const nav_msgs::MapMetaData& info_a = map_a->getInfo();
+    const nav_msgs::MapMetaData& info_b = map_b->getInfo();
+    double yaw_a = quaternionYaw(info_a.origin.orientation);
+    double yaw_b = quaternionYaw(info_b.origin.orientation);
+    double cos_yaw = cos(yaw_a);
+    double sin_yaw = sin(yaw_a);
+    double resolution = info_a.resolution;
+    double dx = info_b.origin.position.x - info_a.origin.position.x;
+    double dy = info_b.origin.position.y - info_a.origin.position.y;
+    double cells_x = (cos_yaw * dx + sin_yaw * dy) / resolution;
+    double cells_y = (-sin_yaw * dx + cos_yaw * dy) / resolution;
+    // Maps far apart would be compared over a huge grid, whose size must be checked before it is converted
+    double span_x = std::max<double>(info_a.width, cells_x + info_b.width) - std::min(0.0, cells_x);
+    double span_y = std::max<double>(info_a.height, cells_y + info_b.height) - std::min(0.0, cells_y);
+    if (!(span_x * span_y <= MAX_DERIVED_CELLS))
+    {
+      res.msg = "diff_maps service failed: the maps are too far apart, the area they cover together would have " +
+                boost::lexical_cast<std::string>(ceil(span_x)) + " X " +
+                boost::lexical_cast<std::string>(ceil(span_y)) + " cells";
+      return true;
+    }
+    long offset_x = lround(cells_x);
+    long offset_y = lround(cells_y);
+    if (fabs(resolution - info_b.resolution) > 1e-6 * resolution || fabs(remainder(yaw_a - yaw_b, 2.0 * M_PI)) > 1e-6 ||
+        fabs(cells_x - offset_x) > 1e-3 || fabs(cells_y - offset_y) > 1e-3)
+    {
+      res.msg = "diff_maps service failed: the cells of the maps don't line up, they must have the same resolution "
+                "and orientation, and origins a whole number of cells apart";
+      return true;
+    }
+
+    MapContentConstPtr version_a, version_b;
+    try
+    {
+      version_a = map_a->getVersion(req.version_a);
+      version_b = map_b->getVersion(req.version_b);
+    }
+    catch (std::runtime_error& e)
+    {
+      res.msg = "diff_maps service failed: " + std::string(e.what());
+      return true;
+    }
+    if (!version_a || !version_b)
+    {
+      res.msg = "diff_maps service failed: version " +
+                boost::lexical_cast<std::string>(!version_a ? req.version_a : req.version_b) + " of map " +
+                (!version_a ? map_a : map_b)->getMapFullName() + " is not known, only the " +
+                boost::lexical_cast<std::string>(pn.param("version_history", 4)) + " previous versions are kept";
+      return true;
+    }
+
+    // Cells of the area covered by both maps, relative to cell (0, 0) of map a
+    long min_x = std::min(0L, offset_x);
+    long min_y = std::min(0L, offset_y);
+    unsigned int width = std::max<long>(info_a.width, offset_x + info_b.width) - min_x;
+    unsigned int height = std::max<long>(info_a.height, offset_y + info_b.height) - min_y;
+    multimap_server::TiledGrid grid_a = version_a->grid;
+    multimap_server::TiledGrid grid_b = version_b->grid;
+    if (offset_x != 0 || offset_y != 0 || info_a.width != info_b.width || info_a.height != info_b.height)
+    {
+      grid_a = multimap_server::placeGrid(version_a->grid, width, height, -min_x, -min_y);
+      grid_b = multimap_server::placeGrid(version_b->grid, width, height, offset_x - min_x, offset_y - min_y);
+    }
+
+    multimap_server::GridDiff diff =
+        multimap_server::diffGrids(grid_a, grid_b, req.occupied_threshold > 0 ? req.occupied_threshold : 50,
+                                   req.return_diff, workerThreads("diff_threads"));
+
+    res.success = true;
+    res.version_a = version_a->hash;
+    res.version_b = version_b->hash;
+    res.changed_cells = diff.changed_cells;
+    for (int from = 0; from < multimap_server::CELL_CLASSES; from++)
+    {
+      for (int to = 0; to < multimap_server::CELL_CLASSES; to++)
+        res.transitions.push_back(diff.transitions[from][to]);
+    }
+
+    // Corners of the cells of map a, in the frame
+    for (size_t i = 0; i < diff.regions.size(); i++)
+    {
+      const multimap_server::CellBox& region = diff.regions[i];
+      double corners_x[2] = { (double)(region.min_x + min_x), (double)(region.max_x + 1 + min_x) };
+      double corners_y[2] = { (double)(region.min_y + min_y), (double)(region.max_y + 1 + min_y) };
+      double bounds[4] = { INFINITY, INFINITY, -INFINITY, -INFINITY };
+      for (int cx = 0; cx < 2; cx++)
+      {
+        for (int cy = 0; cy < 2; cy++)
+        {
+          double x = info_a.origin.position.x + (cos_yaw * corners_x[cx] - sin_yaw * corners_y[cy]) * resolution;
+          double y = info_a.origin.position.y + (sin_yaw * corners_x[cx] + cos_yaw * corners_y[cy]) * resolution;
+          bounds[0] = std::min(bounds[0], x);
+          bounds[1] = std::min(bounds[1], y);
+          bounds[2] = std::max(bounds[2], x);
+          bounds[3] = std::max(bounds[3], y);
+        }
+      }
+      res.regions.insert(res.regions.end(), bounds, bounds + 4);
+    }
+
+    if (req.return_diff)
+    {
+      res.diff.header.frame_id = map_a->getFrameId();
+      res.diff.header.stamp = ros::Time::now();
+      res.diff.info = info_a;
+      res.diff.info.width = width;
+      res.diff.info.height = height;
+      res.diff.info.origin.position.x += (cos_yaw * min_x - sin_yaw * min_y) * resolution;
+      res.diff.info.origin.position.y += (sin_yaw * min_x + cos_yaw * min_y) * resolution;
+      res.diff.data.swap(diff.mask);
+    }
+
+    res.msg = boost::lexical_cast<std::string>(diff.changed_cells) + " cells of " + map_a->getMapFullName() + " and " +
+              map_b->getMapFullName() + " differ, in " + boost::lexical_cast<std::string>(diff.regions.size()) +
+              " areas";
+    return true;
+  }
+
+  bool stitchMapsCallback(multimap_server::StitchMaps::Request& req, multimap_server::StitchMaps::Response& res)
+  {
+    res.success = false;
+    if (isFollower())
+    {
+      res.msg = "stitch_maps service failed: this server follows " + leader_name + ", stitch the maps there";
+      return true;
+    }
+    if (!ownsEnvironment(req.ns))
+    {
+      res.msg = "stitch_maps service failed: environment " + req.ns + " belongs to another shard";
+      return true;
+    }
+
+    multimap_server::MergePolicy policy;
+    try
+    {
+      policy = multimap_server::parseMergePolicy(req.merge_policy.empty() ? "max" : req.merge_policy);
+    }
+    catch (std::runtime_error& e)
+    {
+      res.msg = "stitch_maps service failed: " + std::string(e.what());
+      return true;
+    }
+
+    MapRegistryConstPtr current = getRegistry();
+    if (isMapAlreadyLoaded(*current, req.ns, req.map_name))
+    {
+      res.msg = "stitch_maps service failed: a map with the same name is already loaded";
+      return true;
+    }
+    std::vector<std::string> names = req.map_names;
+    for (size_t i = 0; names.empty() && i < current->environments.environments.size(); i++)
+    {
+      if (current->environments.environments[i].name == req.ns)
+        names = current->environments.environments[i].map_name;
+    }
+    if (names.empty())
     {
-      multimap_server_msgs::Environment new_environment;
-
-      std::string global_frame = namespace_iterator->second["global_frame"].as<std::string>();
-      YAML::Node maps = namespace_iterator->second["maps"];
-
-      new_environment.name = namespace_iterator->first.as<std::string>();
-      new_environment.global_frame = global_frame;
+      res.msg = "stitch_maps service failed: environment " + req.ns + " has no maps";
+      return true;
+    }
 
-      bool maps_loaded = true;
-      for (YAML::const_iterator maps_iterator = maps.begin(); maps_iterator != maps.end(); ++maps_iterator)
+    // The contents are held until the stitched grid is built, even if the maps are edited or dumped meanwhile
+    std::vector<MapContentConstPtr> contents;
+    std::vector<multimap_server::ResampleSource> sources;
+    std::string frame_id;
+    double finest = INFINITY;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+      MapPtr map = findMap(*current, req.ns, names[i]);
+      if (!map)
       {
-        std::string map_path = ros::package::getPath(namespace_iterator->second["maps_package"].as<std::string>()) +
-                               "/" + maps_iterator->second.as<std::string>();
-        std::string map_namespace = namespace_iterator->first.as<std::string>();
-        std::string map_name = maps_iterator->first.as<std::string>();
-        std::string map_frame = namespace_iterator->second["global_frame"].as<std::string>();
-
-        if (isMapAlreadyLoaded(map_namespace, map_name) == true)
-        {
-          *msg = "A map with the name " + map_namespace + "/" + map_name + " is already loaded";
-          ROS_WARN_STREAM(*msg);
-          maps_loaded = false;
-        }
-        else
-        {
-          try
-          {
-            Map* new_map = new Map(map_path, map_namespace, map_name, map_frame);
-            maps_vector.push_back(new_map);
-            new_environment.map_name.push_back(map_name);
-          }
-          catch (std::exception& e)
-          {
-            *msg = std::string("load_map service failed with exception: ") + e.what();
-            ROS_WARN_STREAM(*msg);
-            maps_loaded = false;
-          }
-        }
+        res.msg = "stitch_maps service failed: There is no map loaded under the name " + req.ns + "/" + names[i];
+        return true;
       }
-
-      if ( maps_loaded == true)
+      if (i > 0 && map->getFrameId() != frame_id)
       {
-        environments_vector.environments.push_back(new_environment);
+        res.msg = "stitch_maps service failed: " + map->getMapFullName() + " is in frame " + map->getFrameId() +
+                  ", not " + frame_id;
+        return true;
       }
-      else
+      frame_id = map->getFrameId();
+      try
       {
-        ROS_ERROR("Error loading maps for environment %s", new_environment.name.c_str());
-        return false;
+        contents.push_back(map->getContent());
+      }
+      catch (std::runtime_error& e)
+      {
+        res.msg = "stitch_maps service failed: " + std::string(e.what());
+        return true;
       }
+      multimap_server::ResampleSource source;
+      source.grid = &contents.back()->grid;
+      source.placement = placementOf(map->getInfo());
+      sources.push_back(source);
+      finest = std::min(finest, source.placement.resolution);
+    }
 
+    multimap_server::GridPlacement target;
+    target.resolution = req.resolution > 0.0 ? req.resolution : finest;
+    target.yaw = sources[0].placement.yaw;
+    // Maps far apart in the same frame make a huge, mostly unknown grid
+    if (!multimap_server::coverSources(sources, MAX_DERIVED_CELLS, &target))
+    {
+      res.msg = "stitch_maps service failed: the stitched map would have more than " +
+                boost::lexical_cast<std::string>(MAX_DERIVED_CELLS) + " cells";
+      return true;
     }
-    *msg = "Environments loaded successfully";
+
+    ros::WallTime start = ros::WallTime::now();
+    multimap_server::TiledGrid grid = multimap_server::resampleGrids(
+        sources, target,
+        req.conservative ? multimap_server::RESAMPLE_CONSERVATIVE : multimap_server::RESAMPLE_NEAREST, policy,
+        workerThreads("resample_threads"));
+    contents.clear();
+    ROS_INFO("Stitched %zu maps of %s into a %u X %u map in %.3f s", names.size(), req.ns.c_str(), target.width,
+             target.height, (ros::WallTime::now() - start).toSec());
+
+    MapPtr stitched;
+    if (!addDerivedMap(metaDataOf(target), grid, req.ns, req.map_name, frame_id, &stitched, &res.msg))
+    {
+      res.msg = "stitch_maps service failed: " + res.msg;
+      return true;
+    }
+    res.success = true;
+    res.hash = stitched->getContentHash();
+    res.info = stitched->getInfo();
+    res.msg = "Map " + stitched->getMapFullName() + " stitched from " + boost::lexical_cast<std::string>(names.size()) +
+              " maps";
     return true;
   }
 
-  bool loadMapCallback(multimap_server_msgs::LoadMap::Request& req, multimap_server_msgs::LoadMap::Response& res)
+  bool transformMapCallback(multimap_server::TransformMap::Request& req, multimap_server::TransformMap::Response& res)
   {
-    std::string warning_msg = "";
-
-    if (isMapAlreadyLoaded(req.ns, req.map_name) == true)
+    res.success = false;
+    if (isFollower())
     {
-      res.success = false;
-      res.msg = "load_map service failed: a map with the same name is already loaded";
+      res.msg = "transform_map service failed: this server follows " + leader_name + ", transform the map there";
+      return true;
+    }
+    if (!ownsEnvironment(req.ns))
+    {
+      res.msg = "transform_map service failed: environment " + req.ns + " belongs to another shard";
+      return true;
+    }
+    // NaN passes the checks on the size of the new map, and infinite origins make it read no cell
+    if (!std::isfinite(req.resolution) || !std::isfinite(req.origin_x) || !std::isfinite(req.origin_y) ||
+        !std::isfinite(req.yaw))
+    {
+      res.msg = "transform_map service failed: the resolution, origin and yaw must be finite numbers";
       return true;
     }
 
-    std::ifstream fin(req.map_url.c_str());
-    if (fin.fail())
+    MapRegistryConstPtr current = getRegistry();
+    MapPtr map = findMap(*current, req.ns, req.map_name);
+    if (!map)
     {
-      res.success = false;
-      res.msg = "load_map service failed: could not open %s: " + req.map_url;
+      res.msg = "transform_map service failed: There is no map loaded under the name " + req.ns + "/" + req.map_name;
+      return true;
+    }
+    if (isMapAlreadyLoaded(*current, req.ns, req.new_map_name))
+    {
+      res.msg = "transform_map service failed: a map with the same name is already loaded";
       return true;
     }
 
+    MapContentConstPtr content;
     try
     {
-      Map* new_map = new Map(req.map_url, req.ns, req.map_name, req.global_frame);
-      maps_vector.push_back(new_map);
+      content = map->getContent();
+    }
+    catch (std::runtime_error& e)
+    {
+      res.msg = "transform_map service failed: " + std::string(e.what());
+      return true;
+    }
+    std::vector<multimap_server::ResampleSource> sources(1);
+    sources[0].grid = &content->grid;
+    sources[0].placement = placementOf(map->getInfo());
 
-      bool env_exists = false;
-      std::vector<multimap_server_msgs::Environment>::iterator it;
-      for (it = environments_vector.environments.begin(); it != environments_vector.environments.end(); ++it)
-      {
-        if (it->name == req.ns)
-        {
-          it->map_name.push_back(req.map_name);
-          env_exists = true;
-          if (req.global_frame != "" && req.global_frame != it->global_frame)
-          {
-            warning_msg = "WARNING: You specified a global_frame, but the environment already exists with a different "
-                          "global_frame. Ignoring the input value.";
-            ROS_WARN("%s", warning_msg.c_str());
-          }
-        }
-      }
-      if (false == env_exists)
+    multimap_server::GridPlacement target;
+    target.resolution = req.resolution > 0.0 ? req.resolution : sources[0].placement.resolution;
+    target.yaw = req.yaw;
+    target.origin_x = req.origin_x;
+    target.origin_y = req.origin_y;
+    target.width = req.width;
+    target.height = req.height;
+    if (req.width == 0 || req.height == 0)
+    {
+      // Extend the map from the new origin up to the far side of the source, along the new axes
+      multimap_server::GridPlacement cover = target;
+      if (!multimap_server::coverSources(sources, MAX_DERIVED_CELLS, &cover))
       {
-        multimap_server_msgs::Environment new_environment;
-        new_environment.name = req.ns;
-        new_environment.global_frame = req.global_frame;
-        new_environment.map_name.push_back(req.map_name);
-        environments_vector.environments.push_back(new_environment);
+        res.msg = "transform_map service failed: " + map->getMapFullName() + " would span more than " +
+                  boost::lexical_cast<std::string>(MAX_DERIVED_CELLS) + " cells at the new resolution";
+        return true;
       }
+      double c = cos(target.yaw);
+      double s = sin(target.yaw);
+      double fx = cover.origin_x + (c * cover.width - s * cover.height) * cover.resolution - target.origin_x;
+      double fy = cover.origin_y + (s * cover.width + c * cover.height) * cover.resolution - target.origin_y;
+      double far_u = (c * fx + s * fy) / target.resolution;
+      double far_v = (-s * fx + c * fy) / target.resolution;
+      if (req.width == 0)
+        target.width = far_u > 0.0 ? std::min<double>(ceil(far_u - 1e-6), MAX_DERIVED_CELLS + 1.0) : 0;
+      if (req.height == 0)
+        target.height = far_v > 0.0 ? std::min<double>(ceil(far_v - 1e-6), MAX_DERIVED_CELLS + 1.0) : 0;
     }
-    catch (std::exception& e)
+    if (target.width == 0 || target.height == 0)
     {
-      res.success = false;
-      res.msg = "load_map service failed with exception: " + std::string(e.what());
+      res.msg = "transform_map service failed: " + map->getMapFullName() + " lies behind the new origin";
       return true;
     }
+    if ((uint64_t)target.width * target.height > MAX_DERIVED_CELLS)
+    {
+      res.msg = "transform_map service failed: the new map would have " +
+                boost::lexical_cast<std::string>(target.width) + " X " +
+                boost::lexical_cast<std::string>(target.height) + " cells";
+      return true;
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    multimap_server::TiledGrid grid = multimap_server::resampleGrids(
+        sources, target,
+        req.conservative ? multimap_server::RESAMPLE_CONSERVATIVE : multimap_server::RESAMPLE_NEAREST,
+        multimap_server::MERGE_FIRST, workerThreads("resample_threads"));
+    content.reset();
+    ROS_INFO("Transformed map %s into a %u X %u map in %.3f s", map->getMapFullName().c_str(), target.width,
+             target.height, (ros::WallTime::now() - start).toSec());
 
+    MapPtr transformed;
+    if (!addDerivedMap(metaDataOf(target), grid, req.ns, req.new_map_name, map->getFrameId(), &transformed,
+                       &res.msg))
+    {
+      res.msg = "transform_map service failed: " + res.msg;
+      return true;
+    }
     res.success = true;
-    res.msg = "load_map service worked succesfully for: " + std::string(req.map_url) + ". " + warning_msg;
+    res.hash = transformed->getContentHash();
+    res.info = transformed->getInfo();
+    res.msg = "Map " + transformed->getMapFullName() + " transformed from " + map->getMapFullName();
     return true;
   }
 
-  bool loadEnvironmentsCallback(multimap_server_msgs::LoadEnvironments::Request& req,
-                                multimap_server_msgs::LoadEnvironments::Response& res)
+  /** Register a map computed from other maps, as load_map registers the maps it loads
+   * @return false if a map with the same name was loaded meanwhile */
+  bool addDerivedMap(const nav_msgs::MapMetaData& info, const multimap_server::TiledGrid& grid, const std::string& ns,
+                     const std::string& map_name, const std::string& frame_id, MapPtr* map, std::string* msg)
   {
-    std::string msg;
-    if (true == loadEnvironmentsFromYAML(req.environments_url, &msg))
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+    if (isMapAlreadyLoaded(*working, ns, map_name))
     {
-      res.success = true;
-      res.msg = "Environments loaded using file " + req.environments_url;
-    }
-    else
-    {
-      res.success = false;
-      res.msg = "Multimap_server could not open " + req.environments_url + ": " + msg;
+      *msg = "a map with the same name is already loaded";
+      return false;
     }
+
+    multimap_server_msgs::LoadMap::Request req;
+    req.ns = ns;
+    req.map_name = map_name;
+    req.global_frame = frame_id;
+    *map = boost::make_shared<Map>(info, grid, ns, map_name, frame_id);
+    std::string warning_msg;
+    addMapToRegistry(*working, *map, req, &warning_msg);
+    publishRegistry(working);
     return true;
   }
 
+  /** Value of a thread count parameter, 0 meaning one per core */
+  unsigned int workerThreads(const std::string& param)
+  {
+    int threads = pn.param(param, 0);
+    return threads > 0 ? threads : std::max(1u, boost::thread::hardware_concurrency());
+  }
+
   bool dumpMapCallback(multimap_server_msgs::DumpMap::Request& req, multimap_server_msgs::DumpMap::Response& res)
   {
     bool map_deleted = false;
@@ -466,20 +3454,36 @@ private:
 
     std::string map_fullname = req.ns + "/" + req.map_name;
 
-    if (isMapAlreadyLoaded(req.ns, req.map_name) == true)
+    if (isFollower())
+    {
+      res.success = false;
+      res.msg = "dump_map service failed: this server follows " + leader_name + ", dump the map there";
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+
+    if (isMapAlreadyLoaded(*working, req.ns, req.map_name) == true)
     {
-      std::vector<Map*>::iterator it;
-      for (it = maps_vector.begin(); it != maps_vector.end(); ++it)
+      std::vector<MapPtr>::iterator it;
+      for (it = working->maps.begin(); it != working->maps.end();)
       {
         if ((*it)->getMapFullName() == map_fullname)
         {
-          delete *it;
-          it = maps_vector.erase(it);
+          // The Map itself is released once the last snapshot referencing it goes away
+          (*it)->shutdown();
+          it = working->maps.erase(it);
           map_deleted = true;
         }
+        else
+        {
+          ++it;
+        }
       }
+      bool environment_empty = false;
       std::vector<multimap_server_msgs::Environment>::iterator it2;
-      for (it2 = environments_vector.environments.begin(); it2 != environments_vector.environments.end(); ++it2)
+      for (it2 = working->environments.environments.begin(); it2 != working->environments.environments.end(); ++it2)
       {
         if (it2->name == req.ns)
         {
@@ -497,13 +3501,21 @@ private:
               ++it3;
             }
           }
+          environment_empty = it2->map_name.empty();
         }
       }
 
+      size_t released = publishRegistry(working);
+      if (environment_empty)
+      {
+        // The prefetch policy would otherwise keep warming up its neighbours
+        removeAdjacency(req.ns);
+      }
+
       if (map_deleted && map_deleted_from_env)
       {
         res.success = true;
-        res.msg = "map" + map_fullname + " removed succesfully";
+        res.msg = "map" + map_fullname + " removed succesfully, " + megabytes(released) + " released in the background";
         return true;
       }
       else
@@ -542,49 +3554,365 @@ private:
   // It dumps all the environments for now
   bool dumpEnvironmentsCallback(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res)
   {
-    std::vector<Map*>::iterator it;
-    for (it = maps_vector.begin(); it != maps_vector.end(); ++it)
+    if (isFollower())
+    {
+      res.success = false;
+      res.message = "dump_environments service failed: this server follows " + leader_name + ", dump them there";
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    MapRegistryConstPtr current = getRegistry();
+
+    std::vector<MapPtr>::const_iterator it;
+    for (it = current->maps.begin(); it != current->maps.end(); ++it)
+    {
+      (*it)->shutdown();
+    }
+    // The reclaimer must hold the last references, so that the maps are not destroyed in this call
+    current.reset();
+    size_t released = publishRegistry(boost::make_shared<MapRegistry>());
+    {
+      // The prefetch policy would otherwise keep warming up the neighbours of the dumped environments
+      boost::mutex::scoped_lock prefetch_lock(prefetch_mutex);
+      environment_adjacency.clear();
+    }
+
+    res.success = true;
+    res.message = "All environments dumped succesfully, " + megabytes(released) + " released in the background";
+    return true;
+  }
+
+  /** Conditional retrieval of a map, used by multimap_client: the grid is only sent when the caller does not have
+   * it already. Served from the registry snapshot, without locking */
+  bool fetchMapCallback(multimap_server::FetchMap::Request& req, multimap_server::FetchMap::Response& res)
+  {
+    MapPtr map = findMap(*getRegistry(), req.ns, req.map_name);
+    if (!map)
     {
-      delete *it;
+      res.success = false;
+      res.msg = "fetch_map service failed: There is no map loaded under the name " + req.ns + "/" + req.map_name;
+      return true;
+    }
+
+    res.success = true;
+    res.hash = map->getContentHash();
+    res.not_modified = (req.known_hash == res.hash);
+    if (!res.not_modified)
+    {
+      // Hash and cells of the same version, which also restores an evicted map
+      MapContentConstPtr content = map->getContent();
+      res.hash = content->hash;
+      res.not_modified = (req.known_hash == res.hash);
+      if (!res.not_modified)
+      {
+        map->toMessage(*content, &res.map);
+      }
+    }
+    return true;
+  }
+
+  /** Follower mode: replicate the maps of the leader instead of loading them from their images. Grids are fetched
+   * through multimap_client, whose disk cache keeps them in environment pack format, so a restarted follower only
+   * transfers the maps that changed in the meantime */
+  void startFollowing()
+  {
+    std::string cache_dir = pn.param("follower_cache_dir", multimap_server::MultimapClient::defaultCacheDir());
+    // The registry holds the maps, the client does not need to keep another copy in memory
+    leader_client = boost::make_shared<multimap_server::MultimapClient>(leader_name, cache_dir, false);
+
+    // Fetching a map can take a while, so replication runs on the administrative queue
+    leader_changes_sub =
+        admin_pn.subscribe(leader_name + "/map_changes", 1000, &MultimapServer::leaderChangeCallback, this);
+    leader_environments_sub = admin_pn.subscribe(leader_name + "/environments_snapshot", 1,
+                                                 &MultimapServer::leaderEnvironmentsCallback, this);
+    ROS_INFO("Following %s", leader_name.c_str());
+  }
+
+  bool isFollower() const
+  {
+    return !leader_name.empty();
+  }
+
+  /** Apply a change of the leader. Changes are applied as they come, a gap in their sequence numbers triggers a
+   * full comparison with the next environments message of the leader */
+  void leaderChangeCallback(const multimap_server::MapChange::ConstPtr& change)
+  {
+    boost::mutex::scoped_lock lock(mutation_mutex);
+
+    if (change->session != leader_session)
+    {
+      if (leader_session != 0)
+      {
+        ROS_WARN("%s restarted, resynchronizing", leader_name.c_str());
+      }
+      leader_session = change->session;
+      leader_resync_needed = true;
+    }
+    else if (change->sequence <= leader_sequence)
+    {
+      // Already part of the last snapshot applied
+      return;
+    }
+    else if (leader_sequence != 0 && change->sequence != leader_sequence + 1)
+    {
+      ROS_WARN("Missed changes of %s before change %lu, resynchronizing", leader_name.c_str(),
+               (unsigned long)change->sequence);
+      leader_resync_needed = true;
+    }
+    leader_sequence = change->sequence;
+
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+    if (change->operation == multimap_server::MapChange::DUMP)
+    {
+      removeMapFromRegistry(*working, change->ns, change->map_name);
+    }
+    else
+    {
+      replicateMap(*working, change->ns, change->map_name, change->global_frame, change->hash);
+    }
+    publishRegistry(working);
+  }
+
+  /** Bring the maps in line with the environments of the leader: missing maps are fetched, and maps the leader does
+   * not serve anymore are dumped. Only done on start up and after missed changes, with a snapshot that includes every
+   * change applied so far, so that a snapshot overtaken by a change never undoes it */
+  void leaderEnvironmentsCallback(const multimap_server::EnvironmentsSnapshot::ConstPtr& snapshot)
+  {
+    boost::mutex::scoped_lock lock(mutation_mutex);
+    if (!leader_resync_needed)
+    {
+      return;
+    }
+    if (snapshot->session != leader_session)
+    {
+      // The leader restarted: none of the changes applied so far belong to its session
+      leader_session = snapshot->session;
+      leader_sequence = 0;
+    }
+    else if (snapshot->sequence < leader_sequence)
+    {
+      return;
+    }
+    const multimap_server_msgs::Environments* leader_environments = &snapshot->environments;
+
+    boost::shared_ptr<MapRegistry> working = boost::make_shared<MapRegistry>(*getRegistry());
+    bool complete = true;
+    std::set<std::string> leader_maps;
+    std::vector<multimap_server_msgs::Environment>::const_iterator env;
+    for (env = leader_environments->environments.begin(); env != leader_environments->environments.end(); ++env)
+    {
+      std::vector<std::string>::const_iterator name;
+      for (name = env->map_name.begin(); name != env->map_name.end(); ++name)
+      {
+        leader_maps.insert(env->name + "/" + *name);
+        // The hash is unknown here: the map is fetched conditionally, with the hash of the local copy
+        if (!replicateMap(*working, env->name, *name, env->global_frame, 0))
+        {
+          complete = false;
+        }
+      }
+    }
+
+    std::vector<MapPtr> stale;
+    std::vector<MapPtr>::const_iterator it;
+    for (it = working->maps.begin(); it != working->maps.end(); ++it)
+    {
+      if (leader_maps.count((*it)->getMapFullName()) == 0)
+      {
+        stale.push_back(*it);
+      }
+    }
+    for (it = stale.begin(); it != stale.end(); ++it)
+    {
+      removeMapFromRegistry(*working, (*it)->getNamespace(), (*it)->getName());
+    }
+    stale.clear();
+
+    publishRegistry(working);
+    // Changes up to the snapshot are included, later ones still apply
+    leader_sequence = snapshot->sequence;
+    leader_resync_needed = !complete;
+    ROS_INFO("Replicated %lu maps from %s%s", (unsigned long)working->maps.size(), leader_name.c_str(),
+             complete ? "" : ", some of them failed and will be retried");
+  }
+
+  /** Make the working registry hold the leader's current version of a map. Must be called with mutation_mutex held
+   *
+   * @param hash Content hash announced by the leader, 0 if unknown
+   * @return false if the map could not be fetched
+   */
+  bool replicateMap(MapRegistry& working, const std::string& ns, const std::string& map_name,
+                    const std::string& global_frame, uint64_t hash)
+  {
+    MapPtr local = findMap(working, ns, map_name);
+    if (local && hash != 0 && local->getContentHash() == hash)
+    {
+      return true;
+    }
+
+    try
+    {
+      nav_msgs::OccupancyGridConstPtr grid = leader_client->getMap(ns, map_name);
+      uint64_t fetched_hash = leader_client->getMapHash(ns, map_name);
+      if (local && local->getContentHash() == fetched_hash)
+      {
+        return true;
+      }
+
+      MapPtr new_map = boost::make_shared<Map>(*grid, ns, map_name, fetched_hash);
+      if (local)
+      {
+        removeMapFromRegistry(working, ns, map_name);
+      }
+
+      multimap_server_msgs::LoadMap::Request req;
+      req.ns = ns;
+      req.map_name = map_name;
+      req.global_frame = global_frame;
+      std::string warning_msg;
+      addMapToRegistry(working, new_map, req, &warning_msg);
+    }
+    catch (std::exception& e)
+    {
+      ROS_WARN("Could not replicate map %s/%s from %s: %s", ns.c_str(), map_name.c_str(), leader_name.c_str(),
+               e.what());
+      return false;
+    }
+    return true;
+  }
+
+  /** Stop serving a map and remove it from the working registry. Its environment is kept, even if it becomes empty,
+   * as dump_map does. Must be called with mutation_mutex held */
+  void removeMapFromRegistry(MapRegistry& working, const std::string& ns, const std::string& map_name)
+  {
+    std::string map_fullname = ns + "/" + map_name;
+    std::vector<MapPtr>::iterator it;
+    for (it = working.maps.begin(); it != working.maps.end();)
+    {
+      if ((*it)->getMapFullName() == map_fullname)
+      {
+        (*it)->shutdown();
+        it = working.maps.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    std::vector<multimap_server_msgs::Environment>::iterator env;
+    for (env = working.environments.environments.begin(); env != working.environments.environments.end(); ++env)
+    {
+      if (env->name == ns)
+      {
+        env->map_name.erase(std::remove(env->map_name.begin(), env->map_name.end(), map_name), env->map_name.end());
+      }
+    }
+  }
+
+  /** First step of a chunked transfer. Served from the registry snapshot, without locking */
+  bool getMapManifestCallback(multimap_server::GetMapManifest::Request& req,
+                              multimap_server::GetMapManifest::Response& res)
+  {
+    MapPtr map = findMap(*getRegistry(), req.ns, req.map_name);
+    if (!map)
+    {
+      res.success = false;
+      res.msg = "get_map_manifest service failed: There is no map loaded under the name " + req.ns + "/" +
+                req.map_name;
+      return true;
+    }
+
+    MapContentConstPtr content = map->getContent();
+    uint32_t max_cells = req.max_chunk_cells != 0 ? req.max_chunk_cells : stream_chunk_size;
+    res.success = true;
+    res.version = content->hash;
+    res.frame_id = map->getFrameId();
+    res.info = map->getInfo();
+    res.band_rows = multimap_server::bandRows(res.info.width, max_cells);
+    res.checksums = content->bandChecksums(res.band_rows);
+    return true;
+  }
+
+  bool getMapChunkCallback(multimap_server::GetMapChunk::Request& req, multimap_server::GetMapChunk::Response& res)
+  {
+    MapPtr map = findMap(*getRegistry(), req.ns, req.map_name);
+    MapContentConstPtr content = map ? map->getContent() : MapContentConstPtr();
+    if (!map || content->hash != req.version)
+    {
+      res.success = false;
+      res.msg = "get_map_chunk service failed: map " + req.ns + "/" + req.map_name +
+                (map ? " changed since the manifest was requested" : " is not loaded");
+      return true;
     }
-    maps_vector.clear();
 
-    environments_vector.environments.clear();
+    const nav_msgs::MapMetaData& info = map->getInfo();
+    if (req.band_rows == 0 || req.chunk_index >= multimap_server::bandCount(info.height, req.band_rows))
+    {
+      res.success = false;
+      res.msg = "get_map_chunk service failed: there is no chunk " + boost::lexical_cast<std::string>(req.chunk_index);
+      return true;
+    }
 
     res.success = true;
-    res.message = "All environments dumped succesfully";
+    res.first_row = req.chunk_index * req.band_rows;
+    res.rows = std::min(req.band_rows, info.height - res.first_row);
+    res.data.resize((size_t)res.rows * info.width);
+    content->grid.copyRows(res.first_row, res.rows, res.data.empty() ? NULL : &res.data[0]);
     return true;
   }
 
-  bool isMapAlreadyLoaded(std::string ns, std::string map_name)
+  bool ownsEnvironment(const std::string& ns)
+  {
+    return !shard_ring || (int)shard_ring->shardFor(ns) == shard_index;
+  }
+
+  MapPtr findMap(const MapRegistry& reg, const std::string& ns, const std::string& map_name)
   {
     std::string map_fullname = ns + "/" + map_name;
-    std::vector<Map*>::iterator it;
-    for (it = maps_vector.begin(); it != maps_vector.end(); ++it)
+    std::vector<MapPtr>::const_iterator it;
+    for (it = reg.maps.begin(); it != reg.maps.end(); ++it)
     {
       if ((*it)->getMapFullName() == map_fullname)
       {
-        return true;
+        return *it;
       }
     }
-    return false;
+    return MapPtr();
+  }
+
+  bool isMapAlreadyLoaded(const MapRegistry& reg, std::string ns, std::string map_name)
+  {
+    return findMap(reg, ns, map_name) != MapPtr();
   }
+
 };
 
 int main(int argc, char** argv)
 {
   ros::init(argc, argv, "multimap_server", ros::init_options::AnonymousName);
-  if (argc != 2)
+  // Followers replicate their maps from the leader and need no environments file
+  if (argc > 2 || (argc < 2 && !ros::NodeHandle("~").hasParam("leader")))
   {
     ROS_ERROR("%s", USAGE);
     exit(-1);
   }
-  std::string fname(argv[1]);
+  std::string fname(argc == 2 ? argv[1] : "");
+
+  // Service callbacks run on a pool of threads, so a long load_environments call does not hold back static_map
+  // requests or the environments timer. 0 means one thread per core
+  int spinner_threads;
+  ros::NodeHandle("~").param("spinner_threads", spinner_threads, 0);
+  ros::AsyncSpinner spinner(spinner_threads);
 
   try
   {
+    // The callbacks only start once the server is fully built
     MultimapServer ms(fname);
-    ros::spin();
+    spinner.start();
+    ros::waitForShutdown();
+    spinner.stop();
   }
   catch (std::runtime_error& e)
   {
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parsing of the map .yaml files.
+ */
+
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <stdexcept>
+
+#include "ros/console.h"
+#include "yaml-cpp/yaml.h"
+
+#include "multimap_server/map_description.h"
+
+#ifdef HAVE_YAMLCPP_GT_0_5_0
+// The >> operator disappeared in yaml-cpp 0.5, so this function is
+// added to provide support for code written under the yaml-cpp 0.3 API.
+template <typename T>
+void operator>>(const YAML::Node& node, T& i)
+{
+  i = node.as<T>();
+}
+#endif
+
+namespace multimap_server
+{
+namespace
+{
+/** Resolve an image path of the .yaml file fname, which is a path or a URL */
+std::string imagePath(const std::string& fname, const std::string& image)
+{
+  if (image[0] == '/' || image.find("://") != std::string::npos)
+  {
+    return image;
+  }
+  if (fname.find("://") != std::string::npos)
+  {
+    return fname.substr(0, fname.rfind('/') + 1) + image;
+  }
+  // dirname can modify what you pass it
+  char* fname_copy = strdup(fname.c_str());
+  std::string path = std::string(dirname(fname_copy)) + '/' + image;
+  free(fname_copy);
+  return path;
+}
+
+/** Read an optional tag of node into value, which is left as is if the tag is missing */
+template <typename T>
+void readOptional(const YAML::Node& node, const char* tag, T* value)
+{
+#ifdef HAVE_YAMLCPP_GT_0_5_0
+  if (node[tag])
+    node[tag] >> *value;
+#else
+  if (const YAML::Node* found = node.FindValue(tag))
+    *found >> *value;
+#endif
+}
+
+MapMode parseMode(const std::string& modeS)
+{
+  if (modeS == "trinary")
+    return TRINARY;
+  else if (modeS == "scale")
+    return SCALE;
+  else if (modeS == "raw")
+    return RAW;
+  throw std::runtime_error("Invalid mode tag \"" + modeS + "\".");
+}
+
+/** Parse an entry of the layers list. Thresholds, negate and mode default to
+ *  those of the map */
+LayerDescription parseLayer(const std::string& fname, const YAML::Node& node, const MapDescription& desc)
+{
+  LayerDescription layer;
+  layer.negate = desc.negate;
+  layer.occ_th = desc.occ_th;
+  layer.free_th = desc.free_th;
+  layer.mode = desc.mode;
+
+  try
+  {
+    node["name"] >> layer.name;
+    node["image"] >> layer.image;
+  }
+  catch (YAML::Exception)
+  {
+    throw std::runtime_error("A map layer does not contain a name and an image tag or they are invalid.");
+  }
+  if (layer.image.empty())
+  {
+    throw std::runtime_error("The image tag of layer " + layer.name + " cannot be an empty string.");
+  }
+  layer.image = imagePath(fname, layer.image);
+
+  std::string blend = "max";
+  readOptional(node, "blend", &blend);
+  if (blend == "max")
+    layer.blend = BLEND_MAX;
+  else if (blend == "override")
+    layer.blend = BLEND_OVERRIDE;
+  else
+    throw std::runtime_error("Invalid blend tag \"" + blend + "\" in layer " + layer.name + ".");
+
+  try
+  {
+    readOptional(node, "negate", &layer.negate);
+    readOptional(node, "occupied_thresh", &layer.occ_th);
+    readOptional(node, "free_thresh", &layer.free_th);
+    std::string modeS;
+    readOptional(node, "mode", &modeS);
+    if (!modeS.empty())
+      layer.mode = parseMode(modeS);
+  }
+  catch (YAML::Exception)
+  {
+    throw std::runtime_error("Layer " + layer.name + " has an invalid negate, threshold or mode tag.");
+  }
+  return layer;
+}
+}
+
+MapDescription loadMapDescription(const std::string& fname, const std::string& url)
+{
+  const std::string& base = url.empty() ? fname : url;
+  MapDescription desc;
+  desc.mode = TRINARY;
+
+  std::ifstream fin(fname.c_str());
+  if (fin.fail())
+  {
+    throw std::runtime_error("Multimap_server could not open " + fname + ".");
+  }
+#ifdef HAVE_YAMLCPP_GT_0_5_0
+  // The document loading process changed in yaml-cpp 0.5.
+  YAML::Node doc = YAML::Load(fin);
+#else
+  YAML::Parser parser(fin);
+  YAML::Node doc;
+  parser.GetNextDocument(doc);
+#endif
+
+  try
+  {
+    doc["resolution"] >> desc.resolution;
+  }
+  catch (YAML::InvalidScalar)
+  {
+    throw std::runtime_error("The map does not contain a resolution tag or it is invalid.");
+  }
+  try
+  {
+    doc["negate"] >> desc.negate;
+  }
+  catch (YAML::InvalidScalar)
+  {
+    throw std::runtime_error("The map does not contain a negate tag or it is invalid.");
+  }
+  try
+  {
+    doc["occupied_thresh"] >> desc.occ_th;
+  }
+  catch (YAML::InvalidScalar)
+  {
+    throw std::runtime_error("The map does not contain an occupied_thresh tag or it is invalid.");
+  }
+  try
+  {
+    doc["free_thresh"] >> desc.free_th;
+  }
+  catch (YAML::InvalidScalar)
+  {
+    throw std::runtime_error("The map does not contain a free_thresh tag or it is invalid.");
+  }
+  try
+  {
+    std::string modeS = "";
+    doc["mode"] >> modeS;
+
+    desc.mode = parseMode(modeS);
+  }
+  catch (YAML::Exception)
+  {
+    ROS_DEBUG("The map does not contain a mode tag or it is invalid... assuming Trinary");
+    desc.mode = TRINARY;
+  }
+  try
+  {
+    doc["origin"][0] >> desc.origin[0];
+    doc["origin"][1] >> desc.origin[1];
+    doc["origin"][2] >> desc.origin[2];
+  }
+  catch (YAML::InvalidScalar)
+  {
+    throw std::runtime_error("The map does not contain an origin tag or it is invalid.");
+  }
+  try
+  {
+    doc["image"] >> desc.image;
+    // TODO: make this path-handling more robust
+    if (desc.image.size() == 0)
+    {
+      throw std::runtime_error("The image tag cannot be an empty string.");
+    }
+    desc.image = imagePath(base, desc.image);
+  }
+  catch (YAML::InvalidScalar)
+  {
+    throw std::runtime_error("The map does not contain an image tag or it is invalid.");
+  }
+
+#ifdef HAVE_YAMLCPP_GT_0_5_0
+  if (doc["layers"])
+  {
+    const YAML::Node& layers = doc["layers"];
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+      desc.layers.push_back(parseLayer(base, layers[i], desc));
+    }
+  }
+#else
+  if (const YAML::Node* layers = doc.FindValue("layers"))
+  {
+    for (size_t i = 0; i < layers->size(); i++)
+    {
+      desc.layers.push_back(parseLayer(base, (*layers)[i], desc));
+    }
+  }
+#endif
+
+  return desc;
+}
+
+void loadMapFromDescription(nav_msgs::GetMap::Response* resp, const MapDescription& desc, LoadMonitor* monitor)
+{
+  double origin[3] = { desc.origin[0], desc.origin[1], desc.origin[2] };
+  loadMapFromFile(resp, desc.image.c_str(), desc.resolution, desc.negate, desc.occ_th, desc.free_th, origin, desc.mode,
+                  monitor);
+}
+
+void loadLayerFromDescription(nav_msgs::GetMap::Response* resp, const MapDescription& desc,
+                              const LayerDescription& layer)
+{
+  double origin[3] = { desc.origin[0], desc.origin[1], desc.origin[2] };
+  loadMapFromFile(resp, layer.image.c_str(), desc.resolution, layer.negate, layer.occ_th, layer.free_th, origin,
+                  layer.mode);
+}
+}
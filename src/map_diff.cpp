@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Comparison of occupancy grids.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "multimap_server/map_diff.h"
+
+namespace multimap_server
+{
+namespace
+{
+const unsigned int TILE_SIZE = TiledGrid::TILE_SIZE;
+const size_t TILE_CELLS = TILE_SIZE * TILE_SIZE;
+// Tiles compared by a thread, below which starting it costs more than it saves
+const size_t MIN_TILES_PER_THREAD = 64;
+// 0 for equal cells, 1 + CELL_CLASSES * class in a + class in b otherwise
+const size_t CHANGE_CODES = 1 + CELL_CLASSES * CELL_CLASSES;
+
+// Like the layer kernels, changeCodes() is a branchless loop over plain arrays that the compiler turns into SIMD code
+// (see the compile flags of this file in CMakeLists.txt)
+void changeCodes(const int8_t* __restrict__ a, const int8_t* __restrict__ b, int8_t occupied_threshold,
+                 uint8_t* __restrict__ codes)
+{
+  for (size_t i = 0; i < TILE_CELLS; i++)
+  {
+    int8_t value_a = a[i];
+    int8_t value_b = b[i];
+    uint8_t class_a = (value_a >= 0) + (value_a >= occupied_threshold);
+    uint8_t class_b = (value_b >= 0) + (value_b >= occupied_threshold);
+    codes[i] = value_a != value_b ? 1 + CELL_CLASSES * class_a + class_b : 0;
+  }
+}
+
+/** Compare tiles [first, last). Each tile is written to by one thread only: its entry of tile_boxes and its cells
+ *  of mask */
+void diffTiles(const TiledGrid& a, const TiledGrid& b, int8_t occupied_threshold, size_t first, size_t last,
+               std::vector<CellBox>* tile_boxes, std::vector<int8_t>* mask, uint64_t* counts)
+{
+  uint64_t local_counts[CHANGE_CODES] = { 0 };
+  uint8_t codes[TILE_CELLS];
+  for (size_t tile = first; tile < last; tile++)
+  {
+    unsigned int tx = tile % a.tilesX();
+    unsigned int ty = tile / a.tilesX();
+    if (a.sharesTile(b, tx, ty) || memcmp(a.tileData(tx, ty), b.tileData(tx, ty), TILE_CELLS) == 0)
+    {
+      continue;
+    }
+    changeCodes(a.tileData(tx, ty), b.tileData(tx, ty), occupied_threshold, codes);
+
+    // Cells of edge tiles outside of the grids are -1 in both, so they never count as changed
+    CellBox cells = a.tileBox(tx, ty);
+    CellBox& changed = (*tile_boxes)[tile];
+    for (unsigned int y = cells.min_y; y <= cells.max_y; y++)
+    {
+      const uint8_t* row = codes + (y - cells.min_y) * TILE_SIZE;
+      int8_t* mask_row = mask->empty() ? NULL : &(*mask)[(size_t)y * a.width()];
+      for (unsigned int x = cells.min_x; x <= cells.max_x; x++)
+      {
+        uint8_t code = row[x - cells.min_x];
+        local_counts[code]++;
+        if (code != 0)
+        {
+          CellBox cell = { x, y, x, y };
+          growBox(&changed, cell);
+          if (mask_row)
+            mask_row[x] = 100;
+        }
+      }
+    }
+  }
+  std::copy(local_counts, local_counts + CHANGE_CODES, counts);
+}
+
+/** Group the changed tiles that touch, also diagonally, and return the bounds of the changed cells of each group */
+std::vector<CellBox> changedRegions(unsigned int tiles_x, unsigned int tiles_y, const std::vector<CellBox>& tile_boxes)
+{
+  std::vector<CellBox> regions;
+  std::vector<bool> visited(tile_boxes.size(), false);
+  std::vector<size_t> pending;
+  for (size_t seed = 0; seed < tile_boxes.size(); seed++)
+  {
+    if (visited[seed] || tile_boxes[seed].min_x > tile_boxes[seed].max_x)
+      continue;
+
+    CellBox region = { 1, 1, 0, 0 };
+    visited[seed] = true;
+    pending.push_back(seed);
+    while (!pending.empty())
+    {
+      size_t tile = pending.back();
+      pending.pop_back();
+      growBox(&region, tile_boxes[tile]);
+      unsigned int tx = tile % tiles_x;
+      unsigned int ty = tile / tiles_x;
+      for (unsigned int ny = ty > 0 ? ty - 1 : 0; ny <= std::min(ty + 1, tiles_y - 1); ny++)
+      {
+        for (unsigned int nx = tx > 0 ? tx - 1 : 0; nx <= std::min(tx + 1, tiles_x - 1); nx++)
+        {
+          size_t neighbor = (size_t)ny * tiles_x + nx;
+          if (!visited[neighbor] && tile_boxes[neighbor].min_x <= tile_boxes[neighbor].max_x)
+          {
+            visited[neighbor] = true;
+            pending.push_back(neighbor);
+          }
+        }
+      }
+    }
+    regions.push_back(region);
+  }
+  return regions;
+}
+}
+
+GridDiff diffGrids(const TiledGrid& a, const TiledGrid& b, int8_t occupied_threshold, bool with_mask,
+                   unsigned int threads)
+{
+  GridDiff diff;
+  diff.changed_cells = 0;
+  memset(diff.transitions, 0, sizeof(diff.transitions));
+  if (with_mask)
+  {
+    diff.mask.assign((size_t)a.width() * a.height(), 0);
+  }
+
+  size_t tiles = (size_t)a.tilesX() * a.tilesY();
+  CellBox empty = { 1, 1, 0, 0 };
+  std::vector<CellBox> tile_boxes(tiles, empty);
+  size_t chunks = std::max<size_t>(1, std::min<size_t>(threads, tiles / MIN_TILES_PER_THREAD));
+  std::vector<uint64_t> counts(chunks * CHANGE_CODES, 0);
+  if (chunks == 1)
+  {
+    diffTiles(a, b, occupied_threshold, 0, tiles, &tile_boxes, &diff.mask, &counts[0]);
+  }
+  else
+  {
+    boost::thread_group workers;
+    size_t per_chunk = (tiles + chunks - 1) / chunks;
+    for (size_t chunk = 0; chunk * per_chunk < tiles; chunk++)
+    {
+      size_t first = chunk * per_chunk;
+      workers.create_thread(boost::bind(&diffTiles, boost::cref(a), boost::cref(b), occupied_threshold, first,
+                                        std::min(tiles, first + per_chunk), &tile_boxes, &diff.mask,
+                                        &counts[chunk * CHANGE_CODES]));
+    }
+    workers.join_all();
+  }
+
+  for (size_t chunk = 0; chunk < chunks; chunk++)
+  {
+    for (size_t code = 1; code < CHANGE_CODES; code++)
+    {
+      uint64_t count = counts[chunk * CHANGE_CODES + code];
+      diff.transitions[(code - 1) / CELL_CLASSES][(code - 1) % CELL_CLASSES] += count;
+      diff.changed_cells += count;
+    }
+  }
+  diff.regions = changedRegions(a.tilesX(), a.tilesY(), tile_boxes);
+  return diff;
+}
+
+TiledGrid placeGrid(const TiledGrid& grid, unsigned int width, unsigned int height, unsigned int offset_x,
+                    unsigned int offset_y)
+{
+  TiledGrid placed(width, height, NULL);
+  std::vector<int8_t> row(grid.width());
+  for (unsigned int y = 0; y < grid.height(); y++)
+  {
+    grid.copyRows(y, 1, &row[0]);
+    unsigned int placed_y = offset_y + y;
+    // One copy per tile the row crosses
+    for (unsigned int x = 0; x < grid.width();)
+    {
+      unsigned int placed_x = offset_x + x;
+      unsigned int run = std::min(grid.width() - x, TILE_SIZE - placed_x % TILE_SIZE);
+      int8_t* cells = placed.writableTileData(placed_x / TILE_SIZE, placed_y / TILE_SIZE);
+      memcpy(cells + (placed_y % TILE_SIZE) * TILE_SIZE + placed_x % TILE_SIZE, &row[x], run);
+      x += run;
+    }
+  }
+  return placed;
+}
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Composition of map layers.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "multimap_server/map_layers.h"
+
+namespace multimap_server
+{
+// The kernels are branchless loops over plain int8_t arrays, which the compiler turns into SIMD code (see the
+// compile flags of this file in CMakeLists.txt). Tiles are TILE_SIZE * TILE_SIZE cells, a multiple of any vector width
+
+void blendMax(int8_t* __restrict__ dst, const int8_t* __restrict__ src, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    int8_t s = src[i];
+    int8_t d = dst[i];
+    dst[i] = (s > 0 && s > d) ? s : d;
+  }
+}
+
+void blendOverride(int8_t* __restrict__ dst, const int8_t* __restrict__ src, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    int8_t s = src[i];
+    dst[i] = s != -1 ? s : dst[i];
+  }
+}
+
+bool isTransparent(LayerBlend blend, const int8_t* src, size_t n)
+{
+  // Cells are OR-reduced instead of returning early, so that the loops vectorize
+  uint8_t opaque = 0;
+  if (blend == BLEND_MAX)
+  {
+    for (size_t i = 0; i < n; i++)
+      opaque |= src[i] > 0;
+  }
+  else
+  {
+    for (size_t i = 0; i < n; i++)
+      opaque |= src[i] != -1;
+  }
+  return opaque == 0;
+}
+
+void composeTile(const TiledGrid& base, const std::vector<MapLayer>& layers, unsigned int tx, unsigned int ty,
+                 TiledGrid* composed)
+{
+  const size_t tile_cells = TiledGrid::TILE_SIZE * TiledGrid::TILE_SIZE;
+  composed->shareTile(base, tx, ty);
+
+  int8_t* dst = NULL;
+  std::vector<MapLayer>::const_iterator layer;
+  for (layer = layers.begin(); layer != layers.end(); ++layer)
+  {
+    const int8_t* src = layer->grid.tileData(tx, ty);
+    if (isTransparent(layer->blend, src, tile_cells))
+      continue;
+
+    if (!dst)
+      dst = composed->writableTileData(tx, ty);
+    if (layer->blend == BLEND_MAX)
+      blendMax(dst, src, tile_cells);
+    else
+      blendOverride(dst, src, tile_cells);
+  }
+}
+
+void composeBox(const TiledGrid& base, const std::vector<MapLayer>& layers, const CellBox& box,
+                TiledGrid* composed)
+{
+  if (box.min_x > box.max_x)
+    return;
+  for (unsigned int ty = box.min_y / TiledGrid::TILE_SIZE; ty <= box.max_y / TiledGrid::TILE_SIZE; ty++)
+  {
+    for (unsigned int tx = box.min_x / TiledGrid::TILE_SIZE; tx <= box.max_x / TiledGrid::TILE_SIZE; tx++)
+    {
+      composeTile(base, layers, tx, ty, composed);
+    }
+  }
+}
+
+TiledGrid composeLayers(const TiledGrid& base, const std::vector<MapLayer>& layers)
+{
+  TiledGrid composed = base;
+  if (!layers.empty() && base.width() > 0 && base.height() > 0)
+  {
+    CellBox all = { 0, 0, base.width() - 1, base.height() - 1 };
+    composeBox(base, layers, all, &composed);
+  }
+  return composed;
+}
+
+CellBox changedTiles(const TiledGrid& before, const TiledGrid& after)
+{
+  CellBox changed = { 1, 1, 0, 0 };
+  for (unsigned int ty = 0; ty < after.tilesY(); ty++)
+  {
+    for (unsigned int tx = 0; tx < after.tilesX(); tx++)
+    {
+      if (!after.sharesTile(before, tx, ty) &&
+          memcmp(before.tileData(tx, ty), after.tileData(tx, ty), TiledGrid::TILE_SIZE * TiledGrid::TILE_SIZE) != 0)
+      {
+        growBox(&changed, after.tileBox(tx, ty));
+      }
+    }
+  }
+  return changed;
+}
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Resampling of occupancy grids onto other cells of their frame.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "multimap_server/map_resample.h"
+
+namespace multimap_server
+{
+namespace
+{
+const unsigned int TILE_SIZE = TiledGrid::TILE_SIZE;
+const size_t TILE_CELLS = TILE_SIZE * TILE_SIZE;
+// Tiles resampled by a thread, below which starting it costs more than it saves
+const size_t MIN_TILES_PER_THREAD = 16;
+// Cells that no source covers while a tile is being merged. Never a cell value
+const int8_t NOT_COVERED = -2;
+
+/** Order of occupancy values when resampling conservatively: free,
+ *  unknown, partially occupied, occupied */
+inline int conservativeRank(int8_t value)
+{
+  return value < 0 ? 1 : (value == 0 ? 0 : value + 1);
+}
+
+/** Position in the frame of a point given in cells of a placement */
+void cellToFrame(const GridPlacement& placement, double x, double y, double* frame_x, double* frame_y)
+{
+  double c = cos(placement.yaw);
+  double s = sin(placement.yaw);
+  *frame_x = placement.origin_x + (c * x - s * y) * placement.resolution;
+  *frame_y = placement.origin_y + (s * x + c * y) * placement.resolution;
+}
+
+/** Source with the mapping from cells of the target to its cells */
+struct MappedSource
+{
+  const TiledGrid* grid;
+  /** Source cell coordinates of target cell coordinates (x, y) are
+   *  (xx * x + xy * y + x0, yx * x + yy * y + y0) */
+  double xx, xy, x0;
+  double yx, yy, y0;
+  /** And the other way around, target cell coordinates of source cell
+   *  coordinates (sx, sy) are (ux * sx + uy * sy + u0, vx * sx + vy * sy + v0) */
+  double ux, uy, u0;
+  double vx, vy, v0;
+  /** Whether a target cell reads every source cell its footprint overlaps,
+   *  rather than the one under its center */
+  bool conservative;
+  /** Target cells that the source may cover, empty if none */
+  CellBox cover;
+};
+
+MappedSource mapSource(const ResampleSource& source, const GridPlacement& target, ResampleMode mode)
+{
+  const GridPlacement& placement = source.placement;
+  MappedSource mapped;
+  mapped.grid = source.grid;
+
+  // Rotate the target cells into the source and scale them to its resolution
+  double scale = target.resolution / placement.resolution;
+  double c = cos(target.yaw - placement.yaw);
+  double s = sin(target.yaw - placement.yaw);
+  mapped.xx = scale * c;
+  mapped.xy = -scale * s;
+  mapped.yx = scale * s;
+  mapped.yy = scale * c;
+  double dx = target.origin_x - placement.origin_x;
+  double dy = target.origin_y - placement.origin_y;
+  mapped.x0 = (cos(placement.yaw) * dx + sin(placement.yaw) * dy) / placement.resolution;
+  mapped.y0 = (-sin(placement.yaw) * dx + cos(placement.yaw) * dy) / placement.resolution;
+  mapped.ux = c / scale;
+  mapped.uy = s / scale;
+  mapped.u0 = -(mapped.ux * mapped.x0 + mapped.uy * mapped.y0);
+  mapped.vx = -s / scale;
+  mapped.vy = c / scale;
+  mapped.v0 = -(mapped.vx * mapped.x0 + mapped.vy * mapped.y0);
+
+  mapped.conservative = mode == RESAMPLE_CONSERVATIVE;
+
+  // Bounds of the corners of the source in target cells
+  double min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+  for (int corner = 0; corner < 4; corner++)
+  {
+    double frame_x, frame_y;
+    cellToFrame(placement, (corner & 1) ? placement.width : 0, (corner & 2) ? placement.height : 0, &frame_x,
+                &frame_y);
+    double fx = frame_x - target.origin_x;
+    double fy = frame_y - target.origin_y;
+    double x = (cos(target.yaw) * fx + sin(target.yaw) * fy) / target.resolution;
+    double y = (-sin(target.yaw) * fx + cos(target.yaw) * fy) / target.resolution;
+    min_x = std::min(min_x, x);
+    min_y = std::min(min_y, y);
+    max_x = std::max(max_x, x);
+    max_y = std::max(max_y, y);
+  }
+  CellBox empty = { 1, 1, 0, 0 };
+  mapped.cover = empty;
+  if (max_x > 0.0 && max_y > 0.0 && min_x < target.width && min_y < target.height)
+  {
+    mapped.cover.min_x = std::max(0.0, floor(min_x));
+    mapped.cover.min_y = std::max(0.0, floor(min_y));
+    mapped.cover.max_x = std::min<double>(target.width - 1, ceil(max_x));
+    mapped.cover.max_y = std::min<double>(target.height - 1, ceil(max_y));
+  }
+  return mapped;
+}
+
+/** Whether the cells of the target are cells of the source, translated by a whole number of cells */
+bool cellAligned(const MappedSource& source, long* offset_x, long* offset_y)
+{
+  const double eps = 1e-9;
+  *offset_x = lround(source.x0);
+  *offset_y = lround(source.y0);
+  return fabs(source.xx - 1.0) < eps && fabs(source.yy - 1.0) < eps && fabs(source.xy) < eps &&
+         fabs(source.yx) < eps && fabs(source.x0 - *offset_x) < 1e-6 && fabs(source.y0 - *offset_y) < 1e-6;
+}
+
+/** sampleCells() of a cell aligned source: the rows of box are copied from the tiles of the source */
+void copyCells(const MappedSource& source, const CellBox& box, long offset_x, long offset_y, int8_t* out)
+{
+  long width = source.grid->width();
+  long height = source.grid->height();
+  long min_x = std::max<long>(box.min_x, -offset_x);
+  long max_x = std::min<long>(box.max_x, width - 1 - offset_x);
+  long min_y = std::max<long>(box.min_y, -offset_y);
+  long max_y = std::min<long>(box.max_y, height - 1 - offset_y);
+  for (long y = min_y; y <= max_y; y++)
+  {
+    long sy = y + offset_y;
+    int8_t* row = out + (y - box.min_y) * TILE_SIZE;
+    // A row of the box spans at most two tiles of the source
+    for (long x = min_x; x <= max_x;)
+    {
+      long sx = x + offset_x;
+      long run = std::min<long>(max_x - x + 1, TILE_SIZE - sx % TILE_SIZE);
+      const int8_t* cells = source.grid->tileData(sx / TILE_SIZE, sy / TILE_SIZE);
+      memcpy(row + (x - box.min_x), cells + (sy % TILE_SIZE) * TILE_SIZE + sx % TILE_SIZE, run);
+      x += run;
+    }
+  }
+}
+
+/** Cells of a grid. Neighbouring target cells mostly read the same source tile, which is only looked up again when
+ *  they leave it */
+class TileCursor
+{
+public:
+  explicit TileCursor(const TiledGrid& grid) : grid_(grid), tile_x_(UINT_MAX), tile_y_(UINT_MAX), tile_(NULL)
+  {
+  }
+
+  int8_t get(unsigned int x, unsigned int y)
+  {
+    if (x / TILE_SIZE != tile_x_ || y / TILE_SIZE != tile_y_)
+    {
+      tile_x_ = x / TILE_SIZE;
+      tile_y_ = y / TILE_SIZE;
+      tile_ = grid_.tileData(tile_x_, tile_y_);
+    }
+    return tile_[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+  }
+
+private:
+  const TiledGrid& grid_;
+  unsigned int tile_x_;
+  unsigned int tile_y_;
+  const int8_t* tile_;
+};
+
+/** Most occupied source cell that the footprint of target cell (x, y) overlaps, NOT_COVERED if none. The footprint
+ *  is a rotated square, which can clip source cells that no lattice of samples would hit */
+int8_t overlappedCell(const MappedSource& source, unsigned int x, unsigned int y, TileCursor* cursor)
+{
+  // Footprints sharing only an edge or a corner with a source cell don't read it
+  const double eps = 1e-6;
+  // Corner (x, y) of the footprint, whose sides are (xx, yx) and (xy, yy)
+  double corner_x = source.xx * x + source.xy * y + source.x0;
+  double corner_y = source.yx * x + source.yy * y + source.y0;
+  double min_x = corner_x + std::min(0.0, source.xx) + std::min(0.0, source.xy);
+  double max_x = corner_x + std::max(0.0, source.xx) + std::max(0.0, source.xy);
+  double min_y = corner_y + std::min(0.0, source.yx) + std::min(0.0, source.yy);
+  double max_y = corner_y + std::max(0.0, source.yx) + std::max(0.0, source.yy);
+  double first_x = std::max(0.0, floor(min_x + eps));
+  double last_x = std::min<double>(source.grid->width(), ceil(max_x - eps)) - 1.0;
+  double first_y = std::max(0.0, floor(min_y + eps));
+  double last_y = std::min<double>(source.grid->height(), ceil(max_y - eps)) - 1.0;
+
+  // Source cells within the bounds of the footprint may still lie outside of one of its sides, which are the edges of
+  // target cell (x, y)
+  double du_min = std::min(0.0, source.ux) + std::min(0.0, source.uy) - x;
+  double du_max = std::max(0.0, source.ux) + std::max(0.0, source.uy) - x;
+  double dv_min = std::min(0.0, source.vx) + std::min(0.0, source.vy) - y;
+  double dv_max = std::max(0.0, source.vx) + std::max(0.0, source.vy) - y;
+  int8_t value = NOT_COVERED;
+  for (double cy = first_y; cy <= last_y; cy++)
+  {
+    for (double cx = first_x; cx <= last_x; cx++)
+    {
+      double u = source.ux * cx + source.uy * cy + source.u0;
+      double v = source.vx * cx + source.vy * cy + source.v0;
+      if (u + du_max <= eps || u + du_min >= 1.0 - eps || v + dv_max <= eps || v + dv_min >= 1.0 - eps)
+        continue;
+      int8_t cell = cursor->get(cx, cy);
+      if (value == NOT_COVERED || conservativeRank(cell) > conservativeRank(value))
+        value = cell;
+    }
+  }
+  return value;
+}
+
+/** Read the cells of box from a source into out, TILE_SIZE cells per row starting at the corner of box. The other
+ *  cells of out are NOT_COVERED */
+void sampleCells(const MappedSource& source, const CellBox& box, int8_t* out)
+{
+  memset(out, NOT_COVERED, TILE_CELLS);
+  long offset_x, offset_y;
+  if (cellAligned(source, &offset_x, &offset_y))
+  {
+    copyCells(source, box, offset_x, offset_y, out);
+    return;
+  }
+
+  unsigned int width = source.grid->width();
+  unsigned int height = source.grid->height();
+  TileCursor cursor(*source.grid);
+  unsigned int min_x = std::max(box.min_x, source.cover.min_x);
+  unsigned int max_x = std::min(box.max_x, source.cover.max_x);
+  for (unsigned int y = std::max(box.min_y, source.cover.min_y); y <= std::min(box.max_y, source.cover.max_y); y++)
+  {
+    int8_t* row = out + (y - box.min_y) * TILE_SIZE;
+    for (unsigned int x = min_x; x <= max_x; x++)
+    {
+      if (source.conservative)
+      {
+        row[x - box.min_x] = overlappedCell(source, x, y, &cursor);
+        continue;
+      }
+      double sample_x = x + 0.5;
+      double sample_y = y + 0.5;
+      double sx = source.xx * sample_x + source.xy * sample_y + source.x0;
+      double sy = source.yx * sample_x + source.yy * sample_y + source.y0;
+      if (sx >= 0.0 && sy >= 0.0 && sx < width && sy < height)
+        row[x - box.min_x] = cursor.get(sx, sy);
+    }
+  }
+}
+
+// The merge kernels are branchless loops over plain arrays that the compiler turns into SIMD code (see the compile
+// flags of this file in CMakeLists.txt)
+
+void mergeFirst(int8_t* __restrict__ dst, const int8_t* __restrict__ src)
+{
+  for (size_t i = 0; i < TILE_CELLS; i++)
+  {
+    int8_t d = dst[i];
+    int8_t s = src[i];
+    dst[i] = (d == NOT_COVERED || (d == -1 && s >= 0)) ? s : d;
+  }
+}
+
+void mergeMax(int8_t* __restrict__ dst, const int8_t* __restrict__ src)
+{
+  for (size_t i = 0; i < TILE_CELLS; i++)
+  {
+    int8_t d = dst[i];
+    int8_t s = src[i];
+    dst[i] = (d == NOT_COVERED || s > d) ? s : d;
+  }
+}
+
+void mergeConservative(int8_t* __restrict__ dst, const int8_t* __restrict__ src)
+{
+  for (size_t i = 0; i < TILE_CELLS; i++)
+  {
+    int8_t d = dst[i];
+    int8_t s = src[i];
+    // conservativeRank(), spelled out so that it vectorizes
+    int16_t rank_d = d < 0 ? 1 : d + (d > 0);
+    int16_t rank_s = s < 0 ? 1 : s + (s > 0);
+    bool replace = (d == NOT_COVERED) | ((s != NOT_COVERED) & (rank_s > rank_d));
+    dst[i] = replace ? s : d;
+  }
+}
+
+/** Resample tiles [first, last) of target, which are allocated and written to by one thread only */
+void resampleTiles(const std::vector<MappedSource>& sources, MergePolicy policy, size_t first, size_t last,
+                   TiledGrid* target)
+{
+  int8_t merged[TILE_CELLS];
+  int8_t sampled[TILE_CELLS];
+  for (size_t tile = first; tile < last; tile++)
+  {
+    unsigned int tx = tile % target->tilesX();
+    unsigned int ty = tile / target->tilesX();
+    CellBox box = target->tileBox(tx, ty);
+    bool covered = false;
+    memset(merged, NOT_COVERED, TILE_CELLS);
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+      const CellBox& cover = sources[i].cover;
+      if (cover.min_x > cover.max_x || cover.min_x > box.max_x || cover.max_x < box.min_x ||
+          cover.min_y > box.max_y || cover.max_y < box.min_y)
+      {
+        continue;
+      }
+      sampleCells(sources[i], box, sampled);
+      if (policy == MERGE_FIRST)
+        mergeFirst(merged, sampled);
+      else if (policy == MERGE_MAX)
+        mergeMax(merged, sampled);
+      else
+        mergeConservative(merged, sampled);
+      covered = true;
+    }
+    int8_t* cells = target->allocateTile(tx, ty);
+    if (!covered)
+    {
+      memset(cells, -1, TILE_CELLS);
+      continue;
+    }
+
+    // Cells of edge tiles outside of the target were never sampled, so they become -1 as well
+    for (size_t i = 0; i < TILE_CELLS; i++)
+    {
+      cells[i] = merged[i] == NOT_COVERED ? -1 : merged[i];
+    }
+  }
+}
+}
+
+MergePolicy parseMergePolicy(const std::string& name)
+{
+  if (name == "first")
+    return MERGE_FIRST;
+  if (name == "max")
+    return MERGE_MAX;
+  if (name == "conservative")
+    return MERGE_CONSERVATIVE;
+  throw std::runtime_error("unknown merge policy \"" + name + "\", expected first, max or conservative");
+}
+
+bool coverSources(const std::vector<ResampleSource>& sources, uint64_t max_cells, GridPlacement* placement)
+{
+  // Bounds of the corners of the sources along the axes of the placement
+  double c = cos(placement->yaw);
+  double s = sin(placement->yaw);
+  double min_u = INFINITY, min_v = INFINITY, max_u = -INFINITY, max_v = -INFINITY;
+  for (size_t i = 0; i < sources.size(); i++)
+  {
+    const GridPlacement& source = sources[i].placement;
+    for (int corner = 0; corner < 4; corner++)
+    {
+      double x, y;
+      cellToFrame(source, (corner & 1) ? source.width : 0, (corner & 2) ? source.height : 0, &x, &y);
+      double u = c * x + s * y;
+      double v = -s * x + c * y;
+      min_u = std::min(min_u, u);
+      min_v = std::min(min_v, v);
+      max_u = std::max(max_u, u);
+      max_v = std::max(max_v, v);
+    }
+  }
+  if (sources.empty())
+  {
+    min_u = min_v = max_u = max_v = 0.0;
+  }
+
+  // Extents that are a whole number of cells up to rounding errors don't get an extra cell
+  double width = std::max(0.0, ceil((max_u - min_u) / placement->resolution - 1e-6));
+  double height = std::max(0.0, ceil((max_v - min_v) / placement->resolution - 1e-6));
+  // Checked before converting, which is undefined for counts an unsigned int can't hold (and for NaN)
+  double max_size = std::min<double>(max_cells, UINT_MAX);
+  if (!(width <= max_size && height <= max_size && width * height <= max_cells))
+    return false;
+
+  placement->origin_x = c * min_u - s * min_v;
+  placement->origin_y = s * min_u + c * min_v;
+  placement->width = width;
+  placement->height = height;
+  return true;
+}
+
+TiledGrid resampleGrids(const std::vector<ResampleSource>& sources, const GridPlacement& target, ResampleMode mode,
+                        MergePolicy policy, unsigned int threads)
+{
+  std::vector<MappedSource> mapped;
+  for (size_t i = 0; i < sources.size(); i++)
+  {
+    mapped.push_back(mapSource(sources[i], target, mode));
+  }
+
+  // The tiles are allocated by the threads that fill them, which first touch their pages
+  TiledGrid grid = TiledGrid::withoutTiles(target.width, target.height);
+  size_t tiles = (size_t)grid.tilesX() * grid.tilesY();
+  size_t chunks = std::max<size_t>(1, std::min<size_t>(threads, tiles / MIN_TILES_PER_THREAD));
+  if (chunks == 1)
+  {
+    resampleTiles(mapped, policy, 0, tiles, &grid);
+    return grid;
+  }
+
+  // Threads allocate distinct tiles of a grid no one else holds yet
+  boost::thread_group workers;
+  size_t per_chunk = (tiles + chunks - 1) / chunks;
+  for (size_t first = 0; first < tiles; first += per_chunk)
+  {
+    workers.create_thread(
+        boost::bind(&resampleTiles, boost::cref(mapped), policy, first, std::min(tiles, first + per_chunk), &grid));
+  }
+  workers.join_all();
+  return grid;
+}
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Run-length encoding of grid rows.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "multimap_server/map_rle.h"
+
+namespace multimap_server
+{
+size_t findRunEnd(const int8_t* cells, size_t begin, size_t end)
+{
+  const int8_t value = cells[begin];
+  size_t i = begin + 1;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // Eight cells XORed with the run value at once: the lowest non-zero byte is the first cell that differs
+  const uint64_t pattern = 0x0101010101010101ULL * (uint8_t)value;
+  for (; i + 8 <= end; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, cells + i, sizeof(word));
+    uint64_t diff = word ^ pattern;
+    if (diff != 0)
+    {
+      return i + (__builtin_ctzll(diff) >> 3);
+    }
+  }
+#endif
+  while (i < end && cells[i] == value)
+    i++;
+  return i;
+}
+
+void encodeRows(const TiledGrid& grid, std::vector<uint32_t>* row_starts, std::vector<uint16_t>* run_lengths,
+                std::vector<int8_t>* run_values)
+{
+  const size_t width = grid.width();
+  row_starts->clear();
+  run_lengths->clear();
+  run_values->clear();
+  row_starts->reserve(grid.height() + 1);
+
+  // Rows are exported a band of tiles at a time
+  std::vector<int8_t> band(width * TiledGrid::TILE_SIZE);
+  for (unsigned int first = 0; first < grid.height(); first += TiledGrid::TILE_SIZE)
+  {
+    unsigned int rows = std::min(TiledGrid::TILE_SIZE, grid.height() - first);
+    grid.copyRows(first, rows, band.empty() ? NULL : &band[0]);
+    for (unsigned int y = 0; y < rows; y++)
+    {
+      row_starts->push_back(run_lengths->size());
+      const int8_t* row = &band[y * width];
+      for (size_t x = 0; x < width;)
+      {
+        size_t end = findRunEnd(row, x, std::min(width, x + MAX_RUN_LENGTH));
+        run_lengths->push_back(end - x);
+        run_values->push_back(row[x]);
+        x = end;
+      }
+    }
+  }
+  row_starts->push_back(run_lengths->size());
+}
+
+void decodeRows(unsigned int width, unsigned int height, const std::vector<uint32_t>& row_starts,
+                const std::vector<uint16_t>& run_lengths, const std::vector<int8_t>& run_values, int8_t* out)
+{
+  if (row_starts.size() != (size_t)height + 1 || run_lengths.size() != run_values.size() ||
+      row_starts[height] != run_lengths.size())
+  {
+    throw std::runtime_error("run-length encoded grid has inconsistent sizes");
+  }
+  // Messages come from the network: every row must lie within the runs before any of them is read
+  for (unsigned int y = 0; y < height; y++)
+  {
+    if (row_starts[y] > row_starts[y + 1] || row_starts[y + 1] > run_lengths.size())
+    {
+      throw std::runtime_error("run-length encoded grid has misordered rows");
+    }
+  }
+
+  for (unsigned int y = 0; y < height; y++)
+  {
+    int8_t* row = out + (size_t)y * width;
+    size_t x = 0;
+    for (uint32_t run = row_starts[y]; run < row_starts[y + 1]; run++)
+    {
+      if (x + run_lengths[run] > width)
+      {
+        throw std::runtime_error("run-length encoded row is longer than the grid");
+      }
+      memset(row + x, run_values[run], run_lengths[run]);
+      x += run_lengths[run];
+    }
+    if (x != width)
+    {
+      throw std::runtime_error("run-length encoded row is shorter than the grid");
+    }
+  }
+}
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Monotonic arenas for outgoing messages.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <set>
+
+#include <boost/thread/tss.hpp>
+
+#include "multimap_server/message_arena.h"
+
+namespace multimap_server
+{
+namespace
+{
+/** Alignment of every allocation, enough for any field of a message */
+const size_t ALIGNMENT = 16;
+const size_t MIN_BLOCK_SIZE = 64 * 1024;
+const size_t DEFAULT_THREAD_RETAINED_BYTES = 256 * 1024 * 1024;
+
+void destroyThreadArena(MessageArena* arena);
+
+/** Protects thread_arenas and thread_retained_bytes */
+boost::mutex thread_arenas_mutex;
+std::set<MessageArena*> thread_arenas;
+size_t thread_retained_bytes = DEFAULT_THREAD_RETAINED_BYTES;
+boost::thread_specific_ptr<MessageArena> thread_arena(destroyThreadArena);
+
+double monotonicSeconds()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void destroyThreadArena(MessageArena* arena)
+{
+  {
+    boost::mutex::scoped_lock lock(thread_arenas_mutex);
+    thread_arenas.erase(arena);
+  }
+  delete arena;
+}
+}
+
+const size_t MessageArena::SHRINK_ROUNDS;
+
+MessageArena::MessageArena(size_t retained_bytes)
+  : retained_bytes_(retained_bytes), current_(0), peak_bytes_(0), rounds_(0), last_use_(monotonicSeconds())
+{
+}
+
+MessageArena::~MessageArena()
+{
+  for (size_t i = 0; i < blocks_.size(); i++)
+  {
+    free(blocks_[i].data);
+  }
+}
+
+void* MessageArena::allocate(size_t bytes)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  while (current_ < blocks_.size() && blocks_[current_].used + bytes > blocks_[current_].size)
+  {
+    if (current_ + 1 == blocks_.size())
+    {
+      // Blocks double, so that a message needs few of them before the arena merges them
+      addBlock(std::max(bytes, 2 * blocks_[current_].size));
+    }
+    current_++;
+  }
+  if (current_ == blocks_.size())
+  {
+    addBlock(std::max(bytes, MIN_BLOCK_SIZE));
+  }
+
+  Block& block = blocks_[current_];
+  void* memory = block.data + block.used;
+  block.used += bytes;
+  return memory;
+}
+
+MessageArena::Mark MessageArena::mark() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  Mark position = { current_, current_ < blocks_.size() ? blocks_[current_].used : 0 };
+  return position;
+}
+
+void MessageArena::rewind(const Mark& mark)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if (blocks_.empty())
+    return;
+
+  bool empty = mark.block == 0 && mark.used == 0;
+  if (empty)
+  {
+    size_t used = 0;
+    for (size_t i = 0; i <= current_ && i < blocks_.size(); i++)
+    {
+      used += blocks_[i].used;
+    }
+    peak_bytes_ = std::max(peak_bytes_, used);
+    rounds_++;
+    last_use_ = monotonicSeconds();
+  }
+
+  for (size_t i = mark.block + 1; i <= current_ && i < blocks_.size(); i++)
+  {
+    blocks_[i].used = 0;
+  }
+  current_ = mark.block;
+  blocks_[current_].used = mark.used;
+  if (!empty)
+    return;
+
+  // Nothing is allocated anymore: one block large enough for the largest recent message
+  size_t needed = std::max(MIN_BLOCK_SIZE, std::min(peak_bytes_, retained_bytes_));
+  bool shrink = rounds_ >= SHRINK_ROUNDS && blocks_[0].size > 2 * needed;
+  if (blocks_.size() > 1 || blocks_[0].size > retained_bytes_ || shrink)
+  {
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+      free(blocks_[i].data);
+    }
+    blocks_.clear();
+    addBlock(needed);
+  }
+  if (rounds_ >= SHRINK_ROUNDS)
+  {
+    peak_bytes_ = 0;
+    rounds_ = 0;
+  }
+}
+
+size_t MessageArena::capacity() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  size_t total = 0;
+  for (size_t i = 0; i < blocks_.size(); i++)
+  {
+    total += blocks_[i].size;
+  }
+  return total;
+}
+
+void MessageArena::setRetainedBytes(size_t retained_bytes)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  retained_bytes_ = retained_bytes;
+}
+
+size_t MessageArena::trim(double idle_seconds)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if (blocks_.empty() || current_ != 0 || blocks_[0].used != 0 || monotonicSeconds() - last_use_ < idle_seconds)
+    return 0;
+
+  size_t freed = 0;
+  for (size_t i = 0; i < blocks_.size(); i++)
+  {
+    freed += blocks_[i].size;
+    free(blocks_[i].data);
+  }
+  blocks_.clear();
+  peak_bytes_ = 0;
+  rounds_ = 0;
+  return freed;
+}
+
+void MessageArena::addBlock(size_t size)
+{
+  // malloc aligns for any type, which covers ALIGNMENT
+  Block block = { static_cast<char*>(malloc(size)), size, 0 };
+  if (!block.data)
+    throw std::bad_alloc();
+  blocks_.push_back(block);
+}
+
+MessageArena& threadMessageArena()
+{
+  MessageArena* arena = thread_arena.get();
+  if (!arena)
+  {
+    boost::mutex::scoped_lock lock(thread_arenas_mutex);
+    arena = new MessageArena(thread_retained_bytes);
+    thread_arena.reset(arena);
+    thread_arenas.insert(arena);
+  }
+  return *arena;
+}
+
+void setThreadArenaRetention(size_t retained_bytes)
+{
+  boost::mutex::scoped_lock lock(thread_arenas_mutex);
+  thread_retained_bytes = retained_bytes;
+  std::set<MessageArena*>::const_iterator it;
+  for (it = thread_arenas.begin(); it != thread_arenas.end(); ++it)
+  {
+    (*it)->setRetainedBytes(retained_bytes);
+  }
+}
+
+size_t trimMessageArenas(double idle_seconds)
+{
+  boost::mutex::scoped_lock lock(thread_arenas_mutex);
+  size_t freed = 0;
+  std::set<MessageArena*>::const_iterator it;
+  for (it = thread_arenas.begin(); it != thread_arenas.end(); ++it)
+  {
+    freed += (*it)->trim(idle_seconds);
+  }
+  return freed;
+}
+}
@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Caching client of multimap_server.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+
+#include "ros/ros.h"
+#include "multimap_server/environment_pack.h"
+#include "multimap_server/multimap_client.h"
+#include "multimap_server/map_bands.h"
+#include "multimap_server/map_rle.h"
+#include <multimap_server/FetchMap.h>
+#include <multimap_server/GetMapManifest.h>
+#include <multimap_server/GetMapChunk.h>
+#include <multimap_server/GetMapRle.h>
+
+namespace multimap_server
+{
+namespace
+{
+/** Cache keys are used in file names, so '/' is escaped as %2F (and '%' as %25, so that different keys never share
+ *  a file) */
+std::string sanitize(const std::string& key)
+{
+  std::string result;
+  for (size_t i = 0; i < key.size(); i++)
+  {
+    if (key[i] == '%')
+      result += "%25";
+    else if (key[i] == '/')
+      result += "%2F";
+    else
+      result += key[i];
+  }
+  return result;
+}
+
+bool readIndex(const std::string& path, uint64_t* hash)
+{
+  FILE* index = fopen(path.c_str(), "r");
+  if (!index)
+    return false;
+  bool valid = fscanf(index, "%" SCNx64, hash) == 1;
+  fclose(index);
+  return valid;
+}
+
+void makeDirectory(const std::string& path)
+{
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    throw std::runtime_error("failed to create cache directory \"" + path + "\"");
+  }
+}
+
+double yawOf(const geometry_msgs::Quaternion& q)
+{
+  return atan2(2.0 * (q.w * q.z + q.x * q.y), 1.0 - 2.0 * (q.y * q.y + q.z * q.z));
+}
+}
+
+MultimapClient::MultimapClient(const std::string& server_name, const std::string& cache_dir, bool keep_in_memory)
+  : server_name_(server_name), cache_dir_(cache_dir), keep_in_memory_(keep_in_memory)
+{
+  if (!cache_dir_.empty())
+  {
+    // Only the last level is created: the parent is the ROS home directory
+    makeDirectory(cache_dir_);
+    makeDirectory(cache_dir_ + "/index");
+    countIndexedHashes();
+  }
+}
+
+std::string MultimapClient::defaultCacheDir()
+{
+  const char* ros_home = getenv("ROS_HOME");
+  if (ros_home)
+    return std::string(ros_home) + "/multimap_cache";
+  const char* home = getenv("HOME");
+  return std::string(home ? home : ".") + "/.ros/multimap_cache";
+}
+
+nav_msgs::OccupancyGridConstPtr MultimapClient::getMap(const std::string& ns, const std::string& map_name)
+{
+  std::string key = ns + "/" + map_name;
+  boost::mutex::scoped_lock lock(mutex_);
+
+  uint64_t known_hash = lookupKnownHash(key);
+  nav_msgs::OccupancyGridConstPtr cached;
+  if (known_hash != 0)
+  {
+    cached = lookupCached(known_hash);
+  }
+
+  multimap_server::FetchMap fetch;
+  fetch.request.ns = ns;
+  fetch.request.map_name = map_name;
+  fetch.request.known_hash = cached ? known_hash : 0;
+
+  // Lookups of other maps don't wait for the server
+  lock.unlock();
+  if (!ros::service::call(server_name_ + "/fetch_map", fetch))
+  {
+    if (cached)
+    {
+      ROS_WARN("multimap_client: %s/fetch_map is not available, using the cached copy of %s", server_name_.c_str(),
+               key.c_str());
+      return cached;
+    }
+    throw std::runtime_error("multimap_client: " + server_name_ + "/fetch_map is not available and " + key +
+                             " is not cached");
+  }
+  if (!fetch.response.success)
+  {
+    throw std::runtime_error("multimap_client: " + fetch.response.msg);
+  }
+
+  if (fetch.response.not_modified)
+  {
+    return cached;
+  }
+
+  nav_msgs::OccupancyGridPtr map = boost::make_shared<nav_msgs::OccupancyGrid>();
+  map->header = fetch.response.map.header;
+  map->info = fetch.response.map.info;
+  map->data.swap(fetch.response.map.data);
+  lock.lock();
+  store(key, fetch.response.hash, map);
+  return map;
+}
+
+nav_msgs::OccupancyGridConstPtr MultimapClient::getMapInBands(const std::string& ns, const std::string& map_name,
+                                                              uint32_t focus_row, const BandCallback& on_band,
+                                                              uint32_t max_chunk_cells)
+{
+  std::string key = ns + "/" + map_name;
+  boost::mutex::scoped_lock lock(mutex_);
+
+  uint64_t known_hash = lookupKnownHash(key);
+  nav_msgs::OccupancyGridConstPtr cached;
+  if (known_hash != 0)
+  {
+    cached = lookupCached(known_hash);
+  }
+
+  multimap_server::GetMapManifest manifest;
+  manifest.request.ns = ns;
+  manifest.request.map_name = map_name;
+  manifest.request.max_chunk_cells = max_chunk_cells;
+  // Lookups of other maps don't wait for the transfer
+  lock.unlock();
+  bool reachable = ros::service::call(server_name_ + "/get_map_manifest", manifest);
+  if (!reachable || (manifest.response.success && cached && manifest.response.version == known_hash))
+  {
+    if (!cached)
+    {
+      throw std::runtime_error("multimap_client: " + server_name_ + "/get_map_manifest is not available and " + key +
+                               " is not cached");
+    }
+    if (on_band && !cached->data.empty())
+    {
+      on_band(cached->info, 0, cached->info.height, &cached->data[0]);
+    }
+    return cached;
+  }
+  if (!manifest.response.success)
+  {
+    throw std::runtime_error("multimap_client: " + manifest.response.msg);
+  }
+
+  const multimap_server::GetMapManifest::Response& m = manifest.response;
+  nav_msgs::OccupancyGridPtr map = boost::make_shared<nav_msgs::OccupancyGrid>();
+  map->header.frame_id = m.frame_id;
+  map->info = m.info;
+  map->data.resize((size_t)m.info.width * m.info.height);
+
+  // Bands in order of distance from the focus band: focus, focus + 1, focus - 1, focus + 2...
+  int band_count = m.checksums.size();
+  int focus = std::min((int)(focus_row / std::max(m.band_rows, 1u)), band_count - 1);
+  std::vector<int> order;
+  for (int distance = 0; (int)order.size() < band_count; distance++)
+  {
+    if (focus + distance < band_count)
+      order.push_back(focus + distance);
+    if (distance > 0 && focus - distance >= 0)
+      order.push_back(focus - distance);
+  }
+
+  ros::ServiceClient chunks =
+      ros::NodeHandle().serviceClient<multimap_server::GetMapChunk>(server_name_ + "/get_map_chunk", true);
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    multimap_server::GetMapChunk chunk;
+    chunk.request.ns = ns;
+    chunk.request.map_name = map_name;
+    chunk.request.version = m.version;
+    chunk.request.band_rows = m.band_rows;
+    chunk.request.chunk_index = order[i];
+
+    // A corrupted band is requested once more
+    bool valid = false;
+    for (int attempt = 0; attempt < 2 && !valid; attempt++)
+    {
+      if (!chunks.call(chunk) || !chunk.response.success)
+      {
+        throw std::runtime_error("multimap_client: transfer of " + key + " failed: " +
+                                 (chunk.response.msg.empty() ? "get_map_chunk is not available" : chunk.response.msg));
+      }
+      const std::vector<int8_t>& data = chunk.response.data;
+      valid = (data.size() == (size_t)chunk.response.rows * m.info.width &&
+               checksum64(data.empty() ? NULL : &data[0], data.size()) == m.checksums[order[i]]);
+    }
+    if (!valid)
+    {
+      throw std::runtime_error("multimap_client: band " + boost::lexical_cast<std::string>(order[i]) + " of " + key +
+                               " does not match its checksum");
+    }
+
+    size_t offset = (size_t)chunk.response.first_row * m.info.width;
+    if (offset + chunk.response.data.size() > map->data.size())
+    {
+      throw std::runtime_error("multimap_client: band " + boost::lexical_cast<std::string>(order[i]) + " of " + key +
+                               " is out of bounds");
+    }
+    std::copy(chunk.response.data.begin(), chunk.response.data.end(), map->data.begin() + offset);
+    if (on_band && !chunk.response.data.empty())
+    {
+      on_band(map->info, chunk.response.first_row, chunk.response.rows, &map->data[offset]);
+    }
+  }
+
+  lock.lock();
+  store(key, m.version, map);
+  return map;
+}
+
+nav_msgs::OccupancyGridConstPtr MultimapClient::getMapRle(const std::string& ns, const std::string& map_name)
+{
+  std::string key = ns + "/" + map_name;
+  boost::mutex::scoped_lock lock(mutex_);
+
+  uint64_t known_hash = lookupKnownHash(key);
+  nav_msgs::OccupancyGridConstPtr cached;
+  if (known_hash != 0)
+  {
+    cached = lookupCached(known_hash);
+  }
+
+  multimap_server::GetMapRle fetch;
+  fetch.request.known_hash = cached ? known_hash : 0;
+  std::string service_name = server_name_ + "/maps/" + key + "/static_map_rle";
+  // Lookups of other maps don't wait for the server
+  lock.unlock();
+  if (!ros::service::call(service_name, fetch))
+  {
+    if (cached)
+    {
+      ROS_WARN("multimap_client: %s is not available, using the cached copy of %s", service_name.c_str(),
+               key.c_str());
+      return cached;
+    }
+    throw std::runtime_error("multimap_client: " + service_name + " is not available and " + key + " is not cached");
+  }
+
+  if (fetch.response.not_modified)
+  {
+    return cached;
+  }
+
+  nav_msgs::OccupancyGridPtr map = boost::make_shared<nav_msgs::OccupancyGrid>();
+  decodeMapRle(fetch.response.map, map.get());
+  lock.lock();
+  store(key, fetch.response.map.version, map);
+  return map;
+}
+
+void MultimapClient::decodeMapRle(const MapRle& rle, nav_msgs::OccupancyGrid* map)
+{
+  map->header = rle.header;
+  map->info = rle.info;
+  map->data.resize((size_t)rle.info.width * rle.info.height);
+  decodeRows(rle.info.width, rle.info.height, rle.row_starts, rle.run_lengths, rle.run_values,
+             map->data.empty() ? NULL : &map->data[0]);
+}
+
+uint64_t MultimapClient::getMapHash(const std::string& ns, const std::string& map_name)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  std::map<std::string, uint64_t>::const_iterator it = known_hashes_.find(ns + "/" + map_name);
+  return it == known_hashes_.end() ? 0 : it->second;
+}
+
+uint64_t MultimapClient::lookupKnownHash(const std::string& key)
+{
+  std::map<std::string, uint64_t>::const_iterator it = known_hashes_.find(key);
+  if (it != known_hashes_.end())
+    return it->second;
+  if (cache_dir_.empty())
+    return 0;
+
+  uint64_t hash = 0;
+  if (!readIndex(indexPath(key), &hash))
+    return 0;
+  return hash;
+}
+
+nav_msgs::OccupancyGridConstPtr MultimapClient::lookupCached(uint64_t hash)
+{
+  std::map<uint64_t, nav_msgs::OccupancyGridConstPtr>::const_iterator it = memory_cache_.find(hash);
+  if (it != memory_cache_.end())
+    return it->second;
+  if (cache_dir_.empty())
+    return nav_msgs::OccupancyGridConstPtr();
+
+  try
+  {
+    EnvironmentPack pack(gridPath(hash));
+    if (pack.maps().size() != 1 || !pack.verify(pack.maps()[0]))
+    {
+      ROS_WARN("multimap_client: discarding corrupted cache file %s", gridPath(hash).c_str());
+      return nav_msgs::OccupancyGridConstPtr();
+    }
+
+    const PackedMap& packed = pack.maps()[0];
+    nav_msgs::OccupancyGridPtr map = boost::make_shared<nav_msgs::OccupancyGrid>();
+    map->header.frame_id = pack.globalFrame();
+    map->info.width = packed.width;
+    map->info.height = packed.height;
+    map->info.resolution = packed.resolution;
+    map->info.origin.position.x = packed.origin[0];
+    map->info.origin.position.y = packed.origin[1];
+    map->info.origin.orientation.z = sin(packed.origin[2] / 2.0);
+    map->info.origin.orientation.w = cos(packed.origin[2] / 2.0);
+    map->data.assign(packed.data, packed.data + (size_t)packed.width * packed.height);
+
+    if (keep_in_memory_)
+      memory_cache_[hash] = map;
+    return map;
+  }
+  catch (std::runtime_error& e)
+  {
+    // Not cached, or not readable: fetch it again
+    return nav_msgs::OccupancyGridConstPtr();
+  }
+}
+
+void MultimapClient::store(const std::string& key, uint64_t hash, const nav_msgs::OccupancyGridConstPtr& map)
+{
+  uint64_t previous_hash = lookupKnownHash(key);
+  if (previous_hash != hash)
+  {
+    hash_refs_[hash]++;
+    // The previous version of the map is not needed anymore, unless another map has the same contents
+    if (previous_hash != 0)
+      releaseHash(previous_hash);
+  }
+  known_hashes_[key] = hash;
+  if (keep_in_memory_)
+    memory_cache_[hash] = map;
+
+  if (cache_dir_.empty())
+    return;
+
+  try
+  {
+    // Grids are stored as single map environment packs, named after their content hash
+    std::vector<PackedMap> packed(1);
+    packed[0].name = "map";
+    packed[0].width = map->info.width;
+    packed[0].height = map->info.height;
+    packed[0].resolution = map->info.resolution;
+    packed[0].origin[0] = map->info.origin.position.x;
+    packed[0].origin[1] = map->info.origin.position.y;
+    packed[0].origin[2] = yawOf(map->info.origin.orientation);
+    packed[0].data = map->data.empty() ? NULL : &map->data[0];
+    writeEnvironmentPack(gridPath(hash), "multimap_cache", map->header.frame_id, packed);
+
+    std::string index_path = indexPath(key);
+    std::string tmp_path = index_path + ".tmp";
+    FILE* index = fopen(tmp_path.c_str(), "w");
+    if (!index)
+    {
+      throw std::runtime_error("failed to write \"" + tmp_path + "\"");
+    }
+    fprintf(index, "%016" PRIx64 "\n", hash);
+    if (fclose(index) != 0 || rename(tmp_path.c_str(), index_path.c_str()) != 0)
+    {
+      throw std::runtime_error("failed to write \"" + index_path + "\"");
+    }
+  }
+  catch (std::runtime_error& e)
+  {
+    // The map is still cached in memory
+    ROS_WARN("multimap_client: could not cache %s on disk: %s", key.c_str(), e.what());
+  }
+}
+
+void MultimapClient::countIndexedHashes()
+{
+  std::string index_dir = cache_dir_ + "/index";
+  DIR* dir = opendir(index_dir.c_str());
+  if (!dir)
+    return;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    std::string name = entry->d_name;
+    uint64_t hash;
+    bool temporary = name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0;
+    if (name[0] != '.' && !temporary && readIndex(index_dir + "/" + name, &hash))
+      hash_refs_[hash]++;
+  }
+  closedir(dir);
+}
+
+void MultimapClient::releaseHash(uint64_t hash)
+{
+  std::map<uint64_t, unsigned int>::iterator refs = hash_refs_.find(hash);
+  if (refs != hash_refs_.end() && --refs->second > 0)
+    return;
+  if (refs != hash_refs_.end())
+    hash_refs_.erase(refs);
+  memory_cache_.erase(hash);
+  if (!cache_dir_.empty())
+    unlink(gridPath(hash).c_str());
+}
+
+std::string MultimapClient::indexPath(const std::string& key) const
+{
+  return cache_dir_ + "/index/" + sanitize(key);
+}
+
+std::string MultimapClient::gridPath(uint64_t hash) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016" PRIx64 ".mmpack", hash);
+  return cache_dir_ + "/" + name;
+}
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Front end of a sharded multimap_server deployment. Environments are
+ * assigned to the shards by consistent hashing on their name (see
+ * shard_ring.h); the router forwards the administrative services to the
+ * owning shard, or to all of them, and aggregates their environments
+ * topics. Maps themselves are served directly by the shards.
+ */
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "ros/ros.h"
+#include "ros/console.h"
+#include <std_srvs/Trigger.h>
+#include <multimap_server_msgs/Environments.h>
+#include <multimap_server_msgs/LoadMap.h>
+#include <multimap_server_msgs/DumpMap.h>
+#include <multimap_server_msgs/LoadEnvironments.h>
+#include <multimap_server/LoadMapAsync.h>
+#include <multimap_server/CancelLoad.h>
+#include <multimap_server/LoadProgress.h>
+#include <multimap_server/FetchMap.h>
+#include <multimap_server/EditMap.h>
+#include <multimap_server/ReloadLayer.h>
+#include <multimap_server/DiffMaps.h>
+#include <multimap_server/StitchMaps.h>
+#include <multimap_server/TransformMap.h>
+#include <multimap_server/LocateMap.h>
+
+#include "multimap_server/shard_ring.h"
+
+class MultimapRouter
+{
+public:
+  MultimapRouter() : pn("~"), next_job_id(1)
+  {
+    if (!pn.getParam("shards", shards) || shards.empty())
+    {
+      ROS_ERROR("~shards must list the multimap_server nodes, in shard_index order");
+      exit(-1);
+    }
+    ring = boost::make_shared<multimap_server::ShardRing>(shards.size());
+    shard_environments.resize(shards.size());
+
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+      ROS_INFO("Shard %lu: %s", (unsigned long)i, shards[i].c_str());
+      environment_subs.push_back(n.subscribe<multimap_server_msgs::Environments>(
+          shards[i] + "/environments", 1, boost::bind(&MultimapRouter::environmentsCallback, this, i, _1)));
+      progress_subs.push_back(n.subscribe<multimap_server::LoadProgress>(
+          shards[i] + "/load_progress", 100, boost::bind(&MultimapRouter::progressCallback, this, i, _1)));
+    }
+
+    load_map_service = pn.advertiseService("load_map", &MultimapRouter::loadMapCallback, this);
+    load_map_async_service = pn.advertiseService("load_map_async", &MultimapRouter::loadMapAsyncCallback, this);
+    cancel_load_service = pn.advertiseService("cancel_load", &MultimapRouter::cancelLoadCallback, this);
+    load_environments_service =
+        pn.advertiseService("load_environments", &MultimapRouter::loadEnvironmentsCallback, this);
+    dump_map_service = pn.advertiseService("dump_map", &MultimapRouter::dumpMapCallback, this);
+    dump_environments_service =
+        pn.advertiseService("dump_environments", &MultimapRouter::dumpEnvironmentsCallback, this);
+    fetch_map_service = pn.advertiseService("fetch_map", &MultimapRouter::fetchMapCallback, this);
+    edit_map_service = pn.advertiseService("edit_map", &MultimapRouter::editMapCallback, this);
+    reload_layer_service = pn.advertiseService("reload_layer", &MultimapRouter::reloadLayerCallback, this);
+    diff_maps_service = pn.advertiseService("diff_maps", &MultimapRouter::diffMapsCallback, this);
+    stitch_maps_service = pn.advertiseService("stitch_maps", &MultimapRouter::stitchMapsCallback, this);
+    transform_map_service = pn.advertiseService("transform_map", &MultimapRouter::transformMapCallback, this);
+    locate_map_service = pn.advertiseService("locate_map", &MultimapRouter::locateMapCallback, this);
+
+    environments_pub = pn.advertise<multimap_server_msgs::Environments>("environments", 1, true);
+    progress_pub = pn.advertise<multimap_server::LoadProgress>("load_progress", 100);
+    timerPublish = n.createTimer(ros::Duration(0.2), &MultimapRouter::timerPublishCallback, this);
+  }
+
+private:
+  ros::NodeHandle n;
+  ros::NodeHandle pn;
+
+  std::vector<std::string> shards;
+  boost::shared_ptr<multimap_server::ShardRing> ring;
+
+  ros::Timer timerPublish;
+  ros::Publisher environments_pub;
+  ros::Publisher progress_pub;
+  std::vector<ros::Subscriber> environment_subs;
+  std::vector<ros::Subscriber> progress_subs;
+  ros::ServiceServer load_map_service;
+  ros::ServiceServer load_map_async_service;
+  ros::ServiceServer cancel_load_service;
+  ros::ServiceServer load_environments_service;
+  ros::ServiceServer dump_map_service;
+  ros::ServiceServer dump_environments_service;
+  ros::ServiceServer fetch_map_service;
+  ros::ServiceServer edit_map_service;
+  ros::ServiceServer reload_layer_service;
+  ros::ServiceServer diff_maps_service;
+  ros::ServiceServer stitch_maps_service;
+  ros::ServiceServer transform_map_service;
+  ros::ServiceServer locate_map_service;
+
+  /** Last environments message of every shard */
+  boost::mutex environments_mutex;
+  std::vector<multimap_server_msgs::Environments> shard_environments;
+
+  const std::string& ownerOf(const std::string& ns)
+  {
+    return shards[ring->shardFor(ns)];
+  }
+
+  /** Job ids are only unique within a shard, so the router hands out its own ids, remembering the shard job of
+   * each. The progress of a job can be seen before load_map_async returns its id, so ids are given on first sight */
+  boost::mutex jobs_mutex;
+  uint32_t next_job_id;
+  std::map<std::pair<size_t, uint32_t>, uint32_t> router_job_ids;
+  std::map<uint32_t, std::pair<size_t, uint32_t> > shard_jobs;
+  /** Jobs remembered, beyond which the oldest are forgotten */
+  static const size_t MAX_TRACKED_JOBS = 10000;
+
+  uint32_t routerJobId(uint32_t shard_job_id, size_t shard)
+  {
+    boost::mutex::scoped_lock lock(jobs_mutex);
+    std::pair<size_t, uint32_t> shard_job(shard, shard_job_id);
+    std::map<std::pair<size_t, uint32_t>, uint32_t>::const_iterator known = router_job_ids.find(shard_job);
+    if (known != router_job_ids.end())
+    {
+      return known->second;
+    }
+
+    uint32_t id = next_job_id++;
+    router_job_ids[shard_job] = id;
+    shard_jobs[id] = shard_job;
+    if (shard_jobs.size() > MAX_TRACKED_JOBS)
+    {
+      router_job_ids.erase(shard_jobs.begin()->second);
+      shard_jobs.erase(shard_jobs.begin());
+    }
+    return id;
+  }
+
+  /** @return false if the router does not know the job */
+  bool shardJob(uint32_t router_job_id, size_t* shard, uint32_t* shard_job_id)
+  {
+    boost::mutex::scoped_lock lock(jobs_mutex);
+    std::map<uint32_t, std::pair<size_t, uint32_t> >::const_iterator it = shard_jobs.find(router_job_id);
+    if (it == shard_jobs.end())
+    {
+      return false;
+    }
+    *shard = it->second.first;
+    *shard_job_id = it->second.second;
+    return true;
+  }
+
+  template <class S>
+  bool forward(const std::string& server, const std::string& service, S& srv, std::string* msg)
+  {
+    if (!ros::service::call(server + "/" + service, srv))
+    {
+      *msg = "multimap_router: call to " + server + "/" + service + " failed";
+      return false;
+    }
+    return true;
+  }
+
+  void environmentsCallback(size_t shard, const multimap_server_msgs::EnvironmentsConstPtr& msg)
+  {
+    boost::mutex::scoped_lock lock(environments_mutex);
+    shard_environments[shard] = *msg;
+  }
+
+  void progressCallback(size_t shard, const multimap_server::LoadProgressConstPtr& msg)
+  {
+    multimap_server::LoadProgress progress = *msg;
+    progress.job_id = routerJobId(msg->job_id, shard);
+    progress_pub.publish(progress);
+  }
+
+  void timerPublishCallback(const ros::TimerEvent& event)
+  {
+    multimap_server_msgs::Environments merged;
+    {
+      boost::mutex::scoped_lock lock(environments_mutex);
+      for (size_t i = 0; i < shard_environments.size(); i++)
+      {
+        merged.environments.insert(merged.environments.end(), shard_environments[i].environments.begin(),
+                                   shard_environments[i].environments.end());
+      }
+    }
+    environments_pub.publish(merged);
+  }
+
+  bool loadMapCallback(multimap_server_msgs::LoadMap::Request& req, multimap_server_msgs::LoadMap::Response& res)
+  {
+    multimap_server_msgs::LoadMap srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns), "load_map", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool loadMapAsyncCallback(multimap_server::LoadMapAsync::Request& req, multimap_server::LoadMapAsync::Response& res)
+  {
+    size_t shard = ring->shardFor(req.ns);
+    multimap_server::LoadMapAsync srv;
+    srv.request = req;
+    if (!forward(shards[shard], "load_map_async", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    res.job_id = routerJobId(srv.response.job_id, shard);
+    return true;
+  }
+
+  bool cancelLoadCallback(multimap_server::CancelLoad::Request& req, multimap_server::CancelLoad::Response& res)
+  {
+    size_t shard;
+    multimap_server::CancelLoad srv;
+    if (!shardJob(req.job_id, &shard, &srv.request.job_id))
+    {
+      res.success = false;
+      res.msg = "cancel_load service failed: there is no queued or running job " +
+                boost::lexical_cast<std::string>(req.job_id);
+      return true;
+    }
+    if (!forward(shards[shard], "cancel_load", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  /** Every shard reads the whole file and loads the environments it owns */
+  bool loadEnvironmentsCallback(multimap_server_msgs::LoadEnvironments::Request& req,
+                                multimap_server_msgs::LoadEnvironments::Response& res)
+  {
+    std::stringstream msg;
+    res.success = true;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+      multimap_server_msgs::LoadEnvironments srv;
+      srv.request = req;
+      std::string error;
+      if (!forward(shards[i], "load_environments", srv, &error))
+      {
+        srv.response.success = false;
+        srv.response.msg = error;
+      }
+      res.success = res.success && srv.response.success;
+      msg << shards[i] << ": " << srv.response.msg << ". ";
+    }
+    res.msg = msg.str();
+    return true;
+  }
+
+  bool dumpMapCallback(multimap_server_msgs::DumpMap::Request& req, multimap_server_msgs::DumpMap::Response& res)
+  {
+    multimap_server_msgs::DumpMap srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns), "dump_map", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool dumpEnvironmentsCallback(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res)
+  {
+    std::stringstream msg;
+    res.success = true;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+      std_srvs::Trigger srv;
+      std::string error;
+      if (!forward(shards[i], "dump_environments", srv, &error))
+      {
+        srv.response.success = false;
+        srv.response.message = error;
+      }
+      res.success = res.success && srv.response.success;
+      msg << shards[i] << ": " << srv.response.message << ". ";
+    }
+    res.message = msg.str();
+    return true;
+  }
+
+  bool fetchMapCallback(multimap_server::FetchMap::Request& req, multimap_server::FetchMap::Response& res)
+  {
+    multimap_server::FetchMap srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns), "fetch_map", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool editMapCallback(multimap_server::EditMap::Request& req, multimap_server::EditMap::Response& res)
+  {
+    multimap_server::EditMap srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns), "edit_map", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool reloadLayerCallback(multimap_server::ReloadLayer::Request& req, multimap_server::ReloadLayer::Response& res)
+  {
+    multimap_server::ReloadLayer srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns), "reload_layer", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool diffMapsCallback(multimap_server::DiffMaps::Request& req, multimap_server::DiffMaps::Response& res)
+  {
+    if (ownerOf(req.ns_a) != ownerOf(req.ns_b))
+    {
+      res.success = false;
+      res.msg = "diff_maps service failed: environments " + req.ns_a + " and " + req.ns_b + " are on different shards";
+      return true;
+    }
+    multimap_server::DiffMaps srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns_a), "diff_maps", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool stitchMapsCallback(multimap_server::StitchMaps::Request& req, multimap_server::StitchMaps::Response& res)
+  {
+    multimap_server::StitchMaps srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns), "stitch_maps", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool transformMapCallback(multimap_server::TransformMap::Request& req, multimap_server::TransformMap::Response& res)
+  {
+    multimap_server::TransformMap srv;
+    srv.request = req;
+    if (!forward(ownerOf(req.ns), "transform_map", srv, &res.msg))
+    {
+      res.success = false;
+      return true;
+    }
+    res = srv.response;
+    return true;
+  }
+
+  bool locateMapCallback(multimap_server::LocateMap::Request& req, multimap_server::LocateMap::Response& res)
+  {
+    size_t shard = ring->shardFor(req.ns);
+    res.server_name = shards[shard];
+    res.map_service = shards[shard] + "/maps/" + req.ns + "/" + req.map_name + "/static_map";
+
+    boost::mutex::scoped_lock lock(environments_mutex);
+    const std::vector<multimap_server_msgs::Environment>& environments = shard_environments[shard].environments;
+    for (size_t i = 0; i < environments.size(); i++)
+    {
+      if (environments[i].name != req.ns)
+        continue;
+      for (size_t j = 0; j < environments[i].map_name.size(); j++)
+      {
+        if (environments[i].map_name[j] == req.map_name)
+        {
+          res.success = true;
+          res.msg = req.ns + "/" + req.map_name + " is served by " + res.server_name;
+          return true;
+        }
+      }
+    }
+    res.success = false;
+    res.msg = req.ns + "/" + req.map_name + " is not loaded; its environment belongs to " + res.server_name;
+    return true;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "multimap_router");
+
+  // Forwarded calls can take as long as the shard needs to load a map, so they are served by several threads
+  int spinner_threads;
+  ros::NodeHandle("~").param("spinner_threads", spinner_threads, 0);
+  ros::AsyncSpinner spinner(spinner_threads);
+
+  // The callbacks only start once the router is fully built
+  MultimapRouter router;
+  spinner.start();
+  ros::waitForShutdown();
+  spinner.stop();
+  return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Consistent hashing of environments to shards.
+ */
+
+#include <stdio.h>
+
+#include <stdexcept>
+
+#include "multimap_server/checksum.h"
+#include "multimap_server/shard_ring.h"
+
+namespace multimap_server
+{
+ShardRing::ShardRing(size_t shard_count, size_t virtual_nodes) : shard_count_(shard_count)
+{
+  if (shard_count == 0 || virtual_nodes == 0)
+  {
+    throw std::runtime_error("a shard ring needs at least one shard and one virtual node per shard");
+  }
+
+  for (size_t shard = 0; shard < shard_count; shard++)
+  {
+    for (size_t node = 0; node < virtual_nodes; node++)
+    {
+      char label[64];
+      int length = snprintf(label, sizeof(label), "shard-%lu-%lu", (unsigned long)shard, (unsigned long)node);
+      ring_[checksum64(label, length)] = shard;
+    }
+  }
+}
+
+size_t ShardRing::shardFor(const std::string& environment) const
+{
+  std::map<uint64_t, size_t>::const_iterator it = ring_.lower_bound(checksum64(environment.data(), environment.size()));
+  if (it == ring_.end())
+  {
+    // Wrap around the ring
+    it = ring_.begin();
+  }
+  return it->second;
+}
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Placement of maps in POSIX shared memory, for readers on the same host.
+ */
+
+#include "multimap_server/shm_map_store.h"
+
+#define SHM_MAP_ALIGNMENT 4096
+
+namespace multimap_server
+{
+ShmMapSegment::ShmMapSegment(const std::string& ns, const std::string& map_name, const std::string& prefix,
+                             const ShmMapHeader& metadata, const int8_t* data)
+  : name_(shmMapSegmentName(ns, map_name, prefix)), mapping_(NULL), size_(0), removed_(false)
+{
+  size_t header_size = (sizeof(ShmMapHeader) + SHM_MAP_ALIGNMENT - 1) / SHM_MAP_ALIGNMENT * SHM_MAP_ALIGNMENT;
+  size_t cells = (size_t)metadata.width * metadata.height;
+  size_ = header_size + cells;
+
+  // A segment left behind by a previous server is unlinked rather than resized, so that processes still mapping it
+  // never see it shrink under them
+  shm_unlink(name_.c_str());
+  int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0)
+  {
+    throw std::runtime_error("failed to create shared memory map \"" + name_ + "\": " + strerror(errno));
+  }
+  if (ftruncate(fd, size_) != 0)
+  {
+    std::string error = strerror(errno);
+    close(fd);
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("failed to size shared memory map \"" + name_ + "\": " + error);
+  }
+  mapping_ = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping_ == MAP_FAILED)
+  {
+    mapping_ = NULL;
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("failed to map shared memory map \"" + name_ + "\": " + strerror(errno));
+  }
+
+  ShmMapHeader* h = header();
+  *h = metadata;
+  memcpy(h->magic, SHM_MAP_MAGIC, sizeof(h->magic));
+  h->version = SHM_MAP_VERSION;
+  h->header_size = header_size;
+  h->removed = 0;
+  // Odd while the grid is being filled; the first consistent sequence number is 2
+  h->sequence = 1;
+  if (data)
+  {
+    memcpy(this->data(), data, cells);
+    __atomic_store_n(&h->sequence, 2, __ATOMIC_RELEASE);
+  }
+}
+
+ShmMapSegment::~ShmMapSegment()
+{
+  if (mapping_)
+  {
+    munmap(mapping_, size_);
+  }
+}
+
+void ShmMapSegment::beginUpdate()
+{
+  __atomic_store_n(&header()->sequence, header()->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+int8_t* ShmMapSegment::data()
+{
+  return (int8_t*)mapping_ + header()->header_size;
+}
+
+void ShmMapSegment::endUpdate()
+{
+  __atomic_store_n(&header()->sequence, header()->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void ShmMapSegment::remove()
+{
+  if (removed_)
+    return;
+  __atomic_store_n(&header()->removed, 1, __ATOMIC_RELEASE);
+  shm_unlink(name_.c_str());
+  removed_ = true;
+}
+}
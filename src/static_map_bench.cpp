@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures static_map latency of a running multimap_server, first on an idle server and then while another map
+ * is repeatedly loaded and dumped through the administrative services.
+ */
+
+#define USAGE                                                                                                          \
+  "\nUSAGE: static_map_bench <static_map_service> <map_yaml_for_background_loads>\n"                                   \
+  "  static_map_service: e.g. /multimap_server/maps/level_1/localization/static_map\n"                                \
+  "  map_yaml_for_background_loads: map loaded and dumped in a loop during the second phase"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "ros/ros.h"
+#include "ros/console.h"
+#include "nav_msgs/GetMap.h"
+#include <multimap_server_msgs/LoadMap.h>
+#include <multimap_server_msgs/DumpMap.h>
+
+class StaticMapBench
+{
+public:
+  StaticMapBench(const std::string& map_service, const std::string& load_map_url)
+    : pn("~"), map_service(map_service), load_map_url(load_map_url), running(false), loading(false), loads_done(0)
+  {
+    pn.param("client_threads", client_threads, 4);
+    pn.param("phase_duration", phase_duration, 20.0);
+    pn.param("server_name", server_name, std::string("/multimap_server"));
+  }
+
+  void run()
+  {
+    ros::service::waitForService(map_service);
+    ros::service::waitForService(server_name + "/load_map");
+
+    std::vector<double> idle = measure(false);
+    report("idle", idle);
+
+    std::vector<double> busy = measure(true);
+    report("during load_map/dump_map", busy);
+    ROS_INFO("%d background loads completed during the second phase", loads_done);
+  }
+
+private:
+  ros::NodeHandle n;
+  ros::NodeHandle pn;
+  std::string map_service;
+  std::string load_map_url;
+  std::string server_name;
+  int client_threads;
+  double phase_duration;
+
+  volatile bool running;
+  volatile bool loading;
+  int loads_done;
+  boost::mutex latencies_mutex;
+  std::vector<double> latencies;
+
+  std::vector<double> measure(bool with_background_loads)
+  {
+    latencies.clear();
+    running = true;
+    loading = with_background_loads;
+
+    boost::thread_group clients;
+    for (int i = 0; i < client_threads; i++)
+    {
+      clients.create_thread(boost::bind(&StaticMapBench::clientLoop, this));
+    }
+    boost::thread loader;
+    if (with_background_loads)
+    {
+      loader = boost::thread(boost::bind(&StaticMapBench::loaderLoop, this));
+    }
+
+    ros::WallDuration(phase_duration).sleep();
+    running = false;
+    clients.join_all();
+    if (loader.joinable())
+    {
+      loader.join();
+    }
+    return latencies;
+  }
+
+  void clientLoop()
+  {
+    // Service clients are not thread safe, so every thread uses its own persistent connection
+    ros::ServiceClient client = n.serviceClient<nav_msgs::GetMap>(map_service, true);
+    nav_msgs::GetMap srv;
+    while (running && ros::ok())
+    {
+      ros::WallTime start = ros::WallTime::now();
+      if (!client.call(srv))
+      {
+        ROS_WARN("static_map call failed, reconnecting");
+        client = n.serviceClient<nav_msgs::GetMap>(map_service, true);
+        continue;
+      }
+      double latency = (ros::WallTime::now() - start).toSec();
+
+      boost::mutex::scoped_lock lock(latencies_mutex);
+      latencies.push_back(latency);
+    }
+  }
+
+  void loaderLoop()
+  {
+    ros::ServiceClient load_client = n.serviceClient<multimap_server_msgs::LoadMap>(server_name + "/load_map");
+    ros::ServiceClient dump_client = n.serviceClient<multimap_server_msgs::DumpMap>(server_name + "/dump_map");
+
+    multimap_server_msgs::LoadMap load;
+    load.request.map_url = load_map_url;
+    load.request.ns = "static_map_bench";
+    load.request.map_name = "background";
+    load.request.global_frame = "static_map_bench";
+
+    multimap_server_msgs::DumpMap dump;
+    dump.request.ns = load.request.ns;
+    dump.request.map_name = load.request.map_name;
+
+    while (running && loading && ros::ok())
+    {
+      if (!load_client.call(load) || !load.response.success)
+      {
+        ROS_WARN("Background load_map failed: %s", load.response.msg.c_str());
+        break;
+      }
+      dump_client.call(dump);
+      loads_done++;
+    }
+  }
+
+  void report(const std::string& phase, std::vector<double> samples)
+  {
+    if (samples.empty())
+    {
+      ROS_WARN("%s: no samples", phase.c_str());
+      return;
+    }
+    std::sort(samples.begin(), samples.end());
+    ROS_INFO("%s: %lu calls, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms", phase.c_str(),
+             (unsigned long)samples.size(), 1000.0 * percentile(samples, 0.50), 1000.0 * percentile(samples, 0.90),
+             1000.0 * percentile(samples, 0.99), 1000.0 * samples.back());
+  }
+
+  double percentile(const std::vector<double>& sorted, double p)
+  {
+    size_t index = (size_t)(p * (sorted.size() - 1));
+    return sorted[index];
+  }
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "static_map_bench", ros::init_options::AnonymousName);
+  if (argc != 3)
+  {
+    ROS_ERROR("%s", USAGE);
+    exit(-1);
+  }
+
+  StaticMapBench bench(argv[1], argv[2]);
+  bench.run();
+  return 0;
+}
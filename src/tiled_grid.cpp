@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Copy-on-write tiled occupancy grid.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <boost/make_shared.hpp>
+
+#include "multimap_server/tiled_grid.h"
+
+namespace multimap_server
+{
+const unsigned int TiledGrid::TILE_SIZE;
+
+TiledGrid::TiledGrid() : width_(0), height_(0), tiles_x_(0), tiles_y_(0)
+{
+}
+
+TiledGrid::TiledGrid(unsigned int width, unsigned int height, const int8_t* data)
+  : width_(width)
+  , height_(height)
+  , tiles_x_((width + TILE_SIZE - 1) / TILE_SIZE)
+  , tiles_y_((height + TILE_SIZE - 1) / TILE_SIZE)
+{
+  tiles_.resize((size_t)tiles_x_ * tiles_y_);
+  for (unsigned int ty = 0; ty < tiles_y_; ty++)
+  {
+    for (unsigned int tx = 0; tx < tiles_x_; tx++)
+    {
+      // Edge tiles are padded to the full tile size
+      boost::shared_ptr<Tile> tile = boost::make_shared<Tile>(TILE_SIZE * TILE_SIZE, -1);
+      unsigned int x0 = tx * TILE_SIZE;
+      unsigned int cols = std::min(TILE_SIZE, width_ - x0);
+      for (unsigned int row = 0; data && row < TILE_SIZE && ty * TILE_SIZE + row < height_; row++)
+      {
+        memcpy(&(*tile)[row * TILE_SIZE], data + (size_t)(ty * TILE_SIZE + row) * width_ + x0, cols);
+      }
+      tiles_[(size_t)ty * tiles_x_ + tx] = tile;
+    }
+  }
+}
+
+TiledGrid TiledGrid::withoutTiles(unsigned int width, unsigned int height)
+{
+  TiledGrid grid;
+  grid.width_ = width;
+  grid.height_ = height;
+  grid.tiles_x_ = (width + TILE_SIZE - 1) / TILE_SIZE;
+  grid.tiles_y_ = (height + TILE_SIZE - 1) / TILE_SIZE;
+  grid.tiles_.resize((size_t)grid.tiles_x_ * grid.tiles_y_);
+  return grid;
+}
+
+int8_t TiledGrid::get(unsigned int x, unsigned int y) const
+{
+  return tile(x, y)[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+}
+
+void TiledGrid::set(unsigned int x, unsigned int y, int8_t value)
+{
+  writableTile(x, y)[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE] = value;
+}
+
+void TiledGrid::copyRows(unsigned int first_row, unsigned int rows, int8_t* out) const
+{
+  CellBox box = { 0, first_row, width_ - 1, first_row + rows - 1 };
+  if (rows > 0 && width_ > 0)
+    copyBox(box, out);
+}
+
+void TiledGrid::copyBox(const CellBox& box, int8_t* out) const
+{
+  size_t out_width = box.max_x - box.min_x + 1;
+  for (unsigned int y = box.min_y; y <= box.max_y; y++)
+  {
+    int8_t* out_row = out + (size_t)(y - box.min_y) * out_width;
+    // One memcpy per tile crossed by the row
+    for (unsigned int x = box.min_x; x <= box.max_x;)
+    {
+      unsigned int cols = std::min(TILE_SIZE - x % TILE_SIZE, box.max_x - x + 1);
+      memcpy(out_row + (x - box.min_x), &tile(x, y)[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE], cols);
+      x += cols;
+    }
+  }
+}
+
+void TiledGrid::fillBox(const CellBox& box, int8_t value)
+{
+  for (unsigned int y = box.min_y; y <= box.max_y; y++)
+  {
+    for (unsigned int x = box.min_x; x <= box.max_x;)
+    {
+      unsigned int cols = std::min(TILE_SIZE - x % TILE_SIZE, box.max_x - x + 1);
+      memset(&writableTile(x, y)[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE], value, cols);
+      x += cols;
+    }
+  }
+}
+
+bool TiledGrid::fillPolygon(const std::vector<std::pair<double, double> >& vertices, int8_t value, CellBox* touched)
+{
+  if (vertices.size() < 3 || width_ == 0 || height_ == 0)
+    return false;
+
+  double min_y = vertices[0].second;
+  double max_y = vertices[0].second;
+  for (size_t i = 0; i < vertices.size(); i++)
+  {
+    if (!std::isfinite(vertices[i].first) || !std::isfinite(vertices[i].second))
+      return false;
+    min_y = std::min(min_y, vertices[i].second);
+    max_y = std::max(max_y, vertices[i].second);
+  }
+
+  // Scanlines through the cell centers, clamped to the grid before converting
+  double first_y = std::max(0.0, ceil(min_y - 0.5));
+  double last_y = std::min((double)height_ - 1, floor(max_y - 0.5));
+  if (first_y > last_y)
+    return false;
+
+  bool filled = false;
+  std::vector<double> crossings;
+  for (unsigned int row = first_y; row <= (unsigned int)last_y; row++)
+  {
+    double y = row + 0.5;
+    crossings.clear();
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+      const std::pair<double, double>& a = vertices[i];
+      const std::pair<double, double>& b = vertices[(i + 1) % vertices.size()];
+      if ((a.second <= y) != (b.second <= y))
+      {
+        double x = a.first + (y - a.second) * (b.first - a.first) / (b.second - a.second);
+        if (!std::isfinite(x))
+        {
+          // Far away vertices overflow the products, not the interpolation
+          double t = (y - a.second) / (b.second - a.second);
+          x = a.first * (1 - t) + b.first * t;
+        }
+        crossings.push_back(x);
+      }
+    }
+    std::sort(crossings.begin(), crossings.end());
+
+    // Cells whose center x + 0.5 is in [crossings[k], crossings[k + 1])
+    for (size_t k = 0; k + 1 < crossings.size(); k += 2)
+    {
+      double first_col = std::max(0.0, ceil(crossings[k] - 0.5));
+      double last_col = std::min((double)width_ - 1, ceil(crossings[k + 1] - 0.5) - 1);
+      if (first_col > last_col)
+        continue;
+
+      CellBox span = { (unsigned int)first_col, row, (unsigned int)last_col, row };
+      fillBox(span, value);
+      growBox(touched, span);
+      filled = true;
+    }
+  }
+  return filled;
+}
+
+size_t TiledGrid::ownedTiles() const
+{
+  size_t owned = 0;
+  for (size_t i = 0; i < tiles_.size(); i++)
+  {
+    if (tiles_[i].unique())
+      owned++;
+  }
+  return owned;
+}
+
+CellBox TiledGrid::tileBox(unsigned int tx, unsigned int ty) const
+{
+  CellBox box = { tx * TILE_SIZE, ty * TILE_SIZE, std::min(width_, (tx + 1) * TILE_SIZE) - 1,
+                  std::min(height_, (ty + 1) * TILE_SIZE) - 1 };
+  return box;
+}
+
+int8_t* TiledGrid::writableTileData(unsigned int tx, unsigned int ty)
+{
+  return &writableTile(tx * TILE_SIZE, ty * TILE_SIZE)[0];
+}
+
+int8_t* TiledGrid::allocateTile(unsigned int tx, unsigned int ty)
+{
+  boost::shared_ptr<Tile>& tile = tiles_[(size_t)ty * tiles_x_ + tx];
+  tile = boost::make_shared<Tile>(TILE_SIZE * TILE_SIZE);
+  return &(*tile)[0];
+}
+
+void TiledGrid::shareTile(const TiledGrid& other, unsigned int tx, unsigned int ty)
+{
+  tiles_[(size_t)ty * tiles_x_ + tx] = other.tiles_[(size_t)ty * other.tiles_x_ + tx];
+}
+
+TiledGrid::Tile& TiledGrid::writableTile(unsigned int x, unsigned int y)
+{
+  boost::shared_ptr<Tile>& tile = tiles_[(y / TILE_SIZE) * tiles_x_ + x / TILE_SIZE];
+  if (!tile.unique())
+  {
+    // Shared with another version of the grid
+    tile = boost::make_shared<Tile>(*tile);
+  }
+  return *tile;
+}
+
+void growBox(CellBox* box, const CellBox& other)
+{
+  if (box->min_x > box->max_x)
+  {
+    *box = other;
+    return;
+  }
+  box->min_x = std::min(box->min_x, other.min_x);
+  box->min_y = std::min(box->min_y, other.min_y);
+  box->max_x = std::max(box->max_x, other.max_x);
+  box->max_y = std::max(box->max_y, other.max_y);
+}
+}
@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Content-addressed cache of the map files named by URLs.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <curl/curl.h>
+#include <boost/lexical_cast.hpp>
+
+#include "ros/console.h"
+#include "ros/package.h"
+#include <resource_retriever/retriever.h>
+
+#include "multimap_server/checksum.h"
+#include "multimap_server/url_cache.h"
+
+namespace multimap_server
+{
+namespace
+{
+/** Scheme of url in lower case, empty if url is a path */
+std::string scheme(const std::string& url)
+{
+  size_t end = url.find("://");
+  if (end == std::string::npos || end == 0)
+    return "";
+  std::string result = url.substr(0, end);
+  for (size_t i = 0; i < result.size(); i++)
+  {
+    if (!isalnum(result[i]) && result[i] != '+' && result[i] != '-' && result[i] != '.')
+      return "";
+    result[i] = tolower(result[i]);
+  }
+  return result;
+}
+
+void makeDirectory(const std::string& path)
+{
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    throw std::runtime_error("failed to create cache directory \"" + path + "\"");
+  }
+}
+
+std::string hex(uint64_t value)
+{
+  char text[17];
+  snprintf(text, sizeof(text), "%016" PRIx64, value);
+  return text;
+}
+
+/** Extension of the file named by url, e.g. ".png". Image formats are recognized by their contents, but the
+ * extension keeps cached files readable by hand */
+std::string extension(const std::string& url)
+{
+  std::string path = url.substr(0, url.find_first_of("?#"));
+  size_t slash = path.rfind('/');
+  size_t dot = path.rfind('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || path.size() - dot > 8)
+    return "";
+  return path.substr(dot);
+}
+
+std::string trim(const std::string& text)
+{
+  size_t first = text.find_first_not_of(" \t\r\n");
+  if (first == std::string::npos)
+    return "";
+  return text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+int64_t modificationTime(const struct stat& info)
+{
+  return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+/** Open a new file next to the objects of the cache, where a download is written before it is renamed */
+FILE* openTemporary(const std::string& cache_dir, std::string* path)
+{
+  std::string pattern = cache_dir + "/objects/.download-XXXXXX";
+  std::vector<char> name(pattern.begin(), pattern.end());
+  name.push_back('\0');
+  int fd = mkstemp(&name[0]);
+  FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!file)
+  {
+    if (fd >= 0)
+      close(fd);
+    throw std::runtime_error("failed to create a file in \"" + cache_dir + "/objects\"");
+  }
+  *path = &name[0];
+  return file;
+}
+
+/** Body of a transfer, hashed as it is written */
+struct Download
+{
+  FILE* file;
+  Checksum64 checksum;
+  uint64_t size;
+};
+
+size_t writeBody(char* data, size_t size, size_t count, void* user_data)
+{
+  Download* download = static_cast<Download*>(user_data);
+  size_t bytes = size * count;
+  if (fwrite(data, 1, bytes, download->file) != bytes)
+    return 0;
+  download->checksum.update(data, bytes);
+  download->size += bytes;
+  return bytes;
+}
+
+/** Validators of a response */
+struct Validators
+{
+  std::string etag;
+  std::string last_modified;
+};
+
+size_t readHeader(char* data, size_t size, size_t count, void* user_data)
+{
+  Validators* validators = static_cast<Validators*>(user_data);
+  std::string line(data, size * count);
+  size_t colon = line.find(':');
+  std::string name = line.substr(0, colon);
+  for (size_t i = 0; i < name.size(); i++)
+    name[i] = tolower(name[i]);
+
+  if (name.compare(0, 5, "http/") == 0)
+  {
+    // Status line of a new response, after a redirection
+    *validators = Validators();
+  }
+  else if (colon != std::string::npos && name == "etag")
+  {
+    validators->etag = trim(line.substr(colon + 1));
+  }
+  else if (colon != std::string::npos && name == "last-modified")
+  {
+    validators->last_modified = trim(line.substr(colon + 1));
+  }
+  return size * count;
+}
+
+/** Write data to a new temporary file of the cache */
+void writeTemporary(const std::string& cache_dir, const uint8_t* data, size_t size, uint64_t* checksum,
+                    std::string* path)
+{
+  FILE* file = openTemporary(cache_dir, path);
+  bool written = fwrite(data, 1, size, file) == size;
+  if (fclose(file) != 0 || !written)
+  {
+    unlink(path->c_str());
+    throw std::runtime_error("failed to write \"" + *path + "\"");
+  }
+  *checksum = checksum64(data, size);
+}
+}
+
+const int UrlCache::MIN_EVICTION_AGE;
+
+UrlCache::UrlCache(const std::string& cache_dir, double timeout, uint64_t max_bytes)
+  : cache_dir_(cache_dir), timeout_(timeout), max_bytes_(max_bytes)
+{
+  // Not thread safe, unlike the rest of libcurl
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+bool UrlCache::isUrl(const std::string& name)
+{
+  return !scheme(name).empty();
+}
+
+std::string UrlCache::defaultCacheDir()
+{
+  const char* ros_home = getenv("ROS_HOME");
+  if (ros_home)
+    return std::string(ros_home) + "/multimap_url_cache";
+  const char* home = getenv("HOME");
+  return std::string(home ? home : ".") + "/.ros/multimap_url_cache";
+}
+
+std::string UrlCache::fetch(const std::string& url)
+{
+  std::string url_scheme = scheme(url);
+  if (url_scheme.empty())
+  {
+    return url;
+  }
+  if (url_scheme == "file")
+  {
+    return url.substr(7);
+  }
+  if (url_scheme == "package")
+  {
+    std::string rest = url.substr(10);
+    size_t slash = rest.find('/');
+    std::string package = rest.substr(0, slash);
+    std::string package_path = ros::package::getPath(package);
+    if (package_path.empty())
+    {
+      throw std::runtime_error("package " + package + " of " + url + " could not be found");
+    }
+    return slash == std::string::npos ? package_path : package_path + rest.substr(slash);
+  }
+
+  makeDirectory(cache_dir_);
+  makeDirectory(cache_dir_ + "/objects");
+  makeDirectory(cache_dir_ + "/urls");
+
+  Entry cached;
+  bool have_cached = readEntry(url, &cached) && objectValid(url, &cached);
+  Entry fetched;
+  std::string temp_path;
+  try
+  {
+    if (url_scheme == "http" || url_scheme == "https")
+    {
+      if (!httpGet(url, have_cached ? &cached : NULL, &fetched, &temp_path))
+      {
+        ROS_DEBUG("%s is not modified, using the cached copy", url.c_str());
+        // The modification time of the entry orders the evictions
+        utimes(entryPath(url).c_str(), NULL);
+        return objectPath(url, cached.checksum);
+      }
+    }
+    else
+    {
+      retrieve(url, &fetched, &temp_path);
+    }
+  }
+  catch (std::runtime_error& e)
+  {
+    if (!have_cached)
+    {
+      throw std::runtime_error("failed to fetch " + url + ": " + e.what());
+    }
+    ROS_WARN("Could not fetch %s (%s), using the cached copy", url.c_str(), e.what());
+    utimes(entryPath(url).c_str(), NULL);
+    return objectPath(url, cached.checksum);
+  }
+
+  // Files are stored under their checksum: a URL that changed back, or another URL of the same file, reuses them
+  std::string path = objectPath(url, fetched.checksum);
+  struct stat info;
+  if (rename(temp_path.c_str(), path.c_str()) != 0 || stat(path.c_str(), &info) != 0)
+  {
+    unlink(temp_path.c_str());
+    throw std::runtime_error("failed to write \"" + path + "\"");
+  }
+  // The copy was hashed as it was written: it is only hashed again if it changes
+  fetched.mtime = modificationTime(info);
+  writeEntry(url, fetched);
+  ROS_INFO("Fetched %s, %" PRIu64 " bytes", url.c_str(), fetched.size);
+  evict(path);
+  return path;
+}
+
+MapDescription UrlCache::loadMapDescription(const std::string& url)
+{
+  MapDescription desc = multimap_server::loadMapDescription(fetch(url), url);
+  desc.image = fetch(desc.image);
+  std::vector<LayerDescription>::iterator layer;
+  for (layer = desc.layers.begin(); layer != desc.layers.end(); ++layer)
+  {
+    layer->image = fetch(layer->image);
+  }
+  return desc;
+}
+
+bool UrlCache::httpGet(const std::string& url, const Entry* cached, Entry* entry, std::string* temp_path)
+{
+  CURL* curl = curl_easy_init();
+  if (!curl)
+  {
+    throw std::runtime_error("libcurl could not be initialized");
+  }
+
+  struct curl_slist* request_headers = NULL;
+  if (cached && !cached->etag.empty())
+    request_headers = curl_slist_append(request_headers, ("If-None-Match: " + cached->etag).c_str());
+  if (cached && !cached->last_modified.empty())
+    request_headers = curl_slist_append(request_headers, ("If-Modified-Since: " + cached->last_modified).c_str());
+
+  Download download;
+  download.size = 0;
+  try
+  {
+    download.file = openTemporary(cache_dir_, temp_path);
+  }
+  catch (std::runtime_error&)
+  {
+    curl_slist_free_all(request_headers);
+    curl_easy_cleanup(curl);
+    throw;
+  }
+  Validators validators;
+
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  // Timeouts must not raise signals in a multithreaded process
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  if (timeout_ > 0.0)
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)(timeout_ * 1000.0));
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeBody);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &download);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, readHeader);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &validators);
+
+  CURLcode result = curl_easy_perform(curl);
+  long status = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  curl_slist_free_all(request_headers);
+  curl_easy_cleanup(curl);
+  bool closed = fclose(download.file) == 0;
+
+  if (result != CURLE_OK || !closed || status != 200)
+  {
+    unlink(temp_path->c_str());
+    if (result != CURLE_OK)
+      throw std::runtime_error(curl_easy_strerror(result));
+    if (!closed)
+      throw std::runtime_error("failed to write \"" + *temp_path + "\"");
+    if (status == 304 && cached)
+      return false;
+    throw std::runtime_error("HTTP status " + boost::lexical_cast<std::string>(status));
+  }
+
+  entry->checksum = download.checksum.digest();
+  entry->size = download.size;
+  entry->mtime = 0;
+  entry->etag = validators.etag;
+  entry->last_modified = validators.last_modified;
+  return true;
+}
+
+void UrlCache::retrieve(const std::string& url, Entry* entry, std::string* temp_path)
+{
+  resource_retriever::Retriever retriever;
+  resource_retriever::MemoryResource resource = retriever.get(url);
+  writeTemporary(cache_dir_, resource.data.get(), resource.size, &entry->checksum, temp_path);
+  entry->size = resource.size;
+  entry->mtime = 0;
+  entry->etag.clear();
+  entry->last_modified.clear();
+}
+
+bool UrlCache::readEntry(const std::string& url, Entry* entry) const
+{
+  FILE* file = fopen(entryPath(url).c_str(), "r");
+  if (!file)
+    return false;
+
+  // One "name value" pair per line
+  std::string stored_url;
+  bool complete = false;
+  char line[4096];
+  entry->mtime = 0;
+  entry->etag.clear();
+  entry->last_modified.clear();
+  while (fgets(line, sizeof(line), file))
+  {
+    std::string text = trim(line);
+    size_t space = text.find(' ');
+    std::string name = text.substr(0, space);
+    std::string value = space == std::string::npos ? "" : text.substr(space + 1);
+    if (name == "url")
+      stored_url = value;
+    else if (name == "checksum")
+      complete = sscanf(value.c_str(), "%" SCNx64, &entry->checksum) == 1;
+    else if (name == "size")
+      complete = complete && sscanf(value.c_str(), "%" SCNu64, &entry->size) == 1;
+    else if (name == "mtime")
+      sscanf(value.c_str(), "%" SCNd64, &entry->mtime);
+    else if (name == "etag")
+      entry->etag = value;
+    else if (name == "last_modified")
+      entry->last_modified = value;
+  }
+  fclose(file);
+  // Entries are named after a checksum of the URL, which could collide
+  return complete && stored_url == url;
+}
+
+void UrlCache::writeEntry(const std::string& url, const Entry& entry) const
+{
+  std::string path = entryPath(url);
+  std::vector<char> tmp_path(path.begin(), path.end());
+  const char suffix[] = ".XXXXXX";
+  tmp_path.insert(tmp_path.end(), suffix, suffix + sizeof(suffix));
+  int fd = mkstemp(&tmp_path[0]);
+  FILE* file = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!file)
+  {
+    if (fd >= 0)
+      close(fd);
+    throw std::runtime_error("failed to write \"" + path + "\"");
+  }
+  fprintf(file, "url %s\nchecksum %016" PRIx64 "\nsize %" PRIu64 "\nmtime %" PRId64 "\netag %s\nlast_modified %s\n",
+          url.c_str(), entry.checksum, entry.size, entry.mtime, entry.etag.c_str(), entry.last_modified.c_str());
+  if (fclose(file) != 0 || rename(&tmp_path[0], path.c_str()) != 0)
+  {
+    unlink(&tmp_path[0]);
+    throw std::runtime_error("failed to write \"" + path + "\"");
+  }
+}
+
+bool UrlCache::objectValid(const std::string& url, Entry* entry) const
+{
+  std::string path = objectPath(url, entry->checksum);
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0)
+    return false;
+  if ((uint64_t)info.st_size == entry->size && modificationTime(info) == entry->mtime)
+    return true;
+
+  // Changed since it was stored, or stored for another URL of the same file
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+
+  Checksum64 checksum;
+  uint64_t size = 0;
+  std::vector<char> buffer(1 << 20);
+  size_t read;
+  while ((read = fread(&buffer[0], 1, buffer.size(), file)) > 0)
+  {
+    checksum.update(&buffer[0], read);
+    size += read;
+  }
+  fclose(file);
+  if (size != entry->size || checksum.digest() != entry->checksum)
+  {
+    ROS_WARN("Discarding the corrupted cached copy of %s", url.c_str());
+    return false;
+  }
+  entry->mtime = modificationTime(info);
+  try
+  {
+    writeEntry(url, *entry);
+  }
+  catch (std::runtime_error& e)
+  {
+    // Only costs hashing the copy again next time
+    ROS_DEBUG("%s", e.what());
+  }
+  return true;
+}
+
+std::string UrlCache::objectPath(const std::string& url, uint64_t checksum) const
+{
+  return cache_dir_ + "/objects/" + hex(checksum) + extension(url);
+}
+
+std::string UrlCache::entryPath(const std::string& url) const
+{
+  return cache_dir_ + "/urls/" + hex(checksum64(url.data(), url.size()));
+}
+
+void UrlCache::evict(const std::string& keep)
+{
+  if (max_bytes_ == 0)
+    return;
+  boost::mutex::scoped_lock lock(evict_mutex_);
+
+  std::string objects_dir = cache_dir_ + "/objects";
+  std::map<std::string, uint64_t> sizes;
+  uint64_t total = 0;
+  DIR* dir = opendir(objects_dir.c_str());
+  if (!dir)
+    return;
+  struct dirent* file;
+  while ((file = readdir(dir)) != NULL)
+  {
+    struct stat info;
+    // Skips downloads in progress
+    if (file->d_name[0] != '.' && stat((objects_dir + "/" + file->d_name).c_str(), &info) == 0)
+    {
+      sizes[file->d_name] = info.st_size;
+      total += info.st_size;
+    }
+  }
+  closedir(dir);
+  if (total <= max_bytes_)
+    return;
+
+  // A copy was last fetched when the newest entry naming it was written or reused
+  std::string urls_dir = cache_dir_ + "/urls";
+  std::map<std::string, time_t> last_fetch;
+  std::multimap<std::string, std::string> entries;
+  dir = opendir(urls_dir.c_str());
+  while (dir && (file = readdir(dir)) != NULL)
+  {
+    // Entries being written have a suffix
+    std::string path = urls_dir + "/" + file->d_name;
+    struct stat info;
+    Entry entry;
+    FILE* stored = NULL;
+    if (strchr(file->d_name, '.') || stat(path.c_str(), &info) != 0 || !(stored = fopen(path.c_str(), "r")))
+      continue;
+    char line[4096];
+    std::string url;
+    if (fgets(line, sizeof(line), stored) && strncmp(line, "url ", 4) == 0)
+      url = trim(line + 4);
+    fclose(stored);
+    if (url.empty() || !readEntry(url, &entry))
+      continue;
+    std::string object = objectPath(url, entry.checksum).substr(objects_dir.size() + 1);
+    last_fetch[object] = std::max(last_fetch[object], info.st_mtime);
+    entries.insert(std::make_pair(object, path));
+  }
+  if (dir)
+    closedir(dir);
+
+  // Copies no entry names anymore go first
+  std::vector<std::pair<time_t, std::string> > order;
+  std::map<std::string, uint64_t>::const_iterator it;
+  for (it = sizes.begin(); it != sizes.end(); ++it)
+  {
+    std::map<std::string, time_t>::const_iterator fetched = last_fetch.find(it->first);
+    order.push_back(std::make_pair(fetched != last_fetch.end() ? fetched->second : 0, it->first));
+  }
+  std::sort(order.begin(), order.end());
+
+  std::string kept = keep.substr(keep.rfind('/') + 1);
+  time_t now = time(NULL);
+  size_t deleted = 0;
+  uint64_t freed = 0;
+  for (size_t i = 0; i < order.size() && total > max_bytes_; i++)
+  {
+    const std::string& object = order[i].second;
+    if (object == kept || now - order[i].first < MIN_EVICTION_AGE || unlink((objects_dir + "/" + object).c_str()))
+      continue;
+    std::pair<std::multimap<std::string, std::string>::const_iterator,
+              std::multimap<std::string, std::string>::const_iterator>
+        naming = entries.equal_range(object);
+    for (std::multimap<std::string, std::string>::const_iterator entry = naming.first; entry != naming.second; ++entry)
+      unlink(entry->second.c_str());
+    total -= sizes[object];
+    freed += sizes[object];
+    deleted++;
+  }
+  if (deleted > 0)
+  {
+    ROS_INFO("Deleted %zu cached map files, %" PRIu64 " bytes, to keep the URL cache under %" PRIu64 " bytes",
+             deleted, freed, max_bytes_);
+  }
+}
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/checksum.h"
+
+using multimap_server::Checksum64;
+using multimap_server::checksum64;
+
+TEST(Checksum, IndependentOfSplits)
+{
+  std::vector<unsigned char> data(1000);
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    data[i] = (i * 131) ^ (i >> 3);
+  }
+  uint64_t whole = checksum64(&data[0], data.size());
+
+  // Splits that cut words at every offset
+  for (size_t split = 0; split <= 17; split++)
+  {
+    Checksum64 sum;
+    sum.update(&data[0], split);
+    sum.update(&data[split], data.size() - split);
+    EXPECT_EQ(whole, sum.digest()) << "split at " << split;
+  }
+
+  Checksum64 bytes;
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    bytes.update(&data[i], 1);
+  }
+  EXPECT_EQ(whole, bytes.digest());
+}
+
+TEST(Checksum, EmptyInput)
+{
+  Checksum64 sum;
+  EXPECT_EQ(checksum64(NULL, 0), sum.digest());
+  sum.update(NULL, 0);
+  EXPECT_EQ(checksum64(NULL, 0), sum.digest());
+
+  Checksum64 split;
+  split.update("abc", 3);
+  split.update(NULL, 0);
+  split.update("def", 3);
+  EXPECT_EQ(checksum64("abcdef", 6), split.digest());
+}
+
+TEST(Checksum, DetectsChanges)
+{
+  std::vector<unsigned char> data(4096, 0);
+  uint64_t zeros = checksum64(&data[0], data.size());
+  data[2048] = 1;
+  EXPECT_NE(zeros, checksum64(&data[0], data.size()));
+  data[2048] = 0;
+
+  // The length is part of the checksum, not only the bytes
+  EXPECT_NE(zeros, checksum64(&data[0], data.size() - 1));
+  EXPECT_NE(checksum64(&data[0], 7), checksum64(&data[0], 8));
+}
+
+TEST(Checksum, DigestDoesNotEndTheSum)
+{
+  const char text[] = "multimap_server";
+  Checksum64 sum;
+  sum.update(text, 5);
+  sum.digest();
+  sum.update(text + 5, strlen(text) - 5);
+  EXPECT_EQ(checksum64(text, strlen(text)), sum.digest());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/compressed_grid.h"
+
+using namespace multimap_server;
+
+namespace
+{
+/** Free space with random obstacles and an unknown border */
+std::vector<int8_t> occupancy(unsigned int width, unsigned int height, unsigned int seed)
+{
+  srand(seed);
+  std::vector<int8_t> cells((size_t)width * height, 0);
+  for (unsigned int y = 0; y < height; y++)
+  {
+    for (unsigned int x = 0; x < width; x++)
+    {
+      if (x < 10 || y < 10)
+        cells[(size_t)y * width + x] = -1;
+      else if (rand() % 50 == 0)
+        cells[(size_t)y * width + x] = rand() % 101;
+    }
+  }
+  return cells;
+}
+
+void expectCells(const std::vector<int8_t>& cells, const TiledGrid& grid)
+{
+  ASSERT_EQ(cells.size(), (size_t)grid.width() * grid.height());
+  std::vector<int8_t> out(cells.size());
+  if (!out.empty())
+    grid.copyRows(0, grid.height(), &out[0]);
+  EXPECT_EQ(cells, out);
+}
+}
+
+TEST(CompressedGrid, RoundTrip)
+{
+  unsigned int sizes[][2] = { { 1, 1 }, { 64, 64 }, { 65, 3 }, { 300, 130 } };
+  for (size_t i = 0; i < 4; i++)
+  {
+    std::vector<int8_t> cells = occupancy(sizes[i][0], sizes[i][1], i);
+    TiledGrid grid(sizes[i][0], sizes[i][1], &cells[0]);
+    CompressedGrid compressed(grid);
+    TiledGrid restored = compressed.decompress(1);
+    expectCells(cells, restored);
+    // The padding of edge tiles is unknown, as in any grid
+    if (sizes[i][0] % TiledGrid::TILE_SIZE != 0)
+    {
+      EXPECT_EQ(-1, restored.tileData(restored.tilesX() - 1, 0)[TiledGrid::TILE_SIZE - 1]);
+    }
+  }
+}
+
+TEST(CompressedGrid, ParallelDecompressionMatches)
+{
+  // Enough tiles for several threads
+  unsigned int width = 64 * 30, height = 64 * 20 + 7;
+  std::vector<int8_t> cells = occupancy(width, height, 42);
+  TiledGrid grid(width, height, &cells[0]);
+  CompressedGrid compressed(grid);
+  TiledGrid restored = compressed.decompress(8);
+  expectCells(cells, restored);
+  EXPECT_EQ((size_t)restored.tilesX() * restored.tilesY(), restored.ownedTiles());
+}
+
+TEST(CompressedGrid, UniformTilesShrink)
+{
+  TiledGrid grid(640, 640, NULL);
+  CompressedGrid compressed(grid);
+  // 4096 cells in runs of at most 256
+  EXPECT_EQ(100u * 16 * 2, compressed.size());
+  expectCells(std::vector<int8_t>(640 * 640, -1), compressed.decompress(4));
+}
+
+TEST(CompressedGrid, LongRunsOfEveryValue)
+{
+  std::vector<int8_t> cells;
+  for (int value = -128; value < 128; value++)
+    cells.insert(cells.end(), 300, value);
+  unsigned int width = 256, height = 300;
+  TiledGrid grid(width, height, &cells[0]);
+  expectCells(cells, CompressedGrid(grid).decompress(2));
+}
+
+TEST(CompressedGrid, Empty)
+{
+  CompressedGrid compressed;
+  EXPECT_EQ(0u, compressed.size());
+  TiledGrid restored = compressed.decompress(4);
+  EXPECT_EQ(0u, restored.width());
+  EXPECT_EQ(0u, restored.height());
+  EXPECT_EQ(0u, CompressedGrid(TiledGrid()).decompress(1).tilesX());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
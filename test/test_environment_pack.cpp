@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/environment_pack.h"
+
+using namespace multimap_server;
+
+namespace
+{
+/** Path of a new empty file, removed with the fixture */
+class EnvironmentPackTest : public testing::Test
+{
+protected:
+  void SetUp()
+  {
+    char name[] = "/tmp/test_environment_pack_XXXXXX";
+    int fd = mkstemp(name);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path = name;
+  }
+
+  void TearDown()
+  {
+    unlink(path.c_str());
+  }
+
+  /** Overwrite bytes of the pack */
+  void patch(long offset, const void* data, size_t size)
+  {
+    FILE* file = fopen(path.c_str(), "r+b");
+    ASSERT_TRUE(file != NULL);
+    fseek(file, offset, SEEK_SET);
+    fwrite(data, 1, size, file);
+    fclose(file);
+  }
+
+  std::string path;
+};
+
+PackedMap makeMap(const std::string& name, uint32_t width, uint32_t height, const std::vector<int8_t>& cells)
+{
+  PackedMap map;
+  map.name = name;
+  map.width = width;
+  map.height = height;
+  map.resolution = 0.05;
+  map.origin[0] = -1.0;
+  map.origin[1] = 2.5;
+  map.origin[2] = 0.3;
+  map.data = &cells[0];
+  map.checksum = 0;
+  return map;
+}
+}
+
+TEST_F(EnvironmentPackTest, RoundTrip)
+{
+  std::vector<int8_t> a(100 * 30), b(7 * 5000);
+  for (size_t i = 0; i < a.size(); i++)
+  {
+    a[i] = i % 3 == 0 ? -1 : (i % 3 == 1 ? 0 : 100);
+  }
+  for (size_t i = 0; i < b.size(); i++)
+  {
+    b[i] = i % 101;
+  }
+  std::vector<PackedMap> maps;
+  maps.push_back(makeMap("ground", 100, 30, a));
+  maps.push_back(makeMap("routes", 7, 5000, b));
+  writeEnvironmentPack(path, "floor_0", "map", maps);
+
+  EnvironmentPack pack(path);
+  EXPECT_EQ("floor_0", pack.environment());
+  EXPECT_EQ("map", pack.globalFrame());
+  ASSERT_EQ(2u, pack.maps().size());
+  for (size_t i = 0; i < 2; i++)
+  {
+    const PackedMap& map = pack.maps()[i];
+    const std::vector<int8_t>& cells = i == 0 ? a : b;
+    EXPECT_EQ(maps[i].name, map.name);
+    EXPECT_EQ(maps[i].width, map.width);
+    EXPECT_EQ(maps[i].height, map.height);
+    EXPECT_DOUBLE_EQ(0.05, map.resolution);
+    EXPECT_DOUBLE_EQ(-1.0, map.origin[0]);
+    EXPECT_DOUBLE_EQ(2.5, map.origin[1]);
+    EXPECT_DOUBLE_EQ(0.3, map.origin[2]);
+    // Grids can be used in place
+    EXPECT_EQ(0u, (size_t)map.data % PACK_ALIGNMENT);
+    EXPECT_TRUE(std::equal(cells.begin(), cells.end(), map.data));
+    EXPECT_TRUE(pack.verify(map));
+  }
+}
+
+TEST_F(EnvironmentPackTest, EmptyEnvironment)
+{
+  writeEnvironmentPack(path, "empty", "map", std::vector<PackedMap>());
+  EnvironmentPack pack(path);
+  EXPECT_EQ("empty", pack.environment());
+  EXPECT_TRUE(pack.maps().empty());
+}
+
+TEST_F(EnvironmentPackTest, DetectsCorruptedGrid)
+{
+  std::vector<int8_t> cells(64 * 64, 0);
+  writeEnvironmentPack(path, "floor_0", "map", std::vector<PackedMap>(1, makeMap("ground", 64, 64, cells)));
+  // The header and a single manifest entry fit before the first alignment boundary, where the grid starts
+  int8_t value = 100;
+  patch(PACK_ALIGNMENT + 10, &value, 1);
+
+  EnvironmentPack pack(path);
+  EXPECT_FALSE(pack.verify(pack.maps()[0]));
+}
+
+TEST_F(EnvironmentPackTest, RejectsInvalidFiles)
+{
+  EXPECT_THROW(EnvironmentPack("/nonexistent/pack"), std::runtime_error);
+
+  // Empty file
+  EXPECT_THROW(EnvironmentPack pack(path), std::runtime_error);
+
+  std::vector<int8_t> cells(10 * 10, 0);
+  writeEnvironmentPack(path, "floor_0", "map", std::vector<PackedMap>(1, makeMap("ground", 10, 10, cells)));
+  patch(0, "XXXX", 4);
+  EXPECT_THROW(EnvironmentPack pack(path), std::runtime_error);
+}
+
+TEST_F(EnvironmentPackTest, RejectsCorruptedManifest)
+{
+  std::vector<int8_t> cells(10 * 10, 0);
+  writeEnvironmentPack(path, "floor_0", "map", std::vector<PackedMap>(1, makeMap("ground", 10, 10, cells)));
+  // The manifest follows the header; flipping bytes past the header breaks its checksum
+  FILE* file = fopen(path.c_str(), "rb");
+  ASSERT_TRUE(file != NULL);
+  std::vector<char> head(PACK_ALIGNMENT);
+  size_t read = fread(&head[0], 1, head.size(), file);
+  fclose(file);
+  ASSERT_EQ(head.size(), read);
+  // The map name is stored in the manifest
+  std::string bytes(head.begin(), head.end());
+  size_t name = bytes.find("ground");
+  ASSERT_NE(std::string::npos, name);
+  patch(name, "xx", 2);
+  EXPECT_THROW(EnvironmentPack pack(path), std::runtime_error);
+}
+
+TEST_F(EnvironmentPackTest, RejectsLongNames)
+{
+  std::vector<int8_t> cells(1, 0);
+  std::vector<PackedMap> maps(1, makeMap(std::string(PACK_NAME_SIZE, 'a'), 1, 1, cells));
+  EXPECT_THROW(writeEnvironmentPack(path, "floor_0", "map", maps), std::runtime_error);
+  EXPECT_THROW(writeEnvironmentPack(path, std::string(PACK_NAME_SIZE, 'a'), "map", std::vector<PackedMap>()),
+               std::runtime_error);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
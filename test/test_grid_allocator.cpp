@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/grid_allocator.h"
+#include "multimap_server/tiled_grid.h"
+
+using namespace multimap_server;
+
+namespace
+{
+const size_t BLOCK_SIZE = TiledGrid::TILE_SIZE * TiledGrid::TILE_SIZE;
+const uintptr_t SLAB_MASK = ~(uintptr_t)(2 * 1024 * 1024 - 1);
+
+/** Runs the tests with slabs when the kernel allows it, and restores the heap afterwards */
+class GridAllocatorTest : public testing::Test
+{
+protected:
+  void SetUp()
+  {
+    slabs = setHugePages(HUGE_PAGES_TRANSPARENT) != HUGE_PAGES_OFF;
+  }
+
+  void TearDown()
+  {
+    setHugePages(HUGE_PAGES_OFF);
+  }
+
+  bool slabs;
+};
+
+void allocate(size_t count, std::vector<void*>* blocks)
+{
+  for (size_t i = 0; i < count; i++)
+    blocks->push_back(allocateGridBuffer(BLOCK_SIZE));
+}
+
+/** Tiles allocated, shared and freed by one thread */
+void churnGrids()
+{
+  for (int round = 0; round < 20; round++)
+  {
+    TiledGrid grid(300, 300, NULL);
+    TiledGrid copy = grid;
+    copy.set(299, 299, 100);
+    EXPECT_EQ(-1, grid.get(299, 299));
+    EXPECT_EQ(100, copy.get(299, 299));
+  }
+}
+
+void release(std::vector<void*>* blocks)
+{
+  for (size_t i = 0; i < blocks->size(); i++)
+    freeGridBuffer((*blocks)[i], BLOCK_SIZE);
+  blocks->clear();
+}
+}
+
+TEST(GridAllocator, ParseHugePages)
+{
+  EXPECT_EQ(HUGE_PAGES_OFF, parseHugePages("off"));
+  EXPECT_EQ(HUGE_PAGES_TRANSPARENT, parseHugePages("transparent"));
+  EXPECT_EQ(HUGE_PAGES_HUGETLB, parseHugePages("hugetlb"));
+  EXPECT_THROW(parseHugePages("on"), std::runtime_error);
+  EXPECT_STREQ("hugetlb", hugePagesName(parseHugePages(hugePagesName(HUGE_PAGES_HUGETLB))));
+  EXPECT_STREQ("off", hugePagesName(HUGE_PAGES_OFF));
+}
+
+TEST_F(GridAllocatorTest, BlocksDoNotOverlap)
+{
+  // More than one slab
+  std::vector<void*> blocks;
+  allocate(1200, &blocks);
+  for (size_t i = 0; i < blocks.size(); i++)
+    memset(blocks[i], i % 127, BLOCK_SIZE);
+  std::set<void*> distinct(blocks.begin(), blocks.end());
+  EXPECT_EQ(blocks.size(), distinct.size());
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    const int8_t* cells = static_cast<const int8_t*>(blocks[i]);
+    ASSERT_EQ((int8_t)(i % 127), cells[0]);
+    ASSERT_EQ((int8_t)(i % 127), cells[BLOCK_SIZE - 1]);
+  }
+  release(&blocks);
+}
+
+TEST_F(GridAllocatorTest, FreedBlocksAreReused)
+{
+  if (!slabs)
+    return;
+  std::vector<void*> blocks;
+  allocate(10, &blocks);
+  void* freed = blocks[3];
+  freeGridBuffer(freed, BLOCK_SIZE);
+  blocks.erase(blocks.begin() + 3);
+  void* reused = allocateGridBuffer(BLOCK_SIZE);
+  EXPECT_EQ(freed, reused);
+  blocks.push_back(reused);
+  release(&blocks);
+}
+
+TEST_F(GridAllocatorTest, OtherSizesUseTheHeap)
+{
+  void* buffer = allocateGridBuffer(100);
+  memset(buffer, 0, 100);
+  freeGridBuffer(buffer, 100);
+  std::vector<int8_t, GridAllocator<int8_t> > cells(3 * BLOCK_SIZE, -1);
+  EXPECT_EQ(-1, cells[3 * BLOCK_SIZE - 1]);
+}
+
+TEST_F(GridAllocatorTest, BlocksAreFreedFromOtherThreads)
+{
+  std::vector<void*> blocks;
+  boost::thread worker(boost::bind(&allocate, 1000, &blocks));
+  worker.join();
+  ASSERT_EQ(1000u, blocks.size());
+  release(&blocks);
+
+  // And allocated again afterwards
+  allocate(1000, &blocks);
+  release(&blocks);
+}
+
+TEST_F(GridAllocatorTest, SlabsOfExitedThreadsAreReused)
+{
+  if (!slabs)
+    return;
+  // The worker keeps one block alive, so its slab stays mapped after it exits
+  std::vector<void*> blocks;
+  boost::thread first(boost::bind(&allocate, 10, &blocks));
+  first.join();
+  void* kept = blocks[0];
+  blocks.erase(blocks.begin());
+  release(&blocks);
+
+  boost::thread second(boost::bind(&allocate, 5, &blocks));
+  second.join();
+  ASSERT_EQ(5u, blocks.size());
+  for (size_t i = 0; i < blocks.size(); i++)
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(kept) & SLAB_MASK, reinterpret_cast<uintptr_t>(blocks[i]) & SLAB_MASK);
+  release(&blocks);
+  freeGridBuffer(kept, BLOCK_SIZE);
+}
+
+TEST_F(GridAllocatorTest, ConcurrentGrids)
+{
+  boost::thread_group workers;
+  for (int i = 0; i < 4; i++)
+  {
+    workers.create_thread(&churnGrids);
+  }
+  workers.join_all();
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
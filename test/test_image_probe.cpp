@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/image_probe.h"
+
+using namespace multimap_server;
+
+namespace
+{
+/** Path of a new empty file, removed with the fixture */
+class ImageProbeTest : public testing::Test
+{
+protected:
+  void SetUp()
+  {
+    char name[] = "/tmp/test_image_probe_XXXXXX";
+    int fd = mkstemp(name);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path = name;
+  }
+
+  void TearDown()
+  {
+    unlink(path.c_str());
+  }
+
+  void write(const std::string& bytes)
+  {
+    FILE* file = fopen(path.c_str(), "wb");
+    ASSERT_TRUE(file != NULL);
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+  }
+
+  bool probe(unsigned int* width, unsigned int* height)
+  {
+    *width = *height = 0;
+    return probeImageSize(path, width, height);
+  }
+
+  std::string path;
+};
+
+std::string bytes(const unsigned char* data, size_t size)
+{
+  return std::string(reinterpret_cast<const char*>(data), size);
+}
+}
+
+TEST_F(ImageProbeTest, Png)
+{
+  const unsigned char png[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n', 0, 0, 0, 13, 'I', 'H', 'D', 'R',
+                                0,    0,   0x12, 0x34, 0, 1, 0, 2 };
+  write(bytes(png, sizeof(png)));
+  unsigned int width, height;
+  ASSERT_TRUE(probe(&width, &height));
+  EXPECT_EQ(0x1234u, width);
+  EXPECT_EQ(0x10002u, height);
+}
+
+TEST_F(ImageProbeTest, Gif)
+{
+  write(std::string("GIF89a") + '\x40' + '\x01' + '\xF0' + '\x00');
+  unsigned int width, height;
+  ASSERT_TRUE(probe(&width, &height));
+  EXPECT_EQ(320u, width);
+  EXPECT_EQ(240u, height);
+}
+
+TEST_F(ImageProbeTest, Bmp)
+{
+  unsigned char bmp[26] = { 'B', 'M' };
+  bmp[14] = 40;
+  bmp[18] = 0x00;
+  bmp[19] = 0x02;
+  // A height of -100 is a top-down bitmap
+  bmp[22] = 0x9C;
+  bmp[23] = bmp[24] = bmp[25] = 0xFF;
+  write(bytes(bmp, sizeof(bmp)));
+  unsigned int width, height;
+  ASSERT_TRUE(probe(&width, &height));
+  EXPECT_EQ(512u, width);
+  EXPECT_EQ(100u, height);
+}
+
+TEST_F(ImageProbeTest, Os2Bmp)
+{
+  unsigned char bmp[26] = { 'B', 'M' };
+  bmp[14] = 12;
+  bmp[18] = 7;
+  bmp[20] = 9;
+  write(bytes(bmp, sizeof(bmp)));
+  unsigned int width, height;
+  ASSERT_TRUE(probe(&width, &height));
+  EXPECT_EQ(7u, width);
+  EXPECT_EQ(9u, height);
+}
+
+TEST_F(ImageProbeTest, PnmWithComments)
+{
+  write("P2\n# written by a test\n 640 # width\n480\n255\n");
+  unsigned int width, height;
+  ASSERT_TRUE(probe(&width, &height));
+  EXPECT_EQ(640u, width);
+  EXPECT_EQ(480u, height);
+}
+
+TEST_F(ImageProbeTest, JpegSkipsSegmentsBeforeTheFrame)
+{
+  // SOI, an APP0 segment of 4 bytes, fill bytes, then SOF0 with height 300 and width 400
+  const unsigned char jpeg[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0, 4, 'a', 'b', 0xFF, 0xFF, 0xC0,
+                                 0,    17,   8,    0x01, 0x2C, 0x01, 0x90, 3 };
+  write(bytes(jpeg, sizeof(jpeg)));
+  unsigned int width, height;
+  ASSERT_TRUE(probe(&width, &height));
+  EXPECT_EQ(400u, width);
+  EXPECT_EQ(300u, height);
+}
+
+TEST_F(ImageProbeTest, RejectsUnknownAndTruncatedFiles)
+{
+  unsigned int width, height;
+  write("not an image");
+  EXPECT_FALSE(probe(&width, &height));
+  write("GIF89a\x40");
+  EXPECT_FALSE(probe(&width, &height));
+  // A JPEG ending before its frame header
+  write(std::string("\xFF\xD8\xFF\xE0\x00\x10", 6));
+  EXPECT_FALSE(probe(&width, &height));
+  write("");
+  EXPECT_FALSE(probe(&width, &height));
+  EXPECT_FALSE(probeImageSize("/nonexistent/map.png", &width, &height));
+}
+
+TEST_F(ImageProbeTest, RejectsEmptyImages)
+{
+  write("P5 0 10 255\n");
+  unsigned int width, height;
+  EXPECT_FALSE(probe(&width, &height));
+}
+
+TEST_F(ImageProbeTest, RawPgm)
+{
+  const std::string header = "P5\n# comment\n3 2\n255\n";
+  write(header + std::string(6, '\x7F'));
+  unsigned int width, height;
+  long offset;
+  ASSERT_TRUE(probeRawPgm(path, &width, &height, &offset));
+  EXPECT_EQ(3u, width);
+  EXPECT_EQ(2u, height);
+  EXPECT_EQ((long)header.size(), offset);
+}
+
+TEST_F(ImageProbeTest, RawPgmRejectsOtherPnm)
+{
+  unsigned int width, height;
+  long offset;
+  write("P2\n3 2\n255\n");
+  EXPECT_FALSE(probeRawPgm(path, &width, &height, &offset));
+  write("P5\n3 2\n65535\n");
+  EXPECT_FALSE(probeRawPgm(path, &width, &height, &offset));
+  EXPECT_FALSE(probeRawPgm("/nonexistent/map.pgm", &width, &height, &offset));
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/map_diff.h"
+
+using namespace multimap_server;
+
+namespace
+{
+/** Grid of random unknown, free and occupied cells */
+TiledGrid randomGrid(unsigned int width, unsigned int height, unsigned int seed)
+{
+  srand(seed);
+  std::vector<int8_t> cells((size_t)width * height);
+  for (size_t i = 0; i < cells.size(); i++)
+    cells[i] = rand() % 102 - 1;
+  return TiledGrid(width, height, &cells[0]);
+}
+
+int cellClass(int8_t value, int8_t occupied_threshold)
+{
+  return value < 0 ? CELL_UNKNOWN : value < occupied_threshold ? CELL_FREE : CELL_OCCUPIED;
+}
+
+/** Compare diffGrids() with a cell by cell comparison */
+void expectReferenceDiff(const TiledGrid& a, const TiledGrid& b, int8_t occupied_threshold, unsigned int threads)
+{
+  GridDiff diff = diffGrids(a, b, occupied_threshold, true, threads);
+  uint64_t transitions[CELL_CLASSES][CELL_CLASSES] = { { 0 } };
+  uint64_t changed = 0;
+  ASSERT_EQ((size_t)a.width() * a.height(), diff.mask.size());
+  for (unsigned int y = 0; y < a.height(); y++)
+  {
+    for (unsigned int x = 0; x < a.width(); x++)
+    {
+      bool differs = a.get(x, y) != b.get(x, y);
+      ASSERT_EQ(differs ? 100 : 0, diff.mask[(size_t)y * a.width() + x]) << x << " " << y;
+      if (differs)
+      {
+        transitions[cellClass(a.get(x, y), occupied_threshold)][cellClass(b.get(x, y), occupied_threshold)]++;
+        changed++;
+      }
+    }
+  }
+  EXPECT_EQ(changed, diff.changed_cells);
+  for (int from = 0; from < CELL_CLASSES; from++)
+  {
+    for (int to = 0; to < CELL_CLASSES; to++)
+      EXPECT_EQ(transitions[from][to], diff.transitions[from][to]) << from << " " << to;
+  }
+}
+}
+
+TEST(MapDiff, MatchesTheReference)
+{
+  TiledGrid a = randomGrid(1000, 650, 1);
+  TiledGrid b = a;
+  for (unsigned int i = 0; i < 5000; i++)
+    b.set(rand() % b.width(), rand() % b.height(), rand() % 102 - 1);
+  expectReferenceDiff(a, b, 50, 1);
+  // Enough tiles for several threads
+  expectReferenceDiff(a, b, 50, 4);
+  expectReferenceDiff(a, b, 1, 4);
+  expectReferenceDiff(a, randomGrid(1000, 650, 2), 65, 3);
+}
+
+TEST(MapDiff, EqualGrids)
+{
+  TiledGrid a = randomGrid(300, 200, 3);
+  TiledGrid copy(300, 200, NULL);
+  for (unsigned int y = 0; y < a.height(); y++)
+  {
+    for (unsigned int x = 0; x < a.width(); x++)
+      copy.set(x, y, a.get(x, y));
+  }
+  GridDiff shared = diffGrids(a, a, 50, false, 1);
+  GridDiff copied = diffGrids(a, copy, 50, true, 2);
+  EXPECT_EQ(0u, shared.changed_cells);
+  EXPECT_TRUE(shared.regions.empty());
+  EXPECT_TRUE(shared.mask.empty());
+  EXPECT_EQ(0u, copied.changed_cells);
+  EXPECT_TRUE(copied.regions.empty());
+  EXPECT_EQ(std::vector<int8_t>(300 * 200, 0), copied.mask);
+}
+
+TEST(MapDiff, RegionsGroupTouchingTiles)
+{
+  TiledGrid a(400, 300, NULL);
+  TiledGrid b = a;
+  // Diagonal neighbor tiles make one region, a tile further away another one
+  b.set(10, 20, 0);
+  b.set(70, 100, 100);
+  b.set(300, 250, 0);
+  GridDiff diff = diffGrids(a, b, 50, false, 1);
+  EXPECT_EQ(3u, diff.changed_cells);
+  EXPECT_EQ(2u, diff.transitions[CELL_UNKNOWN][CELL_FREE]);
+  EXPECT_EQ(1u, diff.transitions[CELL_UNKNOWN][CELL_OCCUPIED]);
+  ASSERT_EQ(2u, diff.regions.size());
+  EXPECT_EQ(10u, diff.regions[0].min_x);
+  EXPECT_EQ(20u, diff.regions[0].min_y);
+  EXPECT_EQ(70u, diff.regions[0].max_x);
+  EXPECT_EQ(100u, diff.regions[0].max_y);
+  EXPECT_EQ(300u, diff.regions[1].min_x);
+  EXPECT_EQ(250u, diff.regions[1].min_y);
+  EXPECT_EQ(300u, diff.regions[1].max_x);
+  EXPECT_EQ(250u, diff.regions[1].max_y);
+}
+
+TEST(MapDiff, PlaceGrid)
+{
+  TiledGrid grid = randomGrid(100, 70, 4);
+  TiledGrid placed = placeGrid(grid, 250, 180, 37, 90);
+  ASSERT_EQ(250u, placed.width());
+  ASSERT_EQ(180u, placed.height());
+  for (unsigned int y = 0; y < placed.height(); y++)
+  {
+    for (unsigned int x = 0; x < placed.width(); x++)
+    {
+      bool inside = x >= 37 && x < 137 && y >= 90 && y < 160;
+      ASSERT_EQ(inside ? grid.get(x - 37, y - 90) : -1, placed.get(x, y)) << x << " " << y;
+    }
+  }
+}
+
+TEST(MapDiff, PlacedGridsLineUp)
+{
+  // Two maps of one frame, cell (0, 0) of the second one on cell (20, 10) of the first one
+  TiledGrid a = randomGrid(120, 80, 5);
+  TiledGrid b(90, 100, NULL);
+  for (unsigned int y = 0; y < b.height(); y++)
+  {
+    for (unsigned int x = 0; x < b.width(); x++)
+      b.set(x, y, y < 70 ? a.get(x + 20, y + 10) : -1);
+  }
+  GridDiff diff = diffGrids(placeGrid(a, 120, 110, 0, 0), placeGrid(b, 120, 110, 20, 10), 50, false, 1);
+  // Only the known cells of the first map that the second one doesn't cover differ
+  uint64_t uncovered = 0;
+  for (unsigned int y = 0; y < a.height(); y++)
+  {
+    for (unsigned int x = 0; x < a.width(); x++)
+      uncovered += (x < 20 || x >= 110 || y < 10) && a.get(x, y) >= 0;
+  }
+  EXPECT_EQ(uncovered, diff.changed_cells);
+  EXPECT_EQ(uncovered, diff.transitions[CELL_FREE][CELL_UNKNOWN] + diff.transitions[CELL_OCCUPIED][CELL_UNKNOWN]);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/map_layers.h"
+
+using namespace multimap_server;
+
+namespace
+{
+MapLayer makeLayer(LayerBlend blend, unsigned int width, unsigned int height)
+{
+  MapLayer layer;
+  layer.name = "layer";
+  layer.blend = blend;
+  layer.grid = TiledGrid(width, height, NULL);
+  return layer;
+}
+
+/** Reference blend of one cell */
+int8_t blendCell(LayerBlend blend, int8_t dst, int8_t src)
+{
+  if (blend == BLEND_MAX)
+    return src > 0 && src > dst ? src : dst;
+  return src != -1 ? src : dst;
+}
+}
+
+TEST(MapLayers, KernelsMatchTheReference)
+{
+  // Every pair of cell values, over a length that is not a multiple of a vector width
+  std::vector<int8_t> src, dst;
+  for (int s = -128; s < 128; s++)
+  {
+    for (int d = -128; d < 128; d++)
+    {
+      src.push_back(s);
+      dst.push_back(d);
+    }
+  }
+  src.push_back(5);
+  dst.push_back(3);
+
+  std::vector<int8_t> max_dst = dst;
+  std::vector<int8_t> override_dst = dst;
+  blendMax(&max_dst[0], &src[0], src.size());
+  blendOverride(&override_dst[0], &src[0], src.size());
+  for (size_t i = 0; i < src.size(); i++)
+  {
+    ASSERT_EQ(blendCell(BLEND_MAX, dst[i], src[i]), max_dst[i]) << (int)dst[i] << " " << (int)src[i];
+    ASSERT_EQ(blendCell(BLEND_OVERRIDE, dst[i], src[i]), override_dst[i]) << (int)dst[i] << " " << (int)src[i];
+  }
+}
+
+TEST(MapLayers, Transparency)
+{
+  std::vector<int8_t> cells(100, -1);
+  EXPECT_TRUE(isTransparent(BLEND_MAX, &cells[0], cells.size()));
+  EXPECT_TRUE(isTransparent(BLEND_OVERRIDE, &cells[0], cells.size()));
+  // Free cells only hide what is below with BLEND_OVERRIDE
+  cells[99] = 0;
+  EXPECT_TRUE(isTransparent(BLEND_MAX, &cells[0], cells.size()));
+  EXPECT_FALSE(isTransparent(BLEND_OVERRIDE, &cells[0], cells.size()));
+  cells[0] = 1;
+  EXPECT_FALSE(isTransparent(BLEND_MAX, &cells[0], cells.size()));
+  EXPECT_TRUE(isTransparent(BLEND_MAX, &cells[0], 0));
+}
+
+TEST(MapLayers, ComposeBlendsLayersInOrder)
+{
+  unsigned int width = 150, height = 100;
+  std::vector<int8_t> cells((size_t)width * height, 0);
+  TiledGrid base(width, height, &cells[0]);
+
+  std::vector<MapLayer> layers;
+  layers.push_back(makeLayer(BLEND_MAX, width, height));
+  layers.back().grid.set(10, 10, 100);
+  layers.back().grid.set(140, 90, 50);
+  layers.push_back(makeLayer(BLEND_OVERRIDE, width, height));
+  layers.back().grid.set(10, 10, 0);
+
+  TiledGrid composed = composeLayers(base, layers);
+  EXPECT_EQ(0, composed.get(10, 10));
+  EXPECT_EQ(50, composed.get(140, 90));
+  EXPECT_EQ(0, composed.get(11, 10));
+  // The base is left unchanged
+  EXPECT_EQ(0, base.get(140, 90));
+
+  // Only the tiles a layer changes stop being shared with the base
+  EXPECT_FALSE(composed.sharesTile(base, 0, 0));
+  EXPECT_FALSE(composed.sharesTile(base, 2, 1));
+  EXPECT_TRUE(composed.sharesTile(base, 1, 0));
+  EXPECT_TRUE(composed.sharesTile(base, 0, 1));
+}
+
+TEST(MapLayers, ComposeWithoutLayersSharesEveryTile)
+{
+  TiledGrid base(200, 200, NULL);
+  TiledGrid composed = composeLayers(base, std::vector<MapLayer>());
+  EXPECT_EQ(0u, composed.ownedTiles());
+  EXPECT_EQ(0u, composeLayers(TiledGrid(), std::vector<MapLayer>(1)).width());
+}
+
+TEST(MapLayers, ComposeBoxOnlyTouchesItsTiles)
+{
+  unsigned int width = 200, height = 64;
+  TiledGrid base(width, height, NULL);
+  std::vector<MapLayer> layers(1, makeLayer(BLEND_OVERRIDE, width, height));
+  TiledGrid composed = composeLayers(base, layers);
+
+  // Edits of the layer are only composed inside the box
+  layers[0].grid.set(5, 5, 100);
+  layers[0].grid.set(150, 5, 100);
+  CellBox box = { 130, 0, 140, 10 };
+  composeBox(base, layers, box, &composed);
+  EXPECT_EQ(-1, composed.get(5, 5));
+  EXPECT_EQ(100, composed.get(150, 5));
+
+  CellBox empty = { 1, 1, 0, 0 };
+  composeBox(base, layers, empty, &composed);
+  EXPECT_EQ(-1, composed.get(5, 5));
+}
+
+TEST(MapLayers, ChangedTiles)
+{
+  TiledGrid before(200, 130, NULL);
+  TiledGrid after = before;
+  CellBox changed = changedTiles(before, after);
+  EXPECT_GT(changed.min_x, changed.max_x);
+
+  // A written tile with the same content is not a change
+  after.set(3, 3, -1);
+  changed = changedTiles(before, after);
+  EXPECT_GT(changed.min_x, changed.max_x);
+
+  after.set(70, 3, 0);
+  after.set(199, 129, 0);
+  changed = changedTiles(before, after);
+  EXPECT_EQ(64u, changed.min_x);
+  EXPECT_EQ(0u, changed.min_y);
+  EXPECT_EQ(199u, changed.max_x);
+  EXPECT_EQ(129u, changed.max_y);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
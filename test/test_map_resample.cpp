@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/map_resample.h"
+
+using namespace multimap_server;
+
+namespace
+{
+/** Grid of random free, occupied, partially occupied and unknown cells */
+TiledGrid randomGrid(unsigned int width, unsigned int height, unsigned int seed)
+{
+  const int8_t values[] = { -1, 0, 50, 100 };
+  srand(seed);
+  std::vector<int8_t> cells((size_t)width * height);
+  for (size_t i = 0; i < cells.size(); i++)
+    cells[i] = values[rand() % 4];
+  return TiledGrid(width, height, &cells[0]);
+}
+
+GridPlacement makePlacement(unsigned int width, unsigned int height, double resolution, double origin_x,
+                            double origin_y, double yaw)
+{
+  GridPlacement placement = { width, height, resolution, origin_x, origin_y, yaw };
+  return placement;
+}
+
+ResampleSource makeSource(const TiledGrid& grid, const GridPlacement& placement)
+{
+  ResampleSource source = { &grid, placement };
+  return source;
+}
+
+/** Order of RESAMPLE_CONSERVATIVE: free, unknown, then increasing occupancy */
+int occupancyRank(int8_t value)
+{
+  return value < 0 ? 1 : value == 0 ? 0 : value + 1;
+}
+
+typedef std::vector<std::pair<double, double> > Polygon;
+
+/** Corner (x, y) of the cells of from, in cells of to */
+std::pair<double, double> convertCorner(const GridPlacement& from, const GridPlacement& to, double x, double y)
+{
+  double frame_x = from.origin_x + (cos(from.yaw) * x - sin(from.yaw) * y) * from.resolution - to.origin_x;
+  double frame_y = from.origin_y + (sin(from.yaw) * x + cos(from.yaw) * y) * from.resolution - to.origin_y;
+  return std::make_pair((cos(to.yaw) * frame_x + sin(to.yaw) * frame_y) / to.resolution,
+                        (-sin(to.yaw) * frame_x + cos(to.yaw) * frame_y) / to.resolution);
+}
+
+/** Part of polygon on the side of coordinate axis (0 for x, 1 for y) where it is at least (sign 1) or at most
+ *  (sign -1) limit */
+Polygon clipPolygon(const Polygon& polygon, int axis, double limit, double sign)
+{
+  Polygon clipped;
+  for (size_t i = 0; i < polygon.size(); i++)
+  {
+    const std::pair<double, double>& a = polygon[i];
+    const std::pair<double, double>& b = polygon[(i + 1) % polygon.size()];
+    double da = sign * ((axis ? a.second : a.first) - limit);
+    double db = sign * ((axis ? b.second : b.first) - limit);
+    if (da >= 0.0)
+      clipped.push_back(a);
+    if ((da >= 0.0) != (db >= 0.0))
+    {
+      double t = da / (da - db);
+      clipped.push_back(std::make_pair(a.first + t * (b.first - a.first), a.second + t * (b.second - a.second)));
+    }
+  }
+  return clipped;
+}
+
+double polygonArea(const Polygon& polygon)
+{
+  double area = 0.0;
+  for (size_t i = 0; i < polygon.size(); i++)
+  {
+    const std::pair<double, double>& a = polygon[i];
+    const std::pair<double, double>& b = polygon[(i + 1) % polygon.size()];
+    area += a.first * b.second - b.first * a.second;
+  }
+  return fabs(area) / 2.0;
+}
+
+/** Most occupied source cell that target cell (x, y) overlaps, found by clipping the cell against every source cell
+ *  near it */
+int8_t overlappedReference(const TiledGrid& grid, const GridPlacement& source, const GridPlacement& target,
+                           unsigned int x, unsigned int y)
+{
+  Polygon footprint;
+  footprint.push_back(convertCorner(target, source, x, y));
+  footprint.push_back(convertCorner(target, source, x + 1, y));
+  footprint.push_back(convertCorner(target, source, x + 1, y + 1));
+  footprint.push_back(convertCorner(target, source, x, y + 1));
+  double min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+  for (size_t i = 0; i < footprint.size(); i++)
+  {
+    min_x = std::min(min_x, footprint[i].first);
+    min_y = std::min(min_y, footprint[i].second);
+    max_x = std::max(max_x, footprint[i].first);
+    max_y = std::max(max_y, footprint[i].second);
+  }
+  int8_t value = -1;
+  bool covered = false;
+  for (int sy = std::max(0.0, floor(min_y)); sy < std::min<double>(grid.height(), ceil(max_y)); sy++)
+  {
+    for (int sx = std::max(0.0, floor(min_x)); sx < std::min<double>(grid.width(), ceil(max_x)); sx++)
+    {
+      Polygon part = clipPolygon(clipPolygon(footprint, 0, sx, 1.0), 0, sx + 1, -1.0);
+      part = clipPolygon(clipPolygon(part, 1, sy, 1.0), 1, sy + 1, -1.0);
+      if (polygonArea(part) > 1e-12 && (!covered || occupancyRank(grid.get(sx, sy)) > occupancyRank(value)))
+      {
+        value = grid.get(sx, sy);
+        covered = true;
+      }
+    }
+  }
+  return value;
+}
+}
+
+TEST(MapResample, SamePlacementCopiesTheGrid)
+{
+  TiledGrid grid = randomGrid(300, 200, 1);
+  GridPlacement placement = makePlacement(300, 200, 0.05, 1.0, 2.0, 0.3);
+  std::vector<ResampleSource> sources(1, makeSource(grid, placement));
+  for (unsigned int threads = 1; threads <= 4; threads += 3)
+  {
+    TiledGrid resampled = resampleGrids(sources, placement, RESAMPLE_NEAREST, MERGE_MAX, threads);
+    for (unsigned int y = 0; y < grid.height(); y++)
+    {
+      for (unsigned int x = 0; x < grid.width(); x++)
+        ASSERT_EQ(grid.get(x, y), resampled.get(x, y)) << x << " " << y;
+    }
+  }
+}
+
+TEST(MapResample, QuarterTurn)
+{
+  TiledGrid grid = randomGrid(300, 200, 2);
+  std::vector<ResampleSource> sources(1, makeSource(grid, makePlacement(300, 200, 0.05, 0.0, 0.0, 0.0)));
+  GridPlacement target = makePlacement(0, 0, 0.05, 0.0, 0.0, M_PI / 2);
+  ASSERT_TRUE(coverSources(sources, 1u << 30, &target));
+  EXPECT_EQ(200u, target.width);
+  EXPECT_EQ(300u, target.height);
+
+  TiledGrid resampled = resampleGrids(sources, target, RESAMPLE_NEAREST, MERGE_MAX, 2);
+  for (unsigned int y = 0; y < target.height; y++)
+  {
+    for (unsigned int x = 0; x < target.width; x++)
+    {
+      // Center of the cell in the frame, and the source cell under it
+      double frame_x = target.origin_x - (y + 0.5) * 0.05;
+      double frame_y = target.origin_y + (x + 0.5) * 0.05;
+      int source_x = floor(frame_x / 0.05);
+      int source_y = floor(frame_y / 0.05);
+      bool inside = source_x >= 0 && source_y >= 0 && source_x < 300 && source_y < 200;
+      ASSERT_EQ(inside ? grid.get(source_x, source_y) : -1, resampled.get(x, y)) << x << " " << y;
+    }
+  }
+}
+
+TEST(MapResample, ConservativeKeepsTheMostOccupiedCell)
+{
+  TiledGrid grid = randomGrid(300, 200, 3);
+  std::vector<ResampleSource> sources(1, makeSource(grid, makePlacement(300, 200, 0.05, 0.0, 0.0, 0.0)));
+  TiledGrid resampled =
+      resampleGrids(sources, makePlacement(150, 100, 0.1, 0.0, 0.0, 0.0), RESAMPLE_CONSERVATIVE, MERGE_MAX, 2);
+  for (unsigned int y = 0; y < 100; y++)
+  {
+    for (unsigned int x = 0; x < 150; x++)
+    {
+      int8_t expected = grid.get(2 * x, 2 * y);
+      for (unsigned int i = 0; i < 4; i++)
+      {
+        int8_t value = grid.get(2 * x + i % 2, 2 * y + i / 2);
+        if (occupancyRank(value) > occupancyRank(expected))
+          expected = value;
+      }
+      ASSERT_EQ(expected, resampled.get(x, y)) << x << " " << y;
+    }
+  }
+}
+
+TEST(MapResample, ConservativeReadsEveryOverlappedCell)
+{
+  // Rotated cells clip corners of source cells that a lattice of samples would miss, at any scale
+  TiledGrid grid = randomGrid(80, 70, 4);
+  GridPlacement placement = makePlacement(80, 70, 0.05, 0.3, -0.2, 0.2);
+  std::vector<ResampleSource> sources(1, makeSource(grid, placement));
+  const double resolutions[] = { 0.03, 0.05, 0.085, 0.2 };
+  for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++)
+  {
+    GridPlacement target = makePlacement(0, 0, resolutions[i], 0.0, 0.0, 0.2 + 0.5 * (i + 1));
+    ASSERT_TRUE(coverSources(sources, 1u << 30, &target));
+    TiledGrid resampled = resampleGrids(sources, target, RESAMPLE_CONSERVATIVE, MERGE_MAX, 1);
+    for (unsigned int y = 0; y < target.height; y++)
+    {
+      for (unsigned int x = 0; x < target.width; x++)
+      {
+        ASSERT_EQ(overlappedReference(grid, placement, target, x, y), resampled.get(x, y))
+            << resolutions[i] << ": " << x << " " << y;
+      }
+    }
+  }
+}
+
+TEST(MapResample, MergePolicies)
+{
+  // Two free and occupied wings overlapping over 25 x 95 cells, with an unknown cell of the first one in the overlap
+  std::vector<int8_t> free_cells(100 * 100, 0);
+  std::vector<int8_t> occupied_cells(100 * 100, 100);
+  free_cells[50 * 100 + 80] = -1;
+  TiledGrid first(100, 100, &free_cells[0]);
+  TiledGrid second(100, 100, &occupied_cells[0]);
+  std::vector<ResampleSource> sources;
+  sources.push_back(makeSource(first, makePlacement(100, 100, 0.1, 0.0, 0.0, 0.0)));
+  sources.push_back(makeSource(second, makePlacement(100, 100, 0.1, 7.5, 0.5, 0.0)));
+  GridPlacement target = makePlacement(0, 0, 0.1, 0.0, 0.0, 0.0);
+  ASSERT_TRUE(coverSources(sources, 1u << 30, &target));
+  EXPECT_EQ(175u, target.width);
+  EXPECT_EQ(105u, target.height);
+
+  TiledGrid merged_first = resampleGrids(sources, target, RESAMPLE_NEAREST, parseMergePolicy("first"), 1);
+  TiledGrid merged_max = resampleGrids(sources, target, RESAMPLE_NEAREST, parseMergePolicy("max"), 1);
+  TiledGrid merged_conservative =
+      resampleGrids(sources, target, RESAMPLE_NEAREST, parseMergePolicy("conservative"), 1);
+  EXPECT_EQ(0, merged_first.get(80, 60));
+  EXPECT_EQ(100, merged_first.get(80, 50));
+  EXPECT_EQ(100, merged_max.get(80, 60));
+  EXPECT_EQ(100, merged_conservative.get(80, 60));
+  // Outside of both wings
+  EXPECT_EQ(-1, merged_first.get(10, 102));
+  EXPECT_EQ(-1, merged_max.get(170, 2));
+  EXPECT_THROW(parseMergePolicy("min"), std::runtime_error);
+}
+
+TEST(MapResample, OversizedCoverIsRejected)
+{
+  TiledGrid grid(100, 100, NULL);
+  std::vector<ResampleSource> sources;
+  sources.push_back(makeSource(grid, makePlacement(100, 100, 0.1, 0.0, 0.0, 0.0)));
+  sources.push_back(makeSource(grid, makePlacement(100, 100, 0.1, 1e12, -1e12, 0.0)));
+  GridPlacement target = makePlacement(7, 9, 0.1, 1.0, 2.0, 0.0);
+  EXPECT_FALSE(coverSources(sources, 1u << 30, &target));
+  EXPECT_EQ(7u, target.width);
+  EXPECT_EQ(9u, target.height);
+  EXPECT_EQ(1.0, target.origin_x);
+
+  // Too many cells in total, or a resolution that makes them infinitely many
+  sources.resize(1);
+  EXPECT_FALSE(coverSources(sources, 99 * 100, &target));
+  EXPECT_TRUE(coverSources(sources, 100 * 100, &target));
+  target.resolution = 0.0;
+  EXPECT_FALSE(coverSources(sources, 1u << 30, &target));
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdlib.h>
+
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/map_rle.h"
+
+using namespace multimap_server;
+
+namespace
+{
+struct Runs
+{
+  std::vector<uint32_t> row_starts;
+  std::vector<uint16_t> run_lengths;
+  std::vector<int8_t> run_values;
+};
+
+Runs encode(const TiledGrid& grid)
+{
+  Runs runs;
+  encodeRows(grid, &runs.row_starts, &runs.run_lengths, &runs.run_values);
+  return runs;
+}
+
+std::vector<int8_t> decode(unsigned int width, unsigned int height, const Runs& runs)
+{
+  std::vector<int8_t> out((size_t)width * height + 1, 42);
+  decodeRows(width, height, runs.row_starts, runs.run_lengths, runs.run_values, &out[0]);
+  // Nothing is written past the grid
+  EXPECT_EQ(42, out.back());
+  out.pop_back();
+  return out;
+}
+}
+
+TEST(MapRle, FindRunEnd)
+{
+  std::vector<int8_t> cells(40, -1);
+  for (size_t stop = 1; stop < cells.size(); stop++)
+  {
+    std::vector<int8_t> copy = cells;
+    copy[stop] = 0;
+    EXPECT_EQ(stop, findRunEnd(&copy[0], 0, copy.size()));
+    EXPECT_EQ(stop, findRunEnd(&copy[0], stop > 3 ? stop - 3 : 0, copy.size()));
+  }
+  EXPECT_EQ(cells.size(), findRunEnd(&cells[0], 0, cells.size()));
+  EXPECT_EQ(13u, findRunEnd(&cells[0], 5, 13));
+  EXPECT_EQ(6u, findRunEnd(&cells[0], 5, 6));
+}
+
+TEST(MapRle, RoundTrip)
+{
+  unsigned int width = 150, height = 70;
+  srand(1);
+  std::vector<int8_t> cells((size_t)width * height, 0);
+  for (size_t i = 0; i < cells.size(); i++)
+  {
+    if (rand() % 10 == 0)
+      cells[i] = rand() % 256 - 128;
+  }
+  Runs runs = encode(TiledGrid(width, height, &cells[0]));
+  ASSERT_EQ(height + 1u, runs.row_starts.size());
+  EXPECT_EQ(0u, runs.row_starts[0]);
+  EXPECT_EQ(cells, decode(width, height, runs));
+}
+
+TEST(MapRle, RunsStopAtRowEnds)
+{
+  TiledGrid grid(10, 3, NULL);
+  Runs runs = encode(grid);
+  ASSERT_EQ(3u, runs.run_lengths.size());
+  EXPECT_EQ(10, runs.run_lengths[1]);
+  EXPECT_EQ(-1, runs.run_values[2]);
+  EXPECT_EQ(2u, runs.row_starts[2]);
+}
+
+TEST(MapRle, LongRowsAreSplit)
+{
+  unsigned int width = 2 * MAX_RUN_LENGTH + 10;
+  TiledGrid grid(width, 2, NULL);
+  Runs runs = encode(grid);
+  ASSERT_EQ(6u, runs.run_lengths.size());
+  EXPECT_EQ(MAX_RUN_LENGTH, runs.run_lengths[0]);
+  EXPECT_EQ(10, runs.run_lengths[2]);
+  EXPECT_EQ(std::vector<int8_t>((size_t)width * 2, -1), decode(width, 2, runs));
+}
+
+TEST(MapRle, EmptyGrid)
+{
+  Runs runs = encode(TiledGrid());
+  ASSERT_EQ(1u, runs.row_starts.size());
+  EXPECT_TRUE(runs.run_lengths.empty());
+  decodeRows(0, 0, runs.row_starts, runs.run_lengths, runs.run_values, NULL);
+}
+
+TEST(MapRle, DecodeRejectsInconsistentRuns)
+{
+  unsigned int width = 20, height = 4;
+  Runs valid = encode(TiledGrid(width, height, NULL));
+  std::vector<int8_t> out((size_t)width * height);
+
+  Runs runs = valid;
+  runs.row_starts.pop_back();
+  EXPECT_THROW(decodeRows(width, height, runs.row_starts, runs.run_lengths, runs.run_values, &out[0]),
+               std::runtime_error);
+
+  runs = valid;
+  runs.run_values.pop_back();
+  EXPECT_THROW(decodeRows(width, height, runs.row_starts, runs.run_lengths, runs.run_values, &out[0]),
+               std::runtime_error);
+
+  runs = valid;
+  runs.run_lengths[1] = 21;
+  EXPECT_THROW(decodeRows(width, height, runs.row_starts, runs.run_lengths, runs.run_values, &out[0]),
+               std::runtime_error);
+
+  runs = valid;
+  runs.run_lengths[1] = 19;
+  EXPECT_THROW(decodeRows(width, height, runs.row_starts, runs.run_lengths, runs.run_values, &out[0]),
+               std::runtime_error);
+
+  runs = valid;
+  runs.row_starts[1] = 3;
+  runs.row_starts[2] = 1;
+  EXPECT_THROW(decodeRows(width, height, runs.row_starts, runs.run_lengths, runs.run_values, &out[0]),
+               std::runtime_error);
+}
+
+TEST(MapRle, DecodeRejectsRowsPastTheRuns)
+{
+  // A row ending past the runs, followed by one going back to them, must not read beyond the runs
+  std::vector<uint32_t> row_starts;
+  row_starts.push_back(0);
+  row_starts.push_back(5);
+  row_starts.push_back(2);
+  std::vector<uint16_t> run_lengths(2, 50);
+  std::vector<int8_t> run_values(2, 0);
+  std::vector<int8_t> out(100 * 2);
+  EXPECT_THROW(decodeRows(100, 2, row_starts, run_lengths, run_values, &out[0]), std::runtime_error);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
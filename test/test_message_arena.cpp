@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/message_arena.h"
+
+using namespace multimap_server;
+
+namespace
+{
+const size_t MB = 1024 * 1024;
+
+/** Build a message of bytes in arena */
+void buildMessage(MessageArena* arena, size_t bytes)
+{
+  ArenaScope scope(*arena);
+  memset(arena->allocate(bytes), 0, bytes);
+}
+
+void useThreadArena(MessageArena** arena)
+{
+  *arena = &threadMessageArena();
+  buildMessage(*arena, MB);
+}
+}
+
+TEST(MessageArena, AllocationsAreAlignedAndDistinct)
+{
+  MessageArena arena(MB);
+  char* a = static_cast<char*>(arena.allocate(3));
+  char* b = static_cast<char*>(arena.allocate(1));
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(a) % 16);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(b) % 16);
+  EXPECT_GE(b - a, 16);
+}
+
+TEST(MessageArena, RewindReusesMemory)
+{
+  MessageArena arena(MB);
+  MessageArena::Mark empty = arena.mark();
+  void* first = arena.allocate(1000);
+  MessageArena::Mark middle = arena.mark();
+  void* second = arena.allocate(1000);
+  arena.rewind(middle);
+  EXPECT_EQ(second, arena.allocate(1000));
+  arena.rewind(empty);
+  EXPECT_EQ(first, arena.allocate(1000));
+}
+
+TEST(MessageArena, GrownBlocksAreMerged)
+{
+  MessageArena arena(16 * MB);
+  buildMessage(&arena, 3 * MB);
+  size_t capacity = arena.capacity();
+  // Messages of the same size then fit in the block kept
+  for (int i = 0; i < 10; i++)
+  {
+    ArenaScope scope(arena);
+    arena.allocate(MB);
+    arena.allocate(2 * MB);
+    EXPECT_EQ(capacity, arena.capacity());
+  }
+}
+
+TEST(MessageArena, MessagesLargerThanRetainedAreNotKept)
+{
+  MessageArena arena(MB);
+  buildMessage(&arena, 4 * MB);
+  EXPECT_EQ(MB, arena.capacity());
+}
+
+TEST(MessageArena, RetentionCanBeLowered)
+{
+  MessageArena arena(16 * MB);
+  buildMessage(&arena, 4 * MB);
+  EXPECT_GE(arena.capacity(), 4 * MB);
+  arena.setRetainedBytes(MB);
+  buildMessage(&arena, 4 * MB);
+  EXPECT_EQ(MB, arena.capacity());
+}
+
+TEST(MessageArena, ShrinksAfterSmallerMessages)
+{
+  MessageArena arena(64 * MB);
+  buildMessage(&arena, 32 * MB);
+  EXPECT_GE(arena.capacity(), 32 * MB);
+  for (size_t i = 0; i < 2 * MessageArena::SHRINK_ROUNDS; i++)
+    buildMessage(&arena, MB);
+  EXPECT_LT(arena.capacity(), 4 * MB);
+  EXPECT_GE(arena.capacity(), MB);
+}
+
+TEST(MessageArena, TrimOnlyFreesUnusedArenas)
+{
+  MessageArena arena(16 * MB);
+  buildMessage(&arena, MB);
+  EXPECT_EQ(0u, arena.trim(3600));
+
+  {
+    ArenaScope scope(arena);
+    arena.allocate(100);
+    EXPECT_EQ(0u, arena.trim(0));
+  }
+  size_t capacity = arena.capacity();
+  EXPECT_EQ(capacity, arena.trim(0));
+  EXPECT_EQ(0u, arena.capacity());
+  // And it grows again on the next message
+  buildMessage(&arena, MB);
+  EXPECT_GE(arena.capacity(), MB);
+}
+
+TEST(MessageArena, ContainersUseTheArena)
+{
+  MessageArena arena(MB);
+  ArenaScope scope(arena);
+  std::vector<int, ArenaAllocator<int> > values((ArenaAllocator<int>(&arena)));
+  for (int i = 0; i < 1000; i++)
+    values.push_back(i);
+  EXPECT_EQ(999, values.back());
+  EXPECT_GE(arena.capacity(), 1000 * sizeof(int));
+
+  std::vector<int, ArenaAllocator<int> > heap;
+  heap.push_back(1);
+  EXPECT_TRUE(heap.get_allocator() != values.get_allocator());
+}
+
+TEST(MessageArena, ThreadArenas)
+{
+  MessageArena* first = NULL;
+  MessageArena* second = NULL;
+  boost::thread a(boost::bind(&useThreadArena, &first));
+  a.join();
+  useThreadArena(&second);
+  EXPECT_NE(first, second);
+  EXPECT_EQ(second, &threadMessageArena());
+
+  // The arena of the exited thread is gone, the one of this thread is idle
+  EXPECT_EQ(0u, trimMessageArenas(3600));
+  size_t capacity = second->capacity();
+  EXPECT_EQ(capacity, trimMessageArenas(0));
+  EXPECT_EQ(0u, second->capacity());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
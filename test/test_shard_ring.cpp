@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <gtest/gtest.h>
+
+#include "multimap_server/shard_ring.h"
+
+using multimap_server::ShardRing;
+
+namespace
+{
+std::vector<std::string> environmentNames(size_t count)
+{
+  std::vector<std::string> names;
+  for (size_t i = 0; i < count; i++)
+  {
+    names.push_back("robotnik_floor_" + boost::lexical_cast<std::string>(i));
+  }
+  return names;
+}
+}
+
+TEST(ShardRing, SingleShardOwnsEverything)
+{
+  ShardRing ring(1);
+  EXPECT_EQ(1u, ring.shardCount());
+  std::vector<std::string> names = environmentNames(100);
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    EXPECT_EQ(0u, ring.shardFor(names[i]));
+  }
+  EXPECT_EQ(0u, ring.shardFor(""));
+}
+
+TEST(ShardRing, StableAndInRange)
+{
+  ShardRing ring(5), same(5);
+  std::vector<std::string> names = environmentNames(1000);
+  std::vector<size_t> owned(5, 0);
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    size_t shard = ring.shardFor(names[i]);
+    ASSERT_LT(shard, 5u);
+    // Every server builds the same ring
+    EXPECT_EQ(shard, same.shardFor(names[i]));
+    owned[shard]++;
+  }
+  // Virtual nodes spread the environments, no shard is left out or takes most of them
+  for (size_t shard = 0; shard < owned.size(); shard++)
+  {
+    EXPECT_GT(owned[shard], 100u) << "shard " << shard;
+    EXPECT_LT(owned[shard], 300u) << "shard " << shard;
+  }
+}
+
+TEST(ShardRing, AddingAShardOnlyMovesItsEnvironments)
+{
+  ShardRing before(4), after(5);
+  std::vector<std::string> names = environmentNames(2000);
+  size_t moved = 0;
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    size_t old_shard = before.shardFor(names[i]);
+    size_t new_shard = after.shardFor(names[i]);
+    if (old_shard != new_shard)
+    {
+      EXPECT_EQ(4u, new_shard) << names[i] << " moved between existing shards";
+      moved++;
+    }
+  }
+  // About a fifth of the environments go to the new shard
+  EXPECT_GT(moved, 200u);
+  EXPECT_LT(moved, 600u);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <math.h>
+
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/tiled_grid.h"
+
+using namespace multimap_server;
+
+namespace
+{
+typedef std::vector<std::pair<double, double> > Polygon;
+
+std::vector<int8_t> pattern(unsigned int width, unsigned int height)
+{
+  std::vector<int8_t> cells((size_t)width * height);
+  for (size_t i = 0; i < cells.size(); i++)
+    cells[i] = (i * 7) % 101;
+  return cells;
+}
+
+Polygon rectangle(double x0, double y0, double x1, double y1)
+{
+  Polygon polygon;
+  polygon.push_back(std::make_pair(x0, y0));
+  polygon.push_back(std::make_pair(x1, y0));
+  polygon.push_back(std::make_pair(x1, y1));
+  polygon.push_back(std::make_pair(x0, y1));
+  return polygon;
+}
+
+size_t countCells(const TiledGrid& grid, int8_t value)
+{
+  size_t count = 0;
+  for (unsigned int y = 0; y < grid.height(); y++)
+  {
+    for (unsigned int x = 0; x < grid.width(); x++)
+      count += grid.get(x, y) == value;
+  }
+  return count;
+}
+
+CellBox emptyBox()
+{
+  CellBox box = { 1, 1, 0, 0 };
+  return box;
+}
+}
+
+TEST(TiledGrid, RoundTripsRowMajorCells)
+{
+  // Neither dimension is a multiple of the tile size
+  unsigned int width = 150, height = 70;
+  std::vector<int8_t> cells = pattern(width, height);
+  TiledGrid grid(width, height, &cells[0]);
+  EXPECT_EQ(3u, grid.tilesX());
+  EXPECT_EQ(2u, grid.tilesY());
+
+  std::vector<int8_t> out(cells.size());
+  grid.copyRows(0, height, &out[0]);
+  EXPECT_EQ(cells, out);
+  EXPECT_EQ(cells[69 * width + 149], grid.get(149, 69));
+
+  // Edge tiles are padded with unknown cells
+  const int8_t* edge = grid.tileData(2, 1);
+  EXPECT_EQ(cells[64 * width + 128], edge[0]);
+  EXPECT_EQ(-1, edge[22]);
+  EXPECT_EQ(-1, edge[6 * TiledGrid::TILE_SIZE]);
+}
+
+TEST(TiledGrid, UnknownWithoutData)
+{
+  TiledGrid grid(10, 10, NULL);
+  EXPECT_EQ(100u, countCells(grid, -1));
+}
+
+TEST(TiledGrid, AllocateTiles)
+{
+  TiledGrid grid = TiledGrid::withoutTiles(100, 70);
+  EXPECT_EQ(2u, grid.tilesX());
+  EXPECT_EQ(2u, grid.tilesY());
+  for (unsigned int ty = 0; ty < grid.tilesY(); ty++)
+  {
+    for (unsigned int tx = 0; tx < grid.tilesX(); tx++)
+    {
+      int8_t* cells = grid.allocateTile(tx, ty);
+      for (unsigned int i = 0; i < TiledGrid::TILE_SIZE * TiledGrid::TILE_SIZE; i++)
+        cells[i] = tx + 2 * ty;
+    }
+  }
+  EXPECT_EQ(4u, grid.ownedTiles());
+  EXPECT_EQ(0, grid.get(63, 63));
+  EXPECT_EQ(1, grid.get(64, 0));
+  EXPECT_EQ(3, grid.get(99, 69));
+}
+
+TEST(TiledGrid, CopyBoxAcrossTiles)
+{
+  unsigned int width = 200, height = 130;
+  std::vector<int8_t> cells = pattern(width, height);
+  TiledGrid grid(width, height, &cells[0]);
+  CellBox box = { 60, 62, 140, 129 };
+  std::vector<int8_t> out((box.max_x - box.min_x + 1) * (box.max_y - box.min_y + 1));
+  grid.copyBox(box, &out[0]);
+  for (unsigned int y = box.min_y; y <= box.max_y; y++)
+  {
+    for (unsigned int x = box.min_x; x <= box.max_x; x++)
+      ASSERT_EQ(cells[y * width + x], out[(y - box.min_y) * (box.max_x - box.min_x + 1) + x - box.min_x]);
+  }
+}
+
+TEST(TiledGrid, CopiesShareTilesUntilWritten)
+{
+  unsigned int width = 130, height = 130;
+  std::vector<int8_t> cells = pattern(width, height);
+  TiledGrid grid(width, height, &cells[0]);
+  EXPECT_EQ(9u, grid.ownedTiles());
+
+  TiledGrid copy = grid;
+  EXPECT_EQ(0u, copy.ownedTiles());
+  copy.set(70, 5, 100);
+  EXPECT_EQ(1u, copy.ownedTiles());
+  EXPECT_TRUE(copy.sharesTile(grid, 0, 0));
+  EXPECT_FALSE(copy.sharesTile(grid, 1, 0));
+  EXPECT_EQ(100, copy.get(70, 5));
+  EXPECT_EQ(cells[5 * width + 70], grid.get(70, 5));
+
+  copy.shareTile(grid, 1, 0);
+  EXPECT_EQ(cells[5 * width + 70], copy.get(70, 5));
+}
+
+TEST(TiledGrid, FillBox)
+{
+  TiledGrid grid(100, 100, NULL);
+  CellBox box = { 10, 60, 70, 65 };
+  grid.fillBox(box, 0);
+  EXPECT_EQ(61u * 6, countCells(grid, 0));
+  EXPECT_EQ(0, grid.get(70, 65));
+  EXPECT_EQ(-1, grid.get(71, 65));
+}
+
+TEST(TiledGrid, FillPolygonSelectsCellCenters)
+{
+  TiledGrid grid(100, 100, NULL);
+  CellBox touched = emptyBox();
+  // Covers the centers of the cells 10..19 x 20..29
+  ASSERT_TRUE(grid.fillPolygon(rectangle(9.6, 19.6, 20.4, 30.4), 100, &touched));
+  EXPECT_EQ(100u, countCells(grid, 100));
+  EXPECT_EQ(10u, touched.min_x);
+  EXPECT_EQ(20u, touched.min_y);
+  EXPECT_EQ(19u, touched.max_x);
+  EXPECT_EQ(29u, touched.max_y);
+}
+
+TEST(TiledGrid, FillPolygonTriangle)
+{
+  TiledGrid grid(20, 20, NULL);
+  Polygon triangle;
+  triangle.push_back(std::make_pair(0.0, 0.0));
+  triangle.push_back(std::make_pair(20.0, 0.0));
+  triangle.push_back(std::make_pair(0.0, 20.0));
+  CellBox touched = emptyBox();
+  ASSERT_TRUE(grid.fillPolygon(triangle, 0, &touched));
+  // Centers with x + y < 20
+  EXPECT_EQ(190u, countCells(grid, 0));
+}
+
+TEST(TiledGrid, FillPolygonClipsToTheGrid)
+{
+  TiledGrid grid(50, 40, NULL);
+  CellBox touched = emptyBox();
+  ASSERT_TRUE(grid.fillPolygon(rectangle(-1e300, -1e300, 1e300, 1e300), 0, &touched));
+  EXPECT_EQ(50u * 40, countCells(grid, 0));
+  EXPECT_EQ(49u, touched.max_x);
+  EXPECT_EQ(39u, touched.max_y);
+
+  TiledGrid outside(50, 40, NULL);
+  touched = emptyBox();
+  EXPECT_FALSE(outside.fillPolygon(rectangle(1e12, 1e12, 2e12, 2e12), 0, &touched));
+  EXPECT_FALSE(outside.fillPolygon(rectangle(-2e12, -2e12, -1e12, -1e12), 0, &touched));
+  EXPECT_EQ(50u * 40, countCells(outside, -1));
+}
+
+TEST(TiledGrid, FillPolygonRejectsNonFiniteVertices)
+{
+  TiledGrid grid(10, 10, NULL);
+  CellBox touched = emptyBox();
+  double values[] = { std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::infinity(),
+                      -std::numeric_limits<double>::infinity() };
+  for (size_t i = 0; i < 3; i++)
+  {
+    Polygon polygon = rectangle(0, 0, 10, 10);
+    polygon[2].first = values[i];
+    EXPECT_FALSE(grid.fillPolygon(polygon, 0, &touched));
+    polygon = rectangle(0, 0, 10, 10);
+    polygon[1].second = values[i];
+    EXPECT_FALSE(grid.fillPolygon(polygon, 0, &touched));
+  }
+  EXPECT_EQ(100u, countCells(grid, -1));
+}
+
+TEST(TiledGrid, GrowBox)
+{
+  CellBox box = emptyBox();
+  CellBox a = { 5, 6, 7, 8 };
+  CellBox b = { 1, 7, 9, 7 };
+  growBox(&box, a);
+  EXPECT_EQ(5u, box.min_x);
+  growBox(&box, b);
+  EXPECT_EQ(1u, box.min_x);
+  EXPECT_EQ(6u, box.min_y);
+  EXPECT_EQ(9u, box.max_x);
+  EXPECT_EQ(8u, box.max_y);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
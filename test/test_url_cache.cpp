@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <gtest/gtest.h>
+
+#include "multimap_server/checksum.h"
+#include "multimap_server/url_cache.h"
+
+using namespace multimap_server;
+
+namespace
+{
+/** HTTP server on a loopback port, answering If-None-Match with 304 */
+class FileServer
+{
+public:
+  FileServer() : requests(0), transfers(0), stopping_(false)
+  {
+    socket_ = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (socket_ < 0 || bind(socket_, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        getsockname(socket_, (struct sockaddr*)&address, &length) != 0 || listen(socket_, 8) != 0)
+    {
+      ADD_FAILURE() << "failed to listen on the loopback interface";
+    }
+    port_ = ntohs(address.sin_port);
+    thread_ = boost::thread(boost::bind(&FileServer::serve, this));
+  }
+
+  ~FileServer()
+  {
+    stop();
+  }
+
+  /** Serve body at path, with etag */
+  void put(const std::string& path, const std::string& body, const std::string& etag)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    files_[path] = std::make_pair(body, etag);
+  }
+
+  std::string url(const std::string& path) const
+  {
+    return "http://127.0.0.1:" + boost::lexical_cast<std::string>(port_) + path;
+  }
+
+  /** Close the port: later requests fail to connect */
+  void stop()
+  {
+    if (stopping_)
+      return;
+    stopping_ = true;
+    shutdown(socket_, SHUT_RDWR);
+    thread_.join();
+    close(socket_);
+  }
+
+  int requests;
+  /** Responses carrying a body */
+  int transfers;
+
+private:
+  int socket_;
+  int port_;
+  bool stopping_;
+  boost::thread thread_;
+  boost::mutex mutex_;
+  std::map<std::string, std::pair<std::string, std::string> > files_;
+
+  void serve()
+  {
+    int client;
+    while ((client = accept(socket_, NULL, NULL)) >= 0)
+    {
+      std::string request;
+      char buffer[1024];
+      ssize_t size;
+      while (request.find("\r\n\r\n") == std::string::npos && (size = read(client, buffer, sizeof(buffer))) > 0)
+        request.append(buffer, size);
+      respond(client, request);
+      close(client);
+    }
+  }
+
+  void respond(int client, const std::string& request)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    requests++;
+    size_t start = request.find(' ') + 1;
+    std::string path = request.substr(start, request.find(' ', start) - start);
+    std::string response;
+    std::map<std::string, std::pair<std::string, std::string> >::const_iterator file = files_.find(path);
+    if (file == files_.end())
+    {
+      response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    else if (request.find("If-None-Match: " + file->second.second + "\r\n") != std::string::npos)
+    {
+      response = "HTTP/1.1 304 Not Modified\r\nETag: " + file->second.second + "\r\nConnection: close\r\n\r\n";
+    }
+    else
+    {
+      transfers++;
+      response = "HTTP/1.1 200 OK\r\nETag: " + file->second.second +
+                 "\r\nContent-Length: " + boost::lexical_cast<std::string>(file->second.first.size()) +
+                 "\r\nConnection: close\r\n\r\n" + file->second.first;
+    }
+    for (size_t sent = 0; sent < response.size();)
+    {
+      ssize_t size = write(client, response.data() + sent, response.size() - sent);
+      if (size <= 0)
+        break;
+      sent += size;
+    }
+  }
+};
+
+std::string readFile(const std::string& path)
+{
+  std::string contents;
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return contents;
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents.append(buffer, size);
+  fclose(file);
+  return contents;
+}
+
+void writeFile(const std::string& path, const std::string& contents)
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  ASSERT_TRUE(file != NULL);
+  fwrite(contents.data(), 1, contents.size(), file);
+  fclose(file);
+}
+
+/** Move the modification time of path an hour back */
+void backdate(const std::string& path)
+{
+  struct timeval times[2];
+  gettimeofday(&times[0], NULL);
+  times[0].tv_sec -= 3600;
+  times[1] = times[0];
+  ASSERT_EQ(0, utimes(path.c_str(), times));
+}
+
+bool exists(const std::string& path)
+{
+  struct stat info;
+  return stat(path.c_str(), &info) == 0;
+}
+
+/** Cache in a new directory, removed with the fixture */
+class UrlCacheTest : public testing::Test
+{
+protected:
+  void SetUp()
+  {
+    char name[] = "/tmp/test_url_cache_XXXXXX";
+    ASSERT_TRUE(mkdtemp(name) != NULL);
+    cache_dir = name;
+  }
+
+  void TearDown()
+  {
+    ASSERT_EQ(0, system(("rm -rf " + cache_dir).c_str()));
+  }
+
+  /** Pretend url was last fetched an hour ago */
+  void age(const std::string& url)
+  {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)checksum64(url.data(), url.size()));
+    backdate(cache_dir + "/urls/" + name);
+  }
+
+  std::string cache_dir;
+  FileServer server;
+};
+}
+
+TEST(UrlCache, PathsAreNotUrls)
+{
+  EXPECT_FALSE(UrlCache::isUrl("/maps/level_2.yaml"));
+  EXPECT_FALSE(UrlCache::isUrl("maps/level_2.yaml"));
+  EXPECT_TRUE(UrlCache::isUrl("http://maps.example.com/level_2.yaml"));
+  EXPECT_TRUE(UrlCache::isUrl("file:///maps/level_2.yaml"));
+}
+
+TEST_F(UrlCacheTest, LocalFilesAreUsedInPlace)
+{
+  UrlCache cache(cache_dir, 10.0, 0);
+  EXPECT_EQ("/maps/level_2.pgm", cache.fetch("/maps/level_2.pgm"));
+  EXPECT_EQ("/maps/level_2.pgm", cache.fetch("file:///maps/level_2.pgm"));
+  EXPECT_EQ(0, server.requests);
+}
+
+TEST_F(UrlCacheTest, MissDownloadsAndHitRevalidates)
+{
+  UrlCache cache(cache_dir, 10.0, 0);
+  server.put("/level_2.pgm", "P5 1 1 255 x", "\"a\"");
+  std::string path = cache.fetch(server.url("/level_2.pgm"));
+  EXPECT_EQ(cache_dir + "/objects/", path.substr(0, cache_dir.size() + 9));
+  EXPECT_EQ(".pgm", path.substr(path.size() - 4));
+  EXPECT_EQ("P5 1 1 255 x", readFile(path));
+  EXPECT_EQ(1, server.transfers);
+
+  // The second fetch only asks whether the file changed
+  EXPECT_EQ(path, cache.fetch(server.url("/level_2.pgm")));
+  EXPECT_EQ(2, server.requests);
+  EXPECT_EQ(1, server.transfers);
+
+  // So does another cache on the same directory
+  UrlCache reopened(cache_dir, 10.0, 0);
+  EXPECT_EQ(path, reopened.fetch(server.url("/level_2.pgm")));
+  EXPECT_EQ(3, server.requests);
+  EXPECT_EQ(1, server.transfers);
+}
+
+TEST_F(UrlCacheTest, ChangedFileGetsNewKey)
+{
+  UrlCache cache(cache_dir, 10.0, 0);
+  server.put("/level_2.pgm", "P5 1 1 255 x", "\"a\"");
+  std::string first = cache.fetch(server.url("/level_2.pgm"));
+
+  server.put("/level_2.pgm", "P5 1 1 255 y", "\"b\"");
+  std::string second = cache.fetch(server.url("/level_2.pgm"));
+  EXPECT_NE(first, second);
+  EXPECT_EQ("P5 1 1 255 y", readFile(second));
+  EXPECT_EQ(2, server.transfers);
+
+  // Another URL of the same file shares its copy
+  server.put("/copy.pgm", "P5 1 1 255 y", "\"c\"");
+  EXPECT_EQ(second, cache.fetch(server.url("/copy.pgm")));
+}
+
+TEST_F(UrlCacheTest, CachedCopyIsUsedWhenServerIsDown)
+{
+  UrlCache cache(cache_dir, 10.0, 0);
+  server.put("/level_2.pgm", "P5 1 1 255 x", "\"a\"");
+  std::string path = cache.fetch(server.url("/level_2.pgm"));
+  std::string uncached = server.url("/other.pgm");
+  server.stop();
+  EXPECT_EQ(path, cache.fetch(server.url("/level_2.pgm")));
+  EXPECT_THROW(cache.fetch(uncached), std::runtime_error);
+}
+
+TEST_F(UrlCacheTest, MissingFileThrows)
+{
+  UrlCache cache(cache_dir, 10.0, 0);
+  EXPECT_THROW(cache.fetch(server.url("/missing.pgm")), std::runtime_error);
+}
+
+TEST_F(UrlCacheTest, CorruptedCopyIsDownloadedAgain)
+{
+  UrlCache cache(cache_dir, 10.0, 0);
+  server.put("/level_2.pgm", "P5 1 1 255 x", "\"a\"");
+  std::string path = cache.fetch(server.url("/level_2.pgm"));
+  writeFile(path, "P5 1 1 255 z");
+  // Coarse timestamps could miss a write right after the download
+  backdate(path);
+
+  EXPECT_EQ(path, cache.fetch(server.url("/level_2.pgm")));
+  EXPECT_EQ("P5 1 1 255 x", readFile(path));
+  EXPECT_EQ(2, server.transfers);
+}
+
+TEST_F(UrlCacheTest, LeastRecentlyFetchedCopiesAreEvicted)
+{
+  UrlCache cache(cache_dir, 10.0, 1500);
+  server.put("/a.pgm", std::string(1000, 'a'), "\"a\"");
+  server.put("/b.pgm", std::string(1000, 'b'), "\"b\"");
+  server.put("/c.pgm", std::string(1000, 'c'), "\"c\"");
+  std::string a = cache.fetch(server.url("/a.pgm"));
+  age(server.url("/a.pgm"));
+  std::string b = cache.fetch(server.url("/b.pgm"));
+  EXPECT_FALSE(exists(a));
+  EXPECT_TRUE(exists(b));
+
+  // Copies fetched within MIN_EVICTION_AGE are kept even above the limit
+  std::string c = cache.fetch(server.url("/c.pgm"));
+  EXPECT_TRUE(exists(b));
+  EXPECT_TRUE(exists(c));
+
+  // An evicted copy is downloaded again
+  EXPECT_EQ(a, cache.fetch(server.url("/a.pgm")));
+  EXPECT_EQ(std::string(1000, 'a'), readFile(a));
+  EXPECT_EQ(4, server.transfers);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}